@@ -27,6 +27,7 @@ struct obtain_lock_event_type;
 typedef CEvent<obtain_lock_event_type> CObtainLockEvent;
 
 std::list<CControlSocket::t_lockInfo> CControlSocket::m_lockInfoList;
+mutex CControlSocket::m_lockInfoMutex;
 
 COpData::COpData(Command op_Id)
 	: opId(op_Id)
@@ -485,24 +486,61 @@ wxChar* CControlSocket::ConvToLocalBuffer(const char* buffer, wxMBConv& conv, si
 	return unicode;
 }
 
-wxChar* CControlSocket::ConvToLocalBuffer(const char* buffer, size_t len, size_t& outlen)
+bool CControlSocket::ConvToLocalBuffer(const char* buffer, wxMBConv& conv, size_t len, std::vector<wxChar>& out)
+{
+	wxASSERT(buffer && len > 0 && !buffer[len - 1]);
+	size_t const outlen = conv.ToWChar(0, 0, buffer, len);
+	if (!outlen || outlen == wxCONV_FAILED)
+		return false;
+
+	out.resize(outlen);
+	conv.ToWChar(&out[0], outlen, buffer, len);
+	return true;
+}
+
+namespace {
+// Checks for plain ASCII without embedded null characters, the buffer
+// itself is null-terminated.
+bool IsPlainAscii(const char* buffer, size_t len)
+{
+	// Simple enough for the compiler to vectorize
+	unsigned char acc = 0;
+	unsigned char nul = 0;
+	for (size_t i = 0; i + 1 < len; ++i) {
+		unsigned char const c = static_cast<unsigned char>(buffer[i]);
+		acc |= c;
+		nul |= c == 0;
+	}
+	return !(acc & 0x80) && !nul;
+}
+}
+
+bool CControlSocket::ConvToLocalBuffer(const char* buffer, size_t len, std::vector<wxChar>& out)
 {
 	if (m_useUTF8) {
+		// Most lines of directory listings are plain ASCII, which does not need any decoding.
+		// Lines with embedded null characters are left to the converters.
+		if (len > 1 && IsPlainAscii(buffer, len)) {
+			out.resize(len);
+			for (size_t i = 0; i < len; ++i) {
+				out[i] = static_cast<unsigned char>(buffer[i]);
+			}
+			return true;
+		}
+
 #ifdef __WXMSW__
 		// wxConvUTF8 is generic and slow.
 		// Use the highly optimized MultiByteToWideChar on Windows
 		// This helps when processing large directory listings.
-		int outlen2 = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, buffer, len, 0, 0);
-		if (outlen2 > 0) {
-			wxChar* out = new wxChar[outlen2];
-			MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, buffer, len, out, outlen2);
-			outlen = static_cast<size_t>(outlen2);
-			return out;
+		int outlen = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, buffer, len, 0, 0);
+		if (outlen > 0) {
+			out.resize(outlen);
+			MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, buffer, len, &out[0], outlen);
+			return true;
 		}
 #else
-		wxChar* res = ConvToLocalBuffer(buffer, wxConvUTF8, len, outlen);
-		if (res && *res)
-			return res;
+		if (ConvToLocalBuffer(buffer, wxConvUTF8, len, out) && out[0])
+			return true;
 #endif
 
 		// Fall back to local charset on error
@@ -513,15 +551,12 @@ wxChar* CControlSocket::ConvToLocalBuffer(const char* buffer, size_t len, size_t
 	}
 
 	if (m_pCSConv) {
-		wxChar* res = ConvToLocalBuffer(buffer, *m_pCSConv, len, outlen);
-		if (res && *res)
-			return res;
+		if (ConvToLocalBuffer(buffer, *m_pCSConv, len, out) && out[0])
+			return true;
 	}
 
 	// Fallback: Conversion using current locale
-	wxChar* res = ConvToLocalBuffer(buffer, *wxConvCurrent, len, outlen);
-
-	return res;
+	return ConvToLocalBuffer(buffer, *wxConvCurrent, len, out);
 }
 
 wxCharBuffer CControlSocket::ConvToServer(const wxString& str, bool force_utf8 /*=false*/)
@@ -620,12 +655,15 @@ bool CControlSocket::TryLockCache(enum locking_reason reason, const CServerPath&
 	wxASSERT(m_pCurrentServer);
 	wxASSERT(m_pCurOpData);
 
+	scoped_lock lock(m_lockInfoMutex);
+
 	std::list<t_lockInfo>::iterator own = GetLockStatus();
 	if (own == m_lockInfoList.end())
 	{
 		t_lockInfo info;
 		info.directory = directory;
 		info.pControlSocket = this;
+		info.server = *m_pCurrentServer;
 		info.waiting = true;
 		info.reason = reason;
 		info.lockcount = 0;
@@ -654,7 +692,7 @@ bool CControlSocket::TryLockCache(enum locking_reason reason, const CServerPath&
 	// Try to find other instance holding the lock
 	for (std::list<t_lockInfo>::const_iterator iter = m_lockInfoList.begin(); iter != own; ++iter)
 	{
-		if (*m_pCurrentServer != *iter->pControlSocket->m_pCurrentServer)
+		if (*m_pCurrentServer != iter->server)
 			continue;
 		if (directory != iter->directory)
 			continue;
@@ -674,6 +712,8 @@ bool CControlSocket::IsLocked(enum locking_reason reason, const CServerPath& dir
 {
 	wxASSERT(m_pCurrentServer);
 
+	scoped_lock lock(m_lockInfoMutex);
+
 	std::list<t_lockInfo>::iterator own = GetLockStatus();
 	if (own != m_lockInfoList.end())
 		return true;
@@ -681,7 +721,7 @@ bool CControlSocket::IsLocked(enum locking_reason reason, const CServerPath& dir
 	// Try to find other instance holding the lock
 	for (std::list<t_lockInfo>::const_iterator iter = m_lockInfoList.begin(); iter != own; ++iter)
 	{
-		if (*m_pCurrentServer != *iter->pControlSocket->m_pCurrentServer)
+		if (*m_pCurrentServer != iter->server)
 			continue;
 		if (directory != iter->directory)
 			continue;
@@ -701,6 +741,8 @@ void CControlSocket::UnlockCache()
 		return;
 	m_pCurOpData->holdsLock = false;
 
+	scoped_lock lock(m_lockInfoMutex);
+
 	std::list<t_lockInfo>::iterator iter = GetLockStatus();
 	if (iter == m_lockInfoList.end())
 		return;
@@ -725,12 +767,7 @@ void CControlSocket::UnlockCache()
 		return;
 	}
 	for (auto & lockInfo : m_lockInfoList) {
-		if (!lockInfo.pControlSocket->m_pCurrentServer){
-			LogMessage(MessageType::Debug_Warning, _T("UnlockCache found other instance with !m_pCurrentServer"));
-			continue;
-		}
-
-		if (*m_pCurrentServer != *lockInfo.pControlSocket->m_pCurrentServer)
+		if (*m_pCurrentServer != lockInfo.server)
 			continue;
 
 		if (lockInfo.directory != directory)
@@ -750,6 +787,8 @@ enum CControlSocket::locking_reason CControlSocket::ObtainLockFromEvent()
 	if (!m_pCurOpData)
 		return lock_unknown;
 
+	scoped_lock lock(m_lockInfoMutex);
+
 	std::list<t_lockInfo>::iterator own = GetLockStatus();
 	if (own == m_lockInfoList.end())
 		return lock_unknown;
@@ -759,7 +798,7 @@ enum CControlSocket::locking_reason CControlSocket::ObtainLockFromEvent()
 
 	for (std::list<t_lockInfo>::const_iterator iter = m_lockInfoList.begin(); iter != own; ++iter)
 	{
-		if (*m_pCurrentServer != *iter->pControlSocket->m_pCurrentServer)
+		if (own->server != iter->server)
 			continue;
 
 		if (iter->directory != own->directory)
@@ -790,6 +829,8 @@ void CControlSocket::OnObtainLock()
 
 bool CControlSocket::IsWaitingForLock()
 {
+	scoped_lock lock(m_lockInfoMutex);
+
 	std::list<t_lockInfo>::iterator own = GetLockStatus();
 	if (own == m_lockInfoList.end())
 		return false;
@@ -1358,7 +1399,16 @@ void CControlSocket::operator()(CEventBase const& ev)
 	if (Dispatch<CTimerEvent>(ev, this, &CControlSocket::OnTimer)) {
 		return;
 	}
-	Dispatch<CObtainLockEvent>(ev, this, &CControlSocket::OnObtainLock);
+	Dispatch<CObtainLockEvent, CInvalidateCurrentWorkingDirEvent>(ev, this,
+		&CControlSocket::OnObtainLock,
+		&CControlSocket::OnInvalidateCurrentWorkingDir);
+}
+
+void CControlSocket::OnInvalidateCurrentWorkingDir(CServer const& server, CServerPath const& path)
+{
+	if (m_pCurrentServer && *m_pCurrentServer == server) {
+		InvalidateCurrentWorkingDir(path);
+	}
 }
 
 void CControlSocket::SetActive(CFileZillaEngine::_direction direction)
@@ -5,6 +5,9 @@
 #include "logging_private.h"
 #include "backend.h"
 
+struct invalidate_current_working_dir_event_type;
+typedef CEvent<invalidate_current_working_dir_event_type, CServer, CServerPath> CInvalidateCurrentWorkingDirEvent;
+
 class COpData
 {
 public:
@@ -153,8 +156,13 @@ public:
 
 	// Conversion function which convert between local and server charset.
 	wxString ConvToLocal(const char* buffer, size_t len);
-	wxChar* ConvToLocalBuffer(const char* buffer, size_t len, size_t& outlen);
 	wxChar* ConvToLocalBuffer(const char* buffer, wxMBConv& conv, size_t len, size_t& outlen);
+
+	// Converts the null-terminated buffer into out, reusing its storage. The
+	// result includes the terminating null character. Returns false if nothing
+	// could be converted.
+	bool ConvToLocalBuffer(const char* buffer, size_t len, std::vector<wxChar>& out);
+	bool ConvToLocalBuffer(const char* buffer, wxMBConv& conv, size_t len, std::vector<wxChar>& out);
 	wxCharBuffer ConvToServer(const wxString& str, bool force_utf8 = false);
 
 	void SetActive(CFileZillaEngine::_direction direction);
@@ -245,13 +253,19 @@ protected:
 	struct t_lockInfo
 	{
 		CControlSocket* pControlSocket;
+
+		// Copy of the server, the control sockets can run in different threads
+		CServer server;
+
 		CServerPath directory;
 		enum locking_reason reason;
 		bool waiting;
 		int lockcount;
 	};
 	static std::list<t_lockInfo> m_lockInfoList;
+	static mutex m_lockInfoMutex;
 
+	// m_lockInfoMutex needs to be locked
 	const std::list<t_lockInfo>::iterator GetLockStatus();
 
 	// -----------------------
@@ -264,6 +278,7 @@ protected:
 
 	void OnTimer(timer_id id);
 	void OnObtainLock();
+	void OnInvalidateCurrentWorkingDir(CServer const& server, CServerPath const& path);
 };
 
 class CProxySocket;
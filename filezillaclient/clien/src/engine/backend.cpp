@@ -13,13 +13,13 @@ CBackend::~CBackend()
 	RemoveSocketEvents(m_pEvtHandler, this);
 }
 
-CSocketBackend::CSocketBackend(CEventHandler* pEvtHandler, CSocket & socket, CRateLimiter& rateLimiter)
+CSocketBackend::CSocketBackend(CEventHandler* pEvtHandler, CSocket & socket, CRateLimiter& rateLimiter, wxString const& site)
 	: CBackend(pEvtHandler)
 	, socket_(socket)
 	, m_rateLimiter(rateLimiter)
 {
 	socket_.SetEventHandler(pEvtHandler);
-	m_rateLimiter.AddObject(this);
+	m_rateLimiter.AddObject(this, site);
 }
 
 CSocketBackend::~CSocketBackend()
@@ -41,7 +41,7 @@ int CSocketBackend::Write(const void *buffer, unsigned int len, int& error)
 
 	int written = socket_.Write(buffer, len, error);
 
-	if (written > 0 && max != -1)
+	if (written > 0)
 		UpdateUsage(CRateLimiter::outbound, written);
 
 	return written;
@@ -60,7 +60,7 @@ int CSocketBackend::Read(void *buffer, unsigned int len, int& error)
 
 	int read = socket_.Read(buffer, len, error);
 
-	if (read > 0 && max != -1)
+	if (read > 0)
 		UpdateUsage(CRateLimiter::inbound, read);
 
 	return read;
@@ -27,7 +27,7 @@ class CSocket;
 class CSocketBackend final : public CBackend
 {
 public:
-	CSocketBackend(CEventHandler* pEvtHandler, CSocket & socket, CRateLimiter& rateLimiter);
+	CSocketBackend(CEventHandler* pEvtHandler, CSocket & socket, CRateLimiter& rateLimiter, wxString const& site = wxString());
 	virtual ~CSocketBackend();
 	// Backend definitions
 	virtual int Read(void *buffer, unsigned int size, int& error);
@@ -126,11 +126,23 @@ bool CRenameCommand::valid() const
 
 CChmodCommand::CChmodCommand(const CServerPath& path, const wxString& file, const wxString& permission)
 	: m_path(path)
-	, m_file(file)
-	, m_permission(permission)
+	, m_files(1, std::make_pair(file, permission))
+{}
+
+CChmodCommand::CChmodCommand(const CServerPath& path, std::vector<std::pair<wxString, wxString>> const& files)
+	: m_path(path)
+	, m_files(files)
 {}
 
 bool CChmodCommand::valid() const
 {
-	return !GetPath().empty() && !GetFile().empty() && !GetPermission().empty();
-}
\ No newline at end of file
+	if (GetPath().empty() || m_files.empty())
+		return false;
+
+	for (auto const& file : m_files) {
+		if (file.first.empty() || file.second.empty())
+			return false;
+	}
+
+	return true;
+}
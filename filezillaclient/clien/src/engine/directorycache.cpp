@@ -1,5 +1,27 @@
 #include <filezilla.h>
 #include "directorycache.h"
+#include "directorycache_storage.h"
+
+size_t CDirectoryCache::path_hash::operator()(CServerPath const& path) const
+{
+	// FNV-1a
+	size_t hash = 2166136261u;
+	wxString const str = path.GetPath();
+	for (auto it = str.begin(); it != str.end(); ++it) {
+		hash ^= static_cast<size_t>(static_cast<wxChar>(wxTolower(*it)));
+		hash *= 16777619u;
+	}
+	hash ^= static_cast<size_t>(path.GetType());
+	return hash;
+}
+
+size_t CDirectoryCache::server_hash::operator()(CServer const& server) const
+{
+	size_t hash = std::hash<std::wstring>()(server.GetHost().ToStdWstring());
+	hash ^= static_cast<size_t>(server.GetPort()) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	hash ^= static_cast<size_t>(server.GetProtocol()) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	return hash;
+}
 
 CDirectoryCache::CDirectoryCache()
 {
@@ -7,125 +29,218 @@ CDirectoryCache::CDirectoryCache()
 
 CDirectoryCache::~CDirectoryCache()
 {
-	for( auto & serverEntry : m_serverList ) {
-		for (auto & cacheEntry : serverEntry.cacheList ) {
-#ifdef __WXDEBUG__
-			m_totalFileCount -= cacheEntry.listing.GetCount();
-#endif
-			tLruList::iterator* lruIt = (tLruList::iterator*)cacheEntry.lruIt;
-			if (lruIt) {
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
+	if (storage_) {
+		for (auto & serverEntry : m_serverMap) {
+			for (auto & cacheEntry : serverEntry.second.cacheMap) {
+				if (cacheEntry.second.dirty)
+					storage_->Save(serverEntry.second.server, cacheEntry.second.listing);
 			}
 		}
 	}
+
 #ifdef __WXDEBUG__
+	for (auto & serverEntry : m_serverMap) {
+		for (auto & cacheEntry : serverEntry.second.cacheMap) {
+			m_totalFileCount -= cacheEntry.second.listing.GetCount();
+		}
+	}
 	wxASSERT(m_totalFileCount == 0);
 #endif
 }
 
+void CDirectoryCache::SetStorageFile(wxString const& file)
+{
+	scoped_write_lock lock(rwlock_);
+
+	wxASSERT(m_serverMap.empty());
+
+	storage_.reset();
+	if (!file.empty()) {
+		storage_ = make_unique<CDirectoryCacheStorage>(file);
+		if (!storage_->IsOpen())
+			storage_.reset();
+	}
+}
+
+void CDirectoryCache::SetMemoryLimit(size_t limit)
+{
+	scoped_write_lock lock(rwlock_);
+
+	memory_limit_ = limit;
+	Prune();
+}
+
+CDirectoryCache::statistics CDirectoryCache::GetStatistics()
+{
+	scoped_read_lock lock(rwlock_);
+
+	statistics ret;
+	ret.entries = m_entryCount;
+	ret.files = m_totalFileCount;
+	ret.memory = m_totalMemory;
+	ret.memory_limit = memory_limit_;
+	ret.hits = hits_;
+	ret.misses = misses_;
+	ret.evictions = evictions_;
+	return ret;
+}
+
 void CDirectoryCache::Store(const CDirectoryListing &listing, const CServer &server)
 {
-	scoped_lock lock(mutex_);
+	scoped_write_lock lock(rwlock_);
 
-	tServerIter sit = CreateServerEntry(server);
-	wxASSERT(sit != m_serverList.end());
+	CServerEntry & serverEntry = CreateServerEntry(server);
 
 	m_totalFileCount += listing.GetCount();
 
-	tCacheIter cit;
-	bool unused;
-	if (Lookup(cit, sit, listing.path, true, unused)) {
-		cit->modificationTime = CMonotonicTime::Now();
-
-		m_totalFileCount -= cit->listing.GetCount();
-		cit->listing = listing;
+	auto it = serverEntry.cacheMap.find(listing.path);
+	if (it != serverEntry.cacheMap.end()) {
+		CCacheEntry & entry = it->second;
+		entry.modificationTime = CMonotonicTime::Now();
 
-		return;
+		m_totalFileCount -= entry.listing.GetCount();
+		entry.listing = listing;
+		entry.listing.Compact();
+	}
+	else {
+		it = serverEntry.cacheMap.emplace(std::piecewise_construct, std::forward_as_tuple(listing.path), std::forward_as_tuple(listing, serverEntry)).first;
+		++m_entryCount;
+		it->second.listing.Compact();
 	}
+	UpdateMemoryUsage(it->second);
 
-	sit->cacheList.emplace_front(listing);
+	if (storage_) {
+		storage_->Save(server, listing);
+		it->second.dirty = false;
+		if (serverEntry.storedPathsLoaded)
+			serverEntry.storedPaths.insert(listing.path);
+	}
 
-	UpdateLru(sit, sit->cacheList.begin());
+	UpdateLru(it->second);
 
 	Prune();
 }
 
-bool CDirectoryCache::Lookup(CDirectoryListing &listing, const CServer &server, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated)
+namespace {
+bool IsOutdated(CDirectoryListing const& listing)
 {
-	scoped_lock lock(mutex_);
-
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return false;
+	return (CDateTime::Now() - listing.m_firstListTime.GetTime()).GetSeconds() > CACHE_TIMEOUT;
+}
+}
 
-	tCacheIter iter;
-	if (Lookup(iter, sit, path, allowUnsureEntries, is_outdated)) {
-		listing = iter->listing;
+bool CDirectoryCache::Lookup(CDirectoryListing &listing, const CServer &server, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated)
+{
+	bool found = false;
+	VisitEntry(server, path, [&](CCacheEntry & entry, bool) {
+		if (allowUnsureEntries || !entry.listing.get_unsure_flags()) {
+			listing = entry.listing;
+			is_outdated = IsOutdated(entry.listing);
+			found = true;
+		}
 		return true;
-	}
+	});
 
-	return false;
+	return found;
 }
 
-bool CDirectoryCache::Lookup(tCacheIter &cacheIter, tServerIter &sit, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated)
+template<typename F>
+bool CDirectoryCache::VisitEntry(const CServer& server, const CServerPath& path, F const& f)
 {
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter) {
-		const CCacheEntry &entry = *iter;
+	{
+		scoped_read_lock lock(rwlock_);
+
+		CServerEntry * serverEntry = GetServerEntry(server);
+		if (serverEntry) {
+			auto const it = serverEntry->cacheMap.find(path);
+			if (it != serverEntry->cacheMap.end()) {
+				UpdateLru(it->second);
+				if (f(it->second, false)) {
+					++hits_;
+					return true;
+				}
+			}
+			else if (!MayBeStored(*serverEntry, path)) {
+				++misses_;
+				return false;
+			}
+		}
+		else if (!storage_) {
+			++misses_;
+			return false;
+		}
+	}
 
-		if (entry.listing.path != path)
-			continue;
+	scoped_write_lock lock(rwlock_);
 
-		UpdateLru(sit, iter);
+	// Might have been changed in the meantime, look again
+	CCacheEntry * entry = GetOrLoadEntry(server, path);
+	if (!entry) {
+		++misses_;
+		return false;
+	}
+	++hits_;
 
-		if (!allowUnsureEntries && entry.listing.get_unsure_flags())
-			return false;
+	UpdateLru(*entry);
+	f(*entry, true);
 
-		cacheIter = iter;
-		is_outdated = (CDateTime::Now() - entry.listing.m_firstListTime.GetTime()).GetSeconds() > CACHE_TIMEOUT;
-		return true;
-	}
+	// The entry might have been loaded from the storage
+	Prune();
 
-	return false;
+	return true;
 }
 
-bool CDirectoryCache::DoesExist(const CServer &server, const CServerPath &path, int &hasUnsureEntries, bool &is_outdated)
+template<typename F>
+void CDirectoryCache::ForEachEntryNoCase(CServerEntry & serverEntry, const CServerPath &path, F const& f)
 {
-	scoped_lock lock(mutex_);
+	if (storage_) {
+		// Listings only in the storage would miss the change, load them first
+		LoadStoredPaths(serverEntry);
+
+		std::vector<CServerPath> toLoad;
+		auto const& storedPaths = serverEntry.storedPaths;
+		if (!storedPaths.empty()) {
+			size_t const bucket = storedPaths.bucket(path);
+			for (auto it = storedPaths.begin(bucket); it != storedPaths.end(bucket); ++it) {
+				if (!path.CmpNoCase(*it) && serverEntry.cacheMap.find(*it) == serverEntry.cacheMap.end())
+					toLoad.push_back(*it);
+			}
+		}
+		for (auto const& storedPath : toLoad)
+			LoadEntry(serverEntry, storedPath);
+	}
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return false;
+	tCacheMap & cacheMap = serverEntry.cacheMap;
+	if (cacheMap.empty())
+		return;
 
-	tCacheIter iter;
-	if (Lookup(iter, sit, path, true, is_outdated)) {
-		hasUnsureEntries = iter->listing.get_unsure_flags();
-		return true;
+	size_t const bucket = cacheMap.bucket(path);
+	for (auto it = cacheMap.begin(bucket); it != cacheMap.end(bucket); ++it) {
+		if (!path.CmpNoCase(it->first)) {
+			CCacheEntry & entry = it->second;
+			MarkDirty(entry);
+			bool const wasCompact = entry.listing.IsCompact();
+			unsigned int const oldCount = entry.listing.GetCount();
+			f(entry);
+			UpdateMemoryUsage(entry, wasCompact, oldCount);
+		}
 	}
-
-	return false;
 }
 
-bool CDirectoryCache::LookupFile(CDirentry &entry, const CServer &server, const CServerPath &path, const wxString& file, bool &dirDidExist, bool &matchedCase)
+bool CDirectoryCache::DoesExist(const CServer &server, const CServerPath &path, int &hasUnsureEntries, bool &is_outdated)
 {
-	scoped_lock lock(mutex_);
-
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end()) {
-		dirDidExist = false;
-		return false;
-	}
-
-	tCacheIter iter;
-	bool unused;
-	if (!Lookup(iter, sit, path, true, unused)) {
-		dirDidExist = false;
-		return false;
-	}
-	dirDidExist = true;
+	return VisitEntry(server, path, [&](CCacheEntry & entry, bool) {
+		hasUnsureEntries = entry.listing.get_unsure_flags();
+		is_outdated = IsOutdated(entry.listing);
+		return true;
+	});
+}
 
-	const CCacheEntry &cacheEntry = *iter;
-	const CDirectoryListing &listing = cacheEntry.listing;
+namespace {
+bool LookupFileInListing(CDirentry &entry, CDirectoryListing const& cached, const wxString& file, bool &matchedCase)
+{
+	// Entries of compact listings get recreated on access. Do that in a copy,
+	// the cached listing may be accessed by other threads at the same time.
+	CDirectoryListing const listing(cached);
 
 	int i = listing.FindFile_CmpCase(file);
 	if (i >= 0) {
@@ -142,83 +257,86 @@ bool CDirectoryCache::LookupFile(CDirentry &entry, const CServer &server, const
 
 	return false;
 }
+}
 
-CDirectoryCache::CCacheEntry& CDirectoryCache::CCacheEntry::operator=(const CDirectoryCache::CCacheEntry &a)
+bool CDirectoryCache::LookupFile(CDirentry &entry, const CServer &server, const CServerPath &path, const wxString& file, bool &dirDidExist, bool &matchedCase)
 {
-	lruIt = a.lruIt;
-	listing = a.listing;
-	modificationTime = a.modificationTime;
+	bool found = false;
+	dirDidExist = VisitEntry(server, path, [&](CCacheEntry & cacheEntry, bool writeLocked) {
+		// Searching builds the find map as needed, which modifies the
+		// listing. Only possible with the write lock.
+		if (!cacheEntry.listing.IsFindMapComplete()) {
+			if (!writeLocked)
+				return false;
+			cacheEntry.listing.BuildFindMap();
+			UpdateMemoryUsage(cacheEntry);
+		}
 
-	return *this;
-}
+		found = LookupFileInListing(entry, cacheEntry.listing, file, matchedCase);
+		return true;
+	});
 
-CDirectoryCache::CCacheEntry::CCacheEntry(const CDirectoryCache::CCacheEntry &entry)
-	: lruIt()
-{
-	listing = entry.listing;
-	modificationTime = entry.modificationTime;
+	return found;
 }
 
 bool CDirectoryCache::InvalidateFile(const CServer &server, const CServerPath &path, const wxString& filename, bool *wasDir /*=false*/)
 {
-	scoped_lock lock(mutex_);
+	scoped_write_lock lock(rwlock_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
+	CServerEntry * serverEntry = GetModifiableServerEntry(server);
+	if (!serverEntry)
 		return false;
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter) {
-		CCacheEntry &entry = *iter;
-		if (path.CmpNoCase(entry.listing.path))
-			continue;
-
-		UpdateLru(sit, iter);
+	ForEachEntryNoCase(*serverEntry, path, [&](CCacheEntry & entry) {
+		UpdateLru(entry);
 
-		for (unsigned int i = 0; i < entry.listing.GetCount(); i++) {
-			if (!filename.CmpNoCase(((const CCacheEntry&)entry).listing[i].name)) {
-				if (wasDir)
-					*wasDir = entry.listing[i].is_dir();
-				entry.listing[i].flags |= CDirentry::flag_unsure;
-			}
+		for (auto const& i : entry.listing.FindFiles_CmpNoCase(filename)) {
+			if (wasDir)
+				*wasDir = entry.listing[i].is_dir();
+			entry.listing[i].flags |= CDirentry::flag_unsure;
 		}
 		entry.listing.m_flags |= CDirectoryListing::unsure_unknown;
 		entry.modificationTime = CMonotonicTime::Now();
-	}
+	});
+
+	// Accounting above may have pushed the cache over its limit
+	Prune();
 
 	return true;
 }
 
 bool CDirectoryCache::UpdateFile(const CServer &server, const CServerPath &path, const wxString& filename, bool mayCreate, enum Filetype type /*=file*/, wxLongLong size /*=-1*/)
 {
-	scoped_lock lock(mutex_);
+	scoped_write_lock lock(rwlock_);
+
+	bool const ret = DoUpdateFile(server, path, filename, mayCreate, type, size);
+	Prune();
+	return ret;
+}
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
+bool CDirectoryCache::DoUpdateFile(const CServer &server, const CServerPath &path, const wxString& filename, bool mayCreate, enum Filetype type, wxLongLong size)
+{
+	CServerEntry * serverEntry = GetModifiableServerEntry(server);
+	if (!serverEntry)
 		return false;
 
 	bool updated = false;
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter)
-	{
-		CCacheEntry &entry = *iter;
-		const CCacheEntry &cEntry = *iter;
-		if (path.CmpNoCase(entry.listing.path))
-			continue;
+	ForEachEntryNoCase(*serverEntry, path, [&](CCacheEntry & entry) {
+		const CCacheEntry &cEntry = entry;
 
-		UpdateLru(sit, iter);
+		UpdateLru(entry);
 
 		bool matchCase = false;
-		unsigned int i;
-		for (i = 0; i < entry.listing.GetCount(); i++)
+		unsigned int i = 0;
+		for (auto const& match : cEntry.listing.FindFiles_CmpNoCase(filename))
 		{
-			if (!filename.CmpNoCase(cEntry.listing[i].name))
+			i = match;
+			entry.listing[i].flags |= CDirentry::flag_unsure;
+			if (cEntry.listing[i].name == filename)
 			{
-				entry.listing[i].flags |= CDirentry::flag_unsure;
-				if (cEntry.listing[i].name == filename)
-				{
-					matchCase = true;
-					break;
-				}
+				matchCase = true;
+				break;
 			}
 		}
 
@@ -263,254 +381,455 @@ bool CDirectoryCache::UpdateFile(const CServer &server, const CServerPath &path,
 		entry.modificationTime = CMonotonicTime::Now();
 
 		updated = true;
-	}
+	});
 
 	return updated;
 }
 
 bool CDirectoryCache::RemoveFile(const CServer &server, const CServerPath &path, const wxString& filename)
 {
-	scoped_lock lock(mutex_);
+	scoped_write_lock lock(rwlock_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return false;
+	bool const ret = DoRemoveFile(server, path, filename);
+	Prune();
+	return ret;
+}
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ++iter)
-	{
-		const CCacheEntry &entry = *iter;
-		if (path.CmpNoCase(entry.listing.path))
-			continue;
+bool CDirectoryCache::RemoveFiles(const CServer &server, const CServerPath &path, std::vector<wxString> const& filenames)
+{
+	if (filenames.empty())
+		return true;
 
-		UpdateLru(sit, iter);
+	scoped_write_lock lock(rwlock_);
 
-		bool matchCase = false;
-		for (unsigned int i = 0; i < entry.listing.GetCount(); i++)
-		{
-			if (entry.listing[i].name == filename)
-				matchCase = true;
-		}
+	bool const ret = DoRemoveFiles(server, path, filenames);
+	Prune();
+	return ret;
+}
 
-		if (matchCase)
-		{
-			unsigned int i;
-			for (i = 0; i < entry.listing.GetCount(); i++)
-				if (entry.listing[i].name == filename)
-					break;
-			wxASSERT(i != entry.listing.GetCount());
-
-			CDirectoryListing& listing = iter->listing;
-			listing.RemoveEntry(i); // This does set m_hasUnsureEntries
-			--m_totalFileCount;
-		}
-		else
-		{
-			for (unsigned int i = 0; i < entry.listing.GetCount(); i++)
+bool CDirectoryCache::DoRemoveFile(const CServer &server, const CServerPath &path, const wxString& filename)
+{
+	return DoRemoveFiles(server, path, std::vector<wxString>{filename});
+}
+
+bool CDirectoryCache::DoRemoveFiles(const CServer &server, const CServerPath &path, std::vector<wxString> const& filenames)
+{
+	CServerEntry * serverEntry = GetModifiableServerEntry(server);
+	if (!serverEntry)
+		return false;
+
+	ForEachEntryNoCase(*serverEntry, path, [&](CCacheEntry & entry) {
+		UpdateLru(entry);
+
+		std::vector<unsigned int> indexes;
+		indexes.reserve(filenames.size());
+		for (auto const& filename : filenames) {
+			int const i = static_cast<CCacheEntry const&>(entry).listing.FindFile_CmpCase(filename);
+			if (i >= 0)
+				indexes.push_back(i);
+			else
 			{
-				if (!filename.CmpNoCase(entry.listing[i].name))
-					iter->listing[i].flags |= CDirentry::flag_unsure;
+				for (auto const& match : static_cast<CCacheEntry const&>(entry).listing.FindFiles_CmpNoCase(filename))
+					entry.listing[match].flags |= CDirentry::flag_unsure;
+				entry.listing.m_flags |= CDirectoryListing::unsure_invalid;
 			}
-			iter->listing.m_flags |= CDirectoryListing::unsure_invalid;
 		}
-		iter->modificationTime = CMonotonicTime::Now();
-	}
+		// This does set m_hasUnsureEntries
+		m_totalFileCount -= entry.listing.RemoveEntries(std::move(indexes));
+		entry.modificationTime = CMonotonicTime::Now();
+	});
 
 	return true;
 }
 
 void CDirectoryCache::InvalidateServer(const CServer& server)
 {
-	scoped_lock lock(mutex_);
+	scoped_write_lock lock(rwlock_);
 
-	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter)
-	{
-		if (iter->server != server)
-			continue;
+	DoInvalidateServer(server);
+}
 
-		for (tCacheIter cit = iter->cacheList.begin(); cit != iter->cacheList.end(); ++cit)
-		{
-			tLruList::iterator* lruIt = (tLruList::iterator*)cit->lruIt;
-			if (lruIt)
-			{
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
-			}
+void CDirectoryCache::DoInvalidateServer(const CServer& server)
+{
+	if (storage_)
+		storage_->RemoveServer(server);
 
-			m_totalFileCount -= cit->listing.GetCount();
-		}
+	auto const it = m_serverMap.find(server);
+	if (it == m_serverMap.end())
+		return;
 
-		m_serverList.erase(iter);
-		break;
+	for (auto & cacheEntry : it->second.cacheMap) {
+		UnlinkLru(cacheEntry.second);
+		m_totalFileCount -= cacheEntry.second.listing.GetCount();
+		m_totalMemory -= cacheEntry.second.memory;
+		--m_entryCount;
 	}
+
+	m_serverMap.erase(it);
 }
 
 bool CDirectoryCache::GetChangeTime(CMonotonicTime& time, const CServer &server, const CServerPath &path)
 {
-	scoped_lock lock(mutex_);
-
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
-		return false;
-
-	tCacheIter iter;
-	bool unused;
-	if (Lookup(iter, sit, path, true, unused)) {
-		time = iter->modificationTime;
+	return VisitEntry(server, path, [&](CCacheEntry & entry, bool) {
+		time = entry.modificationTime;
 		return true;
-	}
-
-	return false;
+	});
 }
 
 void CDirectoryCache::RemoveDir(const CServer& server, const CServerPath& path, const wxString& filename, const CServerPath&)
 {
-	scoped_lock lock(mutex_);
+	scoped_write_lock lock(rwlock_);
 
+	DoRemoveDir(server, path, filename);
+	Prune();
+}
+
+void CDirectoryCache::DoRemoveDir(const CServer& server, const CServerPath& path, const wxString& filename)
+{
 	// TODO: This is not 100% foolproof and may not work properly
 	// Perhaps just throw away the complete cache?
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
+	CServerEntry * serverEntry = GetModifiableServerEntry(server);
+	if (!serverEntry)
 		return;
 
 	CServerPath absolutePath = path;
 	if (!absolutePath.AddSegment(filename))
 		absolutePath.clear();
 
-	for (tCacheIter iter = sit->cacheList.begin(); iter != sit->cacheList.end(); ) {
-		CCacheEntry &entry = *iter;
-		// Delete exact matches and subdirs
-		if (!absolutePath.empty() && (entry.listing.path == absolutePath || absolutePath.IsParentOf(entry.listing.path, true))) {
-			m_totalFileCount -= entry.listing.GetCount();
-			tLruList::iterator* lruIt = (tLruList::iterator*)iter->lruIt;
-			if (lruIt) {
-				m_leastRecentlyUsedList.erase(*lruIt);
-				delete lruIt;
+	if (!absolutePath.empty() && storage_) {
+		LoadStoredPaths(*serverEntry);
+
+		auto & storedPaths = serverEntry->storedPaths;
+		for (auto iter = storedPaths.begin(); iter != storedPaths.end(); ) {
+			if (*iter == absolutePath || absolutePath.IsParentOf(*iter, true)) {
+				storage_->Remove(server, *iter);
+				iter = storedPaths.erase(iter);
+			}
+			else {
+				++iter;
 			}
-			sit->cacheList.erase(iter++);
 		}
-		else {
-			++iter;
+	}
+
+	if (!absolutePath.empty()) {
+		tCacheMap & cacheMap = serverEntry->cacheMap;
+		for (auto iter = cacheMap.begin(); iter != cacheMap.end(); ) {
+			// Delete exact matches and subdirs
+			if (iter->first == absolutePath || absolutePath.IsParentOf(iter->first, true)) {
+				UnlinkLru(iter->second);
+				m_totalFileCount -= iter->second.listing.GetCount();
+				m_totalMemory -= iter->second.memory;
+				--m_entryCount;
+				iter = cacheMap.erase(iter);
+			}
+			else {
+				++iter;
+			}
 		}
 	}
 
-	RemoveFile(server, path, filename);
+	DoRemoveFile(server, path, filename);
 }
 
 void CDirectoryCache::Rename(const CServer& server, const CServerPath& pathFrom, const wxString& fileFrom, const CServerPath& pathTo, const wxString& fileTo)
 {
-	scoped_lock lock(mutex_);
+	scoped_write_lock lock(rwlock_);
 
-	tServerIter sit = GetServerEntry(server);
-	if (sit == m_serverList.end())
+	if (!GetModifiableServerEntry(server))
 		return;
 
-	tCacheIter iter;
-	bool is_outdated = false;
-	bool found = Lookup(iter, sit, pathFrom, true, is_outdated);
-	if (found)
+	CCacheEntry * entry = GetOrLoadEntry(server, pathFrom);
+	if (entry)
 	{
-		CDirectoryListing& listing = iter->listing;
+		UpdateLru(*entry);
+
+		CDirectoryListing& listing = entry->listing;
+
+		// Only for lookups, non-const access expands compact listings
+		CDirectoryListing const& cached = listing;
 		if (pathFrom == pathTo)
 		{
-			RemoveFile(server, pathFrom, fileTo);
-			unsigned int i;
-			for (i = 0; i < listing.GetCount(); i++)
-			{
-				if (listing[i].name == fileFrom)
-					break;
-			}
-			if (i != listing.GetCount())
+			DoRemoveFile(server, pathFrom, fileTo);
+			int const i = listing.FindFile_CmpCase(fileFrom);
+			if (i >= 0)
 			{
-				if (listing[i].is_dir())
+				if (cached[i].is_dir())
 				{
-					RemoveDir(server, pathFrom, fileFrom, CServerPath());
-					RemoveDir(server, pathFrom, fileTo, CServerPath());
-					UpdateFile(server, pathFrom, fileTo, true, dir);
+					DoRemoveDir(server, pathFrom, fileFrom);
+					DoRemoveDir(server, pathFrom, fileTo);
+					DoUpdateFile(server, pathFrom, fileTo, true, dir, -1);
 				}
 				else
 				{
-					listing[i].name = fileTo;
+					MarkDirty(*entry);
+					bool const wasCompact = listing.IsCompact();
+					listing.RenameEntry(i, fileTo);
 					listing[i].flags |= CDirentry::flag_unsure;
 					listing.m_flags |= CDirectoryListing::unsure_unknown;
-					listing.ClearFindMap();
+					UpdateMemoryUsage(*entry, wasCompact, listing.GetCount());
 				}
 			}
+			Prune();
 			return;
 		}
 		else {
-			unsigned int i;
-			for (i = 0; i < listing.GetCount(); i++) {
-				if (listing[i].name == fileFrom)
-					break;
-			}
-			if (i != listing.GetCount()) {
-				if (listing[i].is_dir()) {
-					RemoveDir(server, pathFrom, fileFrom, CServerPath());
-					UpdateFile(server, pathTo, fileTo, true, dir);
+			int const i = listing.FindFile_CmpCase(fileFrom);
+			if (i >= 0) {
+				if (cached[i].is_dir()) {
+					DoRemoveDir(server, pathFrom, fileFrom);
+					DoUpdateFile(server, pathTo, fileTo, true, dir, -1);
 				}
 				else {
-					RemoveFile(server, pathFrom, fileFrom);
-					UpdateFile(server, pathTo, fileTo, true, file);
+					DoRemoveFile(server, pathFrom, fileFrom);
+					DoUpdateFile(server, pathTo, fileTo, true, file, -1);
 				}
 			}
+			Prune();
 			return;
 		}
 	}
 
 	// We know nothing, be on the safe side and invalidate everything.
-	InvalidateServer(server);
+	DoInvalidateServer(server);
+}
+
+CDirectoryCache::CServerEntry& CDirectoryCache::CreateServerEntry(const CServer& server)
+{
+	return m_serverMap.emplace(std::piecewise_construct, std::forward_as_tuple(server), std::forward_as_tuple(server)).first->second;
+}
+
+CDirectoryCache::CServerEntry* CDirectoryCache::GetServerEntry(const CServer& server)
+{
+	auto const it = m_serverMap.find(server);
+	if (it == m_serverMap.end())
+		return 0;
+
+	return &it->second;
+}
+
+CDirectoryCache::CServerEntry* CDirectoryCache::GetModifiableServerEntry(const CServer& server)
+{
+	if (storage_)
+		return &CreateServerEntry(server);
+
+	return GetServerEntry(server);
+}
+
+bool CDirectoryCache::MayBeStored(CServerEntry const& serverEntry, const CServerPath& path) const
+{
+	if (!storage_)
+		return false;
+
+	return !serverEntry.storedPathsLoaded || serverEntry.storedPaths.find(path) != serverEntry.storedPaths.end();
+}
+
+void CDirectoryCache::LoadStoredPaths(CServerEntry & serverEntry)
+{
+	if (serverEntry.storedPathsLoaded || !storage_)
+		return;
+
+	for (auto const& path : storage_->GetPaths(serverEntry.server))
+		serverEntry.storedPaths.insert(path);
+	serverEntry.storedPathsLoaded = true;
 }
 
-CDirectoryCache::tServerIter CDirectoryCache::CreateServerEntry(const CServer& server)
+CDirectoryCache::CCacheEntry* CDirectoryCache::GetOrLoadEntry(const CServer& server, const CServerPath& path)
 {
-	for (tServerIter iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
-		if (iter->server == server)
-			return iter;
+	CCacheEntry * entry = GetCacheEntry(server, path);
+	if (!entry && storage_) {
+		CServerEntry & serverEntry = CreateServerEntry(server);
+		if (MayBeStored(serverEntry, path))
+			entry = LoadEntry(serverEntry, path);
 	}
-	m_serverList.emplace_back(server);
 
-	return --m_serverList.end();
+	return entry;
 }
 
-CDirectoryCache::tServerIter CDirectoryCache::GetServerEntry(const CServer& server)
+CDirectoryCache::CCacheEntry* CDirectoryCache::LoadEntry(CServerEntry & serverEntry, const CServerPath& path)
 {
-	tServerIter iter;
-	for (iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
-		if (iter->server == server)
-			break;
+	LoadStoredPaths(serverEntry);
+	if (serverEntry.storedPaths.find(path) == serverEntry.storedPaths.end())
+		return 0;
+
+	CDirectoryListing listing;
+	if (!storage_->Load(serverEntry.server, path, listing)) {
+		// Don't try again
+		serverEntry.storedPaths.erase(path);
+		return 0;
 	}
 
-	return iter;
+	auto const it = serverEntry.cacheMap.emplace(std::piecewise_construct, std::forward_as_tuple(path), std::forward_as_tuple(listing, serverEntry)).first;
+	CCacheEntry & entry = it->second;
+	++m_entryCount;
+	m_totalFileCount += listing.GetCount();
+	entry.listing.Compact();
+	UpdateMemoryUsage(entry);
+
+	UpdateLru(entry);
+
+	return &entry;
 }
 
-void CDirectoryCache::UpdateLru(tServerIter const& sit, tCacheIter const& cit)
+void CDirectoryCache::UpdateMemoryUsage(CCacheEntry & entry)
 {
-	tLruList::iterator* lruIt = (tLruList::iterator*)cit->lruIt;
-	if (lruIt) {
-		m_leastRecentlyUsedList.splice(m_leastRecentlyUsedList.end(), m_leastRecentlyUsedList, *lruIt);
-		**lruIt = std::make_pair(sit, cit);
+	m_totalMemory -= entry.memory;
+	entry.memory = sizeof(CCacheEntry) + sizeof(CServerPath) + entry.listing.GetMemoryUsage();
+	m_totalMemory += entry.memory;
+	entry.estimatedChanges = 0;
+}
+
+void CDirectoryCache::UpdateMemoryUsage(CCacheEntry & entry, bool wasCompact, unsigned int oldCount)
+{
+	// Modifying a compact listing expands it, compact it again
+	if (wasCompact && !entry.listing.IsCompact()) {
+		entry.listing.Compact();
+		UpdateMemoryUsage(entry);
+		return;
+	}
+
+	unsigned int const count = entry.listing.GetCount();
+
+	// Counting exactly takes time linear in the size of the listing. After
+	// small changes, scale the previous figure by the number of entries
+	// instead. Count exactly when the representation changed or the
+	// changes since the last count add up to a fraction of the listing.
+	entry.estimatedChanges += std::max(1u, count > oldCount ? count - oldCount : oldCount - count);
+	if (wasCompact != entry.listing.IsCompact() || !oldCount || entry.estimatedChanges > count / 4 + 16) {
+		UpdateMemoryUsage(entry);
+		return;
 	}
+
+	size_t const perEntry = entry.memory / oldCount;
+	m_totalMemory -= entry.memory;
+	if (count > oldCount)
+		entry.memory += perEntry * (count - oldCount);
 	else
-		cit->lruIt = (void*)new tLruList::iterator(m_leastRecentlyUsedList.emplace(m_leastRecentlyUsedList.end(), sit, cit));
+		entry.memory -= std::min(entry.memory, perEntry * (oldCount - count));
+	m_totalMemory += entry.memory;
 }
 
-void CDirectoryCache::Prune()
+void CDirectoryCache::MarkDirty(CCacheEntry & entry)
 {
-	while ((m_leastRecentlyUsedList.size() > 50000) ||
-		(m_totalFileCount > 1000000 && m_leastRecentlyUsedList.size() > 1000) ||
-		(m_totalFileCount > 5000000 && m_leastRecentlyUsedList.size() > 100))
-	{
-		tFullEntryPosition pos = m_leastRecentlyUsedList.front();
-		tLruList::iterator* lruIt = (tLruList::iterator*)pos.second->lruIt;
-		delete lruIt;
+	if (entry.dirty || !storage_)
+		return;
+
+	// Until the changed listing gets saved, don't keep the old one around.
+	// It would be considered accurate after a crash.
+	entry.dirty = true;
+	storage_->Remove(entry.serverEntry.server, entry.listing.path);
+	entry.serverEntry.storedPaths.erase(entry.listing.path);
+}
+
+CDirectoryCache::CCacheEntry* CDirectoryCache::GetCacheEntry(const CServer& server, const CServerPath &path)
+{
+	CServerEntry * serverEntry = GetServerEntry(server);
+	if (!serverEntry)
+		return 0;
+
+	auto const it = serverEntry->cacheMap.find(path);
+	if (it == serverEntry->cacheMap.end())
+		return 0;
+
+	return &it->second;
+}
+
+void CDirectoryCache::UpdateLru(CCacheEntry & entry)
+{
+	scoped_lock lock(lru_mutex_);
+
+	entry.lastAccess = ++m_accessCounter;
 
-		m_totalFileCount -= pos.second->listing.GetCount();
+	if (m_lruTail == &entry)
+		return;
+
+	if (entry.inLru) {
+		// Unlink, entry isn't the tail so it has a successor
+		if (entry.lruPrev)
+			entry.lruPrev->lruNext = entry.lruNext;
+		else
+			m_lruHead = entry.lruNext;
+		entry.lruNext->lruPrev = entry.lruPrev;
+	}
 
-		pos.first->cacheList.erase(pos.second);
-		if (pos.first->cacheList.empty())
-			m_serverList.erase(pos.first);
+	entry.lruPrev = m_lruTail;
+	entry.lruNext = 0;
+	if (m_lruTail)
+		m_lruTail->lruNext = &entry;
+	else
+		m_lruHead = &entry;
+	m_lruTail = &entry;
+	entry.inLru = true;
+}
+
+void CDirectoryCache::UnlinkLru(CCacheEntry & entry)
+{
+	if (!entry.inLru)
+		return;
+
+	if (entry.lruPrev)
+		entry.lruPrev->lruNext = entry.lruNext;
+	else
+		m_lruHead = entry.lruNext;
+
+	if (entry.lruNext)
+		entry.lruNext->lruPrev = entry.lruPrev;
+	else
+		m_lruTail = entry.lruPrev;
+
+	entry.lruPrev = 0;
+	entry.lruNext = 0;
+	entry.inLru = false;
+}
+
+void CDirectoryCache::RemoveEntry(CCacheEntry & entry)
+{
+	UnlinkLru(entry);
+
+	CServerEntry & serverEntry = entry.serverEntry;
+	if (entry.dirty) {
+		storage_->Save(serverEntry.server, entry.listing);
+		if (serverEntry.storedPathsLoaded)
+			serverEntry.storedPaths.insert(entry.listing.path);
+	}
+
+	m_totalFileCount -= entry.listing.GetCount();
+	m_totalMemory -= entry.memory;
+	--m_entryCount;
+
+	CServerPath const path = entry.listing.path;
+	serverEntry.cacheMap.erase(path);
+
+	// With storage, the server entry also remembers the stored paths
+	if (serverEntry.cacheMap.empty() && !storage_) {
+		CServer const server = serverEntry.server;
+		m_serverMap.erase(server);
+	}
+}
+
+void CDirectoryCache::Prune()
+{
+	// Of the least recently used entries, evict the one with the highest
+	// product of size and time since its last use. This way a single large
+	// listing goes before many small ones that have been used about as
+	// recently.
+	int const candidates = 8;
+
+	while (m_totalMemory > memory_limit_ && m_lruHead) {
+		CCacheEntry * victim = m_lruHead;
+		uint64_t victimCost = 0;
+
+		CCacheEntry * entry = m_lruHead;
+		for (int i = 0; i < candidates && entry; ++i, entry = entry->lruNext) {
+			uint64_t const age = m_accessCounter - entry->lastAccess + 1;
+			uint64_t const cost = age * entry->memory;
+			if (cost > victimCost) {
+				victimCost = cost;
+				victim = entry;
+			}
+		}
 
-		m_leastRecentlyUsedList.pop_front();
+		RemoveEntry(*victim);
+		++evictions_;
 	}
 }
@@ -5,18 +5,30 @@
 This class is the directory cache used to store retrieved directory listings
 for further use.
 Directory get either purged from the cache if the maximum cache time exceeds,
-or on possible data inconsistencies.
+on possible data inconsistencies or once the cached listings take up more
+memory than allowed.
 For example since some servers are case sensitive and others aren't, a
 directory is removed from cache once an operation effects a file wich matches
 multiple entries in a cache directory using a case insensitive search
 On other operations, the directory is marked as unsure. It may still be valid,
 but for some operations the engine/interface prefers to retrieve a clean
 version.
+
+Optionally listings are kept in a database as well, see
+CDirectoryCacheStorage. Listings not in memory get loaded from it on first
+access.
 */
 
 #include <mutex.h>
 
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+
 const int CACHE_TIMEOUT = 1800; // In seconds
+const int CACHE_STORAGE_TIMEOUT = 7 * 24 * 3600; // In seconds, stored listings older than that get dropped
+
+class CDirectoryCacheStorage;
 
 class CDirectoryCache final
 {
@@ -34,6 +46,26 @@ public:
 	CDirectoryCache(CDirectoryCache const&) = delete;
 	CDirectoryCache& operator=(CDirectoryCache const&) = delete;
 
+	// Keeps listings in the given database file, empty to only cache in
+	// memory. Needs to be called before the cache is used.
+	void SetStorageFile(wxString const& file);
+
+	// Listings get evicted once they take up more than the given number of
+	// bytes.
+	void SetMemoryLimit(size_t limit);
+
+	struct statistics
+	{
+		size_t entries;
+		int64_t files;
+		size_t memory;
+		size_t memory_limit;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+	};
+	statistics GetStatistics();
+
 	void Store(const CDirectoryListing &listing, const CServer &server);
 	bool GetChangeTime(CMonotonicTime& time, const CServer &server, const CServerPath &path);
 	bool Lookup(CDirectoryListing &listing, const CServer &server, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated);
@@ -42,67 +74,147 @@ public:
 	bool InvalidateFile(const CServer &server, const CServerPath &path, const wxString& filename, bool *wasDir = 0);
 	bool UpdateFile(const CServer &server, const CServerPath &path, const wxString& filename, bool mayCreate, enum Filetype type = file, wxLongLong size = -1);
 	bool RemoveFile(const CServer &server, const CServerPath &path, const wxString& filename);
+
+	// Same as calling RemoveFile for each of the files, but only looks up the
+	// listing once. Use it to apply the results of batch deletions.
+	bool RemoveFiles(const CServer &server, const CServerPath &path, std::vector<wxString> const& filenames);
 	void InvalidateServer(const CServer& server);
 	void RemoveDir(const CServer& server, const CServerPath& path, const wxString& filename, const CServerPath& target);
 	void Rename(const CServer& server, const CServerPath& pathFrom, const wxString& fileFrom, const CServerPath& pathTo, const wxString& fileTo);
 
 protected:
 
+	class CServerEntry;
+
 	class CCacheEntry final
 	{
 	public:
-		CCacheEntry() : lruIt() { };
-		CCacheEntry(const CCacheEntry &entry);
-		explicit CCacheEntry(CDirectoryListing const& l)
+		CCacheEntry(CDirectoryListing const& l, CServerEntry & s)
 			: listing(l)
 			, modificationTime(CMonotonicTime::Now())
-			, lruIt()
+			, serverEntry(s)
 		{}
-		~CCacheEntry() { };
+
+		CCacheEntry(CCacheEntry const&) = delete;
+		CCacheEntry& operator=(CCacheEntry const&) = delete;
 
 		CDirectoryListing listing;
 		CMonotonicTime modificationTime;
 
-		CCacheEntry& operator=(const CCacheEntry &a);
+		CServerEntry & serverEntry;
+
+		// Set if the listing differs from the stored one, the stored one
+		// then has been removed already.
+		bool dirty{};
+
+		// Bytes accounted for the entry in m_totalMemory
+		size_t memory{};
+
+		// Entries changed since memory was last counted exactly
+		unsigned int estimatedChanges{};
 
-		void* lruIt; // void* to break cyclic declaration dependency
+		// Intrusive least recently used list, guarded by lru_mutex_
+		CCacheEntry* lruPrev{};
+		CCacheEntry* lruNext{};
+		bool inLru{};
+		uint64_t lastAccess{};
 	};
 
+	// Hashes paths case-insensitively, so that all paths differing only in
+	// case end up in the same bucket.
+	struct path_hash final
+	{
+		size_t operator()(CServerPath const& path) const;
+	};
+
+	struct server_hash final
+	{
+		size_t operator()(CServer const& server) const;
+	};
+
+	typedef std::unordered_map<CServerPath, CCacheEntry, path_hash> tCacheMap;
+
 	class CServerEntry final
 	{
 	public:
-		CServerEntry() {}
 		explicit CServerEntry(CServer const& s)
 			: server(s)
 		{}
 
 		CServer server;
-		std::list<CCacheEntry> cacheList;
+		tCacheMap cacheMap;
+
+		// Paths of the listings in the storage
+		std::unordered_set<CServerPath, path_hash> storedPaths;
+		bool storedPathsLoaded{};
 	};
 
-	typedef std::list<CServerEntry>::iterator tServerIter;
+	typedef std::unordered_map<CServer, CServerEntry, server_hash> tServerMap;
+
+	CServerEntry& CreateServerEntry(const CServer& server);
+	CServerEntry* GetServerEntry(const CServer& server);
+
+	// Exact match of the path
+	CCacheEntry* GetCacheEntry(const CServer& server, const CServerPath &path);
+
+	// Calls f(entry, holds_write_lock) with the entry of the exact path,
+	// loading it from the storage if needed. If f returns false while
+	// holding the read lock, it gets called again with the write lock.
+	// Returns false if there is no such entry.
+	template<typename F>
+	bool VisitEntry(const CServer& server, const CServerPath& path, F const& f);
 
-	tServerIter CreateServerEntry(const CServer& server);
-	tServerIter GetServerEntry(const CServer& server);
+	// Calls f for each entry matching the path case-insensitively. f is
+	// expected to modify the entry. Requires the write lock.
+	template<typename F>
+	void ForEachEntryNoCase(CServerEntry & serverEntry, const CServerPath &path, F const& f);
 
-	typedef std::list<CCacheEntry>::iterator tCacheIter;
-	typedef std::list<CCacheEntry>::const_iterator tCacheConstIter;
+	// The following require the write lock
+	CServerEntry* GetModifiableServerEntry(const CServer& server); // Also if only the storage has listings of the server
+	CCacheEntry* GetOrLoadEntry(const CServer& server, const CServerPath& path);
+	CCacheEntry* LoadEntry(CServerEntry & serverEntry, const CServerPath& path);
+	void LoadStoredPaths(CServerEntry & serverEntry);
+	void MarkDirty(CCacheEntry & entry);
+	void UpdateMemoryUsage(CCacheEntry & entry);
+	void UpdateMemoryUsage(CCacheEntry & entry, bool wasCompact, unsigned int oldCount);
+	void RemoveEntry(CCacheEntry & entry);
+	bool DoUpdateFile(const CServer &server, const CServerPath &path, const wxString& filename, bool mayCreate, enum Filetype type, wxLongLong size);
+	bool DoRemoveFile(const CServer &server, const CServerPath &path, const wxString& filename);
+	bool DoRemoveFiles(const CServer &server, const CServerPath &path, std::vector<wxString> const& filenames);
+	void DoInvalidateServer(const CServer& server);
+	void DoRemoveDir(const CServer& server, const CServerPath& path, const wxString& filename);
 
-	bool Lookup(tCacheIter &cacheIter, tServerIter &sit, const CServerPath &path, bool allowUnsureEntries, bool& is_outdated);
+	// Can be called while holding either lock
+	bool MayBeStored(CServerEntry const& serverEntry, const CServerPath& path) const;
 
-	mutex mutex_;
+	// Lookups only need the read lock, modifications the write lock.
+	rwlock rwlock_;
 
-	std::list<CServerEntry> m_serverList;
+	tServerMap m_serverMap;
 
-	void UpdateLru(tServerIter const& sit, tCacheIter const& cit);
+	// Can be called while holding either lock
+	void UpdateLru(CCacheEntry & entry);
+
+	// Requires the write lock
+	void UnlinkLru(CCacheEntry & entry);
 
 	void Prune();
 
-	typedef std::pair<tServerIter, tCacheIter> tFullEntryPosition;
-	typedef std::list<tFullEntryPosition> tLruList;
-	tLruList m_leastRecentlyUsedList;
+	mutex lru_mutex_{false};
+	CCacheEntry* m_lruHead{};
+	CCacheEntry* m_lruTail{};
+	uint64_t m_accessCounter{};
+	size_t m_entryCount{};
 
 	int64_t m_totalFileCount{};
+	size_t m_totalMemory{};
+	size_t memory_limit_{128 * 1024 * 1024};
+
+	std::atomic<uint64_t> hits_{};
+	std::atomic<uint64_t> misses_{};
+	uint64_t evictions_{};
+
+	std::unique_ptr<CDirectoryCacheStorage> storage_;
 };
 
 #endif
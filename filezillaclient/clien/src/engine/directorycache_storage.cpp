@@ -0,0 +1,449 @@
+#include <filezilla.h>
+#include "directorycache.h"
+#include "directorycache_storage.h"
+
+#include <sqlite3.h>
+
+#include <string.h>
+#include <unordered_map>
+
+namespace {
+// Bump if the layout of the table or of the entry blobs changes
+int const schema_version = 1;
+
+wxString GetServerKey(CServer const& server)
+{
+	// Everything which distinguishes the listings of two servers, except for
+	// the password.
+	wxString key = wxString::Format(_T("%d %d %d %d %d "), static_cast<int>(server.GetProtocol()), static_cast<int>(server.GetType()),
+		static_cast<int>(server.GetPort()), static_cast<int>(server.GetLogonType()), server.GetTimezoneOffset());
+	key += server.GetHost();
+	if (server.GetLogonType() != ANONYMOUS) {
+		key += _T(" ");
+		key += server.GetUser();
+	}
+	return key;
+}
+
+int64_t ToMilliseconds(CDateTime const& time)
+{
+	return time.Degenerate().GetValue().GetValue();
+}
+
+class blob_writer final
+{
+public:
+	template<typename T>
+	void Write(T const& v)
+	{
+		char const* p = reinterpret_cast<char const*>(&v);
+		data_.insert(data_.end(), p, p + sizeof(T));
+	}
+
+	void Write(wxString const& s)
+	{
+		wxScopedCharBuffer const utf8 = s.utf8_str();
+		Write(static_cast<uint32_t>(utf8.length()));
+		data_.insert(data_.end(), utf8.data(), utf8.data() + utf8.length());
+	}
+
+	std::vector<char> data_;
+};
+
+class blob_reader final
+{
+public:
+	blob_reader(char const* p, size_t len)
+		: p_(p)
+		, end_(p + len)
+	{}
+
+	template<typename T>
+	bool Read(T & v)
+	{
+		if (static_cast<size_t>(end_ - p_) < sizeof(T))
+			return false;
+		memcpy(&v, p_, sizeof(T));
+		p_ += sizeof(T);
+		return true;
+	}
+
+	bool Read(wxString & s)
+	{
+		uint32_t len;
+		if (!Read(len) || static_cast<size_t>(end_ - p_) < len)
+			return false;
+		s = wxString::FromUTF8(p_, len);
+		p_ += len;
+		return true;
+	}
+
+private:
+	char const* p_;
+	char const* const end_;
+};
+}
+
+class CDirectoryCacheStorage::Impl final
+{
+public:
+	~Impl();
+
+	bool Open(wxString const& file);
+	bool PrepareStatements();
+
+	sqlite3_stmt* PrepareStatement(char const* query);
+	bool Bind(sqlite3_stmt* statement, int index, wxString const& value);
+	bool Bind(sqlite3_stmt* statement, int index, int64_t value);
+	bool Bind(sqlite3_stmt* statement, int index, void const* blob, size_t len);
+
+	// Steps a statement not returning any rows and resets it
+	bool Execute(sqlite3_stmt* statement);
+
+	void Purge();
+
+	std::vector<char> SerializeEntries(CDirectoryListing const& listing);
+	bool DeserializeEntries(CDirectoryListing & listing, char const* data, size_t len);
+
+	sqlite3* db_{};
+
+	sqlite3_stmt* selectPathsQuery_{};
+	sqlite3_stmt* selectListingQuery_{};
+	sqlite3_stmt* saveListingQuery_{};
+	sqlite3_stmt* deleteListingQuery_{};
+	sqlite3_stmt* deleteServerQuery_{};
+};
+
+static int int_callback(void* p, int n, char** v, char**)
+{
+	int* i = static_cast<int*>(p);
+	if (!i || !n || !v || !*v)
+		return -1;
+
+	*i = atoi(*v);
+	return 0;
+}
+
+CDirectoryCacheStorage::Impl::~Impl()
+{
+	sqlite3_finalize(selectPathsQuery_);
+	sqlite3_finalize(selectListingQuery_);
+	sqlite3_finalize(saveListingQuery_);
+	sqlite3_finalize(deleteListingQuery_);
+	sqlite3_finalize(deleteServerQuery_);
+	sqlite3_close(db_);
+}
+
+bool CDirectoryCacheStorage::Impl::Open(wxString const& file)
+{
+	if (sqlite3_open(file.ToUTF8(), &db_) != SQLITE_OK) {
+		sqlite3_close(db_);
+		db_ = 0;
+		return false;
+	}
+
+	// Another instance may be using the same cache at the same time.
+	// Still being busy after the timeout counts as failure.
+	sqlite3_busy_timeout(db_, 1000);
+
+	// Losing the last few changes on power failure is acceptable for a
+	// cache, but the database itself must not become corrupt.
+	sqlite3_exec(db_, "PRAGMA journal_mode=WAL", 0, 0, 0);
+	sqlite3_exec(db_, "PRAGMA synchronous=NORMAL", 0, 0, 0);
+
+	int version = 0;
+	if (sqlite3_exec(db_, "PRAGMA user_version", int_callback, &version, 0) != SQLITE_OK)
+		return false;
+
+	if (version != schema_version) {
+		// It is only a cache, simply start over
+		if (sqlite3_exec(db_, "DROP TABLE IF EXISTS listings", 0, 0, 0) != SQLITE_OK)
+			return false;
+		wxString const query = wxString::Format(_T("PRAGMA user_version = %d"), schema_version);
+		if (sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0) != SQLITE_OK)
+			return false;
+	}
+
+	char const* const create =
+		"CREATE TABLE IF NOT EXISTS listings ("
+		"server TEXT NOT NULL, "
+		"path TEXT NOT NULL, "
+		"first_list_time INTEGER NOT NULL, "
+		"flags INTEGER NOT NULL, "
+		"entries BLOB NOT NULL, "
+		"PRIMARY KEY (server, path))";
+	if (sqlite3_exec(db_, create, 0, 0, 0) != SQLITE_OK)
+		return false;
+
+	if (!PrepareStatements())
+		return false;
+
+	Purge();
+
+	return true;
+}
+
+sqlite3_stmt* CDirectoryCacheStorage::Impl::PrepareStatement(char const* query)
+{
+	sqlite3_stmt* ret = 0;
+	if (sqlite3_prepare_v2(db_, query, -1, &ret, 0) != SQLITE_OK) {
+		sqlite3_finalize(ret);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+bool CDirectoryCacheStorage::Impl::PrepareStatements()
+{
+	selectPathsQuery_ = PrepareStatement("SELECT path FROM listings WHERE server=?1");
+	selectListingQuery_ = PrepareStatement("SELECT first_list_time, flags, entries FROM listings WHERE server=?1 AND path=?2");
+	saveListingQuery_ = PrepareStatement("INSERT OR REPLACE INTO listings (server, path, first_list_time, flags, entries) VALUES (?1, ?2, ?3, ?4, ?5)");
+	deleteListingQuery_ = PrepareStatement("DELETE FROM listings WHERE server=?1 AND path=?2");
+	deleteServerQuery_ = PrepareStatement("DELETE FROM listings WHERE server=?1");
+
+	return selectPathsQuery_ && selectListingQuery_ && saveListingQuery_ && deleteListingQuery_ && deleteServerQuery_;
+}
+
+bool CDirectoryCacheStorage::Impl::Bind(sqlite3_stmt* statement, int index, wxString const& value)
+{
+	wxScopedCharBuffer const utf8 = value.utf8_str();
+	return sqlite3_bind_text(statement, index, utf8.data(), utf8.length(), SQLITE_TRANSIENT) == SQLITE_OK;
+}
+
+bool CDirectoryCacheStorage::Impl::Bind(sqlite3_stmt* statement, int index, int64_t value)
+{
+	return sqlite3_bind_int64(statement, index, value) == SQLITE_OK;
+}
+
+bool CDirectoryCacheStorage::Impl::Bind(sqlite3_stmt* statement, int index, void const* blob, size_t len)
+{
+	return sqlite3_bind_blob(statement, index, blob, len, SQLITE_TRANSIENT) == SQLITE_OK;
+}
+
+bool CDirectoryCacheStorage::Impl::Execute(sqlite3_stmt* statement)
+{
+	int const res = sqlite3_step(statement);
+	sqlite3_reset(statement);
+
+	return res == SQLITE_DONE;
+}
+
+void CDirectoryCacheStorage::Impl::Purge()
+{
+	CDateTime const limit = CDateTime::Now() + wxTimeSpan::Seconds(-CACHE_STORAGE_TIMEOUT);
+
+	wxString const query = wxString::Format(_T("DELETE FROM listings WHERE first_list_time < %lld"), static_cast<long long>(ToMilliseconds(limit)));
+	sqlite3_exec(db_, query.ToUTF8(), 0, 0, 0);
+}
+
+std::vector<char> CDirectoryCacheStorage::Impl::SerializeEntries(CDirectoryListing const& listing)
+{
+	blob_writer writer;
+
+	unsigned int const count = listing.GetCount();
+	writer.Write(static_cast<uint32_t>(count));
+	for (unsigned int i = 0; i < count; ++i) {
+		CDirentry const& entry = listing[i];
+
+		writer.Write(entry.name);
+		writer.Write(static_cast<int64_t>(entry.size.GetValue()));
+		writer.Write(static_cast<int32_t>(entry.flags));
+		if (entry.has_date()) {
+			writer.Write(static_cast<uint8_t>(1));
+			writer.Write(ToMilliseconds(entry.time));
+			writer.Write(static_cast<uint8_t>(entry.time.GetAccuracy()));
+		}
+		else {
+			writer.Write(static_cast<uint8_t>(0));
+		}
+		writer.Write(*entry.permissions);
+		writer.Write(*entry.ownerGroup);
+		if (entry.target) {
+			writer.Write(static_cast<uint8_t>(1));
+			writer.Write(*entry.target);
+		}
+		else {
+			writer.Write(static_cast<uint8_t>(0));
+		}
+	}
+
+	return std::move(writer.data_);
+}
+
+bool CDirectoryCacheStorage::Impl::DeserializeEntries(CDirectoryListing & listing, char const* data, size_t len)
+{
+	blob_reader reader(data, len);
+
+	uint32_t count;
+	if (!reader.Read(count))
+		return false;
+
+	// Permissions and owners are mostly the same for all entries, share them
+	std::unordered_map<wxString, CRefcountObject<wxString>, wxStringHash> strings;
+	auto const intern = [&strings](wxString const& s) {
+		auto it = strings.find(s);
+		if (it == strings.end())
+			it = strings.emplace(s, CRefcountObject<wxString>(s)).first;
+		return it->second;
+	};
+
+	std::deque<CRefcountObject<CDirentry>> entries;
+	for (uint32_t i = 0; i < count; ++i) {
+		CRefcountObject<CDirentry> entry;
+		CDirentry & e = entry.Get();
+
+		int64_t size;
+		int32_t flags;
+		uint8_t hasTime;
+		if (!reader.Read(e.name) || !reader.Read(size) || !reader.Read(flags) || !reader.Read(hasTime))
+			return false;
+		e.size = size;
+		e.flags = flags;
+
+		if (hasTime) {
+			int64_t ms;
+			uint8_t accuracy;
+			if (!reader.Read(ms) || !reader.Read(accuracy) || accuracy > CDateTime::milliseconds)
+				return false;
+			e.time = CDateTime(wxDateTime(wxLongLong(ms)), static_cast<CDateTime::Accuracy>(accuracy));
+		}
+
+		wxString s;
+		if (!reader.Read(s))
+			return false;
+		e.permissions = intern(s);
+		if (!reader.Read(s))
+			return false;
+		e.ownerGroup = intern(s);
+
+		uint8_t hasTarget;
+		if (!reader.Read(hasTarget))
+			return false;
+		if (hasTarget) {
+			if (!reader.Read(s))
+				return false;
+			e.target = CSparseOptional<wxString>(s);
+		}
+
+		entries.push_back(std::move(entry));
+	}
+
+	listing.Assign(entries);
+	return true;
+}
+
+CDirectoryCacheStorage::CDirectoryCacheStorage(wxString const& file)
+	: d_(make_unique<Impl>())
+{
+	if (!d_->Open(file)) {
+		d_.reset();
+	}
+}
+
+CDirectoryCacheStorage::~CDirectoryCacheStorage()
+{
+}
+
+bool CDirectoryCacheStorage::IsOpen() const
+{
+	return d_ != 0;
+}
+
+std::vector<CServerPath> CDirectoryCacheStorage::GetPaths(CServer const& server)
+{
+	std::vector<CServerPath> ret;
+	if (!d_)
+		return ret;
+
+	sqlite3_stmt* const statement = d_->selectPathsQuery_;
+	d_->Bind(statement, 1, GetServerKey(server));
+
+	while (sqlite3_step(statement) == SQLITE_ROW) {
+		char const* text = reinterpret_cast<char const*>(sqlite3_column_text(statement, 0));
+		CServerPath path;
+		if (text && path.SetSafePath(wxString::FromUTF8(text)))
+			ret.push_back(path);
+	}
+
+	sqlite3_reset(statement);
+
+	return ret;
+}
+
+bool CDirectoryCacheStorage::Load(CServer const& server, CServerPath const& path, CDirectoryListing & listing)
+{
+	if (!d_)
+		return false;
+
+	sqlite3_stmt* const statement = d_->selectListingQuery_;
+	d_->Bind(statement, 1, GetServerKey(server));
+	d_->Bind(statement, 2, path.GetSafePath());
+
+	bool ret = false;
+	if (sqlite3_step(statement) == SQLITE_ROW) {
+		char const* data = static_cast<char const*>(sqlite3_column_blob(statement, 2));
+		size_t const len = sqlite3_column_bytes(statement, 2);
+
+		listing.path = path;
+		if (d_->DeserializeEntries(listing, data, len)) {
+			wxDateTime const firstListTime(wxLongLong(sqlite3_column_int64(statement, 0)));
+			listing.m_firstListTime = CMonotonicTime(CDateTime(firstListTime, CDateTime::milliseconds));
+			listing.m_flags = sqlite3_column_int(statement, 1);
+			ret = true;
+		}
+	}
+
+	sqlite3_reset(statement);
+
+	return ret;
+}
+
+void CDirectoryCacheStorage::Save(CServer const& server, CDirectoryListing const& listing)
+{
+	if (!d_)
+		return;
+
+	// Entries of compact listings get recreated on access, do that in a
+	// temporary copy.
+	CDirectoryListing const copy(listing);
+	std::vector<char> const entries = d_->SerializeEntries(copy);
+
+	sqlite3_stmt* const statement = d_->saveListingQuery_;
+	d_->Bind(statement, 1, GetServerKey(server));
+	d_->Bind(statement, 2, listing.path.GetSafePath());
+	d_->Bind(statement, 3, ToMilliseconds(listing.m_firstListTime.GetTime()));
+	d_->Bind(statement, 4, static_cast<int64_t>(listing.m_flags));
+	d_->Bind(statement, 5, entries.data(), entries.size());
+	if (!d_->Execute(statement))
+		Failed();
+}
+
+void CDirectoryCacheStorage::Remove(CServer const& server, CServerPath const& path)
+{
+	if (!d_)
+		return;
+
+	sqlite3_stmt* const statement = d_->deleteListingQuery_;
+	d_->Bind(statement, 1, GetServerKey(server));
+	d_->Bind(statement, 2, path.GetSafePath());
+	if (!d_->Execute(statement))
+		Failed();
+}
+
+void CDirectoryCacheStorage::RemoveServer(CServer const& server)
+{
+	if (!d_)
+		return;
+
+	sqlite3_stmt* const statement = d_->deleteServerQuery_;
+	d_->Bind(statement, 1, GetServerKey(server));
+	if (!d_->Execute(statement))
+		Failed();
+}
+
+void CDirectoryCacheStorage::Failed()
+{
+	// Continuing could serve listings which should have been removed
+	d_.reset();
+}
@@ -0,0 +1,49 @@
+#ifndef __DIRECTORYCACHE_STORAGE_H__
+#define __DIRECTORYCACHE_STORAGE_H__
+
+/*
+Keeps directory listings in an SQLite database so that they survive a
+restart of the program. Used by CDirectoryCache, which loads listings
+lazily from it and takes care of locking.
+
+Listings are keyed by the server and their path. Passwords are not part of
+the key, they never get written to the database.
+
+Each modification is committed right away, so that the database never
+holds on to a listing that has been invalidated and no write lock is held
+between calls. Other instances may use the same database. If it stays busy
+for longer than the busy timeout, or a write fails otherwise, the database
+gets closed and the storage stays unused for the rest of the session.
+*/
+
+#include <vector>
+
+class CDirectoryCacheStorage final
+{
+	class Impl;
+
+public:
+	explicit CDirectoryCacheStorage(wxString const& file);
+	~CDirectoryCacheStorage();
+
+	CDirectoryCacheStorage(CDirectoryCacheStorage const&) = delete;
+	CDirectoryCacheStorage& operator=(CDirectoryCacheStorage const&) = delete;
+
+	bool IsOpen() const;
+
+	// Paths of all listings stored for the given server
+	std::vector<CServerPath> GetPaths(CServer const& server);
+
+	bool Load(CServer const& server, CServerPath const& path, CDirectoryListing & listing);
+	void Save(CServer const& server, CDirectoryListing const& listing);
+
+	void Remove(CServer const& server, CServerPath const& path);
+	void RemoveServer(CServer const& server);
+
+private:
+	void Failed();
+
+	std::unique_ptr<Impl> d_;
+};
+
+#endif
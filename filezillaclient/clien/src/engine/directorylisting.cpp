@@ -1,5 +1,261 @@
 #include <filezilla.h>
 
+#include <algorithm>
+#include <unordered_set>
+
+struct CDirectoryListing::compact_data final
+{
+	// UTF-8 encoded names of all entries. The name of entry i spans from
+	// name_offsets[i] to name_offsets[i + 1].
+	std::string names;
+	std::vector<uint32_t> name_offsets;
+
+	// Distinct values and the index into them for each entry
+	std::vector<CRefcountObject<wxString>> permission_table;
+	std::vector<CRefcountObject<wxString>> owner_table;
+	std::vector<uint32_t> permissions;
+	std::vector<uint32_t> owners;
+
+	std::vector<int64_t> sizes;
+
+	// Milliseconds since the epoch
+	std::vector<int64_t> times;
+
+	// Lower bits are the entry flags and has_target, upper four bits the
+	// accuracy of the time or no_time.
+	std::vector<uint8_t> flags;
+
+	// Link targets, sorted by index of the entry
+	std::vector<std::pair<unsigned int, wxString>> targets;
+
+	static uint8_t const flag_mask = 0x07;
+	static uint8_t const has_target = 0x08;
+	static uint8_t const no_time = 0x0f;
+};
+
+// Open addressing hash table with linear probing. Only hashes and entry
+// indexes are stored, names are compared against the entries of the listing.
+//
+// Removing an entry leaves a tombstone in its slot. The slots keep the
+// indexes the entries had when they got inserted, the indexes removed since
+// are remembered to map them to the current ones. Once there are too many
+// tombstones, the table gets dropped and is rebuilt on the next lookup.
+struct CDirectoryListing::find_index final
+{
+	struct slot
+	{
+		uint32_t hash;
+
+		// Stored index of the entry plus one, 0 for empty slots
+		unsigned int entry;
+	};
+
+	static unsigned int const tombstone = static_cast<unsigned int>(-1);
+
+	// Size is zero or a power of two, at most half of the slots are used
+	std::vector<slot> slots;
+
+	// Stored indexes of the removed entries, sorted
+	std::vector<unsigned int> removed;
+
+	// Entries below this index are in the index
+	unsigned int indexed{};
+
+	static uint32_t Hash(wxString const& name, bool nocase);
+
+	void Reserve(unsigned int count);
+	void Insert(uint32_t hash, unsigned int entry);
+	void Erase(uint32_t hash, unsigned int entry);
+
+	// Like Erase, but the entries after the removed one move down by one
+	void Remove(uint32_t hash, unsigned int entry);
+
+	// Calls f for each entry with the given hash
+	template<typename F>
+	void Find(uint32_t hash, F const& f) const
+	{
+		if (slots.empty())
+			return;
+
+		size_t const mask = slots.size() - 1;
+		for (size_t i = hash & mask; slots[i].entry; i = (i + 1) & mask) {
+			if (slots[i].hash == hash && slots[i].entry != tombstone)
+				f(Current(slots[i].entry - 1));
+		}
+	}
+
+private:
+	// Map between current and stored indexes of the entries
+	unsigned int Current(unsigned int stored) const;
+	unsigned int Stored(unsigned int entry) const;
+
+	size_t Locate(uint32_t hash, unsigned int stored) const;
+};
+
+uint32_t CDirectoryListing::find_index::Hash(wxString const& name, bool nocase)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (auto it = name.begin(); it != name.end(); ++it) {
+		uint32_t c = static_cast<wxChar>(*it);
+		if (nocase)
+			c = static_cast<wxChar>(wxTolower(c));
+		hash = (hash ^ c) * 16777619u;
+	}
+	return hash;
+}
+
+unsigned int CDirectoryListing::find_index::Current(unsigned int stored) const
+{
+	return stored - (std::lower_bound(removed.begin(), removed.end(), stored) - removed.begin());
+}
+
+unsigned int CDirectoryListing::find_index::Stored(unsigned int entry) const
+{
+	// removed[k] - k is the number of entries in front of the k-th removed
+	// one, all removed entries with at most entry ones in front come first.
+	size_t first = 0;
+	size_t count = removed.size();
+	while (count) {
+		size_t const step = count / 2;
+		if (removed[first + step] - (first + step) <= entry) {
+			first += step + 1;
+			count -= step + 1;
+		}
+		else
+			count = step;
+	}
+	return entry + first;
+}
+
+size_t CDirectoryListing::find_index::Locate(uint32_t hash, unsigned int stored) const
+{
+	if (slots.empty())
+		return static_cast<size_t>(-1);
+
+	size_t const mask = slots.size() - 1;
+	size_t i = hash & mask;
+	while (slots[i].entry != stored + 1) {
+		if (!slots[i].entry)
+			return static_cast<size_t>(-1);
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+void CDirectoryListing::find_index::Reserve(unsigned int count)
+{
+	size_t size = slots.empty() ? 16 : slots.size();
+	while (size < static_cast<size_t>(count) * 2)
+		size *= 2;
+	if (size == slots.size())
+		return;
+
+	std::vector<slot> old;
+	old.swap(slots);
+	slots.resize(size, slot{});
+
+	size_t const mask = size - 1;
+	for (auto const& s : old) {
+		if (!s.entry || s.entry == tombstone)
+			continue;
+		size_t i = s.hash & mask;
+		while (slots[i].entry)
+			i = (i + 1) & mask;
+		slots[i] = s;
+	}
+}
+
+void CDirectoryListing::find_index::Insert(uint32_t hash, unsigned int entry)
+{
+	Reserve(indexed + removed.size() + 1);
+
+	size_t const mask = slots.size() - 1;
+	size_t i = hash & mask;
+	while (slots[i].entry)
+		i = (i + 1) & mask;
+	slots[i].hash = hash;
+	slots[i].entry = Stored(entry) + 1;
+	++indexed;
+}
+
+void CDirectoryListing::find_index::Erase(uint32_t hash, unsigned int entry)
+{
+	size_t const i = Locate(hash, Stored(entry));
+	if (i == static_cast<size_t>(-1))
+		return;
+	--indexed;
+
+	// Move subsequent slots of the cluster back so that no probe sequence
+	// gets interrupted by the hole.
+	size_t const mask = slots.size() - 1;
+	size_t hole = i;
+	for (size_t j = (i + 1) & mask; slots[j].entry; j = (j + 1) & mask) {
+		size_t const home = slots[j].hash & mask;
+		bool const movable = (hole <= j) ? (home <= hole || home > j) : (home <= hole && home > j);
+		if (movable) {
+			slots[hole] = slots[j];
+			hole = j;
+		}
+	}
+	slots[hole] = slot{};
+}
+
+void CDirectoryListing::find_index::Remove(uint32_t hash, unsigned int entry)
+{
+	unsigned int const stored = Stored(entry);
+	size_t const i = Locate(hash, stored);
+	if (i == static_cast<size_t>(-1))
+		return;
+	--indexed;
+
+	// Rebuilding takes time linear in the number of entries, do it only
+	// after a proportional number of removals.
+	if (removed.size() >= 16 && removed.size() * 8 >= slots.size()) {
+		slots.clear();
+		removed.clear();
+		indexed = 0;
+		return;
+	}
+
+	slots[i].entry = tombstone;
+	removed.insert(std::upper_bound(removed.begin(), removed.end(), stored), stored);
+}
+
+namespace {
+bool EqualNoCase(wxString const& a, wxString const& b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	for (auto ia = a.begin(), ib = b.begin(); ia != a.end(); ++ia, ++ib) {
+		wxChar const ca = *ia;
+		wxChar const cb = *ib;
+		if (ca != cb && wxTolower(ca) != wxTolower(cb))
+			return false;
+	}
+	return true;
+}
+}
+
+namespace {
+uint32_t Intern(std::map<wxString, uint32_t> & map, std::vector<CRefcountObject<wxString>> & table, CRefcountObject<wxString> const& value)
+{
+	// Consecutive entries tend to share the same values
+	if (!table.empty() && table.back() == value)
+		return table.size() - 1;
+
+	auto it = map.find(*value);
+	if (it != map.end())
+		return it->second;
+
+	uint32_t const index = table.size();
+	table.push_back(value);
+	map.emplace(*value, index);
+	return index;
+}
+}
+
 CDirectoryListing::CDirectoryListing()
 	: m_flags()
 	, m_entryCount()
@@ -10,7 +266,8 @@ CDirectoryListing::CDirectoryListing(const CDirectoryListing& listing)
 	: path(listing.path)
 	, m_firstListTime(listing.m_firstListTime)
 	, m_flags(listing.m_flags)
-	, m_entries(listing.m_entries), m_searchmap_case(listing.m_searchmap_case), m_searchmap_nocase(listing.m_searchmap_nocase)
+	, m_entries(listing.m_entries), m_compact(listing.m_compact)
+	, m_searchmap_case(listing.m_searchmap_case), m_searchmap_nocase(listing.m_searchmap_nocase)
 	, m_entryCount(listing.m_entryCount)
 {
 }
@@ -21,6 +278,8 @@ CDirectoryListing& CDirectoryListing::operator=(const CDirectoryListing &a)
 		return *this;
 
 	m_entries = a.m_entries;
+	m_compact = a.m_compact;
+	m_materialized.clear();
 
 	path = a.path;
 
@@ -81,13 +340,9 @@ void CDirectoryListing::SetCount(unsigned int count)
 	if (count == m_entryCount)
 		return;
 
-	const unsigned int old_count = m_entryCount;
+	Expand();
 
-	if (!count)
-	{
-		m_entryCount = 0;
-		return;
-	}
+	const unsigned int old_count = m_entryCount;
 
 	if (count < old_count)
 	{
@@ -95,6 +350,12 @@ void CDirectoryListing::SetCount(unsigned int count)
 		m_searchmap_nocase.clear();
 	}
 
+	if (!count)
+	{
+		m_entryCount = 0;
+		return;
+	}
+
 	m_entries.Get().resize(count);
 
 	m_entryCount = count;
@@ -104,6 +365,8 @@ const CDirentry& CDirectoryListing::operator[](unsigned int index) const
 {
 	// Commented out, too heavy speed penalty
 	// wxASSERT(index < m_entryCount);
+	if (m_compact)
+		return Materialize(index);
 	return *(*m_entries)[index];
 }
 
@@ -111,6 +374,8 @@ CDirentry& CDirectoryListing::operator[](unsigned int index)
 {
 	// Commented out, too heavy speed penalty
 	// wxASSERT(index < m_entryCount);
+	if (m_compact)
+		Expand();
 	return m_entries.Get()[index].Get();
 }
 
@@ -118,6 +383,9 @@ void CDirectoryListing::Assign(std::deque<CRefcountObject<CDirentry>> &entries)
 {
 	m_entryCount = entries.size();
 
+	m_compact.reset();
+	m_materialized.clear();
+
 	std::vector<CRefcountObject<CDirentry> >& own_entries = m_entries.Get();
 	own_entries.clear();
 	own_entries.reserve(m_entryCount);
@@ -143,11 +411,24 @@ bool CDirectoryListing::RemoveEntry(unsigned int index)
 	if (index >= GetCount())
 		return false;
 
-	m_searchmap_case.clear();
-	m_searchmap_nocase.clear();
+	Expand();
 
 	std::vector<CRefcountObject<CDirentry> >& entries = m_entries.Get();
 	std::vector<CRefcountObject<CDirentry> >::iterator iter = entries.begin() + index;
+
+	if (m_searchmap_case) {
+		find_index& searchmap = m_searchmap_case.Get();
+		if (index < searchmap.indexed) {
+			searchmap.Remove(find_index::Hash((*iter)->name, false), index);
+		}
+	}
+	if (m_searchmap_nocase) {
+		find_index& searchmap = m_searchmap_nocase.Get();
+		if (index < searchmap.indexed) {
+			searchmap.Remove(find_index::Hash((*iter)->name, true), index);
+		}
+	}
+
 	if ((*iter)->is_dir())
 		m_flags |= CDirectoryListing::unsure_dir_removed;
 	else
@@ -159,11 +440,81 @@ bool CDirectoryListing::RemoveEntry(unsigned int index)
 	return true;
 }
 
+unsigned int CDirectoryListing::RemoveEntries(std::vector<unsigned int> indexes)
+{
+	std::sort(indexes.begin(), indexes.end());
+	indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+	while (!indexes.empty() && indexes.back() >= GetCount())
+		indexes.pop_back();
+
+	if (indexes.empty())
+		return 0;
+	if (indexes.size() == 1)
+		return RemoveEntry(indexes.front()) ? 1 : 0;
+
+	Expand();
+
+	std::vector<CRefcountObject<CDirentry> >& entries = m_entries.Get();
+
+	// Compact the remaining entries in place instead of erasing one by one
+	auto next = indexes.cbegin();
+	unsigned int out = indexes.front();
+	for (unsigned int i = indexes.front(); i < m_entryCount; ++i) {
+		if (next != indexes.cend() && *next == i) {
+			if (entries[i]->is_dir())
+				m_flags |= CDirectoryListing::unsure_dir_removed;
+			else
+				m_flags |= CDirectoryListing::unsure_file_removed;
+			++next;
+		}
+		else
+			entries[out++] = std::move(entries[i]);
+	}
+	entries.resize(out);
+	m_entryCount = out;
+
+	// Shifting the lookup indexes would cost as much as rebuilding them
+	m_searchmap_case.clear();
+	m_searchmap_nocase.clear();
+
+	return indexes.size();
+}
+
 void CDirectoryListing::GetFilenames(std::vector<wxString> &names) const
 {
 	names.reserve(GetCount());
-	for (unsigned int i = 0; i < GetCount(); ++i)
-		names.push_back((*m_entries)[i]->name);
+	if (m_compact) {
+		for (unsigned int i = 0; i < GetCount(); ++i)
+			names.push_back(GetCompactName(i));
+	}
+	else {
+		for (unsigned int i = 0; i < GetCount(); ++i)
+			names.push_back((*m_entries)[i]->name);
+	}
+}
+
+wxString const& CDirectoryListing::GetName(unsigned int index, wxString & buffer) const
+{
+	if (m_compact) {
+		buffer = GetCompactName(index);
+		return buffer;
+	}
+	return (*m_entries)[index]->name;
+}
+
+CDirectoryListing::find_index const& CDirectoryListing::GetFindIndex(bool nocase) const
+{
+	auto & searchmap = nocase ? m_searchmap_nocase : m_searchmap_case;
+	if (!searchmap || searchmap->indexed < m_entryCount) {
+		find_index & index = searchmap.Get();
+		index.Reserve(m_entryCount);
+
+		wxString buffer;
+		for (unsigned int i = index.indexed; i < m_entryCount; ++i)
+			index.Insert(find_index::Hash(GetName(i, buffer), nocase), i);
+	}
+
+	return *searchmap;
 }
 
 int CDirectoryListing::FindFile_CmpCase(const wxString& name) const
@@ -171,77 +522,281 @@ int CDirectoryListing::FindFile_CmpCase(const wxString& name) const
 	if (!m_entryCount)
 		return -1;
 
-	if (!m_searchmap_case)
-		m_searchmap_case.Get();
+	int ret = -1;
+	wxString buffer;
+	GetFindIndex(false).Find(find_index::Hash(name, false), [&](unsigned int i) {
+		if ((ret == -1 || static_cast<int>(i) < ret) && GetName(i, buffer) == name)
+			ret = i;
+	});
 
-	// Search map
-	std::multimap<wxString, unsigned int>::const_iterator iter = m_searchmap_case->find(name);
-	if (iter != m_searchmap_case->end())
-		return iter->second;
+	return ret;
+}
 
-	unsigned int i = m_searchmap_case->size();
-	if (i == m_entryCount)
+int CDirectoryListing::FindFile_CmpNoCase(const wxString& name) const
+{
+	if (!m_entryCount)
 		return -1;
 
-	std::multimap<wxString, unsigned int>& searchmap_case = m_searchmap_case.Get();
+	int ret = -1;
+	wxString buffer;
+	GetFindIndex(true).Find(find_index::Hash(name, true), [&](unsigned int i) {
+		if ((ret == -1 || static_cast<int>(i) < ret) && EqualNoCase(GetName(i, buffer), name))
+			ret = i;
+	});
 
-	// Build map if not yet complete
-	std::vector<CRefcountObject<CDirentry> >::const_iterator entry_iter = m_entries->begin() + i;
-	for (; entry_iter != m_entries->end(); ++entry_iter, ++i)
-	{
-		const wxString& entry_name = (*entry_iter)->name;
-		searchmap_case.insert(std::pair<const wxString, unsigned int>(entry_name, i));
+	return ret;
+}
+
+std::vector<unsigned int> CDirectoryListing::FindFiles_CmpNoCase(const wxString& name) const
+{
+	std::vector<unsigned int> ret;
+	if (!m_entryCount)
+		return ret;
+
+	wxString buffer;
+	GetFindIndex(true).Find(find_index::Hash(name, true), [&](unsigned int i) {
+		if (EqualNoCase(GetName(i, buffer), name))
+			ret.push_back(i);
+	});
+	std::sort(ret.begin(), ret.end());
 
-		if (entry_name == name)
-			return i;
+	return ret;
+}
+
+void CDirectoryListing::RenameEntry(unsigned int index, const wxString& name)
+{
+	if (index >= m_entryCount)
+		return;
+
+	CDirentry& entry = (*this)[index];
+	if (entry.name == name)
+		return;
+
+	if (m_searchmap_case) {
+		find_index& searchmap = m_searchmap_case.Get();
+		if (index < searchmap.indexed) {
+			searchmap.Erase(find_index::Hash(entry.name, false), index);
+			searchmap.Insert(find_index::Hash(name, false), index);
+		}
+	}
+	if (m_searchmap_nocase) {
+		find_index& searchmap = m_searchmap_nocase.Get();
+		if (index < searchmap.indexed) {
+			searchmap.Erase(find_index::Hash(entry.name, true), index);
+			searchmap.Insert(find_index::Hash(name, true), index);
+		}
 	}
 
-	// Map is complete, item not in it
-	return -1;
+	entry.name = name;
 }
 
-int CDirectoryListing::FindFile_CmpNoCase(wxString name) const
+void CDirectoryListing::ClearFindMap()
+{
+	if (!m_searchmap_case)
+		return;
+
+	m_searchmap_case.clear();
+	m_searchmap_nocase.clear();
+}
+
+void CDirectoryListing::BuildFindMap()
 {
 	if (!m_entryCount)
-		return -1;
+		return;
+
+	GetFindIndex(false);
+	GetFindIndex(true);
+}
+
+bool CDirectoryListing::IsFindMapComplete() const
+{
+	if (!m_entryCount)
+		return true;
 
-	if (!m_searchmap_nocase)
-		m_searchmap_nocase.Get();
+	return m_searchmap_case && m_searchmap_case->indexed == m_entryCount &&
+		m_searchmap_nocase && m_searchmap_nocase->indexed == m_entryCount;
+}
 
-	name.MakeLower();
+void CDirectoryListing::Compact()
+{
+	if (m_compact || !m_entryCount)
+		return;
 
-	// Search map
-	std::multimap<wxString, unsigned int>::const_iterator iter = m_searchmap_nocase->find(name);
-	if (iter != m_searchmap_nocase->end())
-		return iter->second;
+	auto data = std::make_shared<compact_data>();
+	data->name_offsets.reserve(m_entryCount + 1);
+	data->permissions.reserve(m_entryCount);
+	data->owners.reserve(m_entryCount);
+	data->sizes.reserve(m_entryCount);
+	data->times.reserve(m_entryCount);
+	data->flags.reserve(m_entryCount);
+
+	std::map<wxString, uint32_t> permission_map;
+	std::map<wxString, uint32_t> owner_map;
+
+	for (unsigned int i = 0; i < m_entryCount; ++i) {
+		CDirentry const& entry = *(*m_entries)[i];
+
+		if (entry.flags & ~compact_data::flag_mask)
+			return;
+
+		wxScopedCharBuffer const name = entry.name.utf8_str();
+		if (!name.length() && !entry.name.empty()) {
+			// Not representable, keep the listing as it is
+			return;
+		}
+		if (data->names.size() + name.length() > 0xffffffffu)
+			return;
+		data->name_offsets.push_back(data->names.size());
+		data->names.append(name.data(), name.length());
+
+		data->permissions.push_back(Intern(permission_map, data->permission_table, entry.permissions));
+		data->owners.push_back(Intern(owner_map, data->owner_table, entry.ownerGroup));
+
+		data->sizes.push_back(entry.size.GetValue());
+
+		uint8_t flags = static_cast<uint8_t>(entry.flags);
+		if (entry.time.IsValid()) {
+			data->times.push_back(entry.time.Degenerate().GetValue().GetValue());
+			flags |= static_cast<uint8_t>(entry.time.GetAccuracy()) << 4;
+		}
+		else {
+			data->times.push_back(0);
+			flags |= compact_data::no_time << 4;
+		}
+		if (entry.target) {
+			flags |= compact_data::has_target;
+			data->targets.emplace_back(i, *entry.target);
+		}
+		data->flags.push_back(flags);
+	}
+	data->name_offsets.push_back(data->names.size());
 
-	unsigned int i = m_searchmap_nocase->size();
-	if (i == m_entryCount)
-		return -1;
+	data->names.shrink_to_fit();
+	data->targets.shrink_to_fit();
 
-	std::multimap<wxString, unsigned int>& searchmap_nocase = m_searchmap_nocase.Get();
+	m_compact = std::move(data);
+	m_entries.clear();
+	m_materialized.clear();
+}
 
-	// Build map if not yet complete
-	std::vector<CRefcountObject<CDirentry> >::const_iterator entry_iter = m_entries->begin() + i;
-	for (; entry_iter != m_entries->end(); ++entry_iter, ++i)
-	{
-		wxString entry_name = (*entry_iter)->name;
-		entry_name.MakeLower();
-		searchmap_nocase.insert(std::pair<const wxString, unsigned int>(entry_name, i));
+wxString CDirectoryListing::GetCompactName(unsigned int index) const
+{
+	compact_data const& data = *m_compact;
+	uint32_t const offset = data.name_offsets[index];
+	return wxString::FromUTF8(data.names.c_str() + offset, data.name_offsets[index + 1] - offset);
+}
 
-		if (entry_name == name)
-			return i;
+CDirentry const& CDirectoryListing::Materialize(unsigned int index) const
+{
+	if (m_materialized.empty())
+		m_materialized.resize(m_entryCount);
+
+	CRefcountObject_Uninitialized<CDirentry> & materialized = m_materialized[index];
+	if (!materialized) {
+		compact_data const& data = *m_compact;
+		CDirentry & entry = materialized.Get();
+
+		entry.name = GetCompactName(index);
+		entry.size = data.sizes[index];
+		entry.permissions = data.permission_table[data.permissions[index]];
+		entry.ownerGroup = data.owner_table[data.owners[index]];
+
+		uint8_t const flags = data.flags[index];
+		entry.flags = flags & compact_data::flag_mask;
+
+		if ((flags >> 4) != compact_data::no_time)
+			entry.time = CDateTime(wxDateTime(wxLongLong(data.times[index])), static_cast<CDateTime::Accuracy>(flags >> 4));
+
+		if (flags & compact_data::has_target) {
+			auto const it = std::lower_bound(data.targets.cbegin(), data.targets.cend(), index,
+				[](std::pair<unsigned int, wxString> const& target, unsigned int i) { return target.first < i; });
+			wxASSERT(it != data.targets.cend() && it->first == index);
+			entry.target = CSparseOptional<wxString>(it->second);
+		}
 	}
 
-	// Map is complete, item not in it
-	return -1;
+	return *materialized;
 }
 
-void CDirectoryListing::ClearFindMap()
+void CDirectoryListing::Expand()
 {
-	if (!m_searchmap_case)
+	if (!m_compact)
 		return;
 
-	m_searchmap_case.clear();
-	m_searchmap_nocase.clear();
+	std::vector<CRefcountObject<CDirentry> > entries;
+	entries.reserve(m_entryCount);
+	for (unsigned int i = 0; i < m_entryCount; ++i)
+		entries.emplace_back(Materialize(i));
+
+	m_entries.Get().swap(entries);
+
+	m_compact.reset();
+	std::vector<CRefcountObject_Uninitialized<CDirentry>>().swap(m_materialized);
+}
+
+namespace {
+size_t StringMemory(wxString const& s)
+{
+	return s.capacity() * sizeof(wxChar);
+}
+
+size_t EntryMemory(CDirentry const& entry)
+{
+	size_t ret = sizeof(CDirentry) + StringMemory(entry.name);
+	if (entry.target)
+		ret += sizeof(wxString) + StringMemory(*entry.target);
+	return ret;
+}
+}
+
+size_t CDirectoryListing::GetMemoryUsage() const
+{
+	size_t ret = sizeof(*this);
+
+	if (m_compact) {
+		compact_data const& c = *m_compact;
+
+		ret += sizeof(compact_data) + c.names.capacity();
+		ret += (c.name_offsets.capacity() + c.permissions.capacity() + c.owners.capacity()) * sizeof(uint32_t);
+		ret += (c.sizes.capacity() + c.times.capacity()) * sizeof(int64_t);
+		ret += c.flags.capacity();
+
+		ret += (c.permission_table.capacity() + c.owner_table.capacity()) * sizeof(CRefcountObject<wxString>);
+		for (auto const& s : c.permission_table)
+			ret += sizeof(wxString) + StringMemory(*s);
+		for (auto const& s : c.owner_table)
+			ret += sizeof(wxString) + StringMemory(*s);
+
+		ret += c.targets.capacity() * sizeof(std::pair<unsigned int, wxString>);
+		for (auto const& target : c.targets)
+			ret += StringMemory(target.second);
+
+		ret += m_materialized.capacity() * sizeof(CRefcountObject_Uninitialized<CDirentry>);
+		for (auto const& entry : m_materialized) {
+			if (entry)
+				ret += EntryMemory(*entry);
+		}
+	}
+	else if (m_entries) {
+		std::vector<CRefcountObject<CDirentry> > const& entries = *m_entries;
+		ret += entries.capacity() * sizeof(CRefcountObject<CDirentry>);
+
+		// Permissions and owners are usually shared by many entries, count
+		// each only once.
+		std::unordered_set<wxString const*> strings;
+		for (auto const& entry : entries) {
+			ret += EntryMemory(*entry);
+			if (strings.insert(&*entry->permissions).second)
+				ret += sizeof(wxString) + StringMemory(*entry->permissions);
+			if (strings.insert(&*entry->ownerGroup).second)
+				ret += sizeof(wxString) + StringMemory(*entry->ownerGroup);
+		}
+	}
+
+	if (m_searchmap_case)
+		ret += sizeof(find_index) + m_searchmap_case->slots.capacity() * sizeof(find_index::slot) + m_searchmap_case->removed.capacity() * sizeof(unsigned int);
+	if (m_searchmap_nocase)
+		ret += sizeof(find_index) + m_searchmap_nocase->slots.capacity() * sizeof(find_index::slot) + m_searchmap_nocase->removed.capacity() * sizeof(unsigned int);
+
+	return ret;
 }
@@ -1,11 +1,15 @@
 #include <filezilla.h>
 #include "directorylistingparser.h"
 #include "ControlSocket.h"
+#include "servercapabilities.h"
 
 #include <algorithm>
+#include <memory>
+#include <string>
 #include <vector>
 
 std::map<wxString, int> CDirectoryListingParser::m_MonthNamesMap;
+mutex CDirectoryListingParser::m_MonthNamesMutex;
 
 //#define LISTDEBUG_MVS
 //#define LISTDEBUG
@@ -294,33 +298,28 @@ protected:
 	wxString m_str;
 };
 
+// A line does not own its text unless created by Copy or Concat. The
+// parser reuses a single line for all lines it reads.
 class CLine
 {
 public:
-	CLine(wxChar* p, int len = -1, int trailing_whitespace = 0)
+	CLine()
 	{
-		m_pLine = p;
-		if (len != -1)
-			m_len = len;
-		else
-			m_len = wxStrlen(p);
-
-		m_parsePos = 0;
-
 		m_Tokens.reserve(10);
 		m_LineEndTokens.reserve(10);
-		m_trailing_whitespace = trailing_whitespace;
 	}
 
-	~CLine()
+	// The text has to stay valid while the line is in use
+	void Assign(wxChar const* p, int len, int trailing_whitespace = 0)
 	{
-		delete [] m_pLine;
+		m_pLine = p;
+		m_len = len;
+		m_trailing_whitespace = trailing_whitespace;
 
-		std::vector<CToken *>::iterator iter;
-		for (iter = m_Tokens.begin(); iter != m_Tokens.end(); ++iter)
-			delete *iter;
-		for (iter = m_LineEndTokens.begin(); iter != m_LineEndTokens.end(); ++iter)
-			delete *iter;
+		m_parsePos = 0;
+		m_Tokens.clear();
+		m_LineEndTokens.clear();
+		offset_ = 0;
 	}
 
 	bool GetToken(unsigned int n, CToken &token, bool toEnd = false, bool include_whitespace = false)
@@ -328,21 +327,20 @@ public:
 		n += offset_;
 		if (!toEnd) {
 			if (m_Tokens.size() > n) {
-				token = *(m_Tokens[n]);
+				token = m_Tokens[n];
 				return true;
 			}
 
 			int start = m_parsePos;
 			while (m_parsePos < m_len) {
 				if (m_pLine[m_parsePos] == ' ' || m_pLine[m_parsePos] == '\t') {
-					CToken *pToken = new CToken(m_pLine + start, m_parsePos - start);
-					m_Tokens.push_back(pToken);
+					m_Tokens.emplace_back(m_pLine + start, m_parsePos - start);
 
 					while (m_parsePos < m_len && (m_pLine[m_parsePos] == ' ' || m_pLine[m_parsePos] == '\t'))
 						++m_parsePos;
 
 					if (m_Tokens.size() > n) {
-						token = *(m_Tokens[n]);
+						token = m_Tokens[n];
 						return true;
 					}
 
@@ -351,12 +349,11 @@ public:
 				++m_parsePos;
 			}
 			if (m_parsePos != start) {
-				CToken *pToken = new CToken(m_pLine + start, m_parsePos - start);
-					m_Tokens.push_back(pToken);
+				m_Tokens.emplace_back(m_pLine + start, m_parsePos - start);
 			}
 
 			if (m_Tokens.size() > n) {
-				token = *(m_Tokens[n]);
+				token = m_Tokens[n];
 				return true;
 			}
 
@@ -380,7 +377,7 @@ public:
 			}
 
 			if (m_LineEndTokens.size() > n) {
-				token = *(m_LineEndTokens[n]);
+				token = m_LineEndTokens[n];
 				return true;
 			}
 
@@ -389,25 +386,36 @@ public:
 					return false;
 
 			for (unsigned int i = static_cast<unsigned int>(m_LineEndTokens.size()); i <= n; ++i) {
-				const CToken *refToken = m_Tokens[i];
-				const wxChar* p = refToken->GetToken();
-				CToken *pToken = new CToken(p, m_len - (p - m_pLine) - m_trailing_whitespace);
-				m_LineEndTokens.push_back(pToken);
+				const wxChar* p = m_Tokens[i].GetToken();
+				m_LineEndTokens.emplace_back(p, m_len - (p - m_pLine) - m_trailing_whitespace);
 			}
-			token = *(m_LineEndTokens[n]);
+			token = m_LineEndTokens[n];
 			return true;
 		}
 	};
 
+	CLine *Copy() const
+	{
+		CLine* pLine = new CLine;
+		pLine->m_text.reset(new wxChar[m_len]);
+		memcpy(pLine->m_text.get(), m_pLine, m_len * sizeof(wxChar));
+		pLine->Assign(pLine->m_text.get(), m_len, m_trailing_whitespace);
+
+		return pLine;
+	}
+
 	CLine *Concat(const CLine *pLine) const
 	{
 		int newLen = m_len + pLine->m_len + 1;
-		wxChar* p = new wxChar[newLen];
+		CLine* pConcatenated = new CLine;
+		pConcatenated->m_text.reset(new wxChar[newLen]);
+		wxChar* p = pConcatenated->m_text.get();
 		memcpy(p, m_pLine, m_len * sizeof(wxChar));
 		p[m_len] = ' ';
 		memcpy(p + m_len + 1, pLine->m_pLine, pLine->m_len * sizeof(wxChar));
+		pConcatenated->Assign(p, newLen, pLine->m_trailing_whitespace);
 
-		return new CLine(p, m_len + pLine->m_len + 1, pLine->m_trailing_whitespace);
+		return pConcatenated;
 	}
 
 	void SetTokenOffset(unsigned int offset)
@@ -416,18 +424,21 @@ public:
 	}
 
 protected:
-	std::vector<CToken *> m_Tokens;
-	std::vector<CToken *> m_LineEndTokens;
-	int m_parsePos;
-	int m_len;
-	int m_trailing_whitespace;
-	wxChar* m_pLine;
+	// Stored by value, saves an allocation per token
+	std::vector<CToken> m_Tokens;
+	std::vector<CToken> m_LineEndTokens;
+	int m_parsePos{};
+	int m_len{};
+	int m_trailing_whitespace{};
+	wxChar const* m_pLine{};
 	unsigned int offset_{};
+
+	// Only set for copies
+	std::unique_ptr<wxChar[]> m_text;
 };
 
 CDirectoryListingParser::CDirectoryListingParser(CControlSocket* pControlSocket, const CServer& server, listingEncoding::type encoding, bool sftp_mode)
 	: m_pControlSocket(pControlSocket)
-	, m_currentOffset(0)
 	, m_totalData()
 	, m_prevLine(0)
 	, m_server(server)
@@ -437,6 +448,11 @@ CDirectoryListingParser::CDirectoryListingParser(CControlSocket* pControlSocket,
 	, sftp_mode_(sftp_mode)
 	, today_(wxDateTime::Today())
 {
+	LoadFormat();
+
+	// Parsers get created by multiple engines in parallel. The map is
+	// read-only once filled.
+	scoped_lock lock(m_MonthNamesMutex);
 	if (m_MonthNamesMap.empty()) {
 		//Fill the month names map
 
@@ -656,20 +672,17 @@ CDirectoryListingParser::CDirectoryListingParser(CControlSocket* pControlSocket,
 #ifdef LISTDEBUG
 	for (unsigned int i = 0; data[i][0]; ++i)
 	{
-		unsigned int len = (unsigned int)strlen(data[i]);
-		char *pData = new char[len + 3];
-		strcpy(pData, data[i]);
-		strcat(pData, "\r\n");
-		AddData(pData, len + 2);
+		std::string const line = std::string(data[i]) + "\r\n";
+		AddData(line.c_str(), line.size());
 	}
 #endif
 }
 
 CDirectoryListingParser::~CDirectoryListingParser()
 {
-	for (auto iter = m_DataList.begin(); iter != m_DataList.end(); ++iter)
-		delete [] iter->p;
+	delete [] m_buffer;
 
+	delete m_line;
 	delete m_prevLine;
 }
 
@@ -677,6 +690,8 @@ bool CDirectoryListingParser::ParseData(bool partial)
 {
 	DeduceEncoding();
 
+	// The line returned by GetLine gets reused, lines kept for concatenation
+	// need their own copy.
 	bool error = false;
 	CLine *pLine = GetLine(partial, error);
 	while (pLine) {
@@ -688,24 +703,18 @@ bool CDirectoryListingParser::ParseData(bool partial)
 				delete pConcatenatedLine;
 				delete m_prevLine;
 
-				if (res) {
-					delete pLine;
+				if (res)
 					m_prevLine = 0;
-				}
 				else
-					m_prevLine = pLine;
+					m_prevLine = pLine->Copy();
 			}
 			else if (!sftp_mode_) {
-				m_prevLine = pLine;
-			}
-			else {
-				delete pLine;
+				m_prevLine = pLine->Copy();
 			}
 		}
 		else {
 			delete m_prevLine;
 			m_prevLine = 0;
-			delete pLine;
 		}
 		pLine = GetLine(partial, error);
 	};
@@ -768,58 +777,37 @@ bool CDirectoryListingParser::ParseLine(CLine &line, const enum ServerType serve
 			goto done;
 	}
 
-	ires = ParseAsMlsd(line, entry);
-	if (ires == 1)
-		goto done;
-	else if (ires == 2)
-		goto skip;
-	res = ParseAsUnix(line, entry, true); // Common 'ls -l'
-	if (res)
-		goto done;
-	res = ParseAsDos(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsEplf(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsVms(line, entry);
-	if (res)
-		goto done;
-	res = ParseOther(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsIbm(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsWfFtp(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsIBM_MVS(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsIBM_MVS_PDS(line, entry);
-	if (res)
-		goto done;
-	res = ParseAsOS9(line, entry);
-	if (res)
-		goto done;
+	// Try the format of the previous lines first. If the line isn't of that
+	// format, fall back to trying all of them.
+	if (m_format != line_format::unknown) {
+		ires = ParseAs(m_format, line, entry);
+		if (ires) {
+			m_candidateLines = 0;
+			if (ires == 1)
+				goto done;
+			goto skip;
+		}
+		entry = CDirentry();
+	}
+
+	for (int i = static_cast<int>(line_format::mlsd); i < static_cast<int>(line_format::count); ++i) {
+		line_format const format = static_cast<line_format>(i);
+		if (format == m_format)
+			continue;
+
 #ifndef LISTDEBUG_MVS
-	if (serverType == MVS)
+		if (serverType != MVS && (format == line_format::mvs_migrated || format == line_format::mvs_pds2 || format == line_format::mvs_tape))
+			continue;
 #endif //LISTDEBUG_MVS
-	{
-		res = ParseAsIBM_MVS_Migrated(line, entry);
-		if (res)
-			goto done;
-		res = ParseAsIBM_MVS_PDS2(line, entry);
-		if (res)
-			goto done;
-		res = ParseAsIBM_MVS_Tape(line, entry);
-		if (res)
-			goto done;
+
+		ires = ParseAs(format, line, entry);
+		if (ires) {
+			LearnFormat(format);
+			if (ires == 1)
+				goto done;
+			goto skip;
+		}
 	}
-	res = ParseAsUnix(line, entry, false); // 'ls -l' but without the date/time
-	if (res)
-		goto done;
 
 	// Some servers just send a list of filenames. If a line could not be parsed,
 	// check if it's a filename. If that's the case, store it for later, else clear
@@ -893,6 +881,86 @@ skip:
 	return true;
 }
 
+int CDirectoryListingParser::ParseAs(line_format format, CLine &line, CDirentry &entry)
+{
+	switch (format) {
+	case line_format::mlsd:
+		return ParseAsMlsd(line, entry);
+	case line_format::unix_ls:
+		return ParseAsUnix(line, entry, true) ? 1 : 0; // Common 'ls -l'
+	case line_format::dos:
+		return ParseAsDos(line, entry) ? 1 : 0;
+	case line_format::eplf:
+		return ParseAsEplf(line, entry) ? 1 : 0;
+	case line_format::vms:
+		return ParseAsVms(line, entry) ? 1 : 0;
+	case line_format::other:
+		return ParseOther(line, entry) ? 1 : 0;
+	case line_format::ibm:
+		return ParseAsIbm(line, entry) ? 1 : 0;
+	case line_format::wfftp:
+		return ParseAsWfFtp(line, entry) ? 1 : 0;
+	case line_format::mvs:
+		return ParseAsIBM_MVS(line, entry) ? 1 : 0;
+	case line_format::mvs_pds:
+		return ParseAsIBM_MVS_PDS(line, entry) ? 1 : 0;
+	case line_format::os9:
+		return ParseAsOS9(line, entry) ? 1 : 0;
+	case line_format::mvs_migrated:
+		return ParseAsIBM_MVS_Migrated(line, entry) ? 1 : 0;
+	case line_format::mvs_pds2:
+		return ParseAsIBM_MVS_PDS2(line, entry) ? 1 : 0;
+	case line_format::mvs_tape:
+		return ParseAsIBM_MVS_Tape(line, entry) ? 1 : 0;
+	case line_format::unix_ls_nodate:
+		return ParseAsUnix(line, entry, false) ? 1 : 0; // 'ls -l' but without the date/time
+	default:
+		return 0;
+	}
+}
+
+void CDirectoryListingParser::LearnFormat(line_format format)
+{
+	// 'ls -l' without date also accepts lines meant for other formats, it has
+	// to stay the last resort.
+	if (format == line_format::unix_ls_nodate)
+		return;
+
+	if (format != m_candidateFormat) {
+		m_candidateFormat = format;
+		m_candidateLines = 0;
+	}
+
+	int const lines_needed = 8;
+	if (++m_candidateLines < lines_needed)
+		return;
+
+	m_candidateLines = 0;
+	m_format = format;
+	CServerCapabilities::SetCapability(m_server, listing_format, yes, static_cast<int>(format));
+}
+
+void CDirectoryListingParser::LoadFormat()
+{
+	m_format = line_format::unknown;
+	m_candidateFormat = line_format::unknown;
+	m_candidateLines = 0;
+
+	int format = 0;
+	if (CServerCapabilities::GetCapability(m_server, listing_format, &format) == yes) {
+		if (format > static_cast<int>(line_format::unknown) && format < static_cast<int>(line_format::unix_ls_nodate))
+			m_format = static_cast<line_format>(format);
+		if (m_server.GetType() != MVS && m_format >= line_format::mvs_migrated)
+			m_format = line_format::unknown;
+	}
+}
+
+void CDirectoryListingParser::SetServer(const CServer& server)
+{
+	m_server = server;
+	LoadFormat();
+}
+
 bool CDirectoryListingParser::ParseAsUnix(CLine &line, CDirentry &entry, bool expect_date)
 {
 	int index = 0;
@@ -1941,11 +2009,39 @@ bool CDirectoryListingParser::ParseOther(CLine &line, CDirentry &entry)
 	return true;
 }
 
-bool CDirectoryListingParser::AddData(char *pData, int len)
+bool CDirectoryListingParser::AddData(char const* pData, int len)
 {
-	ConvertEncoding( pData, len );
+	if (len <= 0)
+		return true;
+
+	size_t const size = m_bufferEnd - m_bufferStart;
+	if (m_bufferEnd + len + 1 > m_bufferCapacity) {
+		if (size + len + 1 <= m_bufferCapacity) {
+			// Unparsed data usually is just a partial line, cheap to move
+			memmove(m_buffer, m_buffer + m_bufferStart, size);
+		}
+		else {
+			size_t capacity = std::max(size_t(65536), m_bufferCapacity);
+			while (capacity < size + len + 1)
+				capacity *= 2;
+
+			char* buffer = new char[capacity];
+			if (size)
+				memcpy(buffer, m_buffer + m_bufferStart, size);
+			delete [] m_buffer;
+			m_buffer = buffer;
+			m_bufferCapacity = capacity;
+		}
+		m_bufferStart = 0;
+		m_bufferEnd = size;
+	}
+
+	char* p = m_buffer + m_bufferEnd;
+	memcpy(p, pData, len);
+	m_bufferEnd += len;
+
+	ConvertEncoding(p, len);
 
-	m_DataList.emplace_back(pData, len);
 	m_totalData += len;
 
 	if (m_totalData < 512)
@@ -1965,144 +2061,86 @@ bool CDirectoryListingParser::AddLine(wxChar const* pLine)
 	if (!*pLine)
 		return false;
 
-	const int len = wxStrlen(pLine);
-
-	wxChar* p = new wxChar[len + 1];
-
-	wxStrcpy(p, pLine);
-
-	CLine line(p, len);
+	CLine line;
+	line.Assign(pLine, wxStrlen(pLine));
 
 	ParseLine(line, m_server.GetType(), false);
 
 	return true;
 }
 
-CLine *CDirectoryListingParser::GetLine(bool breakAtEnd /*=false*/, bool &error)
+namespace {
+// Returns the first CR or LF, or end if there is none
+char* FindLineEnd(char* p, char* end)
 {
-	while (!m_DataList.empty()) {
-		// Trim empty lines and spaces
-		auto iter = m_DataList.begin();
-		int len = iter->len;
-		while (iter->p[m_currentOffset] == '\r' || iter->p[m_currentOffset] == '\n' || iter->p[m_currentOffset] == ' ' || iter->p[m_currentOffset] == '\t') {
-			++m_currentOffset;
-			if (m_currentOffset >= len) {
-				delete [] iter->p;
-				++iter;
-				m_currentOffset = 0;
-				if (iter == m_DataList.end()) {
-					m_DataList.clear();
-					return 0;
-				}
-				len = iter->len;
-			}
-		}
-		m_DataList.erase(m_DataList.begin(), iter);
-		iter = m_DataList.begin();
+	char* lf = static_cast<char*>(memchr(p, '\n', end - p));
+	if (!lf)
+		lf = end;
 
-		// Remember start offset and find next linebreak
-		int startpos = m_currentOffset;
-		int reslen = 0;
+	char* cr = static_cast<char*>(memchr(p, '\r', lf - p));
+	return cr ? cr : lf;
+}
+}
 
-		int emptylen = 0;
+CLine *CDirectoryListingParser::GetLine(bool breakAtEnd /*=false*/, bool &error)
+{
+	while (m_bufferStart < m_bufferEnd) {
+		char* const end = m_buffer + m_bufferEnd;
 
-		int currentOffset = m_currentOffset;
-		while ((iter->p[currentOffset] != '\n') && (iter->p[currentOffset] != '\r')) {
-			if (iter->p[currentOffset] == ' ' || iter->p[currentOffset] == '\t')
-				++emptylen;
-			else
-				emptylen = 0;
-			++reslen;
-
-			++currentOffset;
-			if (currentOffset >= len) {
-				++iter;
-				if (iter == m_DataList.end()) {
-					if (reslen > 10000) {
-						m_pControlSocket->LogMessage(MessageType::Error, _("Received a line exceeding 10000 characters, aborting."));
-						error = true;
-						return 0;
-					}
-					if (breakAtEnd)
-						return 0;
-					break;
-				}
-				len = iter->len;
-				currentOffset = 0;
-			}
-		}
+		// Trim empty lines and spaces
+		char* p = m_buffer + m_bufferStart;
+		while (p != end && (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t'))
+			++p;
+		m_bufferStart = p - m_buffer;
+		if (p == end)
+			return 0;
 
+		char* const eol = FindLineEnd(p, end);
+
+		// Length of the line, including any terminating whitespace
+		size_t const reslen = eol - p;
 		if (reslen > 10000) {
 			m_pControlSocket->LogMessage(MessageType::Error, _("Received a line exceeding 10000 characters, aborting."));
 			error = true;
 			return 0;
 		}
-		m_currentOffset = currentOffset;
-
-		// Reslen is now the length of the line, including any terminating whitespace
-		int const buflen = reslen + 1;
-		char *res = new char[buflen];
-		res[reslen] = 0;
-
-		int respos = 0;
-
-		// Copy line data
-		auto i = m_DataList.begin();
-		while (i != iter && reslen) {
-			int copylen = i->len - startpos;
-			if (copylen > reslen)
-				copylen = reslen;
-			memcpy(&res[respos], &i->p[startpos], copylen);
-			reslen -= copylen;
-			respos += i->len - startpos;
-			startpos = 0;
-
-			delete [] i->p;
-			++i;
-		}
+		if (eol == end && breakAtEnd)
+			return 0;
 
-		// Copy last chunk
-		if (iter != m_DataList.end() && reslen) {
-			int copylen = m_currentOffset-startpos;
-			if (copylen > reslen)
-				copylen = reslen;
-			memcpy(&res[respos], &iter->p[startpos], copylen);
-			if (reslen >= iter->len) {
-				delete [] iter->p;
-				m_DataList.erase(m_DataList.begin(), ++iter);
-			}
-			else
-				m_DataList.erase(m_DataList.begin(), iter);
-		}
-		else
-			m_DataList.erase(m_DataList.begin(), iter);
+		int emptylen = 0;
+		for (char* q = eol; q != p && (q[-1] == ' ' || q[-1] == '\t'); --q)
+			++emptylen;
+
+		// Terminate in place, the line ending gets skipped anyway
+		*eol = 0;
+		m_bufferStart = eol - m_buffer;
+		if (eol != end)
+			++m_bufferStart;
 
-		size_t lineLength{};
-		wxChar* buffer;
+		// Converted into the same buffer for all lines
 		if (m_pControlSocket) {
-			buffer = m_pControlSocket->ConvToLocalBuffer(res, buflen, lineLength);
-			m_pControlSocket->LogMessageRaw(MessageType::RawList, buffer);
+			if (!m_pControlSocket->ConvToLocalBuffer(p, reslen + 1, m_lineText)) {
+				// Line contained no usable data, start over
+				continue;
+			}
+			m_pControlSocket->LogMessageRaw(MessageType::RawList, &m_lineText[0]);
 		}
 		else {
-			wxString str(res, wxConvUTF8);
+			wxString str(p, wxConvUTF8);
 			if (str.empty())
 			{
-				str = wxString(res, wxConvLocal);
+				str = wxString(p, wxConvLocal);
 				if (str.empty())
-					str = wxString(res, wxConvISO8859_1);
+					str = wxString(p, wxConvISO8859_1);
 			}
-			lineLength = str.Len() + 1;
-			buffer = new wxChar[str.Len() + 1];
-			wxStrcpy(buffer, str.c_str());
-		}
-		delete [] res;
-
-		if (!buffer) {
-			// Line contained no usable data, start over
-			continue;
+			wxChar const* text = str.c_str();
+			m_lineText.assign(text, text + str.Len() + 1);
 		}
 
-		return new CLine(buffer, lineLength - 1, emptylen);
+		if (!m_line)
+			m_line = new CLine;
+		m_line->Assign(&m_lineText[0], static_cast<int>(m_lineText.size()) - 1, emptylen);
+		return m_line;
 	}
 
 	return 0;
@@ -2760,16 +2798,14 @@ bool CDirectoryListingParser::ParseAsOS9(CLine &line, CDirentry &entry)
 
 void CDirectoryListingParser::Reset()
 {
-	for (auto iter = m_DataList.begin(); iter != m_DataList.end(); ++iter)
-		delete [] iter->p;
-	m_DataList.clear();
+	m_bufferStart = 0;
+	m_bufferEnd = 0;
 
 	delete m_prevLine;
 	m_prevLine = 0;
 
 	m_entryList.clear();
 	m_fileList.clear();
-	m_currentOffset = 0;
 	m_fileListOnly = true;
 	m_maybeMultilineVms = false;
 }
@@ -2975,11 +3011,8 @@ void CDirectoryListingParser::DeduceEncoding()
 
 	memset(&count, 0, sizeof(int)*256);
 
-	for (std::list<t_list>::const_iterator it = m_DataList.begin(); it != m_DataList.end(); ++it)
-	{
-		for (int i = 0; i < it->len; ++i)
-			++count[static_cast<unsigned char>(it->p[i])];
-	}
+	for (size_t i = m_bufferStart; i < m_bufferEnd; ++i)
+		++count[static_cast<unsigned char>(m_buffer[i])];
 
 	int count_normal = 0;
 	int count_ebcdic = 0;
@@ -3020,8 +3053,7 @@ void CDirectoryListingParser::DeduceEncoding()
 	{
 		m_pControlSocket->LogMessage(MessageType::Status, _("Received a directory listing which appears to be encoded in EBCDIC."));
 		m_listingEncoding = listingEncoding::ebcdic;
-		for (auto it = m_DataList.begin(); it != m_DataList.end(); ++it)
-			ConvertEncoding(it->p, it->len);
+		ConvertEncoding(m_buffer + m_bufferStart, m_bufferEnd - m_bufferStart);
 	}
 	else
 		m_listingEncoding = listingEncoding::normal;
@@ -27,6 +27,9 @@
  * If adding data to the parser, it first decomposes the raw data into lines,
  * which then are processed further. Each line gets consecutively tested for
  * different formats, starting with the most common Unix style format.
+ * Once enough consecutive lines turned out to be of the same format, that
+ * format is tried first and remembered in the server capabilities, so that
+ * subsequent listings from the same server start off with it as well.
  * Lines not containing a recognized format (e.g. a part of a multiline
  * entry) are rememberd and if the next line cannot be parsed either, they
  * get concatenated to be parsed again (and discarded if not recognized).
@@ -58,22 +61,55 @@ public:
 
 	CDirectoryListing Parse(const CServerPath &path);
 
-	bool AddData(char *pData, int len);
+	// The data gets copied, the caller keeps ownership of the buffer
+	bool AddData(char const* pData, int len);
 	bool AddLine(const wxChar* pLine);
 
 	void Reset();
 
 	void SetTimezoneOffset(const wxTimeSpan& span) { m_timezoneOffset = span; }
 
-	void SetServer(const CServer& server) { m_server = server; };
+	void SetServer(const CServer& server);
 
 protected:
+	// The returned line stays valid until the next call
 	CLine *GetLine(bool breakAtEnd, bool& error);
 
 	bool ParseData(bool partial);
 
 	bool ParseLine(CLine &line, const enum ServerType serverType, bool concatenated);
 
+	// The line formats tried by ParseLine, in the order they are tried
+	enum class line_format
+	{
+		unknown,
+		mlsd,
+		unix_ls,
+		dos,
+		eplf,
+		vms,
+		other,
+		ibm,
+		wfftp,
+		mvs,
+		mvs_pds,
+		os9,
+		mvs_migrated,
+		mvs_pds2,
+		mvs_tape,
+		unix_ls_nodate,
+		count
+	};
+
+	// Returns 1 if the line got parsed, 2 if it is to be skipped and 0 if it
+	// is not of the given format.
+	int ParseAs(line_format format, CLine &line, CDirentry &entry);
+
+	// Once a number of consecutive lines are of the same format, it is tried
+	// first for the subsequent lines and remembered for the server.
+	void LearnFormat(line_format format);
+	void LoadFormat();
+
 	bool ParseAsUnix(CLine &line, CDirentry &entry, bool expect_date);
 	bool ParseAsDos(CLine &line, CDirentry &entry);
 	bool ParseAsEplf(CLine &line, CDirentry &entry);
@@ -113,24 +149,23 @@ protected:
 	CControlSocket* m_pControlSocket;
 
 	static std::map<wxString, int> m_MonthNamesMap;
-
-	struct t_list
-	{
-		t_list() = default;
-		t_list(char* s, int l)
-			: p(s), len(l)
-		{}
-
-		char *p;
-		int len;
-	};
-
-	int m_currentOffset;
-
-	std::list<t_list> m_DataList;
+	static mutex m_MonthNamesMutex;
+
+	// Received data that has not been split into lines yet is kept in a
+	// single buffer, lines are taken from the front in place. There
+	// always is room for one more byte after the data, so that the last
+	// line can be terminated without copying it.
+	char* m_buffer{};
+	size_t m_bufferStart{};
+	size_t m_bufferEnd{};
+	size_t m_bufferCapacity{};
 	std::deque<CRefcountObject<CDirentry>> m_entryList;
 	wxLongLong m_totalData;
 
+	// Reused for all lines, and the text of the current line
+	CLine *m_line{};
+	std::vector<wxChar> m_lineText;
+
 	CLine *m_prevLine;
 
 	CServer m_server;
@@ -140,6 +175,10 @@ protected:
 
 	bool m_maybeMultilineVms;
 
+	line_format m_format{line_format::unknown};
+	line_format m_candidateFormat{line_format::unknown};
+	int m_candidateLines{};
+
 	wxTimeSpan m_timezoneOffset;
 
 	listingEncoding::type m_listingEncoding;
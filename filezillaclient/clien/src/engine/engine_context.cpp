@@ -3,6 +3,7 @@
 
 #include "directorycache.h"
 #include "event_loop.h"
+#include "iothread.h"
 #include "logging_private.h"
 #include "pathcache.h"
 #include "ratelimiter.h"
@@ -45,22 +46,57 @@ class CFileZillaEngineContext::Impl final
 {
 public:
 	Impl(COptionsBase& options)
-		: limiter_(loop_, options)
-		, optionChangeHandler_(options, loop_)
+		: loops_(CreateLoops(options))
+		, users_(loops_.size())
+		, limiter_(*loops_.front(), options)
+		, io_buffer_pool_(options)
 	{
 		CLogging::UpdateLogLevel(options);
+
+		directory_cache_.SetMemoryLimit(static_cast<size_t>(std::max(1, options.GetOptionVal(OPTION_DIRECTORYCACHE_MEMORY))) * 1024 * 1024);
+		directory_cache_.SetStorageFile(options.GetOption(OPTION_DIRECTORYCACHE_FILE));
+
+		// The log level is thread-local, each loop needs to pick it up
+		for (auto & loop : loops_) {
+			optionChangeHandlers_.emplace_back(make_unique<CLoggingOptionsChanged>(options, *loop));
+		}
 	}
 
 	~Impl()
 	{
-		loop_.RemoveHandler(&optionChangeHandler_);
+		for (auto & handler : optionChangeHandlers_) {
+			handler->RemoveHandler();
+		}
+	}
+
+	static std::vector<std::unique_ptr<CEventLoop>> CreateLoops(COptionsBase& options)
+	{
+		int count = options.GetOptionVal(OPTION_EVENT_LOOPS);
+		if (count <= 0) {
+			count = wxThread::GetCPUCount();
+			if (count <= 0) {
+				count = 1;
+			}
+		}
+
+		std::vector<std::unique_ptr<CEventLoop>> loops;
+		for (int i = 0; i < count; ++i) {
+			loops.emplace_back(make_unique<CEventLoop>());
+		}
+		return loops;
 	}
 
-	CEventLoop loop_;
+	std::vector<std::unique_ptr<CEventLoop>> loops_;
+
+	// Number of engines pinned to each loop
+	mutex mutex_;
+	std::vector<int> users_;
+
 	CRateLimiter limiter_;
 	CDirectoryCache directory_cache_;
 	CPathCache path_cache_;
-	CLoggingOptionsChanged optionChangeHandler_;
+	CIOBufferPool io_buffer_pool_;
+	std::vector<std::unique_ptr<CLoggingOptionsChanged>> optionChangeHandlers_;
 };
 
 CFileZillaEngineContext::CFileZillaEngineContext(COptionsBase & options)
@@ -80,7 +116,35 @@ COptionsBase& CFileZillaEngineContext::GetOptions()
 
 CEventLoop& CFileZillaEngineContext::GetEventLoop()
 {
-	return impl_->loop_;
+	return *impl_->loops_.front();
+}
+
+CEventLoop& CFileZillaEngineContext::AcquireEventLoop()
+{
+	scoped_lock lock(impl_->mutex_);
+
+	size_t best = 0;
+	for (size_t i = 1; i < impl_->users_.size(); ++i) {
+		if (impl_->users_[i] < impl_->users_[best]) {
+			best = i;
+		}
+	}
+
+	++impl_->users_[best];
+	return *impl_->loops_[best];
+}
+
+void CFileZillaEngineContext::ReleaseEventLoop(CEventLoop& loop)
+{
+	scoped_lock lock(impl_->mutex_);
+
+	for (size_t i = 0; i < impl_->loops_.size(); ++i) {
+		if (impl_->loops_[i].get() == &loop) {
+			wxASSERT(impl_->users_[i] > 0);
+			--impl_->users_[i];
+			break;
+		}
+	}
 }
 
 CRateLimiter& CFileZillaEngineContext::GetRateLimiter()
@@ -97,3 +161,8 @@ CPathCache& CFileZillaEngineContext::GetPathCache()
 {
 	return impl_->path_cache_;
 }
+
+CIOBufferPool& CFileZillaEngineContext::GetIOBufferPool()
+{
+	return impl_->io_buffer_pool_;
+}
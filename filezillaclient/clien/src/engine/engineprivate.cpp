@@ -16,18 +16,20 @@ std::atomic_int CFileZillaEnginePrivate::m_activeStatus[2] = {{0}, {0}};
 std::list<CFileZillaEnginePrivate::t_failedLogins> CFileZillaEnginePrivate::m_failedLogins;
 
 CFileZillaEnginePrivate::CFileZillaEnginePrivate(CFileZillaEngineContext& context, CFileZillaEngine& parent)
-	: CEventHandler(context.GetEventLoop())
+	: CEventHandler(context.AcquireEventLoop())
 	, transfer_status_(*this)
 	, m_options(context.GetOptions())
+	, context_(context)
 	, m_rateLimiter(context.GetRateLimiter())
 	, directory_cache_(context.GetDirectoryCache())
 	, path_cache_(context.GetPathCache())
+	, io_buffer_pool_(context.GetIOBufferPool())
 	, parent_(parent)
 {
-	m_engineList.push_back(this);
-
 	{
 		scoped_lock lock(mutex_);
+		m_engineList.push_back(this);
+
 		static int id = 0;
 		m_engine_id = ++id;
 	}
@@ -66,18 +68,25 @@ CFileZillaEnginePrivate::~CFileZillaEnginePrivate()
 		delete notification;
 	}
 
-	// Remove ourself from the engine list
-	for (auto iter = m_engineList.begin(); iter != m_engineList.end(); ++iter) {
-		if (*iter == this) {
-			m_engineList.erase(iter);
-			break;
+	bool last;
+	{
+		// Remove ourself from the engine list
+		scoped_lock lock(mutex_);
+		for (auto iter = m_engineList.begin(); iter != m_engineList.end(); ++iter) {
+			if (*iter == this) {
+				m_engineList.erase(iter);
+				break;
+			}
 		}
+		last = m_engineList.empty();
 	}
 
 	delete m_pLogging;
 
-	if (m_engineList.empty())
+	if (last)
 		CSocket::Cleanup(true);
+
+	context_.ReleaseEventLoop(event_loop_);
 }
 
 void CFileZillaEnginePrivate::OnEngineEvent(EngineNotificationType type)
@@ -276,6 +285,9 @@ int CFileZillaEnginePrivate::Connect(const CConnectCommand &command)
 
 	m_retryCount = 0;
 
+	m_lastListDir.clear();
+	m_lastListServer = CServer();
+
 	// Need to delete before setting m_pCurrentCommand.
 	// The destructor can call CFileZillaEnginePrivate::ResetOperation
 	// which would delete m_pCurrentCommand
@@ -399,6 +411,7 @@ void CFileZillaEnginePrivate::SendDirectoryListingNotification(const CServerPath
 	wxASSERT(pOwnServer);
 
 	m_lastListDir = path;
+	m_lastListServer = *pOwnServer;
 
 	if (failed) {
 		AddNotification(new CDirectoryListingNotification(path, false, true));
@@ -425,8 +438,8 @@ void CFileZillaEnginePrivate::SendDirectoryListingNotification(const CServerPath
 		if (!pEngine->m_pControlSocket || pEngine->m_pControlSocket == m_pControlSocket)
 			continue;
 
-		const CServer* const pServer = pEngine->m_pControlSocket->GetCurrentServer();
-		if (!pServer || *pServer != *pOwnServer)
+		// The other control socket might be busy in a different thread, don't touch it
+		if (pEngine->m_lastListServer != *pOwnServer)
 			continue;
 
 		if (pEngine->m_lastListDir != path)
@@ -566,11 +579,8 @@ void CFileZillaEnginePrivate::InvalidateCurrentWorkingDirs(const CServerPath& pa
 		if (!pEngine->m_pControlSocket)
 			continue;
 
-		const CServer* const pServer = pEngine->m_pControlSocket->GetCurrentServer();
-		if (!pServer || *pServer != *pOwnServer)
-			continue;
-
-		pEngine->m_pControlSocket->InvalidateCurrentWorkingDir(path);
+		// Let the control socket check the server in its own thread
+		pEngine->m_pControlSocket->SendEvent<CInvalidateCurrentWorkingDirEvent>(*pOwnServer, path);
 	}
 }
 
@@ -13,6 +13,7 @@
 #include <atomic>
 
 class CControlSocket;
+class CIOBufferPool;
 class CLogging;
 class CRateLimiter;
 
@@ -91,6 +92,7 @@ public:
 	CRateLimiter& GetRateLimiter() { return m_rateLimiter; }
 	CDirectoryCache& GetDirectoryCache() { return directory_cache_; }
 	CPathCache& GetPathCache() { return path_cache_; }
+	CIOBufferPool& GetIOBufferPool() { return io_buffer_pool_; }
 
 	void SendDirectoryListingNotification(const CServerPath& path, bool onList, bool modified, bool failed);
 
@@ -158,6 +160,7 @@ protected:
 
 	// Remember last path used in a dirlisting.
 	CServerPath m_lastListDir;
+	CServer m_lastListServer;
 	CMonotonicTime m_lastListTime;
 
 	std::unique_ptr<CControlSocket> m_pControlSocket;
@@ -194,9 +197,12 @@ protected:
 	int m_retryCount{};
 	timer_id m_retryTimer{};
 
+	CFileZillaEngineContext& context_;
+
 	CRateLimiter& m_rateLimiter;
 	CDirectoryCache& directory_cache_;
 	CPathCache& path_cache_;
+	CIOBufferPool& io_buffer_pool_;
 
 	CFileZillaEngine& parent_;
 
@@ -3,9 +3,23 @@
 #include "event_loop.h"
 
 #include <algorithm>
+#include <atomic>
+
+namespace {
+// Events are allocated in size classes of this granularity, larger ones are not pooled
+size_t const event_granularity = 16;
+size_t const max_free_events = 256;
+
+// Keeps the size class in front of the event, without affecting its alignment
+size_t const event_header_size = alignof(std::max_align_t) > sizeof(size_t) ? alignof(std::max_align_t) : sizeof(size_t);
+
+// How many of the most recently queued events are checked for coalescing
+size_t const coalesce_window = 16;
+}
 
 CEventLoop::CEventLoop()
 	: wxThread(wxTHREAD_JOINABLE)
+	, epoch_(CMonotonicClock::now())
 	, sync_(false)
 {
 	Create();
@@ -25,23 +39,84 @@ CEventLoop::~CEventLoop()
 
 	scoped_lock lock(sync_);
 	for (auto & v : pending_events_) {
-		delete v.second;
+		DestroyEvent(v.second);
+	}
+	pending_events_.clear();
+
+	for (auto & free : free_events_) {
+		for (auto & block : free) {
+			::operator delete(block);
+		}
 	}
 }
 
-void CEventLoop::SendEvent(CEventHandler* handler, CEventBase* evt)
+void CEventLoop::EnqueueEvent(scoped_lock & l, CEventHandler* handler, CEventBase* evt, coalesce_func coalesce)
 {
-	{
-		scoped_lock lock(sync_);
-		if (!handler->removing_) {
-			pending_events_.emplace_back(handler, evt);
-			signalled_ = true;
-			cond_.signal(lock);
+	if (handler->removing_) {
+		DestroyEvent(evt);
+		return;
+	}
+
+	if (coalesce) {
+		size_t checked = 0;
+		for (auto it = pending_events_.rbegin(); it != pending_events_.rend() && checked < coalesce_window; ++it, ++checked) {
+			if (it->first == handler && coalesce(*it->second, *evt)) {
+				DestroyEvent(evt);
+				return;
+			}
+		}
+	}
+
+	pending_events_.emplace_back(handler, evt);
+	signalled_ = true;
+	cond_.signal(l);
+}
+
+void* CEventLoop::AllocateEvent(size_t size)
+{
+	size_t const size_class = (size + event_granularity - 1) / event_granularity - 1;
+
+	void* block;
+	if (size_class < sizeof(free_events_) / sizeof(free_events_[0])) {
+		auto & free = free_events_[size_class];
+		if (!free.empty()) {
+			block = free.back();
+			free.pop_back();
 		}
 		else {
-			delete evt;
+			block = ::operator new(event_header_size + (size_class + 1) * event_granularity);
 		}
 	}
+	else {
+		block = ::operator new(event_header_size + size);
+	}
+
+	*static_cast<size_t*>(block) = size_class;
+	return static_cast<char*>(block) + event_header_size;
+}
+
+void CEventLoop::DestroyEvent(CEventBase* evt)
+{
+	if (!evt) {
+		return;
+	}
+
+	// Pointer to the most derived object, which is where the storage begins
+	void* p = dynamic_cast<void*>(evt);
+	evt->~CEventBase();
+	ReleaseEvent(p);
+}
+
+void CEventLoop::ReleaseEvent(void* p)
+{
+	void* block = static_cast<char*>(p) - event_header_size;
+	size_t const size_class = *static_cast<size_t*>(block);
+	if (size_class < sizeof(free_events_) / sizeof(free_events_[0]) && free_events_[size_class].size() < max_free_events) {
+		free_events_[size_class].push_back(block);
+	}
+	else {
+		::operator delete(block);
+	}
 }
 
 void CEventLoop::RemoveHandler(CEventHandler* handler)
@@ -54,7 +129,7 @@ void CEventLoop::RemoveHandler(CEventHandler* handler)
 		std::remove_if(pending_events_.begin(), pending_events_.end(),
 			[&](Events::value_type const& v) {
 				if (v.first == handler) {
-					delete v.second;
+					DestroyEvent(v.second);
 				}
 				return v.first == handler;
 			}
@@ -62,14 +137,28 @@ void CEventLoop::RemoveHandler(CEventHandler* handler)
 		pending_events_.end()
 	);
 
+	auto const timerCount = timers_.size();
 	timers_.erase(
 		std::remove_if(timers_.begin(), timers_.end(),
 			[&](timer_data const& v) {
-				return v.handler_ == handler;
+				if (v.handler_ == handler) {
+					timer_index_.erase(v.id_);
+					return true;
+				}
+				return false;
 			}
 		),
 		timers_.end()
 	);
+	if (timers_.size() != timerCount) {
+		// Restore the heap property
+		for (size_t i = timers_.size() / 2; i-- > 0; ) {
+			SiftTimerDown(i);
+		}
+		for (size_t i = 0; i < timers_.size(); ++i) {
+			timer_index_[timers_[i].id_] = i;
+		}
+	}
 
 	while (active_handler_ == handler) {
 		l.unlock();
@@ -87,7 +176,7 @@ void CEventLoop::FilterEvents(std::function<bool(Events::value_type &)> filter)
 			[&](Events::value_type & v) {
 				bool const remove = filter(v);
 				if (remove) {
-					delete v.second;
+					DestroyEvent(v.second);
 				}
 				return remove;
 			}
@@ -102,17 +191,22 @@ timer_id CEventLoop::AddTimer(CEventHandler* handler, int ms_interval, bool one_
 	d.handler_ = handler;
 	d.ms_interval_ = ms_interval;
 	d.one_shot_ = one_shot;
-	d.deadline_ = CDateTime::Now() + wxTimeSpan::Milliseconds(ms_interval);
+	d.deadline_ = Now() + ms_interval;
 
+	// Shared by all loops, AddTimer may run concurrently on different ones
+	static std::atomic<timer_id> id{};
 
 	scoped_lock lock(sync_);
-	static timer_id id{};
 	if (!handler->removing_) {
 		d.id_ = ++id; // 64bit, can this really ever overflow?
 
-		timers_.emplace_back(d);
-		signalled_ = true;
-		cond_.signal(lock);
+		// Only need to wake up the loop if the new timer expires first
+		bool const first = timers_.empty() || d.deadline_ < timers_.front().deadline_;
+		PushTimer(d);
+		if (first) {
+			signalled_ = true;
+			cond_.signal(lock);
+		}
 	}
 	return d.id_;
 }
@@ -121,12 +215,85 @@ void CEventLoop::StopTimer(timer_id id)
 {
 	if (id) {
 		scoped_lock lock(sync_);
-		for (auto it = timers_.begin(); it != timers_.end(); ++it) {
-			if (it->id_ == id) {
-				timers_.erase(it);
-				break;
-			}
+		auto const it = timer_index_.find(id);
+		if (it != timer_index_.end()) {
+			RemoveTimerAt(it->second);
+		}
+	}
+}
+
+namespace {
+bool TimerBefore(timer_data const& a, timer_data const& b)
+{
+	// Ties are broken by id so that timers with the same deadline fire in the order they were added
+	return a.deadline_ < b.deadline_ || (a.deadline_ == b.deadline_ && a.id_ < b.id_);
+}
+}
+
+void CEventLoop::SetTimerAt(size_t pos, timer_data && d)
+{
+	timer_index_[d.id_] = pos;
+	timers_[pos] = std::move(d);
+}
+
+void CEventLoop::SiftTimerUp(size_t pos)
+{
+	timer_data d = std::move(timers_[pos]);
+	while (pos) {
+		size_t const parent = (pos - 1) / 2;
+		if (!TimerBefore(d, timers_[parent])) {
+			break;
+		}
+		SetTimerAt(pos, std::move(timers_[parent]));
+		pos = parent;
+	}
+	SetTimerAt(pos, std::move(d));
+}
+
+void CEventLoop::SiftTimerDown(size_t pos)
+{
+	size_t const size = timers_.size();
+	timer_data d = std::move(timers_[pos]);
+	while (true) {
+		size_t child = pos * 2 + 1;
+		if (child >= size) {
+			break;
+		}
+		if (child + 1 < size && TimerBefore(timers_[child + 1], timers_[child])) {
+			++child;
+		}
+		if (!TimerBefore(timers_[child], d)) {
+			break;
+		}
+		SetTimerAt(pos, std::move(timers_[child]));
+		pos = child;
+	}
+	SetTimerAt(pos, std::move(d));
+}
+
+void CEventLoop::PushTimer(timer_data const& d)
+{
+	timers_.push_back(d);
+	SiftTimerUp(timers_.size() - 1);
+}
+
+void CEventLoop::RemoveTimerAt(size_t pos)
+{
+	timer_index_.erase(timers_[pos].id_);
+
+	size_t const last = timers_.size() - 1;
+	if (pos != last) {
+		SetTimerAt(pos, std::move(timers_[last]));
+		timers_.pop_back();
+		if (pos && TimerBefore(timers_[pos], timers_[(pos - 1) / 2])) {
+			SiftTimerUp(pos);
 		}
+		else {
+			SiftTimerDown(pos);
+		}
+	}
+	else {
+		timers_.pop_back();
 	}
 }
 
@@ -145,15 +312,22 @@ bool CEventLoop::ProcessEvent(scoped_lock & l)
 	if (ev.first && !ev.first->removing_) {
 		active_handler_ = ev.first;
 		l.unlock();
+		void* p{};
 		if (ev.second) {
 			(*ev.first)(*ev.second);
+
+			// Destroy outside the lock, values might have non-trivial destructors
+			p = dynamic_cast<void*>(ev.second);
+			ev.second->~CEventBase();
 		}
-		delete ev.second;
 		l.lock();
+		if (p) {
+			ReleaseEvent(p);
+		}
 		active_handler_ = 0;
 	}
 	else {
-		delete ev.second;
+		DestroyEvent(ev.second);
 	}
 
 	return requestMore;
@@ -187,64 +361,58 @@ wxThread::ExitCode CEventLoop::Entry()
 
 bool CEventLoop::ProcessTimers(scoped_lock & l)
 {
-	CDateTime const now(CDateTime::Now());
-	for (auto it = timers_.begin(); it != timers_.end(); ++it) {
-		int diff = static_cast<int>((it->deadline_ - now).GetMilliseconds().GetValue());
-		if (diff <= -60000) {
-			// Did the system time change? Update deadline
-			it->deadline_ = now + it->ms_interval_;
-			continue;
-		}
-		else if (diff <= 0) {
-			CEventHandler *const handler = it->handler_;
-			auto const id = it->id_;
-			if (it->one_shot_) {
-				timers_.erase(it);
-			}
-			else {
-				it->deadline_ = now + wxTimeSpan::Milliseconds(it->ms_interval_);
-			}
-
-			bool const requestMore = !pending_events_.empty() || quit_;
+	if (timers_.empty()) {
+		return false;
+	}
 
-			if (!handler->removing_) {
-				active_handler_ = handler;
-				l.unlock();
-				(*handler)(CTimerEvent(id));
-				l.lock();
-				active_handler_ = 0;
-			}
+	int64_t const now = Now();
+	if (timers_.front().deadline_ > now) {
+		return false;
+	}
 
-			signalled_ |= requestMore;
+	// Fire all timers that are due. The heap is looked at again after each
+	// callback, so timers stopped by an earlier callback do not fire.
+	bool const requestMore = !pending_events_.empty() || quit_;
+	while (!quit_ && !timers_.empty() && timers_.front().deadline_ <= now) {
+		timer_data & front = timers_.front();
+		CEventHandler *const handler = front.handler_;
+		auto const id = front.id_;
+		if (front.one_shot_) {
+			RemoveTimerAt(0);
+		}
+		else {
+			// At least one ms so that the batch ends
+			front.deadline_ = now + std::max(front.ms_interval_, 1);
+			SiftTimerDown(0);
+		}
 
-			return true;
+		if (!handler->removing_) {
+			active_handler_ = handler;
+			l.unlock();
+			(*handler)(CTimerEvent(id));
+			l.lock();
+			active_handler_ = 0;
 		}
 	}
 
-	return false;
+	signalled_ |= requestMore || !pending_events_.empty();
+
+	return true;
 }
 
 int CEventLoop::GetNextWaitInterval()
 {
-	int wait = std::numeric_limits<int>::max();
-
-	CDateTime const now(CDateTime::Now());
-	for (auto & timer : timers_) {
-		int diff = static_cast<int>((timer.deadline_ - now).GetMilliseconds().GetValue());
-		if (diff <= -60000) {
-			// Did the system time change? Update deadline
-			timer.deadline_ = now + timer.ms_interval_;
-			diff = timer.ms_interval_;
-		}
-
-		if (diff < wait) {
-			wait = diff;
-		}
+	if (timers_.empty()) {
+		return std::numeric_limits<int>::max();
 	}
 
-	if (wait < 0) {
-		wait = 0;
+	int64_t const wait = timers_.front().deadline_ - Now();
+	if (wait <= 0) {
+		return 0;
+	}
+	if (wait >= std::numeric_limits<int>::max()) {
+		return std::numeric_limits<int>::max() - 1;
 	}
 
-	return wait;
+	return static_cast<int>(wait);
 }
@@ -176,6 +176,30 @@ public:
 
 	// Set to true if deletion of at least one file failed
 	bool m_deleteFailed;
+
+	struct sent_file
+	{
+		wxString file;
+
+		// Sent while replies to other commands were outstanding
+		bool pipelined;
+	};
+
+	// Files a DELE command has been sent for, in order. Replies belong to
+	// the front.
+	std::deque<sent_file> sent;
+
+	// Number of files at the front of files which got put back there to
+	// be retried, while waiting for the remaining replies.
+	size_t retried{};
+
+	// Maximum number of outstanding DELE commands
+	int window{1};
+
+	// Deleted files not yet removed from the directory cache. They get
+	// applied in one go right before the listing notification.
+	std::vector<wxString> deleted;
+	int deletedCount{};
 };
 
 CFtpControlSocket::CFtpControlSocket(CFileZillaEnginePrivate & engine)
@@ -1758,9 +1782,21 @@ int CFtpControlSocket::ResetOperation(int nErrorCode)
 			}
 		}
 	}
-	if (m_pCurOpData && m_pCurOpData->opId == Command::del && !(nErrorCode & FZ_REPLY_DISCONNECTED)) {
+	if (m_pCurOpData && m_pCurOpData->opId == Command::del && (nErrorCode & FZ_REPLY_TIMEOUT) == FZ_REPLY_TIMEOUT) {
+		CFtpDeleteOpData *pData = static_cast<CFtpDeleteOpData *>(m_pCurOpData);
+		if (pData->sent.size() > 1) {
+			// Some servers silently drop commands received while still
+			// processing the previous one.
+			LogMessage(MessageType::Debug_Warning, _T("Timed out waiting for replies to pipelined commands, disabling pipelining."));
+			CServerCapabilities::SetCapability(*m_pCurrentServer, pipelining, no);
+		}
+	}
+	if (m_pCurOpData && m_pCurOpData->opId == Command::del) {
 		CFtpDeleteOpData *pData = static_cast<CFtpDeleteOpData *>(m_pCurOpData);
-		if (pData->m_needSendListing)
+		engine_.GetDirectoryCache().RemoveFiles(*m_pCurrentServer, pData->path, pData->deleted);
+		if (pData->deletedCount > 1)
+			LogMessage(MessageType::Status, wxPLURAL("Deleted %d file", "Deleted %d files", pData->deletedCount), pData->deletedCount);
+		if (pData->m_needSendListing && !(nErrorCode & FZ_REPLY_DISCONNECTED))
 			engine_.SendDirectoryListingNotification(pData->path, false, true, false);
 	}
 
@@ -2674,8 +2710,16 @@ int CFtpControlSocket::FileTransferSend()
 				wxFileOffset len = pFile->Length();
 				engine_.transfer_status_.Init(len, startOffset, false);
 			}
-			pData->pIOThread = new CIOThread;
-			if (!pData->pIOThread->Create(std::move(pFile), !pData->download, pData->binary)) {
+
+			// Zero-copy transfers bypass TLS, ASCII conversion and the rate limiter
+			bool zeroCopy = false;
+			if (engine_.GetOptions().GetOptionVal(OPTION_IO_ZERO_COPY) && pData->binary && !m_protectDataChannel) {
+				CRateLimiter::rate_direction const direction = pData->download ? CRateLimiter::inbound : CRateLimiter::outbound;
+				zeroCopy = !engine_.GetRateLimiter().GetLimit(direction);
+			}
+
+			pData->pIOThread = new CIOThread(engine_.GetIOBufferPool());
+			if (!pData->pIOThread->Create(std::move(pFile), !pData->download, pData->binary, zeroCopy)) {
 				// CIOThread will delete pFile
 				delete pData->pIOThread;
 				pData->pIOThread = 0;
@@ -2981,6 +3025,7 @@ int CFtpControlSocket::Delete(const CServerPath& path, const std::list<wxString>
 	pData->path = path;
 	pData->files = files;
 	pData->omitPath = true;
+	pData->window = GetPipelineDepth();
 
 	int res = ChangeDir(pData->path);
 	if (res != FZ_REPLY_OK)
@@ -3024,29 +3069,41 @@ int CFtpControlSocket::DeleteSend()
 
 	CFtpDeleteOpData *pData = static_cast<CFtpDeleteOpData *>(m_pCurOpData);
 
-	const wxString& file = pData->files.front();
-	if (file.empty())
-	{
-		LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Info, _T("Empty filename"));
-		ResetOperation(FZ_REPLY_INTERNALERROR);
-		return FZ_REPLY_ERROR;
-	}
+	if (!pData->m_time.IsValid())
+		pData->m_time = wxDateTime::UNow();
 
-	wxString filename = pData->path.FormatFilename(file, pData->omitPath);
-	if (filename.empty())
+	// The commands are independent of each other, so keep up to window of
+	// them outstanding. The replies arrive in order.
+	while (!pData->files.empty() && static_cast<int>(pData->sent.size()) < pData->window)
 	{
-		LogMessage(MessageType::Error, _("Filename cannot be constructed for directory %s and filename %s"), pData->path.GetPath(), file);
-		ResetOperation(FZ_REPLY_ERROR);
-		return FZ_REPLY_ERROR;
-	}
+		const wxString& file = pData->files.front();
+		if (file.empty())
+		{
+			LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Info, _T("Empty filename"));
+			ResetOperation(FZ_REPLY_INTERNALERROR);
+			return FZ_REPLY_ERROR;
+		}
 
-	if (!pData->m_time.IsValid())
-		pData->m_time = wxDateTime::UNow();
+		wxString filename = pData->path.FormatFilename(file, pData->omitPath);
+		if (filename.empty())
+		{
+			LogMessage(MessageType::Error, _("Filename cannot be constructed for directory %s and filename %s"), pData->path.GetPath(), file);
+			ResetOperation(FZ_REPLY_ERROR);
+			return FZ_REPLY_ERROR;
+		}
 
-	engine_.GetDirectoryCache().InvalidateFile(*m_pCurrentServer, pData->path, file);
+		engine_.GetDirectoryCache().InvalidateFile(*m_pCurrentServer, pData->path, file);
 
-	if (!SendCommand(_T("DELE ") + filename))
-		return FZ_REPLY_ERROR;
+		// Only the round trip of a command sent while nothing else is
+		// outstanding tells the latency.
+		bool const pipelined = !pData->sent.empty();
+		if (!SendCommand(_T("DELE ") + filename, false, !pipelined))
+			return FZ_REPLY_ERROR;
+
+		pData->sent.push_back({file, pipelined});
+		pData->files.pop_front();
+		pData->retried = 0;
+	}
 
 	return FZ_REPLY_WOULDBLOCK;
 }
@@ -3063,16 +3120,41 @@ int CFtpControlSocket::DeleteParseResponse()
 
 	CFtpDeleteOpData *pData = static_cast<CFtpDeleteOpData *>(m_pCurOpData);
 
+	if (pData->sent.empty()) {
+		LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Info, _T("Reply without outstanding DELE command"));
+		ResetOperation(FZ_REPLY_INTERNALERROR);
+		return FZ_REPLY_ERROR;
+	}
+
+	wxString const file = pData->sent.front().file;
+	bool const pipelined = pData->sent.front().pipelined;
+	pData->sent.pop_front();
+
 	int code = GetReplyCode();
-	if (code != 2 && code != 3)
+	if (code == 5 && pipelined && m_Response.Left(3) == _T("500")) {
+		// DELE not being understood means the server garbled the commands
+		// sent in a row. Retry the file and from now on wait for each reply.
+		// The other commands already sent in a row may fail the same way,
+		// retry those as well, in their original order.
+		if (pData->window > 1) {
+			LogMessage(MessageType::Debug_Warning, _T("Server does not handle pipelined commands, disabling pipelining."));
+			CServerCapabilities::SetCapability(*m_pCurrentServer, pipelining, no);
+			pData->window = 1;
+		}
+		auto pos = pData->files.begin();
+		std::advance(pos, pData->retried++);
+		pData->files.insert(pos, file);
+	}
+	else if (code != 2 && code != 3)
 		pData->m_deleteFailed = true;
 	else {
-		const wxString& file = pData->files.front();
-
-		engine_.GetDirectoryCache().RemoveFile(*m_pCurrentServer, pData->path, file);
+		pData->deleted.push_back(file);
+		++pData->deletedCount;
 
 		wxDateTime now = wxDateTime::UNow();
 		if (now.IsValid() && pData->m_time.IsValid() && (now - pData->m_time).GetSeconds() >= 1) {
+			engine_.GetDirectoryCache().RemoveFiles(*m_pCurrentServer, pData->path, pData->deleted);
+			pData->deleted.clear();
 			engine_.SendDirectoryListingNotification(pData->path, false, true, false);
 			pData->m_time = now;
 			pData->m_needSendListing = false;
@@ -3081,14 +3163,22 @@ int CFtpControlSocket::DeleteParseResponse()
 			pData->m_needSendListing = true;
 	}
 
-	pData->files.pop_front();
-
-	if (!pData->files.empty())
+	if (!pData->files.empty() && static_cast<int>(pData->sent.size()) < pData->window)
 		return SendNextCommand();
+	if (!pData->sent.empty())
+		return FZ_REPLY_WOULDBLOCK;
 
 	return ResetOperation(pData->m_deleteFailed ? FZ_REPLY_ERROR : FZ_REPLY_OK);
 }
 
+int CFtpControlSocket::GetPipelineDepth()
+{
+	if (CServerCapabilities::GetCapability(*m_pCurrentServer, pipelining) == no)
+		return 1;
+
+	return std::max(1, engine_.GetOptions().GetOptionVal(OPTION_FTP_PIPELINE_DEPTH));
+}
+
 class CFtpRemoveDirOpData : public COpData
 {
 public:
@@ -3599,6 +3689,12 @@ public:
 
 	CChmodCommand m_cmd;
 	bool m_useAbsolute;
+
+	// Index of the file currently being changed
+	size_t current{};
+
+	// Set to true if changing the permissions of at least one file failed
+	bool failed{};
 };
 
 enum chmodStates
@@ -3616,7 +3712,11 @@ int CFtpControlSocket::Chmod(const CChmodCommand& command)
 		return FZ_REPLY_ERROR;
 	}
 
-	LogMessage(MessageType::Status, _("Set permissions of '%s' to '%s'"), command.GetPath().FormatFilename(command.GetFile()), command.GetPermission());
+	size_t const count = command.GetFiles().size();
+	if (count > 1)
+		LogMessage(MessageType::Status, wxPLURAL("Set permissions of %d file in '%s'", "Set permissions of %d files in '%s'", count), static_cast<int>(count), command.GetPath().GetPath());
+	else
+		LogMessage(MessageType::Status, _("Set permissions of '%s' to '%s'"), command.GetPath().FormatFilename(command.GetFile()), command.GetPermission());
 
 	CFtpChmodOpData *pData = new CFtpChmodOpData(command);
 	pData->opState = chmod_chmod;
@@ -3639,13 +3739,19 @@ int CFtpControlSocket::ChmodParseResponse()
 	}
 
 	int code = GetReplyCode();
-	if (code != 2 && code != 3) {
+	if (code != 2 && code != 3)
+		pData->failed = true;
+	else
+		engine_.GetDirectoryCache().UpdateFile(*m_pCurrentServer, pData->m_cmd.GetPath(), pData->m_cmd.GetFiles()[pData->current].first, false, CDirectoryCache::unknown);
+
+	if (++pData->current < pData->m_cmd.GetFiles().size())
+		return SendNextCommand();
+
+	if (pData->failed) {
 		ResetOperation(FZ_REPLY_ERROR);
 		return FZ_REPLY_ERROR;
 	}
 
-	engine_.GetDirectoryCache().UpdateFile(*m_pCurrentServer, pData->m_cmd.GetPath(), pData->m_cmd.GetFile(), false, CDirectoryCache::unknown);
-
 	ResetOperation(FZ_REPLY_OK);
 	return FZ_REPLY_OK;
 }
@@ -3684,7 +3790,10 @@ int CFtpControlSocket::ChmodSend()
 	switch (pData->opState)
 	{
 	case chmod_chmod:
-		res = SendCommand(_T("SITE CHMOD ") + pData->m_cmd.GetPermission() + _T(" ") + pData->m_cmd.GetPath().FormatFilename(pData->m_cmd.GetFile(), !pData->m_useAbsolute));
+		{
+			auto const& file = pData->m_cmd.GetFiles()[pData->current];
+			res = SendCommand(_T("SITE CHMOD ") + file.second + _T(" ") + pData->m_cmd.GetPath().FormatFilename(file.first, !pData->m_useAbsolute));
+		}
 		break;
 	default:
 		LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Warning, _T("unknown op state: %d"), pData->opState);
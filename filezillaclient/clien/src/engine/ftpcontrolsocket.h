@@ -57,6 +57,10 @@ protected:
 	int DeleteSend();
 	int DeleteParseResponse();
 
+	// Number of independent commands, e.g. DELE, which may be sent without
+	// waiting for the replies of the previous ones.
+	int GetPipelineDepth();
+
 	virtual int RemoveDir(const CServerPath& path, const wxString& subDir);
 	int RemoveDirSubcommandResult(int prevResult);
 	int RemoveDirSend();
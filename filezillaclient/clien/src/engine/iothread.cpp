@@ -5,21 +5,197 @@
 
 #include <wx/log.h>
 
-CIOThread::CIOThread()
-	: wxThread(wxTHREAD_JOINABLE)
+#ifndef __WXMSW__
+#include <string.h>
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
+
+namespace {
+// Number of released buffers the pool keeps around for reuse
+size_t const max_free_buffers = 16;
+
+// In adaptive mode, grow the ring each time the app had to wait this often...
+int const grow_threshold = 4;
+
+// ...unless it managed to get this many buffers in a row without waiting
+int const wait_decay = 64;
+
+#ifndef __WXMSW__
+// Returns the first occurrence of c in [p, end), or end if there is none.
+// Used by the ASCII mode line-ending conversion, which only ever needs to
+// look for a single character.
+char const* find_char(char const* p, char const* const end, char const c)
 {
-	m_buffers[0] = new char[BUFFERSIZE*BUFFERCOUNT];
-	for (unsigned int i = 0; i < BUFFERCOUNT; ++i) {
-		m_buffers[i] = m_buffers[0] + BUFFERSIZE * i;
-		m_bufferLens[i] = 0;
+#if defined(__AVX2__)
+	__m256i const needle256 = _mm256_set1_epi8(c);
+	while (end - p >= 32) {
+		__m256i const block = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+		unsigned int const mask = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle256)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+	__m128i const needle128 = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		__m128i const block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+		unsigned int const mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle128)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
 	}
+#endif
+	while (p != end && *p != c)
+		++p;
+	return p;
+}
+#endif
+}
+
+CIOBufferPool::CIOBufferPool(COptionsBase& options)
+	: options_(options)
+	, limit_(256 * 1024 * 1024)
+{
+}
+
+CIOBufferPool::~CIOBufferPool()
+{
+	ClearFree();
+}
+
+CIOBufferPool::settings CIOBufferPool::GetSettings()
+{
+	settings s;
+	s.buffer_size = static_cast<unsigned int>(std::max(4096, options_.GetOptionVal(OPTION_IO_BUFFERSIZE)));
+	s.count = std::max(2, options_.GetOptionVal(OPTION_IO_BUFFERCOUNT));
+	s.adaptive = options_.GetOptionVal(OPTION_IO_ADAPTIVE_BUFFERS) != 0;
+	if (s.adaptive)
+		s.max_count = std::max(s.count, options_.GetOptionVal(OPTION_IO_MAX_BUFFERCOUNT));
+	else
+		s.max_count = s.count;
+
+	limit_ = static_cast<uint64_t>(std::max(1, options_.GetOptionVal(OPTION_IO_BUFFER_MEMORY))) * 1024 * 1024;
+
+	return s;
+}
+
+char* CIOBufferPool::Allocate(unsigned int size, bool force)
+{
+	scoped_lock l(mutex_);
+
+	if (free_size_ == size && !free_.empty()) {
+		char* buffer = free_.back();
+		free_.pop_back();
+		return buffer;
+	}
+
+	if (allocated_ + size > limit_) {
+		// Whatever is left in the free list has the wrong size
+		ClearFree();
+
+		if (allocated_ + size > limit_ && !force) {
+			pressure_ = true;
+			return nullptr;
+		}
+	}
+
+	allocated_ += size;
+	return new char[size];
+}
+
+void CIOBufferPool::Release(char* buffer, unsigned int size)
+{
+	if (!buffer)
+		return;
+
+	scoped_lock l(mutex_);
+
+	if (free_size_ != size) {
+		ClearFree();
+		free_size_ = size;
+	}
+
+	if (free_.size() < max_free_buffers && allocated_ <= limit_)
+		free_.push_back(buffer);
+	else {
+		delete [] buffer;
+		allocated_ -= size;
+	}
+
+	if (!free_.empty() || allocated_ + size <= limit_)
+		pressure_ = false;
+}
+
+void CIOBufferPool::ClearFree()
+{
+	for (auto buffer : free_)
+		delete [] buffer;
+	allocated_ -= static_cast<uint64_t>(free_size_) * free_.size();
+	free_.clear();
+}
+
+void CIOBufferPool::AddUser()
+{
+	++users_;
+}
+
+void CIOBufferPool::RemoveUser()
+{
+	--users_;
+}
+
+bool CIOBufferPool::ShouldShrink(int count, unsigned int size) const
+{
+	if (!pressure_)
+		return false;
+
+	int const users = std::max(1, users_.load());
+	uint64_t const share = limit_ / size / users;
+
+	return static_cast<uint64_t>(count) > share;
+}
+
+CIOThread::CIOThread(CIOBufferPool& pool)
+	: wxThread(wxTHREAD_JOINABLE)
+	, m_pool(pool)
+{
+	m_pool.AddUser();
+
+	auto const settings = m_pool.GetSettings();
+	m_bufferSize = settings.buffer_size;
+	m_adaptive = settings.adaptive;
+	m_initialBufferCount = settings.count;
+	m_maxBufferCount = settings.max_count;
 }
 
 CIOThread::~CIOThread()
 {
 	Close();
 
-	delete [] m_buffers[0];
+#ifdef __linux__
+	for (auto & fd : m_pipe) {
+		if (fd != -1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+#endif
+
+	for (auto const& b : m_buffers)
+		m_pool.Release(b.data, m_bufferSize);
+
+	m_pool.RemoveUser();
 }
 
 void CIOThread::Close()
@@ -34,7 +210,7 @@ void CIOThread::Close()
 	}
 }
 
-bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary)
+bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary, bool zeroCopy)
 {
 	wxASSERT(pFile);
 
@@ -44,8 +220,26 @@ bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary)
 	m_read = read;
 	m_binary = binary;
 
+#ifdef __linux__
+	if (zeroCopy && binary)
+		m_zeroCopy = CreateZeroCopy();
+#else
+	(void)zeroCopy;
+#endif
+
+	// The ring does not work with less than two buffers, so those two are
+	// allocated even if the pool is over its limit.
+	if (!m_zeroCopy && m_buffers.empty()) {
+		for (int i = 0; i < m_initialBufferCount; ++i) {
+			char* data = m_pool.Allocate(m_bufferSize, i < m_minBufferCount);
+			if (!data)
+				break;
+			m_buffers.push_back(buffer{data, 0});
+		}
+	}
+
 	if (read) {
-		m_curAppBuf = BUFFERCOUNT - 1;
+		m_curAppBuf = static_cast<int>(m_buffers.size()) - 1;
 		m_curThreadBuf = 0;
 	}
 	else {
@@ -66,11 +260,20 @@ bool CIOThread::Create(std::unique_ptr<CFile> && pFile, bool read, bool binary)
 
 wxThread::ExitCode CIOThread::Entry()
 {
+#ifdef __linux__
+	if (m_zeroCopy)
+		return ZeroCopyEntry();
+#endif
+
 	if (m_read) {
+		scoped_lock l(m_mutex);
 		while (m_running) {
-			int len = ReadFromFile(m_buffers[m_curThreadBuf], BUFFERSIZE);
-
-			scoped_lock l(m_mutex);
+			// The app might modify the ring while reading, but never
+			// touches the buffer the thread is working on.
+			char* const data = m_buffers[m_curThreadBuf].data;
+			l.unlock();
+			int len = ReadFromFile(data, m_bufferSize);
+			l.lock();
 
 			if (m_appWaiting) {
 				if (!m_evtHandler) {
@@ -87,14 +290,14 @@ wxThread::ExitCode CIOThread::Entry()
 				break;
 			}
 
-			m_bufferLens[m_curThreadBuf] = len;
+			m_buffers[m_curThreadBuf].len = len;
 
 			if (!len) {
 				m_running = false;
 				break;
 			}
 
-			++m_curThreadBuf %= BUFFERCOUNT;
+			m_curThreadBuf = (m_curThreadBuf + 1) % static_cast<int>(m_buffers.size());
 			if (m_curThreadBuf == m_curAppBuf) {
 				if (!m_running)
 					break;
@@ -126,8 +329,9 @@ wxThread::ExitCode CIOThread::Entry()
 				m_condition.wait(l);
 			}
 
+			char* const data = m_buffers[m_curThreadBuf].data;
 			l.unlock();
-			bool writeSuccessful = WriteToFile(m_buffers[m_curThreadBuf], BUFFERSIZE);
+			bool writeSuccessful = WriteToFile(data, m_bufferSize);
 			l.lock();
 
 			if (!writeSuccessful) {
@@ -147,7 +351,7 @@ wxThread::ExitCode CIOThread::Entry()
 			if (m_error)
 				break;
 
-			++m_curThreadBuf %= BUFFERCOUNT;
+			m_curThreadBuf = (m_curThreadBuf + 1) % static_cast<int>(m_buffers.size());
 		}
 	}
 
@@ -165,14 +369,19 @@ int CIOThread::GetNextWriteBuffer(char** pBuffer)
 
 	if (m_curAppBuf == -1) {
 		m_curAppBuf = 0;
-		*pBuffer = m_buffers[0];
+		*pBuffer = m_buffers[0].data;
 		return IO_Success;
 	}
 
-	int newBuf = (m_curAppBuf + 1) % BUFFERCOUNT;
+	int newBuf = (m_curAppBuf + 1) % static_cast<int>(m_buffers.size());
 	if (newBuf == m_curThreadBuf) {
-		m_appWaiting = true;
-		return IO_Again;
+		// Growing the ring might have freed up a buffer
+		OnAppWouldBlock(l);
+		newBuf = (m_curAppBuf + 1) % static_cast<int>(m_buffers.size());
+		if (newBuf == m_curThreadBuf) {
+			m_appWaiting = true;
+			return IO_Again;
+		}
 	}
 
 	if (m_threadWaiting) {
@@ -181,7 +390,9 @@ int CIOThread::GetNextWriteBuffer(char** pBuffer)
 	}
 
 	m_curAppBuf = newBuf;
-	*pBuffer = m_buffers[newBuf];
+	*pBuffer = m_buffers[newBuf].data;
+
+	OnAppProgress();
 
 	return IO_Success;
 }
@@ -195,6 +406,9 @@ bool CIOThread::Finalize(int len)
 
 	Destroy();
 
+	if (m_zeroCopy)
+		return !m_error;
+
 	if (m_curAppBuf == -1)
 		return true;
 
@@ -204,7 +418,7 @@ bool CIOThread::Finalize(int len)
 	if (!len)
 		return true;
 
-	if (!WriteToFile(m_buffers[m_curAppBuf], len))
+	if (!WriteToFile(m_buffers[m_curAppBuf].data, len))
 		return false;
 
 #ifndef __WXMSW__
@@ -222,16 +436,16 @@ int CIOThread::GetNextReadBuffer(char** pBuffer)
 	wxASSERT(!m_destroyed);
 	wxASSERT(m_read);
 
-	int newBuf = (m_curAppBuf + 1) % BUFFERCOUNT;
-
 	scoped_lock l(m_mutex);
 
+	int newBuf = (m_curAppBuf + 1) % static_cast<int>(m_buffers.size());
 	if (newBuf == m_curThreadBuf) {
 		if (m_error)
 			return IO_Error;
 		else if (!m_running)
 			return IO_Success;
 		else {
+			OnAppWouldBlock(l);
 			m_appWaiting = true;
 			return IO_Again;
 		}
@@ -242,10 +456,102 @@ int CIOThread::GetNextReadBuffer(char** pBuffer)
 		m_threadWaiting = false;
 	}
 
-	*pBuffer = m_buffers[newBuf];
+	*pBuffer = m_buffers[newBuf].data;
 	m_curAppBuf = newBuf;
 
-	return m_bufferLens[newBuf];
+	int const len = m_buffers[newBuf].len;
+
+	OnAppProgress();
+
+	return len;
+}
+
+void CIOThread::OnAppWouldBlock(scoped_lock & l)
+{
+	if (!m_adaptive)
+		return;
+
+	m_appProgressCount = 0;
+	if (++m_appWaitCount >= grow_threshold) {
+		m_appWaitCount = 0;
+		GrowRing(l);
+	}
+}
+
+void CIOThread::OnAppProgress()
+{
+	if (!m_adaptive)
+		return;
+
+	if (++m_appProgressCount >= wait_decay) {
+		m_appProgressCount = 0;
+		m_appWaitCount = 0;
+	}
+
+	int const count = static_cast<int>(m_buffers.size());
+	if (count > m_minBufferCount && m_pool.ShouldShrink(count, m_bufferSize))
+		ShrinkRing();
+}
+
+void CIOThread::GrowRing(scoped_lock & l)
+{
+	if (static_cast<int>(m_buffers.size()) >= m_maxBufferCount)
+		return;
+
+	char* data = m_pool.Allocate(m_bufferSize, false);
+	if (!data)
+		return;
+
+	// The new buffer has to end up in the part of the ring that is free
+	// for the side filling the buffers: Right before the app's buffer when
+	// reading, right after it when writing.
+	int const pos = m_read ? m_curAppBuf : (m_curAppBuf + 1);
+	m_buffers.insert(m_buffers.begin() + pos, buffer{data, 0});
+
+	if (m_curAppBuf >= pos)
+		++m_curAppBuf;
+
+	if (m_read) {
+		// If the thread was waiting for the app, it now gets the new buffer
+		if (m_curThreadBuf > pos)
+			++m_curThreadBuf;
+		if (m_threadWaiting && m_curThreadBuf != m_curAppBuf) {
+			m_condition.signal(l);
+			m_threadWaiting = false;
+		}
+	}
+	else if (m_curThreadBuf >= pos)
+		++m_curThreadBuf;
+}
+
+void CIOThread::ShrinkRing()
+{
+	int const count = static_cast<int>(m_buffers.size());
+	if (count <= m_minBufferCount || m_curAppBuf == -1)
+		return;
+
+	// Only remove a buffer that neither side is using and which holds no pending data
+	int pos;
+	if (m_read) {
+		if (m_curThreadBuf == m_curAppBuf)
+			return;
+		pos = (m_curThreadBuf + 1) % count;
+		if (pos == m_curAppBuf)
+			return;
+	}
+	else {
+		pos = (m_curAppBuf + 1) % count;
+		if (pos == m_curThreadBuf)
+			return;
+	}
+
+	m_pool.Release(m_buffers[pos].data, m_bufferSize);
+	m_buffers.erase(m_buffers.begin() + pos);
+
+	if (m_curAppBuf > pos)
+		--m_curAppBuf;
+	if (m_curThreadBuf > pos)
+		--m_curThreadBuf;
 }
 
 void CIOThread::Destroy()
@@ -263,9 +569,189 @@ void CIOThread::Destroy()
 	}
 	l.unlock();
 
+#ifdef __linux__
+	// Closing the write end lets the thread drain the pipe and exit
+	if (m_pipe[1] != -1) {
+		close(m_pipe[1]);
+		m_pipe[1] = -1;
+	}
+#endif
+
 	Wait(wxTHREAD_WAIT_BLOCK);
 }
 
+#ifdef __linux__
+bool CIOThread::CreateZeroCopy()
+{
+	wxFileOffset const window = static_cast<wxFileOffset>(m_bufferSize) * m_initialBufferCount;
+
+	if (m_read) {
+		wxFileOffset const offset = m_pFile->Seek(0, CFile::current);
+		if (offset == wxInvalidOffset)
+			return false;
+
+		m_appOffset = offset;
+		m_readaheadOffset = offset;
+		m_readaheadWindow = window;
+
+		posix_fadvise(m_pFile->GetDescriptor(), 0, 0, POSIX_FADV_SEQUENTIAL);
+		return true;
+	}
+
+	if (pipe2(m_pipe, O_CLOEXEC) != 0) {
+		m_pipe[0] = -1;
+		m_pipe[1] = -1;
+		return false;
+	}
+
+	// The app side must never block on the pipe. The pipe gets as large as
+	// the buffer ring would have been, if the system allows it.
+	fcntl(m_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(m_pipe[1], F_SETPIPE_SZ, static_cast<int>(std::min(window, static_cast<wxFileOffset>(1024 * 1024))));
+	int const size = fcntl(m_pipe[1], F_GETPIPE_SZ);
+	m_pipeSize = size > 0 ? static_cast<unsigned int>(size) : 65536;
+
+	return true;
+}
+
+wxThread::ExitCode CIOThread::ZeroCopyEntry()
+{
+	int const fd = m_pFile->GetDescriptor();
+
+	if (m_read) {
+		// Read ahead of the app, but only once it has used up half the window
+		scoped_lock l(m_mutex);
+		while (m_running) {
+			if (m_readaheadOffset - m_appOffset > m_readaheadWindow / 2) {
+				m_threadWaiting = true;
+				m_condition.wait(l);
+				continue;
+			}
+
+			wxFileOffset const offset = m_readaheadOffset;
+			wxFileOffset const len = m_appOffset + m_readaheadWindow - offset;
+			m_readaheadOffset += len;
+
+			l.unlock();
+			readahead(fd, offset, len);
+			l.lock();
+		}
+		return 0;
+	}
+
+	bool splice_supported = true;
+	for (;;) {
+		ssize_t res;
+		if (splice_supported) {
+			res = splice(m_pipe[0], 0, fd, 0, m_pipeSize, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (res == -1 && errno == EINVAL) {
+				// Not all file systems support splice, copy through a buffer instead
+				splice_supported = false;
+				m_conversionBuffer.resize(m_bufferSize);
+				continue;
+			}
+		}
+		else {
+			res = read(m_pipe[0], &m_conversionBuffer[0], m_conversionBuffer.size());
+			if (res > 0 && !DoWrite(&m_conversionBuffer[0], res)) {
+				scoped_lock l(m_mutex);
+				m_error = true;
+			}
+		}
+
+		if (res == -1) {
+			int const code = errno;
+			if (code == EINTR)
+				continue;
+
+			scoped_lock l(m_mutex);
+			m_error_description = wxSysErrorMsg(code);
+			m_error = true;
+		}
+
+		scoped_lock l(m_mutex);
+
+		m_pipeCongested = false;
+		if (m_appWaiting) {
+			if (!m_evtHandler) {
+				m_running = false;
+				break;
+			}
+			m_appWaiting = false;
+			m_evtHandler->SendEvent<CIOThreadEvent>();
+		}
+
+		// No data left and the app has closed its end of the pipe
+		if (m_error || !res) {
+			m_running = false;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int CIOThread::GetNextPipeSpace(int& fd, unsigned int& space)
+{
+	wxASSERT(!m_destroyed);
+	wxASSERT(m_zeroCopy && !m_read);
+
+	scoped_lock l(m_mutex);
+
+	if (m_error || !m_running)
+		return IO_Error;
+
+	int queued{};
+	if (ioctl(m_pipe[0], FIONREAD, &queued) != 0) {
+		m_error_description = wxSysErrorMsg(errno);
+		m_error = true;
+		return IO_Error;
+	}
+
+	if (m_pipeCongested || static_cast<unsigned int>(queued) >= m_pipeSize) {
+		m_appWaiting = true;
+		return IO_Again;
+	}
+
+	fd = m_pipe[1];
+	space = m_pipeSize - queued;
+
+	return IO_Success;
+}
+
+bool CIOThread::WaitForPipe()
+{
+	scoped_lock l(m_mutex);
+
+	int queued{};
+	if (ioctl(m_pipe[0], FIONREAD, &queued) != 0 || !queued)
+		return false;
+
+	// The thread is still busy with the pipe and will notify us
+	m_pipeCongested = true;
+	m_appWaiting = true;
+
+	return true;
+}
+
+int CIOThread::GetFileDescriptor() const
+{
+	wxASSERT(m_zeroCopy && m_read);
+	return m_pFile->GetDescriptor();
+}
+
+void CIOThread::OnFileSent(int len)
+{
+	scoped_lock l(m_mutex);
+
+	m_appOffset += len;
+	if (m_threadWaiting && m_readaheadOffset - m_appOffset <= m_readaheadWindow / 2) {
+		m_threadWaiting = false;
+		m_condition.signal(l);
+	}
+}
+#endif
+
 int CIOThread::ReadFromFile(char* pBuffer, int maxLen)
 {
 #ifdef SIMULATE_IO
@@ -290,28 +776,32 @@ int CIOThread::ReadFromFile(char* pBuffer, int maxLen)
 	// only LFs from the file
 	const int readLen = maxLen / 2;
 
-	char* r = pBuffer + readLen;
-	int len = m_pFile->Read(r, readLen);
+	const char* r = pBuffer + readLen;
+	int len = m_pFile->Read(pBuffer + readLen, readLen);
 	if (!len || len == wxInvalidOffset)
 		return len;
 
 	const char* const end = r + len;
 	char* w = pBuffer;
 
-	// Convert all stand-alone LFs into CRLF pairs.
+	// Convert all stand-alone LFs into CRLF pairs. Everything in between
+	// gets moved in blocks. The write position never overtakes the read
+	// position as at most readLen CRs can get inserted.
 	while (r != end) {
-		char c = *r++;
-		if (c == '\n') {
-			if (!m_wasCarriageReturn)
-				*w++ = '\r';
-			m_wasCarriageReturn = false;
+		char const* lf = find_char(r, end, '\n');
+		if (lf != r) {
+			m_wasCarriageReturn = lf[-1] == '\r';
+			memmove(w, r, lf - r);
+			w += lf - r;
 		}
-		else if (c == '\r')
-			m_wasCarriageReturn = true;
-		else
-			m_wasCarriageReturn = false;
-
-		*w++ = c;
+		if (lf == end)
+			break;
+
+		if (!m_wasCarriageReturn)
+			*w++ = '\r';
+		*w++ = '\n';
+		m_wasCarriageReturn = false;
+		r = lf + 1;
 	}
 
 	return w - pBuffer;
@@ -333,32 +823,45 @@ bool CIOThread::WriteToFile(char* pBuffer, int len)
 #ifndef __WXMSW__
 	}
 	else {
-		// On all CRLF pairs, omit the CR. Don't harm stand-alone CRs
-		// I assume disk access is buffered, otherwise the 1 byte writes are
-		// going to hurt performance.
-		const char CR = '\r';
+		// On all CRLF pairs, omit the CR. Don't harm stand-alone CRs.
+		// The result is assembled in a staging buffer and written in one go.
+		// It is at most one byte longer than the input: A CR at the end of
+		// the previous buffer that turned out not to be followed by a LF.
+		if (m_conversionBuffer.size() < static_cast<size_t>(len) + 1)
+			m_conversionBuffer.resize(len + 1);
+
+		char* const out = &m_conversionBuffer[0];
+		char* w = out;
+
+		const char* r = pBuffer;
 		const char* const end = pBuffer + len;
-		for (char* r = pBuffer; r != end; ++r) {
-			char c = *r;
-			if (c == '\r')
-				m_wasCarriageReturn = true;
-			else if (c == '\n') {
-				m_wasCarriageReturn = false;
-				if (!DoWrite(&c, 1))
-					return false;
-			}
-			else {
-				if (m_wasCarriageReturn) {
-					m_wasCarriageReturn = false;
-					if (!DoWrite(&CR, 1))
-						return false;
-				}
+		if (m_wasCarriageReturn && r != end) {
+			m_wasCarriageReturn = false;
+			if (*r != '\n')
+				*w++ = '\r';
+		}
 
-				if (!DoWrite(&c, 1))
-					return false;
+		while (r != end) {
+			char const* cr = find_char(r, end, '\r');
+			memcpy(w, r, cr - r);
+			w += cr - r;
+			if (cr == end)
+				break;
+
+			r = cr + 1;
+			if (r == end) {
+				// Decided by the next buffer or by Finalize
+				m_wasCarriageReturn = true;
+				break;
 			}
+			if (*r != '\n')
+				*w++ = '\r';
 		}
-		return true;
+
+		if (w == out)
+			return true;
+
+		return DoWrite(out, w - out);
 	}
 #endif
 }
@@ -4,8 +4,8 @@
 #include <wx/file.h>
 #include "event_loop.h"
 
-#define BUFFERCOUNT 5
-#define BUFFERSIZE 128*1024
+#include <atomic>
+#include <vector>
 
 // Does not actually read from or write to file
 // Useful for benchmarks to avoid IO bottleneck
@@ -22,14 +22,71 @@ enum IORet
 	IO_Again = -1
 };
 
+class COptionsBase;
+
+// Hands out the buffers used by CIOThread. There is one pool per engine
+// context, shared by all transfers, so that the total amount of memory
+// used for file I/O stays bounded regardless of the number of transfers.
+class CIOBufferPool final
+{
+public:
+	explicit CIOBufferPool(COptionsBase& options);
+	~CIOBufferPool();
+
+	CIOBufferPool(CIOBufferPool const&) = delete;
+	CIOBufferPool& operator=(CIOBufferPool const&) = delete;
+
+	struct settings
+	{
+		unsigned int buffer_size;
+		int count;
+		int max_count;
+		bool adaptive;
+	};
+
+	// Reads the current settings from the options
+	settings GetSettings();
+
+	// Returns nullptr if the memory limit has been reached, unless force is set.
+	char* Allocate(unsigned int size, bool force);
+	void Release(char* buffer, unsigned int size);
+
+	void AddUser();
+	void RemoveUser();
+
+	// Returns true if some transfer could not get an additional buffer and a
+	// transfer with the passed number of buffers is holding more than its share.
+	bool ShouldShrink(int count, unsigned int size) const;
+
+protected:
+	void ClearFree();
+
+	COptionsBase& options_;
+
+	mutex mutex_;
+
+	// Recycled buffers, all of size free_size_
+	std::vector<char*> free_;
+	unsigned int free_size_{};
+
+	// Bytes allocated, including the recycled buffers
+	uint64_t allocated_{};
+
+	std::atomic<uint64_t> limit_;
+	std::atomic<int> users_{};
+	std::atomic<bool> pressure_{};
+};
+
 class CFile;
 class CIOThread final : protected wxThread
 {
 public:
-	CIOThread();
+	explicit CIOThread(CIOBufferPool& pool);
 	virtual ~CIOThread();
 
-	bool Create(std::unique_ptr<CFile> && pFile, bool read, bool binary);
+	// Zero-copy mode is only honored for binary transfers on Linux, see
+	// ZeroCopy() below.
+	bool Create(std::unique_ptr<CFile> && pFile, bool read, bool binary, bool zeroCopy = false);
 	virtual void Destroy(); // Only call that might be blocking
 
 	// Call before first call to one of the GetNext*Buffer functions
@@ -55,10 +112,48 @@ public:
 
 	wxString GetError();
 
+	// All buffers have the same size, fixed for the lifetime of the thread
+	unsigned int GetBufferSize() const { return m_bufferSize; }
+
+	// In zero-copy mode there is no buffer ring, the GetNext*Buffer
+	// functions must not be used. Downloads go through a pipe which the
+	// thread splices into the file. Uploads get sent straight from the file
+	// with sendfile while the thread reads ahead to keep the data in the
+	// page cache.
+	bool ZeroCopy() const { return m_zeroCopy; }
+
+#ifdef __linux__
+	// Downloads: Gets the write end of the pipe and how much it can take.
+	// Same return values as GetNextWriteBuffer.
+	int GetNextPipeSpace(int& fd, unsigned int& space);
+
+	// Downloads: Call if writing into the pipe failed with EAGAIN. Returns
+	// true if the pipe still holds data, a CIOThreadEvent gets sent once
+	// the thread has made room. If false, the pipe is empty and it was the
+	// socket that would have blocked.
+	bool WaitForPipe();
+
+	// Uploads: The file to pass to sendfile and how much got sent from it
+	int GetFileDescriptor() const;
+	void OnFileSent(int len);
+#endif
+
 protected:
 	void Close();
 
+	// Both need m_mutex to be locked
+	void GrowRing(scoped_lock & l);
+	void ShrinkRing();
+
+	// Called by the GetNext*Buffer functions with m_mutex locked
+	void OnAppWouldBlock(scoped_lock & l);
+	void OnAppProgress();
+
 	virtual ExitCode Entry();
+#ifdef __linux__
+	bool CreateZeroCopy();
+	ExitCode ZeroCopyEntry();
+#endif
 
 	int ReadFromFile(char* pBuffer, int maxLen);
 	bool WriteToFile(char* pBuffer, int len);
@@ -70,8 +165,27 @@ protected:
 	bool m_binary{};
 	std::unique_ptr<CFile> m_pFile;
 
-	char* m_buffers[BUFFERCOUNT];
-	unsigned int m_bufferLens[BUFFERCOUNT];
+	CIOBufferPool& m_pool;
+
+	struct buffer
+	{
+		char* data;
+		unsigned int len;
+	};
+
+	// Ring of buffers. In adaptive mode, buffers get inserted or removed
+	// between the positions of the app and the thread, only ever in the
+	// part of the ring that currently is not in use by either side.
+	std::vector<buffer> m_buffers;
+	unsigned int m_bufferSize{};
+	int m_minBufferCount{2};
+	int m_initialBufferCount{2};
+	int m_maxBufferCount{2};
+	bool m_adaptive{};
+
+	// Number of times the app had to wait since the last change to the ring
+	int m_appWaitCount{};
+	int m_appProgressCount{};
 
 	mutex m_mutex;
 	condition m_condition;
@@ -88,6 +202,22 @@ protected:
 
 	bool m_wasCarriageReturn{};
 
+	// Staging buffer for the ASCII mode conversion in WriteToFile. In
+	// zero-copy mode used if the file system cannot splice.
+	std::vector<char> m_conversionBuffer;
+
+	bool m_zeroCopy{};
+#ifdef __linux__
+	int m_pipe[2]{-1, -1};
+	unsigned int m_pipeSize{};
+	bool m_pipeCongested{};
+
+	// Uploads: How far the socket side got and how far the thread has read ahead
+	wxFileOffset m_appOffset{};
+	wxFileOffset m_readaheadOffset{};
+	wxFileOffset m_readaheadWindow{};
+#endif
+
 	wxString m_error_description;
 
 #ifdef SIMULATE_IO
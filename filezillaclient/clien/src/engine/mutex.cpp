@@ -47,6 +47,59 @@ void mutex::unlock()
 }
 
 
+rwlock::rwlock()
+{
+#ifdef __WXMSW__
+	InitializeSRWLock(&l_);
+#else
+	pthread_rwlock_init(&l_, 0);
+#endif
+}
+
+rwlock::~rwlock()
+{
+#ifdef __WXMSW__
+#else
+	pthread_rwlock_destroy(&l_);
+#endif
+}
+
+void rwlock::lock_read()
+{
+#ifdef __WXMSW__
+	AcquireSRWLockShared(&l_);
+#else
+	pthread_rwlock_rdlock(&l_);
+#endif
+}
+
+void rwlock::unlock_read()
+{
+#ifdef __WXMSW__
+	ReleaseSRWLockShared(&l_);
+#else
+	pthread_rwlock_unlock(&l_);
+#endif
+}
+
+void rwlock::lock_write()
+{
+#ifdef __WXMSW__
+	AcquireSRWLockExclusive(&l_);
+#else
+	pthread_rwlock_wrlock(&l_);
+#endif
+}
+
+void rwlock::unlock_write()
+{
+#ifdef __WXMSW__
+	ReleaseSRWLockExclusive(&l_);
+#else
+	pthread_rwlock_unlock(&l_);
+#endif
+}
+
 condition::condition()
 	: signalled_()
 {
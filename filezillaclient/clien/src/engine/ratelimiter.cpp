@@ -2,19 +2,71 @@
 #include "ratelimiter.h"
 
 #include "event_loop.h"
+#include <server.h>
 
-static int const tickDelay = 250;
+#include <vector>
+
+namespace {
+// Refills are triggered by objects running out of tokens, but happen at most this often
+int const minRefillInterval = 50;
+
+// Hands out tokens to the children in proportion to their weights. Tokens
+// a child does not take get offered to the remaining children. Returns
+// the tokens nobody wanted.
+template<typename T, typename Weight, typename Offer>
+int64_t Distribute(int64_t tokens, std::vector<T*> children, Weight const& weight, Offer const& offer)
+{
+	std::vector<T*> next;
+	while (tokens > 0 && !children.empty()) {
+		int64_t totalWeight = 0;
+		for (auto const& child : children)
+			totalWeight += weight(*child);
+
+		int64_t leftover = tokens;
+		next.clear();
+		for (auto const& child : children) {
+			int64_t const share = tokens * weight(*child) / totalWeight;
+			int64_t const rest = offer(*child, share);
+			leftover -= share - rest;
+			if (!rest)
+				next.push_back(child);
+		}
+
+		if (next.size() == children.size()) {
+			// Nobody is saturated, only rounding remainders are left
+			for (auto const& child : next) {
+				leftover = offer(*child, leftover);
+				if (!leftover)
+					break;
+			}
+			return leftover;
+		}
+
+		tokens = leftover;
+		children.swap(next);
+	}
+
+	return tokens;
+}
+
+void AddStats(CRateLimiter::stats & to, CRateLimiter::stats const& from)
+{
+	for (int i = 0; i < 2; ++i) {
+		to.bytes[i] += from.bytes[i];
+		to.waits[i] += from.waits[i];
+	}
+}
+}
 
 CRateLimiter::CRateLimiter(CEventLoop& loop, COptionsBase& options)
 	: CEventHandler(loop)
+	, last_refill_(CMonotonicClock::now())
 	, options_(options)
 {
 	RegisterOption(OPTION_SPEEDLIMIT_ENABLE);
 	RegisterOption(OPTION_SPEEDLIMIT_INBOUND);
 	RegisterOption(OPTION_SPEEDLIMIT_OUTBOUND);
-
-	m_tokenDebt[0] = 0;
-	m_tokenDebt[1] = 0;
+	RegisterOption(OPTION_SPEEDLIMIT_BURSTTOLERANCE);
 }
 
 CRateLimiter::~CRateLimiter()
@@ -32,37 +84,35 @@ int64_t CRateLimiter::GetLimit(rate_direction direction) const
 	return ret;
 }
 
-void CRateLimiter::AddObject(CRateLimiterObject* pObject)
+wxString CRateLimiter::GetSiteName(CServer const& server)
+{
+	return server.FormatHost();
+}
+
+void CRateLimiter::AddObject(CRateLimiterObject* pObject, wxString const& site_name)
 {
 	scoped_lock lock(sync_);
 
-	m_objectList.push_back(pObject);
+	if (pObject->m_limiter) {
+		wxASSERT(pObject->m_limiter == this);
+		DetachObject(*pObject);
+	}
 
-	for (int i = 0; i < 2; ++i) {
-		int64_t limit = GetLimit(static_cast<rate_direction>(i));
-		if (limit > 0) {
-			int64_t tokens = limit / (1000 / tickDelay);
-
-			tokens /= m_objectList.size();
-			if (m_tokenDebt[i] > 0) {
-				if (tokens >= m_tokenDebt[i]) {
-					tokens -= m_tokenDebt[i];
-					m_tokenDebt[i] = 0;
-				}
-				else {
-					tokens = 0;
-					m_tokenDebt[i] -= tokens;
-				}
-			}
+	auto it = sites_.find(site_name);
+	if (it == sites_.end()) {
+		it = sites_.emplace(site_name, site()).first;
+		it->second.name = site_name;
+	}
+	site & s = it->second;
 
-			pObject->m_bytesAvailable[i] = tokens;
+	pObject->m_limiter = this;
+	pObject->m_site = &s;
+	pObject->m_siteIter = s.objects.insert(s.objects.end(), pObject);
 
-			if (!m_timer)
-				m_timer = AddTimer(tickDelay, false);
-		}
-		else {
-			pObject->m_bytesAvailable[i] = -1;
-		}
+	// Limited objects start out empty and get their share with the next refill
+	for (int i = 0; i < 2; ++i) {
+		bool const limited = GetLimit(static_cast<rate_direction>(i)) > 0 || s.limit[i] > 0 || pObject->m_limit[i] > 0;
+		pObject->m_bytesAvailable[i] = limited ? 0 : -1;
 	}
 }
 
@@ -70,131 +120,292 @@ void CRateLimiter::RemoveObject(CRateLimiterObject* pObject)
 {
 	scoped_lock lock(sync_);
 
-	for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-		if (*iter == pObject) {
-			for (int i = 0; i < 2; ++i) {
-				// If an object already used up some of its assigned tokens, add them to m_tokenDebt,
-				// so that newly created objects get less initial tokens.
-				// That ensures that rapidly adding and removing objects does not exceed the rate
-				int64_t limit = GetLimit(static_cast<rate_direction>(i));
-				int64_t tokens = limit / (1000 / tickDelay);
-				tokens /= m_objectList.size();
-				if ((*iter)->m_bytesAvailable[i] < tokens)
-					m_tokenDebt[i] += tokens - (*iter)->m_bytesAvailable[i];
-			}
-			m_objectList.erase(iter);
-			break;
+	if (pObject->m_limiter)
+		DetachObject(*pObject);
+}
+
+void CRateLimiter::DetachObject(CRateLimiterObject & object)
+{
+	site & s = *object.m_site;
+
+	AddStats(s.stats_, object.m_stats);
+	object.m_stats = stats();
+
+	s.objects.erase(object.m_siteIter);
+
+	for (int i = 0; i < 2; ++i) {
+		if (object.m_inWakeupList[i]) {
+			m_wakeupList[i].erase(object.m_wakeupIter[i]);
+			object.m_inWakeupList[i] = false;
 		}
 	}
 
-	for (int i = 0; i < 2; ++i) {
-		for (auto iter = m_wakeupList[i].begin(); iter != m_wakeupList[i].end(); ++iter) {
-			if (*iter == pObject) {
-				m_wakeupList[i].erase(iter);
-				break;
-			}
+	object.m_limiter = 0;
+	object.m_site = 0;
+
+	RemoveSiteIfUnused(sites_.find(s.name));
+}
+
+void CRateLimiter::RemoveSiteIfUnused(std::map<wxString, site>::iterator it)
+{
+	if (it == sites_.end() || it->second.configured || !it->second.objects.empty())
+		return;
+
+	AddStats(removed_stats_, it->second.stats_);
+	sites_.erase(it);
+}
+
+void CRateLimiter::SetObjectLimits(CRateLimiterObject* pObject, int64_t inbound, int64_t outbound, int weight)
+{
+	{
+		scoped_lock lock(sync_);
+		pObject->m_limit[0] = std::max(int64_t(0), inbound);
+		pObject->m_limit[1] = std::max(int64_t(0), outbound);
+		pObject->m_weight = std::max(1, weight);
+	}
+
+	SendEvent<CRateLimitChangedEvent>();
+}
+
+void CRateLimiter::SetSiteLimits(wxString const& site_name, int64_t inbound, int64_t outbound, int weight)
+{
+	{
+		scoped_lock lock(sync_);
+
+		auto it = sites_.find(site_name);
+		if (it == sites_.end()) {
+			it = sites_.emplace(site_name, site()).first;
+			it->second.name = site_name;
 		}
+
+		site & s = it->second;
+		s.limit[0] = std::max(int64_t(0), inbound);
+		s.limit[1] = std::max(int64_t(0), outbound);
+		s.weight = std::max(1, weight);
+		s.configured = s.limit[0] || s.limit[1] || s.weight != 1;
+
+		RemoveSiteIfUnused(it);
 	}
+
+	SendEvent<CRateLimitChangedEvent>();
 }
 
-void CRateLimiter::OnTimer(timer_id)
+CRateLimiter::stats CRateLimiter::GetStats() const
 {
 	scoped_lock lock(sync_);
 
-	int64_t const limits[2] = { GetLimit(inbound), GetLimit(outbound) };
+	stats ret = removed_stats_;
+	for (auto const& s : sites_) {
+		AddStats(ret, s.second.stats_);
+		for (auto const& object : s.second.objects)
+			AddStats(ret, object->m_stats);
+	}
 
-	for (int i = 0; i < 2; ++i) {
-		m_tokenDebt[i] = 0;
+	return ret;
+}
 
-		if (m_objectList.empty())
-			continue;
+CRateLimiter::stats CRateLimiter::GetSiteStats(wxString const& site_name) const
+{
+	scoped_lock lock(sync_);
 
-		if (limits[i] == 0) {
-			for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-				(*iter)->m_bytesAvailable[i] = -1;
-				if ((*iter)->m_waiting[i])
-					m_wakeupList[i].push_back(*iter);
-			}
-			continue;
-		}
+	stats ret;
 
-		int64_t tokens = (limits[i] * tickDelay) / 1000;
-		int64_t maxTokens = tokens * GetBucketSize();
+	auto const it = sites_.find(site_name);
+	if (it != sites_.end()) {
+		ret = it->second.stats_;
+		for (auto const& object : it->second.objects)
+			AddStats(ret, object->m_stats);
+	}
 
-		// Get amount of tokens for each object
-		int64_t tokensPerObject = tokens / m_objectList.size();
+	return ret;
+}
 
-		if (tokensPerObject == 0)
-			tokensPerObject = 1;
-		tokens = 0;
+void CRateLimiter::Refill()
+{
+	CMonotonicClock const now = CMonotonicClock::now();
+	int64_t elapsed = now - last_refill_;
+	last_refill_ = now;
 
-		// This list will hold all objects which didn't reach maxTokens
-		std::list<CRateLimiterObject*> unsaturatedObjects;
+	burst_seconds_ = GetBurstSeconds();
 
-		for (auto iter = m_objectList.begin(); iter != m_objectList.end(); ++iter) {
-			if ((*iter)->m_bytesAvailable[i] == -1) {
-				wxASSERT(!(*iter)->m_waiting[i]);
-				(*iter)->m_bytesAvailable[i] = tokensPerObject;
-				unsaturatedObjects.push_back(*iter);
-			}
-			else {
-				(*iter)->m_bytesAvailable[i] += tokensPerObject;
-				if ((*iter)->m_bytesAvailable[i] > maxTokens)
-				{
-					tokens += (*iter)->m_bytesAvailable[i] - maxTokens;
-					(*iter)->m_bytesAvailable[i] = maxTokens;
-				}
-				else
-					unsaturatedObjects.push_back(*iter);
-
-				if ((*iter)->m_waiting[i])
-					m_wakeupList[i].push_back(*iter);
-			}
-		}
+	// Anything beyond the burst tolerance would just overflow the buckets
+	if (elapsed > burst_seconds_ * 1000)
+		elapsed = burst_seconds_ * 1000;
+	else if (elapsed < 0)
+		elapsed = 0;
 
-		// If there are any left-over tokens (in case of objects with a rate below the limit)
-		// assign to the unsaturated sources
-		while (tokens != 0 && !unsaturatedObjects.empty()) {
-			tokensPerObject = tokens / unsaturatedObjects.size();
-			if (tokensPerObject == 0)
-				break;
-			tokens = 0;
-
-			std::list<CRateLimiterObject*> objects;
-			objects.swap(unsaturatedObjects);
-
-			for (auto iter = objects.begin(); iter != objects.end(); ++iter) {
-				(*iter)->m_bytesAvailable[i] += tokensPerObject;
-				if ((*iter)->m_bytesAvailable[i] > maxTokens) {
-					tokens += (*iter)->m_bytesAvailable[i] - maxTokens;
-					(*iter)->m_bytesAvailable[i] = maxTokens;
-				}
-				else
-					unsaturatedObjects.push_back(*iter);
-			}
-		}
+	for (int i = 0; i < 2; ++i)
+		RefillDirection(static_cast<rate_direction>(i), elapsed);
+}
+
+void CRateLimiter::RefillDirection(rate_direction direction, int64_t elapsed)
+{
+	int64_t const limit = GetLimit(direction);
+
+	std::vector<site*> sites;
+	sites.reserve(sites_.size());
+	for (auto & s : sites_)
+		sites.push_back(&s.second);
+
+	if (!limit) {
+		// Unlimited at the top, but sites or objects can still have limits of their own
+		for (auto & s : sites)
+			OfferSite(*s, direction, -1, elapsed, 0);
+		return;
 	}
 
-	WakeupWaitingObjects(lock);
+	Distribute(limit * elapsed / 1000, std::move(sites),
+		[](site const& s) { return s.weight; },
+		[&](site & s, int64_t tokens) { return OfferSite(s, direction, tokens, elapsed, limit); });
+}
 
-	if (m_objectList.empty() || (limits[inbound] == 0 && limits[outbound] == 0)) {
-		if (m_timer) {
-			StopTimer(m_timer);
-			m_timer = 0;
-		}
+int64_t CRateLimiter::OfferSite(site & s, rate_direction direction, int64_t tokens, int64_t elapsed, int64_t bucket_rate)
+{
+	// tokens being -1 means unlimited
+	int64_t accepted = tokens;
+	if (s.limit[direction] > 0) {
+		int64_t const cap = s.limit[direction] * elapsed / 1000;
+		if (accepted == -1 || accepted > cap)
+			accepted = cap;
+		if (!bucket_rate || s.limit[direction] < bucket_rate)
+			bucket_rate = s.limit[direction];
+	}
+
+	if (accepted == -1) {
+		for (auto & object : s.objects)
+			OfferObject(*object, direction, -1, elapsed, 0);
+		return 0;
+	}
+
+	std::vector<CRateLimiterObject*> objects(s.objects.begin(), s.objects.end());
+	int64_t const leftover = Distribute(accepted, std::move(objects),
+		[](CRateLimiterObject const& o) { return o.m_weight; },
+		[&](CRateLimiterObject & o, int64_t t) { return OfferObject(o, direction, t, elapsed, bucket_rate); });
+
+	if (tokens == -1)
+		return 0;
+
+	return tokens - accepted + leftover;
+}
+
+int64_t CRateLimiter::OfferObject(CRateLimiterObject & object, rate_direction direction, int64_t tokens, int64_t elapsed, int64_t bucket_rate)
+{
+	int64_t accepted = tokens;
+	if (object.m_limit[direction] > 0) {
+		int64_t const cap = object.m_limit[direction] * elapsed / 1000;
+		if (accepted == -1 || accepted > cap)
+			accepted = cap;
+		if (!bucket_rate || object.m_limit[direction] < bucket_rate)
+			bucket_rate = object.m_limit[direction];
 	}
+
+	int64_t & available = object.m_bytesAvailable[direction];
+	if (accepted == -1) {
+		available = -1;
+		return 0;
+	}
+
+	if (available == -1)
+		available = 0;
+
+	// The bucket holds up to the burst tolerance worth of the tightest limit above it
+	int64_t const room = std::max(int64_t(0), bucket_rate * burst_seconds_ - available);
+	int64_t const taken = std::min(accepted, room);
+	available += taken;
+
+	if (tokens == -1)
+		return 0;
+
+	return tokens - taken;
+}
+
+void CRateLimiter::OnWait(CRateLimiterObject & object, rate_direction direction)
+{
+	scoped_lock lock(sync_);
+
+	if (object.m_limiter != this)
+		return;
+
+	object.m_waiting[direction] = true;
+	++object.m_stats.waits[direction];
+
+	// Might have been refilled in the meantime
+	if (object.m_bytesAvailable[direction]) {
+		object.m_waiting[direction] = false;
+		lock.unlock();
+		object.OnRateAvailable(direction);
+		return;
+	}
+
+	if (!object.m_inWakeupList[direction]) {
+		object.m_wakeupIter[direction] = m_wakeupList[direction].insert(m_wakeupList[direction].end(), &object);
+		object.m_inWakeupList[direction] = true;
+	}
+
+	ScheduleRefill();
+}
+
+void CRateLimiter::ScheduleRefill()
+{
+	if (refill_pending_)
+		return;
+	refill_pending_ = true;
+
+	int64_t const elapsed = CMonotonicClock::now() - last_refill_;
+	if (elapsed >= minRefillInterval)
+		SendEvent<CRateLimitRefillEvent>();
+	else
+		m_timer = AddTimer(static_cast<int>(minRefillInterval - elapsed), true);
+}
+
+void CRateLimiter::OnRefill()
+{
+	scoped_lock lock(sync_);
+
+	if (m_timer) {
+		StopTimer(m_timer);
+		m_timer = 0;
+	}
+	refill_pending_ = false;
+
+	Refill();
+	WakeupWaitingObjects(lock);
+
+	// Some objects might have gotten less than a single token
+	if (!m_wakeupList[inbound].empty() || !m_wakeupList[outbound].empty())
+		ScheduleRefill();
+}
+
+void CRateLimiter::OnTimer(timer_id)
+{
+	m_timer = 0;
+	OnRefill();
 }
 
 void CRateLimiter::WakeupWaitingObjects(scoped_lock & l)
 {
 	for (int i = 0; i < 2; ++i) {
-		while (!m_wakeupList[i].empty()) {
-			CRateLimiterObject* pObject = m_wakeupList[i].front();
-			m_wakeupList[i].pop_front();
+		auto & list = m_wakeupList[i];
+
+		// Move the objects that still have no tokens to the back, so that
+		// the ones to wake up can be taken from the front.
+		size_t count = list.size();
+		for (auto iter = list.begin(); count; --count) {
+			auto cur = iter++;
+			if (!(*cur)->m_bytesAvailable[i])
+				list.splice(list.end(), list, cur);
+		}
+
+		while (!list.empty()) {
+			CRateLimiterObject* pObject = list.front();
+			if (!pObject->m_bytesAvailable[i])
+				break;
+
+			list.pop_front();
+			pObject->m_inWakeupList[i] = false;
+
 			if (!pObject->m_waiting[i])
 				continue;
-
-			wxASSERT(pObject->m_bytesAvailable != 0);
 			pObject->m_waiting[i] = false;
 
 			l.unlock(); // Do not hold while executing callback
@@ -204,24 +415,19 @@ void CRateLimiter::WakeupWaitingObjects(scoped_lock & l)
 	}
 }
 
-int CRateLimiter::GetBucketSize() const
+int64_t CRateLimiter::GetBurstSeconds() const
 {
 	const int burst_tolerance = options_.GetOptionVal(OPTION_SPEEDLIMIT_BURSTTOLERANCE);
 
-	int bucket_size = 1000 / tickDelay;
 	switch (burst_tolerance)
 	{
 	case 1:
-		bucket_size *= 2;
-		break;
+		return 2;
 	case 2:
-		bucket_size *= 5;
-		break;
+		return 5;
 	default:
-		break;
+		return 1;
 	}
-
-	return bucket_size;
 }
 
 void CRateLimiter::operator()(CEventBase const& ev)
@@ -229,16 +435,15 @@ void CRateLimiter::operator()(CEventBase const& ev)
 	if (Dispatch<CTimerEvent>(ev, this, &CRateLimiter::OnTimer)) {
 		return;
 	}
-	Dispatch<CRateLimitChangedEvent>(ev, this, &CRateLimiter::OnRateChanged);
+	Dispatch<CRateLimitChangedEvent, CRateLimitRefillEvent>(ev, this,
+		&CRateLimiter::OnRateChanged,
+		&CRateLimiter::OnRefill);
 }
 
 void CRateLimiter::OnRateChanged()
 {
-	scoped_lock lock(sync_);
-	if (GetLimit(inbound) > 0 || GetLimit(outbound) > 0) {
-		if (!m_timer)
-			m_timer = AddTimer(tickDelay, false);
-	}
+	// Objects need to learn immediately whether they are limited now
+	OnRefill();
 }
 
 void CRateLimiter::OnOptionsChanged(changed_options_t const&)
@@ -246,6 +451,35 @@ void CRateLimiter::OnOptionsChanged(changed_options_t const&)
 	SendEvent<CRateLimitChangedEvent>();
 }
 
+namespace {
+// The limiter refills the buckets in its own thread, while the objects
+// can be in different ones.
+class object_lock final
+{
+public:
+	object_lock(mutex * m)
+		: m_(m)
+	{
+		if (m_) {
+			m_->lock();
+		}
+	}
+
+	~object_lock()
+	{
+		if (m_) {
+			m_->unlock();
+		}
+	}
+
+	object_lock(object_lock const&) = delete;
+	object_lock& operator=(object_lock const&) = delete;
+
+private:
+	mutex * m_;
+};
+}
+
 CRateLimiterObject::CRateLimiterObject()
 {
 	for (int i = 0; i < 2; ++i) {
@@ -254,8 +488,27 @@ CRateLimiterObject::CRateLimiterObject()
 	}
 }
 
+int64_t CRateLimiterObject::GetAvailableBytes(CRateLimiter::rate_direction direction) const
+{
+	object_lock l(m_limiter ? &m_limiter->sync_ : 0);
+	return m_bytesAvailable[direction];
+}
+
+CRateLimiter::stats CRateLimiterObject::GetStats() const
+{
+	object_lock l(m_limiter ? &m_limiter->sync_ : 0);
+	return m_stats;
+}
+
 void CRateLimiterObject::UpdateUsage(CRateLimiter::rate_direction direction, int usedBytes)
 {
+	object_lock l(m_limiter ? &m_limiter->sync_ : 0);
+
+	m_stats.bytes[direction] += usedBytes;
+
+	if (m_bytesAvailable[direction] == -1)
+		return;
+
 	wxASSERT(usedBytes <= m_bytesAvailable[direction]);
 	if (usedBytes > m_bytesAvailable[direction])
 		m_bytesAvailable[direction] = 0;
@@ -265,11 +518,17 @@ void CRateLimiterObject::UpdateUsage(CRateLimiter::rate_direction direction, int
 
 void CRateLimiterObject::Wait(CRateLimiter::rate_direction direction)
 {
-	wxASSERT(m_bytesAvailable[direction] == 0);
-	m_waiting[direction] = true;
+	if (m_limiter) {
+		m_limiter->OnWait(*this, direction);
+	}
+	else {
+		m_waiting[direction] = true;
+		++m_stats.waits[direction];
+	}
 }
 
 bool CRateLimiterObject::IsWaiting(CRateLimiter::rate_direction direction) const
 {
+	object_lock l(m_limiter ? &m_limiter->sync_ : 0);
 	return m_waiting[direction];
 }
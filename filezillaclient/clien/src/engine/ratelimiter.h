@@ -2,12 +2,28 @@
 #define __RATELIMITER_H__
 
 #include <option_change_event_handler.h>
+#include "timeex.h"
+
+#include <list>
+#include <map>
 
 class COptionsBase;
+class CServer;
 
 class CRateLimiterObject;
 
-// This class implements a simple rate limiter based on the Token Bucket algorithm.
+// This class implements a hierarchical rate limiter based on the Token Bucket algorithm.
+//
+// The global limit from the options is shared among all sites, the share of
+// each site is in turn shared among its objects, typically the connections to
+// that site. On each level the tokens are handed out according to the weights
+// of the children. Tokens a child cannot take, be it because it is slower
+// than its share, its bucket is full or it has a limit of its own, go to its
+// siblings. Sites and objects can optionally have their own limits.
+//
+// Only objects hold tokens. There is no fixed tick, tokens get refilled in
+// proportion to the elapsed time whenever an object runs out of them, but no
+// more often than every few dozen milliseconds.
 class CRateLimiter final : protected CEventHandler, COptionChangeEventHandler
 {
 public:
@@ -20,37 +36,99 @@ public:
 		outbound
 	};
 
-	void AddObject(CRateLimiterObject* pObject);
+	struct stats
+	{
+		// Bytes accounted for through UpdateUsage
+		int64_t bytes[2]{};
+
+		// How often it had to wait for tokens
+		int64_t waits[2]{};
+	};
+
+	// Objects without site are put into a common default site
+	void AddObject(CRateLimiterObject* pObject, wxString const& site = wxString());
 	void RemoveObject(CRateLimiterObject* pObject);
 
-protected:
+	// Weight defaults to 1, limits to 0 meaning no limit of its own
+	void SetObjectLimits(CRateLimiterObject* pObject, int64_t inbound, int64_t outbound, int weight = 1);
+	void SetSiteLimits(wxString const& site, int64_t inbound, int64_t outbound, int weight = 1);
+
+	// Site name as used by the engine for the objects of a given server
+	static wxString GetSiteName(CServer const& server);
+
+	stats GetStats() const;
+	stats GetSiteStats(wxString const& site) const;
+
+	// Global limit in bytes per second, 0 if unlimited
 	int64_t GetLimit(rate_direction direction) const;
 
-	int GetBucketSize() const;
+protected:
+	friend class CRateLimiterObject;
 
-	std::list<CRateLimiterObject*> m_objectList;
-	std::list<CRateLimiterObject*> m_wakeupList[2];
+	struct site final
+	{
+		wxString name;
 
-	timer_id m_timer{};
+		int weight{1};
+		int64_t limit[2]{};
 
-	int64_t m_tokenDebt[2];
+		// Set if SetSiteLimits got called. Otherwise the site gets removed once empty.
+		bool configured{};
 
-	COptionsBase& options_;
+		std::list<CRateLimiterObject*> objects;
+
+		// Of objects that have already been removed
+		stats stats_;
+	};
+
+	int64_t GetBurstSeconds() const;
+
+	// Hands out the tokens accumulated since the last refill
+	void Refill();
+	void RefillDirection(rate_direction direction, int64_t elapsed);
+	int64_t OfferSite(site & s, rate_direction direction, int64_t tokens, int64_t elapsed, int64_t bucket_rate);
+	int64_t OfferObject(CRateLimiterObject & object, rate_direction direction, int64_t tokens, int64_t elapsed, int64_t bucket_rate);
+
+	// Called by objects running out of tokens
+	void OnWait(CRateLimiterObject & object, rate_direction direction);
+	void ScheduleRefill();
 
 	void WakeupWaitingObjects(scoped_lock & l);
 
+	void DetachObject(CRateLimiterObject & object);
+	void RemoveSiteIfUnused(std::map<wxString, site>::iterator it);
+
+	std::map<wxString, site> sites_;
+
+	// Of sites that have already been removed
+	stats removed_stats_;
+
+	int64_t burst_seconds_{1};
+
+	std::list<CRateLimiterObject*> m_wakeupList[2];
+
+	timer_id m_timer{};
+	bool refill_pending_{};
+	CMonotonicClock last_refill_;
+
+	COptionsBase& options_;
+
 	void OnOptionsChanged(changed_options_t const& options);
 
 	void operator()(CEventBase const& ev);
 	void OnTimer(timer_id id);
 	void OnRateChanged();
+	void OnRefill();
 
-	mutex sync_;
+	mutable mutex sync_;
 };
 
 struct ratelimit_changed_event_type{};
 typedef CEvent<ratelimit_changed_event_type> CRateLimitChangedEvent;
 
+struct ratelimit_refill_event_type{};
+typedef CEvent<ratelimit_refill_event_type> CRateLimitRefillEvent;
+
 class CRateLimiterObject
 {
 	friend class CRateLimiter;
@@ -58,19 +136,37 @@ class CRateLimiterObject
 public:
 	CRateLimiterObject();
 	virtual ~CRateLimiterObject() {}
-	int64_t GetAvailableBytes(CRateLimiter::rate_direction direction) const { return m_bytesAvailable[direction]; }
+	int64_t GetAvailableBytes(CRateLimiter::rate_direction direction) const;
 
 	bool IsWaiting(CRateLimiter::rate_direction direction) const;
 
+	CRateLimiter::stats GetStats() const;
+
 protected:
+	// Can also be called if there is no limit, for the statistics
 	void UpdateUsage(CRateLimiter::rate_direction direction, int usedBytes);
 	void Wait(CRateLimiter::rate_direction direction);
 
+	// Called from the thread of the rate limiter's event loop, which need not
+	// be the one of the object.
 	virtual void OnRateAvailable(CRateLimiter::rate_direction) {}
 
 private:
 	bool m_waiting[2];
 	int64_t m_bytesAvailable[2];
+
+	CRateLimiter::stats m_stats;
+
+	// Set by the owner of the object through AddObject and RemoveObject
+	CRateLimiter* m_limiter{};
+
+	// Only touched while holding the mutex of the limiter
+	CRateLimiter::site* m_site{};
+	std::list<CRateLimiterObject*>::iterator m_siteIter;
+	bool m_inWakeupList[2]{};
+	std::list<CRateLimiterObject*>::iterator m_wakeupIter[2];
+	int m_weight{1};
+	int64_t m_limit[2]{};
 };
 
 #endif //__RATELIMITER_H__
@@ -2,6 +2,7 @@
 #include "servercapabilities.h"
 
 std::map<CServer, CCapabilities> CServerCapabilities::m_serverMap;
+mutex CServerCapabilities::m_mutex;
 
 enum capabilities CCapabilities::GetCapability(enum capabilityNames name, wxString* pOption /*=0*/) const
 {
@@ -48,6 +49,8 @@ void CCapabilities::SetCapability(enum capabilityNames name, enum capabilities c
 
 enum capabilities CServerCapabilities::GetCapability(const CServer& server, enum capabilityNames name, wxString* pOption /*=0*/)
 {
+	scoped_lock lock(m_mutex);
+
 	const std::map<CServer, CCapabilities>::const_iterator iter = m_serverMap.find(server);
 	if (iter == m_serverMap.end())
 		return unknown;
@@ -57,6 +60,8 @@ enum capabilities CServerCapabilities::GetCapability(const CServer& server, enum
 
 enum capabilities CServerCapabilities::GetCapability(const CServer& server, enum capabilityNames name, int* pOption)
 {
+	scoped_lock lock(m_mutex);
+
 	const std::map<CServer, CCapabilities>::const_iterator iter = m_serverMap.find(server);
 	if (iter == m_serverMap.end())
 		return unknown;
@@ -66,6 +71,8 @@ enum capabilities CServerCapabilities::GetCapability(const CServer& server, enum
 
 void CServerCapabilities::SetCapability(const CServer& server, enum capabilityNames name, enum capabilities cap, const wxString& option /*=_T("")*/)
 {
+	scoped_lock lock(m_mutex);
+
 	const std::map<CServer, CCapabilities>::iterator iter = m_serverMap.find(server);
 	if (iter == m_serverMap.end())
 	{
@@ -80,6 +87,8 @@ void CServerCapabilities::SetCapability(const CServer& server, enum capabilityNa
 
 void CServerCapabilities::SetCapability(const CServer& server, enum capabilityNames name, enum capabilities cap, int option)
 {
+	scoped_lock lock(m_mutex);
+
 	const std::map<CServer, CCapabilities>::iterator iter = m_serverMap.find(server);
 	if (iter == m_serverMap.end())
 	{
@@ -29,6 +29,7 @@ enum capabilityNames
 	list_hidden_support, // LIST -a command
 	rest_stream, // supports REST+STOR in addition to APPE
 	epsv_command,
+	pipelining, // set to 'no' if the server mishandled commands sent without waiting for the previous reply
 
 	// FTPS and HTTPS
 	tls_resume, // Does the server support resuming of TLS sessions?
@@ -42,7 +43,11 @@ enum capabilityNames
 	timezone_offset,
 
 	auth_tls_command,
-	auth_ssl_command
+	auth_ssl_command,
+
+	// Format of the lines of the last directory listings, as number. Only a
+	// hint for the directory listing parser which format to try first.
+	listing_format
 };
 
 class CCapabilities final
@@ -74,7 +79,9 @@ public:
 	static void SetCapability(const CServer& server, enum capabilityNames name, enum capabilities cap, int option);
 
 protected:
+	// Accessed by all engines
 	static std::map<CServer, CCapabilities> m_serverMap;
+	static mutex m_mutex;
 };
 
 #endif //__SERVERCAPABILITIES_H__
@@ -0,0 +1,235 @@
+#include <filezilla.h>
+#include "sftp_shm.h"
+
+#include <wx/utils.h>
+
+#include <atomic>
+
+#ifndef __WXMSW__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+int64_t const shm_version = 1;
+
+struct shared_block
+{
+	std::atomic<int64_t> version;
+
+	// Written by the engine
+	std::atomic<int64_t> granted[2];
+	std::atomic<int64_t> unlimited[2];
+	std::atomic<int64_t> limit[2];
+
+	// Set by fzsftp when it wants more quota, cleared by the engine once granted
+	std::atomic<int64_t> requested[2];
+
+	// Progress fzsftp has accumulated and whether it has told us about it
+	std::atomic<int64_t> transferred;
+	std::atomic<int64_t> progress_pending;
+};
+
+static_assert(sizeof(shared_block) == 11 * sizeof(int64_t), "Layout of shared_block has to match the one used by fzsftp");
+
+std::atomic<int> shm_counter{};
+
+wxString MakeName()
+{
+#ifdef __WXMSW__
+	wxString const prefix = _T("Local\\fzsftp-");
+#else
+	wxString const prefix = _T("/fzsftp-");
+#endif
+	return prefix + wxString::Format(_T("%lu-%d"), wxGetProcessId(), ++shm_counter);
+}
+}
+
+#ifdef __WXMSW__
+
+class CSftpSharedMemory::Impl
+{
+public:
+	Impl() = default;
+	~Impl()
+	{
+		if (block_) {
+			UnmapViewOfFile(block_);
+		}
+		if (mapping_) {
+			CloseHandle(mapping_);
+		}
+	}
+
+	Impl(Impl const&) = delete;
+	Impl& operator=(Impl const&) = delete;
+
+	bool Create()
+	{
+		name_ = MakeName();
+
+		// Pagefile-backed, so the contents start out zeroed
+		mapping_ = CreateFileMapping(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, 0, sizeof(shared_block), name_.wc_str());
+		if (!mapping_) {
+			return false;
+		}
+		if (GetLastError() == ERROR_ALREADY_EXISTS) {
+			CloseHandle(mapping_);
+			mapping_ = 0;
+			return false;
+		}
+
+		void* p = MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(shared_block));
+		if (!p) {
+			CloseHandle(mapping_);
+			mapping_ = 0;
+			return false;
+		}
+		block_ = static_cast<shared_block*>(p);
+
+		return true;
+	}
+
+	void Unlink()
+	{
+		// Nothing to do, the name goes away with the last handle
+	}
+
+	shared_block* block_{};
+	wxString name_;
+
+private:
+	HANDLE mapping_{};
+};
+
+#else
+
+class CSftpSharedMemory::Impl
+{
+public:
+	Impl() = default;
+	~Impl()
+	{
+		if (block_) {
+			munmap(block_, sizeof(shared_block));
+		}
+		Unlink();
+	}
+
+	Impl(Impl const&) = delete;
+	Impl& operator=(Impl const&) = delete;
+
+	bool Create()
+	{
+		name_ = MakeName();
+
+		int fd = shm_open(name_.mb_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1) {
+			return false;
+		}
+		linked_ = true;
+
+		// A freshly extended object reads as zeroes
+		void* p = MAP_FAILED;
+		if (ftruncate(fd, sizeof(shared_block)) != -1) {
+			p = mmap(0, sizeof(shared_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+
+		if (p == MAP_FAILED) {
+			Unlink();
+			return false;
+		}
+		block_ = static_cast<shared_block*>(p);
+
+		return true;
+	}
+
+	void Unlink()
+	{
+		if (linked_) {
+			shm_unlink(name_.mb_str());
+			linked_ = false;
+		}
+	}
+
+	shared_block* block_{};
+	wxString name_;
+
+private:
+	bool linked_{};
+};
+
+#endif
+
+
+CSftpSharedMemory::CSftpSharedMemory()
+	: impl_(make_unique<Impl>())
+{
+}
+
+CSftpSharedMemory::~CSftpSharedMemory()
+{
+	impl_.reset();
+}
+
+bool CSftpSharedMemory::Create()
+{
+	if (!impl_->Create()) {
+		return false;
+	}
+
+	impl_->block_->version = shm_version;
+	return true;
+}
+
+wxString CSftpSharedMemory::GetName() const
+{
+	return impl_->name_;
+}
+
+void CSftpSharedMemory::Unlink()
+{
+	impl_->Unlink();
+}
+
+void CSftpSharedMemory::Grant(CRateLimiter::rate_direction direction, int64_t bytes, int limit)
+{
+	shared_block* block = impl_->block_;
+	if (!block) {
+		return;
+	}
+
+	block->limit[direction] = limit;
+	block->granted[direction] += bytes;
+	block->unlimited[direction] = 0;
+
+	// Only now, so that fzsftp sees the grant before it may ask for more
+	block->requested[direction] = 0;
+}
+
+void CSftpSharedMemory::SetUnlimited(CRateLimiter::rate_direction direction)
+{
+	shared_block* block = impl_->block_;
+	if (!block) {
+		return;
+	}
+
+	block->limit[direction] = -1;
+	block->unlimited[direction] = 1;
+	block->requested[direction] = 0;
+}
+
+int64_t CSftpSharedMemory::TakeTransferred()
+{
+	shared_block* block = impl_->block_;
+	if (!block) {
+		return 0;
+	}
+
+	// Clear the flag first. Whatever fzsftp adds afterwards either gets taken
+	// below or comes with another notification.
+	block->progress_pending = 0;
+	return block->transferred.exchange(0);
+}
@@ -0,0 +1,46 @@
+#ifndef FILEZILLA_ENGINE_SFTP_SHM_HEADER
+#define FILEZILLA_ENGINE_SFTP_SHM_HEADER
+
+/*
+The CSftpSharedMemory class manages a block of memory shared with fzsftp.
+
+Through it fzsftp draws rate limiter quota and reports transfer progress
+without having to wait for a reply on the text protocol. Its layout must
+match the one in src/putty/fzsftp.c.
+
+All members but Create may be called from any thread.
+*/
+
+#include "ratelimiter.h"
+
+#include <memory>
+
+class CSftpSharedMemory final
+{
+public:
+	CSftpSharedMemory();
+	~CSftpSharedMemory();
+
+	CSftpSharedMemory(CSftpSharedMemory const&) = delete;
+	CSftpSharedMemory& operator=(CSftpSharedMemory const&) = delete;
+
+	bool Create();
+
+	// Name to pass to fzsftp's shm command
+	wxString GetName() const;
+
+	// Removes the name once fzsftp has attached, the memory stays valid.
+	void Unlink();
+
+	void Grant(CRateLimiter::rate_direction direction, int64_t bytes, int limit);
+	void SetUnlimited(CRateLimiter::rate_direction direction);
+
+	// Returns the progress reported since the previous call
+	int64_t TakeTransferred();
+
+private:
+	class Impl;
+	std::unique_ptr<Impl> impl_;
+};
+
+#endif
@@ -10,13 +10,15 @@
 #include "proxy.h"
 #include "servercapabilities.h"
 #include "sftpcontrolsocket.h"
+#include "sftp_shm.h"
 
 #include <wx/filename.h>
 #include <wx/log.h>
 #include <wx/tokenzr.h>
 #include <wx/txtstrm.h>
 
-#define FZSFTP_PROTOCOL_VERSION 2
+// Bump together with the copy in putty/fzprintf.h
+#define FZSFTP_PROTOCOL_VERSION 4
 
 struct sftp_event_type;
 typedef CEvent<sftp_event_type> CSftpEvent;
@@ -24,6 +26,9 @@ typedef CEvent<sftp_event_type> CSftpEvent;
 struct terminate_event_type;
 typedef CEvent<terminate_event_type> CTerminateEvent;
 
+struct sftp_rate_available_event_type;
+typedef CEvent<sftp_rate_available_event_type, CRateLimiter::rate_direction> CSftpRateAvailableEvent;
+
 class CSftpFileTransferOpData : public CFileTransferOpData
 {
 public:
@@ -57,9 +62,9 @@ struct sftp_message
 class CSftpInputThread final : public wxThread
 {
 public:
-	CSftpInputThread(CSftpControlSocket* pOwner, CProcess& process)
+	CSftpInputThread(CSftpControlSocket* pOwner, CProcess& process, CSftpSharedMemory* shm)
 		: wxThread(wxTHREAD_JOINABLE), process_(process),
-		  m_pOwner(pOwner)
+		  m_pOwner(pOwner), shm_(shm)
 	{
 	}
 
@@ -263,6 +268,11 @@ protected:
 						delete message;
 						goto loopexit;
 					}
+					if (shm_) {
+						// With shared memory the line is just a wakeup
+						int64_t const transferred = shm_->TakeTransferred();
+						message->value += transferred > INT_MAX ? INT_MAX : static_cast<int>(transferred);
+					}
 					if (!message->value)
 						delete message;
 					else
@@ -292,6 +302,7 @@ loopexit:
 
 	CProcess& process_;
 	CSftpControlSocket* m_pOwner;
+	CSftpSharedMemory* shm_;
 
 	std::list<sftp_message*> m_sftpMessages;
 	mutex m_sync;
@@ -320,8 +331,47 @@ public:
 
 	// Set to true if deletion of at least one file failed
 	bool m_deleteFailed;
+
+	// Files passed to fzsftp, in order. fzsftp reports the result of each
+	// file separately, replies belong to the front.
+	std::deque<wxString> sent;
+
+	// Deleted files not yet removed from the directory cache. They get
+	// applied in one go right before the listing notification.
+	std::vector<wxString> deleted;
+	int deletedCount{};
 };
 
+class CSftpChmodOpData : public COpData
+{
+public:
+	CSftpChmodOpData(const CChmodCommand& command)
+		: COpData(Command::chmod), m_cmd(command)
+	{
+		m_useAbsolute = false;
+	}
+
+	virtual ~CSftpChmodOpData() {}
+
+	CChmodCommand m_cmd;
+	bool m_useAbsolute;
+
+	// Batches: Index of the next file to pass to fzsftp and the number of
+	// files still awaiting their result
+	size_t next{};
+	int outstanding{};
+
+	// Set to true if changing the permissions of at least one file failed
+	bool failed{};
+};
+
+namespace {
+// Limits for the number of files awaiting their result and the length of a
+// single batch command such as mrm or mchmod
+int const batchFiles = 64;
+size_t const batchLength = 16384;
+}
+
 CSftpControlSocket::CSftpControlSocket(CFileZillaEnginePrivate & engine)
 	: CControlSocket(engine)
 {
@@ -337,6 +387,8 @@ CSftpControlSocket::~CSftpControlSocket()
 enum connectStates
 {
 	connect_init,
+	connect_shm,
+	connect_window,
 	connect_proxy,
 	connect_keys,
 	connect_open
@@ -403,7 +455,14 @@ int CSftpControlSocket::Connect(const CServer &server)
 
 	m_pProcess = new CProcess();
 
-	engine_.GetRateLimiter().AddObject(this);
+	m_pSharedMemory = new CSftpSharedMemory();
+	if (!m_pSharedMemory->Create()) {
+		LogMessage(MessageType::Debug_Warning, _T("Could not create shared memory block: %s"), wxSysErrorMsg());
+		delete m_pSharedMemory;
+		m_pSharedMemory = 0;
+	}
+
+	engine_.GetRateLimiter().AddObject(this, CRateLimiter::GetSiteName(server));
 
 	wxString executable = engine_.GetOptions().GetOption(OPTION_FZSFTP_EXECUTABLE);
 	if (executable.empty())
@@ -416,7 +475,7 @@ int CSftpControlSocket::Connect(const CServer &server)
 		return FZ_REPLY_ERROR;
 	}
 
-	m_pInputThread = new CSftpInputThread(this, *m_pProcess);
+	m_pInputThread = new CSftpInputThread(this, *m_pProcess, m_pSharedMemory);
 	if (!m_pInputThread->Init()) {
 		LogMessage(MessageType::Debug_Warning, _T("Thread creation failed"));
 		delete m_pInputThread;
@@ -432,6 +491,19 @@ int CSftpControlSocket::ConnectParseResponse(bool successful, const wxString& re
 {
 	LogMessage(MessageType::Debug_Verbose, _T("CSftpControlSocket::ConnectParseResponse(%s)"), reply);
 
+	if (m_pCurOpData && m_pCurOpData->opId == Command::connect && m_pCurOpData->opState == connect_shm) {
+		// Not fatal, quota and progress then go through the text protocol
+		if (successful) {
+			m_sharedMemoryAttached = true;
+		}
+		else {
+			LogMessage(MessageType::Debug_Warning, _T("fzsftp could not attach to the shared memory block"));
+		}
+		m_pSharedMemory->Unlink();
+		m_pCurOpData->opState = connect_window;
+		return SendNextCommand();
+	}
+
 	if (!successful) {
 		DoClose(FZ_REPLY_ERROR);
 		return FZ_REPLY_ERROR;
@@ -459,6 +531,9 @@ int CSftpControlSocket::ConnectParseResponse(bool successful, const wxString& re
 			DoClose(FZ_REPLY_INTERNALERROR);
 			return FZ_REPLY_ERROR;
 		}
+		pData->opState = m_pSharedMemory ? connect_shm : connect_window;
+		break;
+	case connect_window:
 		if (engine_.GetOptions().GetOptionVal(OPTION_PROXY_TYPE) && !m_pCurrentServer->GetBypassProxy())
 			pData->opState = connect_proxy;
 		else if (pData->pKeyFiles)
@@ -511,6 +586,12 @@ int CSftpControlSocket::ConnectSend()
 	bool res;
 	switch (pData->opState)
 	{
+	case connect_shm:
+		res = SendCommand(_T("shm \"") + m_pSharedMemory->GetName() + _T("\""));
+		break;
+	case connect_window:
+		res = SendCommand(wxString::Format(_T("xferwindow %d"), engine_.GetOptions().GetOptionVal(OPTION_SFTP_MAX_WINDOW) * 1024 * 1024));
+		break;
 	case connect_proxy:
 		{
 			int type;
@@ -602,6 +683,11 @@ void CSftpControlSocket::OnSftpEvent()
 			break;
 		case sftpEvent::Done:
 			{
+				if (m_skipReplies > 0) {
+					--m_skipReplies;
+					LogMessage(MessageType::Debug_Verbose, _T("Skipping result of ended batch, %d left"), m_skipReplies);
+					break;
+				}
 				ProcessReply(message->text == _T("1"));
 				break;
 			}
@@ -1480,11 +1566,20 @@ int CSftpControlSocket::ResetOperation(int nErrorCode)
 		if (pData->criticalFailure)
 			nErrorCode |= FZ_REPLY_CRITICALERROR;
 	}
-	if (m_pCurOpData && m_pCurOpData->opId == Command::del && !(nErrorCode & FZ_REPLY_DISCONNECTED))
+	if (m_pCurOpData && m_pCurOpData->opId == Command::del)
 	{
 		CSftpDeleteOpData *pData = static_cast<CSftpDeleteOpData *>(m_pCurOpData);
-		if (pData->m_needSendListing)
+		engine_.GetDirectoryCache().RemoveFiles(*m_pCurrentServer, pData->path, pData->deleted);
+		if (pData->deletedCount > 1)
+			LogMessage(MessageType::Status, wxPLURAL("Deleted %d file", "Deleted %d files", pData->deletedCount), pData->deletedCount);
+		if (pData->m_needSendListing && !(nErrorCode & FZ_REPLY_DISCONNECTED))
 			engine_.SendDirectoryListingNotification(pData->path, false, true, false);
+		m_skipReplies += static_cast<int>(pData->sent.size());
+	}
+	if (m_pCurOpData && m_pCurOpData->opId == Command::chmod)
+	{
+		CSftpChmodOpData *pData = static_cast<CSftpChmodOpData *>(m_pCurOpData);
+		m_skipReplies += pData->outstanding;
 	}
 
 	return CControlSocket::ResetOperation(nErrorCode);
@@ -1921,7 +2016,16 @@ int CSftpControlSocket::DoClose(int nErrorCode /*=FZ_REPLY_DISCONNECTED*/)
 		delete m_pProcess;
 		m_pProcess = 0;
 	}
-	return CControlSocket::DoClose(nErrorCode);
+	delete m_pSharedMemory;
+	m_pSharedMemory = 0;
+	m_sharedMemoryAttached = false;
+
+	int const res = CControlSocket::DoClose(nErrorCode);
+
+	// A new fzsftp process has no results left over
+	m_skipReplies = 0;
+
+	return res;
 }
 
 void CSftpControlSocket::Cancel()
@@ -2159,17 +2263,28 @@ int CSftpControlSocket::DeleteParseResponse(bool successful, const wxString&)
 
 	CSftpDeleteOpData *pData = static_cast<CSftpDeleteOpData *>(m_pCurOpData);
 
+	if (pData->sent.empty())
+	{
+		LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Info, _T("Reply without outstanding file"));
+		ResetOperation(FZ_REPLY_INTERNALERROR);
+		return FZ_REPLY_ERROR;
+	}
+
+	wxString const file = pData->sent.front();
+	pData->sent.pop_front();
+
 	if (!successful)
 		pData->m_deleteFailed = true;
 	else
 	{
-		const wxString& file = pData->files.front();
-
-		engine_.GetDirectoryCache().RemoveFile(*m_pCurrentServer, pData->path, file);
+		pData->deleted.push_back(file);
+		++pData->deletedCount;
 
 		wxDateTime now = wxDateTime::UNow();
 		if (now.IsValid() && pData->m_time.IsValid() && (now - pData->m_time).GetSeconds() >= 1)
 		{
+			engine_.GetDirectoryCache().RemoveFiles(*m_pCurrentServer, pData->path, pData->deleted);
+			pData->deleted.clear();
 			engine_.SendDirectoryListingNotification(pData->path, false, true, false);
 			pData->m_time = now;
 			pData->m_needSendListing = false;
@@ -2178,10 +2293,15 @@ int CSftpControlSocket::DeleteParseResponse(bool successful, const wxString&)
 			pData->m_needSendListing = true;
 	}
 
-	pData->files.pop_front();
-
-	if (!pData->files.empty())
+	// Queue the next batch before the current one is done so that fzsftp
+	// does not run out of work.
+	if (!pData->files.empty() && static_cast<int>(pData->sent.size()) <= batchFiles / 2)
 		return SendNextCommand();
+	if (!pData->sent.empty())
+	{
+		SetAlive();
+		return FZ_REPLY_WOULDBLOCK;
+	}
 
 	return ResetOperation(pData->m_deleteFailed ? FZ_REPLY_ERROR : FZ_REPLY_OK);
 }
@@ -2198,27 +2318,47 @@ int CSftpControlSocket::DeleteSend()
 	}
 	CSftpDeleteOpData *pData = static_cast<CSftpDeleteOpData *>(m_pCurOpData);
 
-	const wxString& file = pData->files.front();
-	if (file.empty())
+	if (pData->path.GetPath().empty())
 	{
-		LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Info, _T("Empty filename"));
-		ResetOperation(FZ_REPLY_INTERNALERROR);
+		LogMessage(MessageType::Error, _("Filename cannot be constructed for directory %s and filename %s"), pData->path.GetPath(), pData->files.front());
 		return FZ_REPLY_ERROR;
 	}
 
-	wxString filename = pData->path.FormatFilename(file);
-	if (filename.empty())
+	if (!pData->m_time.IsValid())
+		pData->m_time = wxDateTime::UNow();
+
+	// All files of a batch go into a single mrm command, fzsftp then keeps
+	// several removal requests in flight.
+	wxString cmd = _T("mrm ") + QuoteFilename(pData->path.GetPath());
+	std::list<wxString> batch;
+	int count = static_cast<int>(pData->sent.size());
+	while (!pData->files.empty() && count < batchFiles)
 	{
-		LogMessage(MessageType::Error, _("Filename cannot be constructed for directory %s and filename %s"), pData->path.GetPath(), file);
-		return FZ_REPLY_ERROR;
-	}
+		wxString const& file = pData->files.front();
+		if (file.empty())
+		{
+			LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Info, _T("Empty filename"));
+			ResetOperation(FZ_REPLY_INTERNALERROR);
+			return FZ_REPLY_ERROR;
+		}
 
-	engine_.GetDirectoryCache().InvalidateFile(*m_pCurrentServer, pData->path, file);
+		wxString const quoted = QuoteFilename(file);
+		if (!batch.empty() && cmd.size() + quoted.size() >= batchLength)
+			break;
+
+		engine_.GetDirectoryCache().InvalidateFile(*m_pCurrentServer, pData->path, file);
+
+		cmd += _T(" ") + quoted;
+		batch.splice(batch.end(), pData->files, pData->files.begin());
+		++count;
+	}
 
-	if (!SendCommand(_T("rm ") + WildcardEscape(QuoteFilename(filename)),
-			  _T("rm ") + QuoteFilename(filename)))
+	if (!SendCommand(cmd))
 		return FZ_REPLY_ERROR;
 
+	// Only now fzsftp owes us a result for each of them
+	pData->sent.insert(pData->sent.end(), batch.begin(), batch.end());
+
 	return FZ_REPLY_WOULDBLOCK;
 }
 
@@ -2299,25 +2439,11 @@ int CSftpControlSocket::RemoveDirParseResponse(bool successful, const wxString&)
 	return ResetOperation(FZ_REPLY_OK);
 }
 
-class CSftpChmodOpData : public COpData
-{
-public:
-	CSftpChmodOpData(const CChmodCommand& command)
-		: COpData(Command::chmod), m_cmd(command)
-	{
-		m_useAbsolute = false;
-	}
-
-	virtual ~CSftpChmodOpData() {}
-
-	CChmodCommand m_cmd;
-	bool m_useAbsolute;
-};
-
 enum chmodStates
 {
 	chmod_init = 0,
-	chmod_chmod
+	chmod_chmod,
+	chmod_batch
 };
 
 int CSftpControlSocket::Chmod(const CChmodCommand& command)
@@ -2329,6 +2455,20 @@ int CSftpControlSocket::Chmod(const CChmodCommand& command)
 		return FZ_REPLY_ERROR;
 	}
 
+	size_t const count = command.GetFiles().size();
+	if (count > 1)
+	{
+		// fzsftp works on absolute paths for batches, no need to change
+		// the directory first.
+		LogMessage(MessageType::Status, wxPLURAL("Set permissions of %d file in '%s'", "Set permissions of %d files in '%s'", count), static_cast<int>(count), command.GetPath().GetPath());
+
+		CSftpChmodOpData *pData = new CSftpChmodOpData(command);
+		pData->opState = chmod_batch;
+		m_pCurOpData = pData;
+
+		return SendNextCommand();
+	}
+
 	LogMessage(MessageType::Status, _("Set permissions of '%s' to '%s'"), command.GetPath().FormatFilename(command.GetFile()), command.GetPermission());
 
 	CSftpChmodOpData *pData = new CSftpChmodOpData(command);
@@ -2352,6 +2492,31 @@ int CSftpControlSocket::ChmodParseResponse(bool successful, const wxString&)
 		return FZ_REPLY_ERROR;
 	}
 
+	if (pData->opState == chmod_batch)
+	{
+		// One result per file, in the order they have been sent
+		if (pData->outstanding <= 0)
+		{
+			LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Info, _T("Reply without outstanding file"));
+			ResetOperation(FZ_REPLY_INTERNALERROR);
+			return FZ_REPLY_ERROR;
+		}
+		--pData->outstanding;
+
+		if (!successful)
+			pData->failed = true;
+
+		if (pData->next < pData->m_cmd.GetFiles().size() && pData->outstanding <= batchFiles / 2)
+			return SendNextCommand();
+		if (pData->outstanding)
+		{
+			SetAlive();
+			return FZ_REPLY_WOULDBLOCK;
+		}
+
+		successful = !pData->failed;
+	}
+
 	if (!successful)
 	{
 		ResetOperation(FZ_REPLY_ERROR);
@@ -2405,6 +2570,32 @@ int CSftpControlSocket::ChmodSend()
 					   _T("chmod ") + pData->m_cmd.GetPermission() + _T(" ") + quotedFilename);
 		}
 		break;
+	case chmod_batch:
+		{
+			// Pairs of permission and filename, fzsftp keeps several
+			// requests in flight and reports each file separately.
+			auto const& files = pData->m_cmd.GetFiles();
+			wxString cmd = _T("mchmod ") + QuoteFilename(pData->m_cmd.GetPath().GetPath());
+			int count = 0;
+			while (pData->next < files.size() && pData->outstanding + count < batchFiles)
+			{
+				auto const& file = files[pData->next];
+				wxString const arg = QuoteFilename(file.second) + _T(" ") + QuoteFilename(file.first);
+				if (count && cmd.size() + arg.size() >= batchLength)
+					break;
+
+				engine_.GetDirectoryCache().UpdateFile(*m_pCurrentServer, pData->m_cmd.GetPath(), file.first, false, CDirectoryCache::unknown);
+
+				cmd += _T(" ") + arg;
+				++pData->next;
+				++count;
+			}
+
+			res = SendCommand(cmd);
+			if (res)
+				pData->outstanding += count;
+		}
+		break;
 	default:
 		LogMessage(__TFILE__, __LINE__, this, MessageType::Debug_Warning, _T("unknown op state: %d"), pData->opState);
 		ResetOperation(FZ_REPLY_INTERNALERROR);
@@ -2596,7 +2787,8 @@ wxString CSftpControlSocket::WildcardEscape(const wxString& file)
 
 void CSftpControlSocket::OnRateAvailable(CRateLimiter::rate_direction direction)
 {
-	OnQuotaRequest(direction);
+	// The rate limiter can be running in a different thread
+	SendEvent<CSftpRateAvailableEvent>(direction);
 }
 
 void CSftpControlSocket::OnQuotaRequest(CRateLimiter::rate_direction direction)
@@ -2608,13 +2800,21 @@ void CSftpControlSocket::OnQuotaRequest(CRateLimiter::rate_direction direction)
 			b = INT_MAX;
 		else
 			b = bytes;
-		AddToStream(wxString::Format(_T("-%d%d,%d\n"), (int)direction, b, engine_.GetOptions().GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + static_cast<int>(direction))));
+		int const limit = engine_.GetOptions().GetOptionVal(OPTION_SPEEDLIMIT_INBOUND + static_cast<int>(direction));
+		if (m_sharedMemoryAttached)
+			m_pSharedMemory->Grant(direction, b, limit);
+		else
+			AddToStream(wxString::Format(_T("-%d%d,%d\n"), (int)direction, b, limit));
 		UpdateUsage(direction, b);
 	}
 	else if (bytes == 0)
 		Wait(direction);
-	else if (bytes < 0)
-		AddToStream(wxString::Format(_T("-%d-\n"), (int)direction));
+	else if (bytes < 0) {
+		if (m_sharedMemoryAttached)
+			m_pSharedMemory->SetUnlimited(direction);
+		else
+			AddToStream(wxString::Format(_T("-%d-\n"), (int)direction));
+	}
 }
 
 
@@ -2675,9 +2875,10 @@ int CSftpControlSocket::ListCheckTimezoneDetection()
 
 void CSftpControlSocket::operator()(CEventBase const& ev)
 {
-	if (Dispatch<CSftpEvent, CTerminateEvent>(ev, this,
+	if (Dispatch<CSftpEvent, CTerminateEvent, CSftpRateAvailableEvent>(ev, this,
 		&CSftpControlSocket::OnSftpEvent,
-		&CSftpControlSocket::OnTerminate)) {
+		&CSftpControlSocket::OnTerminate,
+		&CSftpControlSocket::OnQuotaRequest)) {
 		return;
 	}
 
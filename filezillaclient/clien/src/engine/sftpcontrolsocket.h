@@ -42,6 +42,7 @@ enum sftpRequestTypes
 
 class CProcess;
 class CSftpInputThread;
+class CSftpSharedMemory;
 
 class CSftpControlSocket final : public CControlSocket, public CRateLimiterObject
 {
@@ -125,6 +126,15 @@ protected:
 	CProcess* m_pProcess{};
 	CSftpInputThread* m_pInputThread{};
 
+	// Quota and transfer progress go through it once fzsftp has attached
+	CSftpSharedMemory* m_pSharedMemory{};
+	bool m_sharedMemoryAttached{};
+
+	// Results still to come for batch commands of operations that have
+	// ended early. fzsftp reports them anyway, they must not be taken as
+	// replies to the next command.
+	int m_skipReplies{};
+
 	virtual void operator()(CEventBase const& ev);
 	void OnSftpEvent();
 	void OnTerminate();
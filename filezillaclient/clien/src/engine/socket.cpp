@@ -31,6 +31,20 @@
   #endif
 #endif
 
+// On Linux, all sockets share a single epoll based reactor thread.
+// Elsewhere each socket has its own thread waiting for events.
+#if defined(__linux__) && !defined(__WXMSW__)
+  #define FZ_USE_EPOLL 1
+  #include <poll.h>
+  #include <signal.h>
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <sys/sendfile.h>
+  #include <unordered_map>
+#else
+  #define FZ_USE_EPOLL 0
+#endif
+
 // Fixups needed on FreeBSD
 #if !defined(EAI_ADDRFAMILY) && defined(EAI_FAMILY)
   #define EAI_ADDRFAMILY EAI_FAMILY
@@ -54,7 +68,9 @@ union sockaddr_u
 #define WAIT_EVENTCOUNT 5
 
 class CSocketThread;
+#if !FZ_USE_EPOLL
 static std::list<CSocketThread*> waiting_socket_threads;
+#endif
 
 struct socket_event_type;
 typedef CEvent<socket_event_type> CInternalSocketEvent;
@@ -186,6 +202,695 @@ public:
 #endif
 }
 
+#if FZ_USE_EPOLL
+class CSocketResolver;
+
+// A single thread waits for events on all sockets using epoll.
+//
+// Interest in events is registered one-shot: Once an event for a descriptor
+// has been delivered, the descriptor needs to be re-armed by the socket.
+// Events get delivered to the sockets with their mutex held.
+//
+// Events carry the id of the socket, not a pointer to it. Events fetched
+// while a socket gets removed are dropped when looking up the id, ids are
+// never reused.
+//
+// Locking order: m_sync, then the mutex of the socket, then m_resolver_sync.
+class CSocketReactor final : protected wxThread
+{
+public:
+	// Each socket using the reactor must acquire and release it
+	static CSocketReactor& Acquire();
+	void Release(CSocketThread* pSocketThread);
+
+	// Assigns the socket its id
+	void Register(CSocketThread* pSocketThread);
+
+	// Joins finished name resolution threads. If force is set, waits for all
+	// of them and destroys the reactor if it is no longer in use.
+	static void Cleanup(bool force);
+
+	int Arm(CSocketThread* pSocketThread, int fd, int wait, bool add);
+	void Disarm(int fd);
+
+	bool AddResolver(CSocketResolver* pResolver);
+	void OnResolved(CSocketResolver* pResolver, int res, addrinfo* addressList);
+
+private:
+	CSocketReactor();
+	virtual ~CSocketReactor();
+
+	// After this returns, no further events are delivered to the socket
+	void Remove(CSocketThread* pSocketThread);
+
+	void JoinResolvers(bool force);
+
+	virtual ExitCode Entry();
+
+	int m_epoll_fd{-1};
+
+	// Only used to stop the reactor thread
+	int m_wakeup_fd{-1};
+
+	bool m_running{};
+	bool m_quit{};
+
+	mutex m_sync;
+
+	static int const max_events = 64;
+
+	// Registered sockets by id, 0 is the wakeup descriptor
+	std::unordered_map<uint64_t, CSocketThread*> m_sockets;
+	uint64_t m_next_id{};
+
+	// Guarded by reactor_instance_sync
+	int m_socket_count{};
+
+	mutex m_resolver_sync;
+	std::list<CSocketResolver*> m_resolvers;
+};
+
+// Name resolution is blocking, each connection attempt uses a short-lived
+// thread for it.
+class CSocketResolver final : protected wxThread
+{
+	friend class CSocketReactor;
+public:
+	CSocketResolver(CSocketReactor& reactor, CSocketThread* pOwner, unsigned int serial, char* pHost, char* pPort, int family)
+		: wxThread(wxTHREAD_JOINABLE)
+		, m_reactor(reactor)
+		, m_pOwner(pOwner)
+		, m_serial(serial)
+		, m_pHost(pHost)
+		, m_pPort(pPort)
+		, m_family(family)
+	{
+	}
+
+	virtual ~CSocketResolver()
+	{
+		delete [] m_pHost;
+		delete [] m_pPort;
+	}
+
+protected:
+	virtual ExitCode Entry()
+	{
+		struct addrinfo hints = {0};
+		hints.ai_family = m_family;
+		hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_IDN
+		hints.ai_flags |= AI_IDN;
+#endif
+
+		struct addrinfo *addressList = 0;
+		int res = getaddrinfo(m_pHost, m_pPort, &hints, &addressList);
+		if (res) {
+			addressList = 0;
+		}
+
+		m_reactor.OnResolved(this, res, addressList);
+
+		return 0;
+	}
+
+	CSocketReactor& m_reactor;
+
+	// Guarded by the reactor's m_sync, reset if the socket goes away
+	CSocketThread* m_pOwner;
+
+	// Identifies the connection attempt
+	unsigned int const m_serial;
+
+	char* const m_pHost;
+	char* const m_pPort;
+	int const m_family;
+
+	// Guarded by the reactor's m_resolver_sync
+	bool m_finished{};
+};
+
+// Per-socket state. Does not own a thread, waiting for events is done by the
+// shared CSocketReactor.
+class CSocketThread final
+{
+	friend class CSocket;
+	friend class CSocketReactor;
+public:
+	CSocketThread()
+		: m_sync(false)
+		, m_reactor(CSocketReactor::Acquire())
+	{
+		for (int i = 0; i < WAIT_EVENTCOUNT; ++i) {
+			m_triggered_errors[i] = 0;
+		}
+		m_reactor.Register(this);
+	}
+
+	~CSocketThread()
+	{
+		FreeAddressList();
+	}
+
+	void SetSocket(CSocket* pSocket)
+	{
+		scoped_lock l(m_sync);
+		SetSocket(pSocket, l);
+	}
+
+	void SetSocket(CSocket* pSocket, scoped_lock const&)
+	{
+		m_pSocket = pSocket;
+
+		ResetConnect();
+
+		m_waiting = 0;
+	}
+
+	// Starts name resolution. Once done, connection attempts continue
+	// asynchronously.
+	int Connect(scoped_lock &)
+	{
+		wxASSERT(m_pSocket);
+
+		ResetConnect();
+
+		const wxWX2MBbuf buf = m_pSocket->m_host.mb_str();
+		if (!buf) {
+			return EINVAL;
+		}
+		char* pHost = new char[strlen(buf) + 1];
+		strcpy(pHost, buf);
+
+		// Connect method of CSocket ensures port is in range
+		char* pPort = new char[6];
+		sprintf(pPort, "%u", m_pSocket->m_port);
+		pPort[5] = 0;
+
+		if (!m_reactor.AddResolver(new CSocketResolver(m_reactor, this, m_serial, pHost, pPort, m_pSocket->m_family))) {
+			return 1;
+		}
+
+		return 0;
+	}
+
+	int Start()
+	{
+		scoped_lock l(m_sync);
+		return Arm(l);
+	}
+
+	// Needs to be called after adding to m_waiting. Re-arms the descriptor
+	// with the reactor, there is no thread to wake up.
+	void WakeupThread(scoped_lock & l)
+	{
+		Arm(l);
+	}
+
+protected:
+	int Arm(scoped_lock &)
+	{
+		if (!m_pSocket || m_pSocket->m_fd == -1 || !m_waiting) {
+			return 0;
+		}
+
+		int const fd = m_pSocket->m_fd;
+		int res = m_reactor.Arm(this, fd, m_waiting, fd != m_registered_fd);
+		if (!res) {
+			m_registered_fd = fd;
+		}
+		return res;
+	}
+
+	// Use instead of CSocket::CloseSocketFd to unregister from the reactor first
+	void CloseFd(int& fd, scoped_lock const&)
+	{
+		if (fd != -1 && fd == m_registered_fd) {
+			m_reactor.Disarm(fd);
+			m_registered_fd = -1;
+		}
+		CSocket::CloseSocketFd(fd);
+	}
+
+	void FreeAddressList()
+	{
+		if (m_pAddressList) {
+			freeaddrinfo(m_pAddressList);
+		}
+		m_pAddressList = 0;
+		m_pNextAddress = 0;
+	}
+
+	// Invalidates any outstanding connection attempt
+	void ResetConnect()
+	{
+		++m_serial;
+		FreeAddressList();
+	}
+
+	void SendConnectionEvent(int error, bool have_next)
+	{
+		if (m_pSocket->m_pEvtHandler) {
+			m_pSocket->m_pEvtHandler->SendEvent<CSocketEvent>(m_pSocket, have_next ? SocketEventType::connection_next : SocketEventType::connection, error);
+		}
+	}
+
+	// Called by the reactor once name resolution has finished
+	void OnResolved(unsigned int serial, int res, addrinfo* addressList, scoped_lock & l)
+	{
+		// If state isn't connecting or the serial does not match, Close() was
+		// called, possibly followed by another Connect().
+		if (!m_pSocket || serial != m_serial || m_pSocket->m_state != CSocket::connecting) {
+			if (addressList) {
+				freeaddrinfo(addressList);
+			}
+			return;
+		}
+
+		if (res) {
+			SendConnectionEvent(res, false);
+			m_pSocket->m_state = CSocket::closed;
+			return;
+		}
+
+		m_pAddressList = addressList;
+		m_pNextAddress = addressList;
+		TryConnectNext(l);
+	}
+
+	void TryConnectNext(scoped_lock & l)
+	{
+		while (m_pNextAddress) {
+			addrinfo* addr = m_pNextAddress;
+			m_pNextAddress = addr->ai_next;
+
+			if (m_pSocket->m_pEvtHandler) {
+				m_pSocket->m_pEvtHandler->SendEvent<CHostAddressEvent>(m_pSocket, CSocket::AddressToString(addr->ai_addr, addr->ai_addrlen));
+			}
+
+			int fd = CSocket::CreateSocketFd(addr);
+			if (fd == -1) {
+				SendConnectionEvent(GetLastSocketError(), addr->ai_next != 0);
+				continue;
+			}
+
+			CSocket::DoSetFlags(fd, m_pSocket->m_flags, m_pSocket->m_flags);
+			CSocket::DoSetBufferSizes(fd, m_pSocket->m_buffer_sizes[0], m_pSocket->m_buffer_sizes[1]);
+
+			m_pSocket->m_fd = fd;
+
+			int res = connect(fd, addr->ai_addr, addr->ai_addrlen);
+			if (res == -1) {
+				res = errno;
+			}
+
+			if (res == EINPROGRESS) {
+				m_waiting = WAIT_CONNECT;
+				res = Arm(l);
+				if (!res) {
+					return;
+				}
+				m_waiting = 0;
+			}
+
+			if (!res) {
+				OnConnected(l);
+				return;
+			}
+
+			SendConnectionEvent(res, addr->ai_next != 0);
+			CloseFd(m_pSocket->m_fd, l);
+		}
+
+		FreeAddressList();
+
+		SendConnectionEvent(ECONNABORTED, false);
+		m_pSocket->m_state = CSocket::closed;
+	}
+
+	void OnConnected(scoped_lock & l)
+	{
+		FreeAddressList();
+
+		m_pSocket->m_state = CSocket::connected;
+		if (m_pSocket->m_pEvtHandler) {
+			m_pSocket->m_pEvtHandler->SendEvent<CSocketEvent>(m_pSocket, SocketEventType::connection, 0);
+		}
+
+		// We're now interested in all the other nice events
+		m_waiting |= WAIT_READ | WAIT_WRITE;
+		Arm(l);
+	}
+
+	// Called by the reactor
+	void OnReactorEvent(uint32_t events, scoped_lock & l)
+	{
+		if (!m_pSocket || m_pSocket->m_fd == -1 || m_pSocket->m_fd != m_registered_fd) {
+			return;
+		}
+
+		if (m_waiting & WAIT_CONNECT) {
+			// The notification might be a stale one for a previous descriptor
+			// that happened to have the same number. Verify that the connection
+			// attempt has really completed.
+			pollfd pfd = { m_pSocket->m_fd, POLLOUT, 0 };
+			if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) || poll(&pfd, 1, 0) != 1) {
+				Arm(l);
+				return;
+			}
+
+			int error;
+			socklen_t len = sizeof(error);
+			int res = getsockopt(m_pSocket->m_fd, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (res) {
+				error = errno;
+			}
+			m_waiting &= ~WAIT_CONNECT;
+
+			if (error) {
+				SendConnectionEvent(error, m_pNextAddress != 0);
+				CloseFd(m_pSocket->m_fd, l);
+				TryConnectNext(l);
+			}
+			else {
+				OnConnected(l);
+			}
+			return;
+		}
+
+		if (m_waiting & WAIT_ACCEPT) {
+			if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				m_triggered |= WAIT_ACCEPT;
+				m_waiting &= ~WAIT_ACCEPT;
+			}
+		}
+		else if (m_waiting & WAIT_READ) {
+			if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+				m_triggered |= WAIT_READ;
+				m_waiting &= ~WAIT_READ;
+			}
+		}
+		if (m_waiting & WAIT_WRITE) {
+			if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+				m_triggered |= WAIT_WRITE;
+				m_waiting &= ~WAIT_WRITE;
+			}
+		}
+
+		SendEvents();
+
+		Arm(l);
+	}
+
+	void SendEvents()
+	{
+		if (!m_pSocket || !m_pSocket->m_pEvtHandler)
+			return;
+		if (m_triggered & WAIT_READ) {
+			if (m_pSocket->m_synchronous_read_cb)
+				m_pSocket->m_synchronous_read_cb->cb();
+			m_pSocket->m_pEvtHandler->SendEvent<CSocketEvent>(m_pSocket, SocketEventType::read, m_triggered_errors[1]);
+			m_triggered &= ~WAIT_READ;
+		}
+		if (m_triggered & WAIT_WRITE) {
+			m_pSocket->m_pEvtHandler->SendEvent<CSocketEvent>(m_pSocket, SocketEventType::write, m_triggered_errors[2]);
+			m_triggered &= ~WAIT_WRITE;
+		}
+		if (m_triggered & WAIT_ACCEPT) {
+			m_pSocket->m_pEvtHandler->SendEvent<CSocketEvent>(m_pSocket, SocketEventType::connection, m_triggered_errors[3]);
+			m_triggered &= ~WAIT_ACCEPT;
+		}
+	}
+
+	CSocket* m_pSocket{};
+
+	mutex m_sync;
+
+	CSocketReactor& m_reactor;
+
+	// Identifies the socket in the reactor's events
+	uint64_t m_reactor_id{};
+
+	// The descriptor currently registered with the reactor
+	int m_registered_fd{-1};
+
+	// Increased on each connection attempt and on close
+	unsigned int m_serial{};
+
+	addrinfo* m_pAddressList{};
+	addrinfo* m_pNextAddress{};
+
+	// The socket events we are waiting for
+	int m_waiting{};
+
+	// The triggered socket events
+	int m_triggered{};
+	int m_triggered_errors[WAIT_EVENTCOUNT];
+};
+
+namespace {
+mutex reactor_instance_sync(false);
+CSocketReactor* reactor_instance{};
+}
+
+CSocketReactor::CSocketReactor()
+	: wxThread(wxTHREAD_JOINABLE)
+	, m_sync(false)
+	, m_resolver_sync(false)
+{
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (m_epoll_fd == -1 || m_wakeup_fd == -1) {
+		return;
+	}
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &ev) == -1) {
+		return;
+	}
+
+	if (Create() != wxTHREAD_NO_ERROR) {
+		return;
+	}
+	Run();
+
+	m_running = true;
+}
+
+CSocketReactor::~CSocketReactor()
+{
+	if (m_running) {
+		{
+			scoped_lock l(m_sync);
+			m_quit = true;
+		}
+
+		uint64_t const v = 1;
+		int damn_spurious_warning = write(m_wakeup_fd, &v, sizeof(v));
+		(void)damn_spurious_warning;
+
+		Wait(wxTHREAD_WAIT_BLOCK);
+	}
+
+	JoinResolvers(true);
+
+	if (m_wakeup_fd != -1) {
+		close(m_wakeup_fd);
+	}
+	if (m_epoll_fd != -1) {
+		close(m_epoll_fd);
+	}
+}
+
+CSocketReactor& CSocketReactor::Acquire()
+{
+	scoped_lock l(reactor_instance_sync);
+	if (!reactor_instance) {
+		reactor_instance = new CSocketReactor;
+	}
+	++reactor_instance->m_socket_count;
+
+	return *reactor_instance;
+}
+
+void CSocketReactor::Release(CSocketThread* pSocketThread)
+{
+	scoped_lock l(reactor_instance_sync);
+	Remove(pSocketThread);
+	--m_socket_count;
+}
+
+void CSocketReactor::Register(CSocketThread* pSocketThread)
+{
+	scoped_lock l(m_sync);
+	pSocketThread->m_reactor_id = ++m_next_id;
+	m_sockets[pSocketThread->m_reactor_id] = pSocketThread;
+}
+
+void CSocketReactor::Cleanup(bool force)
+{
+	scoped_lock l(reactor_instance_sync);
+	if (!reactor_instance) {
+		return;
+	}
+
+	reactor_instance->JoinResolvers(force);
+	if (force && !reactor_instance->m_socket_count) {
+		delete reactor_instance;
+		reactor_instance = 0;
+	}
+}
+
+int CSocketReactor::Arm(CSocketThread* pSocketThread, int fd, int wait, bool add)
+{
+	if (!m_running) {
+		return EINVAL;
+	}
+
+	epoll_event ev = {};
+	ev.events = EPOLLONESHOT;
+	if (wait & (WAIT_READ | WAIT_ACCEPT)) {
+		ev.events |= EPOLLIN;
+	}
+	if (wait & (WAIT_WRITE | WAIT_CONNECT)) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.u64 = pSocketThread->m_reactor_id;
+
+	int res = epoll_ctl(m_epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+	if (res == -1 && add && errno == EEXIST) {
+		res = epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	}
+
+	return res == -1 ? errno : 0;
+}
+
+void CSocketReactor::Disarm(int fd)
+{
+	epoll_event ev = {};
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+void CSocketReactor::Remove(CSocketThread* pSocketThread)
+{
+	scoped_lock l(m_sync);
+
+	{
+		scoped_lock sl(pSocketThread->m_sync);
+		if (pSocketThread->m_registered_fd != -1) {
+			Disarm(pSocketThread->m_registered_fd);
+			pSocketThread->m_registered_fd = -1;
+		}
+	}
+
+	// Events for this socket might already have been fetched, they get
+	// dropped once its id is no longer known.
+	m_sockets.erase(pSocketThread->m_reactor_id);
+
+	scoped_lock rl(m_resolver_sync);
+	for (auto pResolver : m_resolvers) {
+		if (pResolver->m_pOwner == pSocketThread) {
+			pResolver->m_pOwner = 0;
+		}
+	}
+}
+
+bool CSocketReactor::AddResolver(CSocketResolver* pResolver)
+{
+	if (pResolver->Create() != wxTHREAD_NO_ERROR) {
+		delete pResolver;
+		return false;
+	}
+
+	{
+		scoped_lock l(m_resolver_sync);
+		m_resolvers.push_back(pResolver);
+	}
+	pResolver->Run();
+
+	return true;
+}
+
+void CSocketReactor::OnResolved(CSocketResolver* pResolver, int res, addrinfo* addressList)
+{
+	{
+		scoped_lock l(m_sync);
+		CSocketThread* pSocketThread = pResolver->m_pOwner;
+		if (pSocketThread) {
+			scoped_lock sl(pSocketThread->m_sync);
+			pSocketThread->OnResolved(pResolver->m_serial, res, addressList, sl);
+		}
+		else if (addressList) {
+			freeaddrinfo(addressList);
+		}
+	}
+
+	scoped_lock l(m_resolver_sync);
+	pResolver->m_finished = true;
+}
+
+void CSocketReactor::JoinResolvers(bool force)
+{
+	std::list<CSocketResolver*> resolvers;
+	{
+		scoped_lock l(m_resolver_sync);
+		auto iter = m_resolvers.begin();
+		while (iter != m_resolvers.end()) {
+			auto current = iter++;
+			if (force || (*current)->m_finished) {
+				resolvers.splice(resolvers.end(), m_resolvers, current);
+			}
+		}
+	}
+
+	for (auto pResolver : resolvers) {
+		pResolver->Wait(wxTHREAD_WAIT_BLOCK);
+		delete pResolver;
+	}
+}
+
+wxThread::ExitCode CSocketReactor::Entry()
+{
+	epoll_event events[max_events];
+	for (;;) {
+		int res = epoll_wait(m_epoll_fd, events, max_events, -1);
+
+		scoped_lock l(m_sync);
+		if (m_quit) {
+			break;
+		}
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (int i = 0; i < res; ++i) {
+			uint64_t const id = events[i].data.u64;
+			if (!id) {
+				uint64_t v;
+				int damn_spurious_warning = read(m_wakeup_fd, &v, sizeof(v));
+				(void)damn_spurious_warning;
+			}
+			else {
+				auto const it = m_sockets.find(id);
+				if (it != m_sockets.end()) {
+					CSocketThread* pSocketThread = it->second;
+					scoped_lock sl(pSocketThread->m_sync);
+					pSocketThread->OnReactorEvent(events[i].events, sl);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+#else
+
 class CSocketThread final : protected wxThread
 {
 	friend class CSocket;
@@ -335,48 +1040,13 @@ public:
 	}
 
 protected:
-	static int CreateSocketFd(addrinfo const* addr)
-	{
-		int fd;
-#if defined(SOCK_CLOEXEC) && !defined(__WXMSW__)
-		fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
-		if (fd == -1 && errno == EINVAL)
-#endif
-		{
-			fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-		}
-
-		if (fd != -1) {
-#if defined(SO_NOSIGPIPE) && !defined(MSG_NOSIGNAL)
-			// We do not want SIGPIPE if writing to socket.
-			const int value = 1;
-			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(int));
-#endif
-			CSocket::SetNonblocking(fd);
-		}
-
-		return fd;
-	}
-
-	static void CloseSocketFd(int& fd)
-	{
-		if (fd != -1) {
-	#ifdef __WXMSW__
-			closesocket(fd);
-	#else
-			close(fd);
-	#endif
-			fd = -1;
-		}
-	}
-
 	int TryConnectHost(struct addrinfo *addr, scoped_lock & l)
 	{
 		if (m_pSocket->m_pEvtHandler) {
 			m_pSocket->m_pEvtHandler->SendEvent<CHostAddressEvent>(m_pSocket, CSocket::AddressToString(addr->ai_addr, addr->ai_addrlen));
 		}
 
-		int fd = CreateSocketFd(addr);
+		int fd = CSocket::CreateSocketFd(addr);
 		if (fd == -1) {
 			if (m_pSocket->m_pEvtHandler) {
 				m_pSocket->m_pEvtHandler->SendEvent<CSocketEvent>(m_pSocket, addr->ai_next ? SocketEventType::connection_next : SocketEventType::connection, GetLastSocketError());
@@ -414,7 +1084,7 @@ protected:
 			} while (wait_successful);
 
 			if (!wait_successful) {
-				CloseSocketFd(fd);
+				CSocket::CloseSocketFd(fd);
 				if (m_pSocket)
 					m_pSocket->m_fd = -1;
 				return -1;
@@ -429,7 +1099,7 @@ protected:
 				m_pSocket->m_pEvtHandler->SendEvent<CSocketEvent>(m_pSocket, addr->ai_next ? SocketEventType::connection_next : SocketEventType::connection, res);
 			}
 
-			CloseSocketFd(fd);
+			CSocket::CloseSocketFd(fd);
 			m_pSocket->m_fd = -1;
 		}
 		else {
@@ -853,6 +1523,8 @@ protected:
 	CCallback* m_synchronous_read_cb;
 };
 
+#endif
+
 CSocket::CSocket(CEventHandler* pEvtHandler)
 	: m_pEvtHandler(pEvtHandler)
 {
@@ -884,6 +1556,10 @@ void CSocket::DetachThread()
 	if (!m_pSocketThread)
 		return;
 
+#if FZ_USE_EPOLL
+	m_pSocketThread->m_reactor.Release(m_pSocketThread);
+	delete m_pSocketThread;
+#else
 	scoped_lock l(m_pSocketThread->m_sync);
 	m_pSocketThread->SetSocket(0, l);
 	if (m_pSocketThread->m_finished) {
@@ -905,6 +1581,7 @@ void CSocket::DetachThread()
 			waiting_socket_threads.push_back(m_pSocketThread);
 		}
 	}
+#endif
 	m_pSocketThread = 0;
 
 	Cleanup(false);
@@ -933,6 +1610,24 @@ int CSocket::Connect(wxString host, unsigned int port, address_family family /*=
 		return EINVAL;
 	}
 
+#if FZ_USE_EPOLL
+	if (!m_pSocketThread) {
+		m_pSocketThread = new CSocketThread();
+		m_pSocketThread->SetSocket(this);
+	}
+
+	scoped_lock l(m_pSocketThread->m_sync);
+
+	m_state = connecting;
+
+	m_host = host;
+	m_port = port;
+	int res = m_pSocketThread->Connect(l);
+	if (res) {
+		m_state = none;
+		return res;
+	}
+#else
 	if (m_pSocketThread && m_pSocketThread->m_started) {
 		scoped_lock l(m_pSocketThread->m_sync);
 		if (!m_pSocketThread->m_threadwait) {
@@ -965,6 +1660,7 @@ int CSocket::Connect(wxString host, unsigned int port, address_family family /*=
 		m_pSocketThread = 0;
 		return res;
 	}
+#endif
 
 	return EINPROGRESS;
 }
@@ -1127,6 +1823,11 @@ int CSocket::Close()
 		int fd = m_fd;
 		m_fd = -1;
 
+#if FZ_USE_EPOLL
+		m_pSocketThread->ResetConnect();
+		m_pSocketThread->m_waiting = 0;
+		m_pSocketThread->CloseFd(fd, l);
+#else
 		delete [] m_pSocketThread->m_pHost;
 		m_pSocketThread->m_pHost = 0;
 		delete [] m_pSocketThread->m_pPort;
@@ -1134,7 +1835,8 @@ int CSocket::Close()
 		if (!m_pSocketThread->m_threadwait)
 			m_pSocketThread->WakeupThread(l);
 
-		CSocketThread::CloseSocketFd(fd);
+		CloseSocketFd(fd);
+#endif
 		m_state = none;
 
 		m_pSocketThread->m_triggered = 0;
@@ -1150,7 +1852,7 @@ int CSocket::Close()
 	else {
 		int fd = m_fd;
 		m_fd = -1;
-		CSocketThread::CloseSocketFd(fd);
+		CloseSocketFd(fd);
 		m_state = none;
 
 		if (m_pEvtHandler) {
@@ -1176,6 +1878,9 @@ CSocket::SocketState CSocket::GetState()
 
 bool CSocket::Cleanup(bool force)
 {
+#if FZ_USE_EPOLL
+	CSocketReactor::Cleanup(force);
+#else
 	auto iter = waiting_socket_threads.begin();
 	while (iter != waiting_socket_threads.end()) {
 		auto current = iter++;
@@ -1192,6 +1897,7 @@ bool CSocket::Cleanup(bool force)
 		delete pThread;
 		waiting_socket_threads.erase(current);
 	}
+#endif
 
 	return false;
 }
@@ -1274,6 +1980,68 @@ int CSocket::Write(const void* buffer, unsigned int size, int& error)
 	return res;
 }
 
+#ifdef __linux__
+int CSocket::SpliceToPipe(int pipe_fd, unsigned int size, int& error)
+{
+	int res = splice(m_fd, 0, pipe_fd, 0, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if (res == -1) {
+		// EAGAIN might also mean that the pipe is full, the caller has to
+		// check for that. Waiting for the socket is harmless either way.
+		error = GetLastSocketError();
+		if (error == EAGAIN) {
+			if (m_pSocketThread) {
+				scoped_lock l(m_pSocketThread->m_sync);
+				if (!(m_pSocketThread->m_waiting & WAIT_READ)) {
+					m_pSocketThread->m_waiting |= WAIT_READ;
+					m_pSocketThread->WakeupThread(l);
+				}
+			}
+		}
+	}
+	else
+		error = 0;
+
+	return res;
+}
+
+int CSocket::SendFile(int file_fd, unsigned int size, int& error)
+{
+	// There is no MSG_NOSIGNAL for sendfile. Block SIGPIPE in this thread
+	// and discard it should it get raised.
+	sigset_t pipe_set;
+	sigset_t old_set;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+	int res = sendfile(m_fd, file_fd, 0, size);
+	if (res == -1) {
+		error = GetLastSocketError();
+		if (error == EPIPE) {
+			timespec const ts{};
+			sigtimedwait(&pipe_set, 0, &ts);
+		}
+	}
+	else
+		error = 0;
+
+	pthread_sigmask(SIG_SETMASK, &old_set, 0);
+
+	if (error == EAGAIN) {
+		if (m_pSocketThread) {
+			scoped_lock l(m_pSocketThread->m_sync);
+			if (!(m_pSocketThread->m_waiting & WAIT_WRITE)) {
+				m_pSocketThread->m_waiting |= WAIT_WRITE;
+				m_pSocketThread->WakeupThread(l);
+			}
+		}
+	}
+
+	return res;
+}
+#endif
+
 wxString CSocket::AddressToString(const struct sockaddr* addr, int addr_len, bool with_port /*=true*/, bool strip_zone_index/*=false*/)
 {
 	char hostbuf[NI_MAXHOST];
@@ -1413,7 +2181,7 @@ int CSocket::Listen(address_family family, int port)
 		}
 
 		for (struct addrinfo* addr = addressList; addr; addr = addr->ai_next) {
-			m_fd = CSocketThread::CreateSocketFd(addr);
+			m_fd = CreateSocketFd(addr);
 			res = GetLastSocketError();
 
 			if (m_fd == -1)
@@ -1424,7 +2192,7 @@ int CSocket::Listen(address_family family, int port)
 				break;
 
 			res = GetLastSocketError();
-			CSocketThread::CloseSocketFd(m_fd);
+			CloseSocketFd(m_fd);
 		}
 		freeaddrinfo(addressList);
 		if (m_fd == -1)
@@ -1434,7 +2202,7 @@ int CSocket::Listen(address_family family, int port)
 	int res = listen(m_fd, 1);
 	if (res) {
 		res = GetLastSocketError();
-		CSocketThread::CloseSocketFd(m_fd);
+		CloseSocketFd(m_fd);
 		m_fd = -1;
 		return res;
 	}
@@ -1549,6 +2317,41 @@ int CSocket::SetNonblocking(int fd)
 #endif
 }
 
+int CSocket::CreateSocketFd(addrinfo const* addr)
+{
+	int fd;
+#if defined(SOCK_CLOEXEC) && !defined(__WXMSW__)
+	fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+	if (fd == -1 && errno == EINVAL)
+#endif
+	{
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	}
+
+	if (fd != -1) {
+#if defined(SO_NOSIGPIPE) && !defined(MSG_NOSIGNAL)
+		// We do not want SIGPIPE if writing to socket.
+		const int value = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(int));
+#endif
+		SetNonblocking(fd);
+	}
+
+	return fd;
+}
+
+void CSocket::CloseSocketFd(int& fd)
+{
+	if (fd != -1) {
+#ifdef __WXMSW__
+		closesocket(fd);
+#else
+		close(fd);
+#endif
+		fd = -1;
+	}
+}
+
 void CSocket::SetFlags(int flags)
 {
 	if (m_pSocketThread)
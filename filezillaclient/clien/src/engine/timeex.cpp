@@ -1,6 +1,8 @@
 #include <filezilla.h>
 #include "timeex.h"
 
+#include "mutex.h"
+
 #define TIME_ASSERT(x) //wxASSERT(x)
 
 CDateTime::CDateTime()
@@ -357,6 +359,10 @@ bool CDateTime::VerifyFormat(wxString const& fmt)
 CDateTime CMonotonicTime::m_lastTime = CDateTime::Now();
 int CMonotonicTime::m_lastOffset = 0;
 
+namespace {
+mutex monotonic_time_mutex;
+}
+
 CMonotonicTime::CMonotonicTime(const CDateTime& time)
 	: m_time(time)
 {
@@ -366,6 +372,8 @@ CMonotonicTime CMonotonicTime::Now()
 {
 	CMonotonicTime time;
 	time.m_time = CDateTime::Now();
+
+	scoped_lock lock(monotonic_time_mutex);
 	if (time.m_time == m_lastTime)
 		time.m_offset = ++m_lastOffset;
 	else
@@ -28,7 +28,10 @@ CTlsSocket::CTlsSocket(CEventHandler* pEvtHandler, CSocket* pSocket, CControlSoc
 	, m_pSocket(pSocket)
 {
 	wxASSERT(pSocket);
-	m_pSocketBackend = new CSocketBackend(this, *m_pSocket, m_pOwner->GetEngine().GetRateLimiter());
+	wxString site;
+	if (m_pOwner->GetCurrentServer())
+		site = CRateLimiter::GetSiteName(*m_pOwner->GetCurrentServer());
+	m_pSocketBackend = new CSocketBackend(this, *m_pSocket, m_pOwner->GetEngine().GetRateLimiter(), site);
 
 	m_implicitTrustedCert.data = 0;
 	m_implicitTrustedCert.size = 0;
@@ -226,12 +226,12 @@ void CTransferSocket::OnReceive()
 	}
 
 	if (m_transferMode == TransferMode::list) {
+		// The parser copies the data, so the buffer can be reused for every read
+		char buffer[16384];
 		for (;;) {
-			char *pBuffer = new char[4096];
 			int error;
-			int numread = m_pBackend->Read(pBuffer, 4096, error);
+			int numread = m_pBackend->Read(buffer, sizeof(buffer), error);
 			if (numread < 0) {
-				delete [] pBuffer;
 				if (error != EAGAIN) {
 					controlSocket_.LogMessage(MessageType::Error, _T("Could not read from transfer socket: %s"), CSocket::GetErrorDescription(error));
 					TransferEnd(TransferEndReason::transfer_failure);
@@ -242,7 +242,7 @@ void CTransferSocket::OnReceive()
 			}
 
 			if (numread > 0) {
-				if (!m_pDirectoryListingParser->AddData(pBuffer, numread))
+				if (!m_pDirectoryListingParser->AddData(buffer, numread))
 				{
 					TransferEnd(TransferEndReason::transfer_failure);
 					return;
@@ -256,13 +256,19 @@ void CTransferSocket::OnReceive()
 				engine_.transfer_status_.Update(numread);
 			}
 			else {
-				delete [] pBuffer;
 				TransferEnd(TransferEndReason::successful);
 				return;
 			}
 		}
 	}
 	else if (m_transferMode == TransferMode::download) {
+#ifdef __linux__
+		if (ioThread_->ZeroCopy()) {
+			OnReceiveZeroCopy();
+			return;
+		}
+#endif
+
 		int error;
 		int numread;
 
@@ -363,6 +369,13 @@ void CTransferSocket::OnSend()
 	if (m_transferMode != TransferMode::upload)
 		return;
 
+#ifdef __linux__
+	if (ioThread_->ZeroCopy()) {
+		OnSendZeroCopy();
+		return;
+	}
+#endif
+
 	int error;
 	int written;
 
@@ -407,6 +420,107 @@ void CTransferSocket::OnSend()
 	}
 }
 
+#ifdef __linux__
+void CTransferSocket::OnReceiveZeroCopy()
+{
+	wxASSERT(!m_pTlsSocket);
+
+	int error;
+	int numread;
+
+	for (int i = 0; i < 100; ++i) {
+		int pipe;
+		unsigned int space;
+		int res = ioThread_->GetNextPipeSpace(pipe, space);
+		if (res == IO_Again)
+			return;
+		else if (res == IO_Error) {
+			wxString const description = ioThread_->GetError();
+			if (description.empty())
+				controlSocket_.LogMessage(MessageType::Error, _("Can't write data to file."));
+			else
+				controlSocket_.LogMessage(MessageType::Error, _("Can't write data to file: %s"), description);
+			TransferEnd(TransferEndReason::transfer_failure_critical);
+			return;
+		}
+
+		numread = m_pSocket->SpliceToPipe(pipe, space, error);
+		if (numread <= 0)
+			break;
+
+		controlSocket_.SetActive(CFileZillaEngine::recv);
+		if (!m_madeProgress) {
+			m_madeProgress = 2;
+			engine_.transfer_status_.SetMadeProgress();
+		}
+		engine_.transfer_status_.Update(numread);
+	}
+
+	if (numread < 0) {
+		if (error != EAGAIN) {
+			controlSocket_.LogMessage(MessageType::Error, _T("Could not read from transfer socket: %s"), CSocket::GetErrorDescription(error));
+			TransferEnd(TransferEndReason::transfer_failure);
+		}
+		else if (!ioThread_->WaitForPipe() && m_onCloseCalled) {
+			FinalizeWrite();
+		}
+	}
+	else if (!numread) {
+		FinalizeWrite();
+	}
+	else {
+		SendEvent<CSocketEvent>(m_pBackend, SocketEventType::read, 0);
+	}
+}
+
+void CTransferSocket::OnSendZeroCopy()
+{
+	wxASSERT(!m_pTlsSocket);
+
+	int const fd = ioThread_->GetFileDescriptor();
+
+	int error;
+	int written;
+
+	for (int i = 0; i < 100; ++i) {
+		written = m_pSocket->SendFile(fd, ioThread_->GetBufferSize(), error);
+		if (written <= 0)
+			break;
+
+		ioThread_->OnFileSent(written);
+
+		controlSocket_.SetActive(CFileZillaEngine::send);
+		if (m_madeProgress == 1) {
+			controlSocket_.LogMessage(MessageType::Debug_Debug, _T("Made progress in CTransferSocket::OnSendZeroCopy()"));
+			m_madeProgress = 2;
+			engine_.transfer_status_.SetMadeProgress();
+		}
+		engine_.transfer_status_.Update(written);
+	}
+
+	if (written < 0) {
+		if (error == EAGAIN) {
+			if (!m_madeProgress) {
+				controlSocket_.LogMessage(MessageType::Debug_Debug, _T("First EAGAIN in CTransferSocket::OnSendZeroCopy()"));
+				m_madeProgress = 1;
+				engine_.transfer_status_.SetMadeProgress();
+			}
+		}
+		else {
+			controlSocket_.LogMessage(MessageType::Error, _T("Could not write to transfer socket: %s"), CSocket::GetErrorDescription(error));
+			TransferEnd(TransferEndReason::transfer_failure);
+		}
+	}
+	else if (!written) {
+		// Reached the end of the file
+		TransferEnd(TransferEndReason::successful);
+	}
+	else {
+		SendEvent<CSocketEvent>(m_pBackend, SocketEventType::write, 0);
+	}
+}
+#endif
+
 void CTransferSocket::OnClose(int error)
 {
 	controlSocket_.LogMessage(MessageType::Debug_Verbose, _T("CTransferSocket::OnClose(%d)"), error);
@@ -623,7 +737,7 @@ bool CTransferSocket::CheckGetNextWriteBuffer()
 			return false;
 		}
 
-		m_transferBufferLen = BUFFERSIZE;
+		m_transferBufferLen = ioThread_->GetBufferSize();
 	}
 
 	return true;
@@ -673,7 +787,7 @@ void CTransferSocket::OnIOThreadEvent()
 
 void CTransferSocket::FinalizeWrite()
 {
-	bool res = ioThread_->Finalize(BUFFERSIZE - m_transferBufferLen);
+	bool res = ioThread_->Finalize(ioThread_->GetBufferSize() - m_transferBufferLen);
 	if (m_transferEndReason != TransferEndReason::none)
 		return;
 
@@ -750,7 +864,7 @@ bool CTransferSocket::InitBackend()
 			return false;
 	}
 	else
-		m_pBackend = new CSocketBackend(this, *m_pSocket, engine_.GetRateLimiter());
+		m_pBackend = new CSocketBackend(this, *m_pSocket, engine_.GetRateLimiter(), CRateLimiter::GetSiteName(*controlSocket_.m_pCurrentServer));
 
 	return true;
 }
@@ -55,6 +55,11 @@ protected:
 	void OnAccept(int error);
 	void OnReceive();
 	void OnSend();
+#ifdef __linux__
+	// Used instead of the buffers if the IO thread is in zero-copy mode
+	void OnReceiveZeroCopy();
+	void OnSendZeroCopy();
+#endif
 	void OnClose(int error);
 
 	// Create a socket server
@@ -259,16 +259,23 @@ public:
 	// i.e. chmod 755 foo.bar
 	CChmodCommand(const CServerPath& path, const wxString& file, const wxString& permission);
 
+	// Changes the permissions of several files in the same directory at once.
+	// Each file is paired with its own permission string.
+	CChmodCommand(const CServerPath& path, std::vector<std::pair<wxString, wxString>> const& files);
+
 	CServerPath GetPath() const { return m_path; }
-	wxString GetFile() const { return m_file; }
-	wxString GetPermission() const { return m_permission; }
+
+	// File and permission of the first file
+	wxString GetFile() const { return m_files.front().first; }
+	wxString GetPermission() const { return m_files.front().second; }
+
+	std::vector<std::pair<wxString, wxString>> const& GetFiles() const { return m_files; }
 
 	bool valid() const;
 
 protected:
 	CServerPath const m_path;
-	wxString const m_file;
-	wxString const m_permission;
+	std::vector<std::pair<wxString, wxString>> const m_files;
 };
 
 #endif
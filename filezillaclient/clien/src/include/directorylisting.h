@@ -73,17 +73,31 @@ public:
 	const CDirentry& operator[](unsigned int index) const;
 
 	// Word of caution: You MUST NOT change the name of the returned
-	// entry if you do not call ClearFindMap afterwards
+	// entry if you do not call ClearFindMap afterwards, use RenameEntry
+	// instead.
 	CDirentry& operator[](unsigned int index);
 
 	void SetCount(unsigned int count);
 	unsigned int GetCount() const { return m_entryCount; }
 
+	// Return the index of the first matching entry, -1 if there is none.
 	int FindFile_CmpCase(const wxString& name) const;
-	int FindFile_CmpNoCase(wxString name) const;
+	int FindFile_CmpNoCase(const wxString& name) const;
+
+	// Indexes of all entries matching the name case-insensitively, in
+	// ascending order.
+	std::vector<unsigned int> FindFiles_CmpNoCase(const wxString& name) const;
+
+	// Changes the name of an entry and updates the lookup indexes accordingly
+	void RenameEntry(unsigned int index, const wxString& name);
 
 	void ClearFindMap();
 
+	// Indexes all entries for FindFile in advance. Afterwards FindFile does
+	// not modify the listing until entries get added.
+	void BuildFindMap();
+	bool IsFindMapComplete() const;
+
 	CMonotonicTime m_firstListTime;
 
 	enum
@@ -125,14 +139,55 @@ public:
 
 	bool RemoveEntry(unsigned int index);
 
+	// Removes all entries at the given indexes in a single pass. Returns the
+	// number of entries removed, invalid and duplicate indexes are ignored.
+	unsigned int RemoveEntries(std::vector<unsigned int> indexes);
+
 	void GetFilenames(std::vector<wxString> &names) const;
 
+	// Converts the listing into a compact representation using a fraction of
+	// the memory: All names share a single buffer, permissions and owners
+	// are kept in tables of distinct values and the remaining fields are
+	// packed into arrays. Copies share the compact data.
+	// Entries get recreated on demand when accessed. Modifying the listing
+	// turns it back into the normal representation.
+	void Compact();
+	bool IsCompact() const { return static_cast<bool>(m_compact); }
+
+	// Number of bytes allocated for the listing, including entries, compact
+	// data and lookup indexes. Data shared with copies is counted as well.
+	size_t GetMemoryUsage() const;
+
 protected:
+	struct compact_data;
+	struct find_index;
+
+	CDirentry const& Materialize(unsigned int index) const;
+	wxString GetCompactName(unsigned int index) const;
+
+	// For compact listings the name gets stored in buffer
+	wxString const& GetName(unsigned int index, wxString & buffer) const;
+
+	// Indexes all entries not yet in the index
+	find_index const& GetFindIndex(bool nocase) const;
+
+	// Turns a compact listing back into the normal representation
+	void Expand();
 
 	CRefcountObject_Uninitialized<std::vector<CRefcountObject<CDirentry> > > m_entries;
 
-	mutable CRefcountObject_Uninitialized<std::multimap<wxString, unsigned int> > m_searchmap_case;
-	mutable CRefcountObject_Uninitialized<std::multimap<wxString, unsigned int> > m_searchmap_nocase;
+	// Only set for compact listings, m_entries is unused then.
+	std::shared_ptr<compact_data const> m_compact;
+
+	// The entries of a compact listing that have been accessed. Not shared
+	// with copies, so that accessing one copy does not modify another one
+	// that may be used by a different thread.
+	mutable std::vector<CRefcountObject_Uninitialized<CDirentry>> m_materialized;
+
+	// Hash indexes of the names, built on the first lookup and shared by
+	// copies.
+	mutable CRefcountObject_Uninitialized<find_index> m_searchmap_case;
+	mutable CRefcountObject_Uninitialized<find_index> m_searchmap_nocase;
 
 	unsigned int m_entryCount;
 };
@@ -5,6 +5,7 @@
 
 class CDirectoryCache;
 class CEventLoop;
+class CIOBufferPool;
 class COptionsBase;
 class CPathCache;
 class CRateLimiter;
@@ -17,10 +18,18 @@ public:
 	~CFileZillaEngineContext();
 
 	COptionsBase& GetOptions();
+
+	// The loop shared services like the rate limiter run in
 	CEventLoop& GetEventLoop();
+
+	// Engines get pinned to the least used of the context's event loops
+	CEventLoop& AcquireEventLoop();
+	void ReleaseEventLoop(CEventLoop& loop);
+
 	CRateLimiter& GetRateLimiter();
 	CDirectoryCache& GetDirectoryCache();
 	CPathCache& GetPathCache();
+	CIOBufferPool& GetIOBufferPool();
 
 protected:
 	COptionsBase& options_;
@@ -49,6 +49,15 @@ bool same_type(CEventBase const& ev)
 	return ev.derived_type() == T::type();
 }
 
+// Specialize to let the event loop drop an event if an equivalent one is
+// still pending for the same handler.
+template<typename T>
+struct event_traits
+{
+	static bool const coalescable = false;
+	static bool coalesce(T const&, T const&) { return false; }
+};
+
 typedef unsigned long long timer_id;
 struct timer_event_type{};
 typedef CEvent<timer_event_type, timer_id> CTimerEvent;
@@ -18,7 +18,7 @@ public:
 
 	template<typename T, typename... Args>
 	void SendEvent(Args&&... args) {
-		event_loop_.SendEvent(this, new T(std::forward<Args>(args)...));
+		event_loop_.SendEvent<T>(this, std::forward<Args>(args)...);
 	};
 
 	timer_id AddTimer(int ms_interval, bool one_shot);
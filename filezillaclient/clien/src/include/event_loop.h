@@ -6,8 +6,11 @@
 #include "mutex.h"
 #include "timeex.h"
 
+#include <cstddef>
 #include <deque>
 #include <functional>
+#include <new>
+#include <unordered_map>
 #include <vector>
 
 class CEventHandler;
@@ -15,7 +18,9 @@ struct timer_data final
 {
 	CEventHandler* handler_{};
 	timer_id id_{};
-	CDateTime deadline_;
+
+	// In milliseconds since the creation of the event loop
+	int64_t deadline_{};
 	int ms_interval_{};
 	bool one_shot_{true};
 };
@@ -40,17 +45,60 @@ public:
 
 protected:
 	friend class CEventHandler;
-	void SendEvent(CEventHandler* handler, CEventBase* evt);
+
+	template<typename T, typename... Args>
+	void SendEvent(CEventHandler* handler, Args&&... args)
+	{
+		static_assert(alignof(T) <= alignof(std::max_align_t), "Overaligned event type");
+
+		// The storage comes from the pool which is guarded by the same mutex as the queue
+		scoped_lock lock(sync_);
+		T* evt = new (AllocateEvent(sizeof(T))) T(std::forward<Args>(args)...);
+		EnqueueEvent(lock, handler, evt, event_traits<T>::coalescable ? &Coalesce<T> : nullptr);
+	}
+
+	typedef bool (*coalesce_func)(CEventBase const& pending, CEventBase const& evt);
+
+	template<typename T>
+	static bool Coalesce(CEventBase const& pending, CEventBase const& evt)
+	{
+		return same_type<T>(pending) && event_traits<T>::coalesce(static_cast<T const&>(pending), static_cast<T const&>(evt));
+	}
+
+	void EnqueueEvent(scoped_lock & l, CEventHandler* handler, CEventBase* evt, coalesce_func coalesce);
+
+	// Must be called with the mutex held
+	void* AllocateEvent(size_t size);
+	void DestroyEvent(CEventBase* evt);
+	void ReleaseEvent(void* p);
 
 	bool ProcessTimers(scoped_lock & l);
 	int GetNextWaitInterval();
 
+	// Milliseconds elapsed since the creation of the event loop
+	int64_t Now() const { return CMonotonicClock::now() - epoch_; }
+
+	// timers_ is a binary min-heap ordered by deadline, timer_index_ maps
+	// the ids to the positions in the heap so timers can be stopped in
+	// logarithmic time.
+	void PushTimer(timer_data const& d);
+	void RemoveTimerAt(size_t pos);
+	void SiftTimerUp(size_t pos);
+	void SiftTimerDown(size_t pos);
+	void SetTimerAt(size_t pos, timer_data && d);
+
 	virtual wxThread::ExitCode Entry();
 
 	typedef std::vector<timer_data> Timers;
 
 	Events pending_events_;
+
+	// Free event storage, by size class
+	std::vector<void*> free_events_[16];
 	Timers timers_;
+	std::unordered_map<timer_id, size_t> timer_index_;
+
+	CMonotonicClock const epoch_;
 
 	mutex sync_;
 	condition cond_;
@@ -57,6 +57,11 @@ public:
 	// Returns number of bytes written or -1 on error
 	ssize_t Write(void const* buf, size_t count);
 
+#ifndef __WXMSW__
+	// For use with system calls CFile has no wrapper for, like splice
+	int GetDescriptor() const { return fd_; }
+#endif
+
 protected:
 #ifdef __WXMSW__
 	HANDLE hFile_{INVALID_HANDLE_VALUE};
@@ -101,6 +101,73 @@ private:
 	bool locked_{true};
 };
 
+// Allows either any number of readers or a single writer at a time.
+// Not recursive, a thread holding the lock must not lock it again.
+class rwlock final
+{
+public:
+	rwlock();
+	~rwlock();
+
+	rwlock(rwlock const&) = delete;
+	rwlock& operator=(rwlock const&) = delete;
+
+	// Beware, manual locking isn't exception safe
+	void lock_read();
+	void unlock_read();
+	void lock_write();
+	void unlock_write();
+
+private:
+#ifdef __WXMSW__
+	SRWLOCK l_;
+#else
+	pthread_rwlock_t l_;
+#endif
+};
+
+class scoped_read_lock final
+{
+public:
+	explicit scoped_read_lock(rwlock& l)
+		: l_(l)
+	{
+		l_.lock_read();
+	}
+
+	~scoped_read_lock()
+	{
+		l_.unlock_read();
+	}
+
+	scoped_read_lock(scoped_read_lock const&) = delete;
+	scoped_read_lock& operator=(scoped_read_lock const&) = delete;
+
+private:
+	rwlock& l_;
+};
+
+class scoped_write_lock final
+{
+public:
+	explicit scoped_write_lock(rwlock& l)
+		: l_(l)
+	{
+		l_.lock_write();
+	}
+
+	~scoped_write_lock()
+	{
+		l_.unlock_write();
+	}
+
+	scoped_write_lock(scoped_write_lock const&) = delete;
+	scoped_write_lock& operator=(scoped_write_lock const&) = delete;
+
+private:
+	rwlock& l_;
+};
+
 class condition final
 {
 public:
@@ -74,6 +74,18 @@ enum engineOptions
 	OPTION_SIZE_USETHOUSANDSEP,
 	OPTION_SIZE_DECIMALPLACES,
 
+	OPTION_IO_BUFFERSIZE,		// Size of each buffer used for file I/O during transfers
+	OPTION_IO_BUFFERCOUNT,		// Initial number of buffers per transfer
+	OPTION_IO_ADAPTIVE_BUFFERS,	// Grow and shrink the number of buffers as needed
+	OPTION_IO_MAX_BUFFERCOUNT,	// Upper bound per transfer if adaptive
+	OPTION_IO_BUFFER_MEMORY,	// Limit in MiB for all transfers combined
+	OPTION_IO_ZERO_COPY,		// Use splice/sendfile for plain binary FTP transfers where available
+	OPTION_EVENT_LOOPS,			// Number of engine threads, 0 for one per CPU core. Needs restart.
+	OPTION_DIRECTORYCACHE_FILE,	// Database keeping directory listings across sessions, empty to disable. Needs restart.
+	OPTION_DIRECTORYCACHE_MEMORY,	// Limit in MiB for the cached directory listings. Needs restart.
+	OPTION_FTP_PIPELINE_DEPTH,	// Maximum number of independent FTP commands sent without waiting for their replies, 1 to disable pipelining
+	OPTION_SFTP_MAX_WINDOW,		// Limit in MiB for the adaptive amount of data in flight during SFTP transfers
+
 	OPTIONS_ENGINE_NUM
 };
 
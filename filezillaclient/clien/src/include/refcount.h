@@ -65,7 +65,7 @@ public:
 	CRefcountObject_Uninitialized<T>& operator=(const CRefcountObject_Uninitialized<T>& v);
 
 	bool operator!() const { return !data_; }
-	explicit operator bool() const { return data_; }
+	explicit operator bool() const { return static_cast<bool>(data_); }
 
 	bool empty() const { return data_.get(); }
 protected:
@@ -30,6 +30,18 @@ public:
 struct socket_event_type;
 typedef CEvent<socket_event_type, CSocketEventSource*, SocketEventType, int> CSocketEvent;
 
+// Handlers read or write until the operation would block, so a pending
+// notification makes further ones for the same source redundant.
+template<>
+struct event_traits<CSocketEvent>
+{
+	static bool const coalescable = true;
+	static bool coalesce(CSocketEvent const& pending, CSocketEvent const& ev) {
+		SocketEventType const t = std::get<1>(ev.v_);
+		return (t == SocketEventType::read || t == SocketEventType::write) && pending.v_ == ev.v_;
+	}
+};
+
 struct hostaddress_event_type;
 typedef CEvent<hostaddress_event_type, CSocketEventSource*, wxString> CHostAddressEvent;
 
@@ -41,6 +53,7 @@ public:
 
 void RemoveSocketEvents(CEventHandler * handler, CSocketEventSource const* const source);
 
+struct addrinfo;
 class CSocketThread;
 class CSocket final : public CSocketEventSource
 {
@@ -93,6 +106,14 @@ public:
 	int Peek(void *buffer, unsigned int size, int& error);
 	int Write(const void *buffer, unsigned int size, int& error);
 
+#ifdef __linux__
+	// Zero-copy variants of Read and Write, with the same semantics.
+	// SpliceToPipe moves received data into the passed pipe, SendFile sends
+	// data from the current position of the passed file.
+	int SpliceToPipe(int pipe_fd, unsigned int size, int& error);
+	int SendFile(int file_fd, unsigned int size, int& error);
+#endif
+
 	int Close();
 
 	// Returns empty string on error
@@ -144,6 +165,9 @@ protected:
 	static int DoSetBufferSizes(int fd, int size_read, int size_write);
 	static int SetNonblocking(int fd);
 
+	static int CreateSocketFd(addrinfo const* addr);
+	static void CloseSocketFd(int& fd);
+
 	void DetachThread();
 
 	CEventHandler* m_pEvtHandler;
@@ -106,6 +106,17 @@ static const t_Option options[OPTIONS_NUM] =
 	{ "Size format", number, _T("0"), normal },
 	{ "Size thousands separator", number, _T("1"), normal },
 	{ "Size decimal places", number, _T("1"), normal },
+	{ "I/O buffer size", number, _T("131072"), normal },
+	{ "I/O buffer count", number, _T("5"), normal },
+	{ "I/O adaptive buffers", number, _T("1"), normal },
+	{ "I/O max buffer count", number, _T("32"), normal },
+	{ "I/O buffer memory limit", number, _T("256"), normal },
+	{ "I/O zero-copy transfers", number, _T("0"), normal },
+	{ "Event loop count", number, _T("0"), normal },
+	{ "Directory cache file", string, _T(""), normal },
+	{ "Directory cache memory limit", number, _T("128"), normal },
+	{ "FTP pipeline depth", number, _T("8"), normal },
+	{ "SFTP maximum window", number, _T("32"), normal },
 
 	// Interface settings
 	{ "Number of Transfers", number, _T("2"), normal },
@@ -501,6 +512,38 @@ int COptions::Validate(unsigned int nID, int value)
 		if (value < 0 || value >= CSizeFormat::formats_count)
 			value = 0;
 		break;
+	case OPTION_IO_BUFFERSIZE:
+		if (value < 4096 || value > 4096 * 4096)
+			value = 131072;
+		break;
+	case OPTION_IO_BUFFERCOUNT:
+		if (value < 2 || value > 64)
+			value = 5;
+		break;
+	case OPTION_IO_MAX_BUFFERCOUNT:
+		if (value < 2 || value > 1024)
+			value = 32;
+		break;
+	case OPTION_IO_BUFFER_MEMORY:
+		if (value < 1 || value > 65536)
+			value = 256;
+		break;
+	case OPTION_EVENT_LOOPS:
+		if (value < 0 || value > 64)
+			value = 0;
+		break;
+	case OPTION_DIRECTORYCACHE_MEMORY:
+		if (value < 1 || value > 65536)
+			value = 128;
+		break;
+	case OPTION_FTP_PIPELINE_DEPTH:
+		if (value < 1 || value > 64)
+			value = 8;
+		break;
+	case OPTION_SFTP_MAX_WINDOW:
+		if (value < 4 || value > 1024)
+			value = 32;
+		break;
 	}
 	return value;
 }
@@ -35,6 +35,12 @@
 #include <powrprof.h>
 #endif
 
+#include <algorithm>
+
+// Number of stored files loaded at once. The first page gets loaded on
+// startup, the others in the background.
+#define QUEUE_LOAD_PAGE_SIZE 10000
+
 class CQueueViewDropTarget : public CScrollableDropTarget<wxListCtrlEx>
 {
 public:
@@ -470,6 +476,8 @@ CQueueView::CQueueView(CQueue* parent, int index, CMainFrame* pMainFrame, CAsync
 #endif
 
 	m_resize_timer.SetOwner(this);
+	m_journal_timer.SetOwner(this);
+	m_load_timer.SetOwner(this);
 
 #if WITH_LIBDBUS
 	m_desktop_notification = 0;
@@ -486,6 +494,8 @@ CQueueView::~CQueueView()
 	DeleteEngines();
 
 	m_resize_timer.Stop();
+	m_journal_timer.Stop();
+	m_load_timer.Stop();
 
 #if WITH_LIBDBUS
 	delete m_desktop_notification;
@@ -1291,6 +1301,10 @@ bool CQueueView::RemoveItem(CQueueItem* item, bool destroy, bool updateItemCount
 		}
 	}
 
+	// If this removes the last child, the row of the server item is kept as
+	// files not loaded yet may still belong to it. It gets purged on next start.
+	JournalRemove(item);
+
 	bool didRemoveParent = CQueueViewBase::RemoveItem(item, destroy, updateItemCount, updateSelections);
 
 	UpdateStatusLinePositions();
@@ -1546,6 +1560,9 @@ bool CQueueView::Quit()
 
 	DeleteEngines();
 
+	// Files not loaded yet stay stored
+	m_load_timer.Stop();
+
 	if (m_quit == 1) {
 		SaveQueue();
 		m_quit = 2;
@@ -1576,6 +1593,10 @@ void CQueueView::CheckQueueState()
 	if (m_activeCount)
 		return;
 
+	// Not done yet if there are still files to load
+	if (m_activeMode && !m_quit && m_queue_storage.HasUnloadedFiles())
+		return;
+
 	if (m_activeMode) {
 		m_activeMode = 0;
 		/* Users don't seem to like this, so comment it out for now.
@@ -1606,6 +1627,7 @@ void CQueueView::CheckQueueState()
 bool CQueueView::IncreaseErrorCount(t_EngineData& engineData)
 {
 	++engineData.pItem->m_errorCount;
+	JournalUpdate(engineData.pItem);
 	if (engineData.pItem->m_errorCount <= COptions::Get()->GetOptionVal(OPTION_RECONNECTCOUNT))
 		return true;
 
@@ -1829,6 +1851,8 @@ void CQueueView::SaveQueue()
 	// just as extra precaution. Better 'save' than sorry.
 	CInterProcessMutex mutex(MUTEX_QUEUE);
 
+	m_journal_timer.Stop();
+
 	if (!m_queue_storage.SaveQueue(m_serverList))
 	{
 		wxString msg = wxString::Format(_("An error occurred saving the transfer queue to \"%s\".\nSome queue items might not have been saved."), m_queue_storage.GetDatabaseFilename());
@@ -1836,6 +1860,44 @@ void CQueueView::SaveQueue()
 	}
 }
 
+void CQueueView::JournalUpdate(CQueueItem* pItem)
+{
+	if (!m_queue_storage.Journaling())
+		return;
+
+	if (pItem->GetType() == QueueItemType::Server) {
+		const std::vector<CQueueItem*>& children = pItem->GetChildren();
+		for (auto iter = children.begin(); iter != children.end(); ++iter) {
+			if (*iter)
+				JournalUpdate(*iter);
+		}
+	}
+	else if (pItem->GetType() == QueueItemType::File || pItem->GetType() == QueueItemType::Folder) {
+		m_queue_storage.UpdateItem(*static_cast<CFileItem*>(pItem));
+		ScheduleJournalFlush();
+	}
+}
+
+void CQueueView::JournalRemove(CQueueItem* pItem)
+{
+	if (!m_queue_storage.Journaling())
+		return;
+
+	if (pItem->GetType() == QueueItemType::Server)
+		m_queue_storage.RemoveServer(*static_cast<CServerItem*>(pItem));
+	else if (pItem->GetType() == QueueItemType::File || pItem->GetType() == QueueItemType::Folder)
+		m_queue_storage.RemoveItem(*static_cast<CFileItem*>(pItem));
+
+	ScheduleJournalFlush();
+}
+
+void CQueueView::ScheduleJournalFlush()
+{
+	// Commit changes in batches, a crash loses at most the last second
+	if (m_queue_storage.HasPendingChanges() && !m_journal_timer.IsRunning())
+		m_journal_timer.Start(1000, true);
+}
+
 void CQueueView::LoadQueueFromXML()
 {
 	CXmlFile xml(wxGetApp().GetSettingsFile(_T("queue")));
@@ -1873,58 +1935,85 @@ void CQueueView::LoadQueue()
 
 	LoadQueueFromXML();
 
-	bool error = false;
-
 	if (!m_queue_storage.BeginTransaction())
-		error = true;
+		m_loadError = true;
 	else
 	{
 		CServer server;
 		int64_t id;
 		for (id = m_queue_storage.GetServer(server, true); id > 0; id = m_queue_storage.GetServer(server, false))
-		{
-			m_insertionStart = -1;
-			m_insertionCount = 0;
-			CServerItem *pServerItem = CreateServerItem(server);
-
-			CFileItem* fileItem = 0;
-			int64_t fileId;
-			for (fileId = m_queue_storage.GetFile(&fileItem, id); fileItem; fileId = m_queue_storage.GetFile(&fileItem, 0))
-			{
-				fileItem->SetParent(pServerItem);
-				fileItem->SetPriority(fileItem->GetPriority());
-				InsertItem(pServerItem, fileItem);
-			}
-			if (fileId < 0)
-				error = true;
-
-			if (!pServerItem->GetChild(0))
-			{
-				m_itemCount--;
-				m_serverList.pop_back();
-				delete pServerItem;
-			}
-		}
+			m_storedServers[id] = server;
 		if (id < 0)
-			error = true;
+			m_loadError = true;
 
-		if (COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 2)
-			if (!m_queue_storage.Clear())
-				error = true;
+		if (!LoadStoredFiles())
+			m_loadError = true;
 
 		if (!m_queue_storage.EndTransaction())
-			error = true;
+			m_loadError = true;
+	}
 
-		if (!m_queue_storage.Vacuum())
-			error = true;
+	if (m_queue_storage.HasUnloadedFiles())
+		m_load_timer.Start(10, true);
+	else
+		FinishLoading();
+}
+
+bool CQueueView::LoadStoredFiles()
+{
+	int64_t serverId = 0;
+	CServerItem* pServerItem = 0;
+
+	CFileItem* fileItem = 0;
+	int64_t server;
+	int64_t fileId;
+	for (fileId = m_queue_storage.GetFile(&fileItem, server, QUEUE_LOAD_PAGE_SIZE); fileItem; fileId = m_queue_storage.GetFile(&fileItem, server))
+	{
+		if (server != serverId) {
+			// Finish the range of items inserted for the previous server
+			CommitChanges();
+
+			pServerItem = CreateServerItem(m_storedServers[server]);
+			if (!pServerItem->m_storageId)
+				pServerItem->m_storageId = server;
+			else if (pServerItem->m_storageId != server) {
+				auto& merged = pServerItem->m_mergedStorageIds;
+				if (std::find(merged.begin(), merged.end(), server) == merged.end())
+					merged.push_back(server);
+			}
+			serverId = server;
+		}
+
+		// Keeps the row, the item is already stored
+		fileItem->m_storageId = fileId;
+		fileItem->SetParent(pServerItem);
+		fileItem->SetPriority(fileItem->GetPriority());
+		InsertItem(pServerItem, fileItem);
 	}
 
-	m_insertionStart = -1;
-	m_insertionCount = 0;
 	CommitChanges();
 
-	if (error)
+	return fileId == 0;
+}
+
+void CQueueView::FinishLoading()
+{
+	m_load_timer.Stop();
+	m_storedServers.clear();
+
+	if (!m_queue_storage.Purge())
+		m_loadError = true;
+
+	// The queue stays in the database, only compact it if there is nothing
+	// to rewrite.
+	if (m_serverList.empty() && m_queue_storage.Journaling())
+		if (!m_queue_storage.Vacuum())
+			m_loadError = true;
+
+	if (m_loadError)
 	{
+		m_loadError = false;
+
 		wxString file = CQueueStorage::GetDatabaseFilename();
 		wxString msg = wxString::Format(_("An error occurred loading the transfer queue from \"%s\".\nSome queue items might not have been restored."), file);
 		wxMessageBoxEx(msg, _("Error loading queue"), wxICON_ERROR);
@@ -2179,10 +2268,17 @@ void CQueueView::RemoveAll()
 			SetItemState(item, 0, wxLIST_STATE_SELECTED);
 	}
 
+	bool const loading = m_queue_storage.HasUnloadedFiles();
+	if (loading)
+		m_queue_storage.RemoveUnloadedFiles();
+
 	std::vector<CServerItem*> newServerList;
 	m_itemCount = 0;
 	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter)
 	{
+		// Active items remaining are pending removal
+		JournalRemove(*iter);
+
 		if ((*iter)->TryRemoveAll())
 			delete *iter;
 		else
@@ -2208,6 +2304,9 @@ void CQueueView::RemoveAll()
 	m_serverList = newServerList;
 	UpdateStatusLinePositions();
 
+	if (loading)
+		FinishLoading();
+
 	CalculateQueueSize();
 
 	CheckQueueState();
@@ -2272,6 +2371,7 @@ void CQueueView::OnRemoveSelected(wxCommandEvent&)
 		else if (pItem->GetType() == QueueItemType::Server)
 		{
 			CServerItem* pServer = (CServerItem*)pItem;
+			JournalRemove(pServer);
 			StopItem(pServer);
 
 			// Server items get deleted automatically if all children are gone
@@ -2403,8 +2503,10 @@ void CQueueView::OnFolderThreadFiles(wxCommandEvent&)
 
 void CQueueView::SetDefaultFileExistsAction(enum CFileExistsNotification::OverwriteAction action, const TransferDirection direction)
 {
-	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter)
+	for (auto iter = m_serverList.begin(); iter != m_serverList.end(); ++iter) {
 		(*iter)->SetDefaultFileExistsAction(action, direction);
+		JournalUpdate(*iter);
+	}
 }
 
 void CQueueView::OnSetDefaultFileExistsAction(wxCommandEvent &)
@@ -2532,6 +2634,8 @@ void CQueueView::OnSetDefaultFileExistsAction(wxCommandEvent &)
 		default:
 			break;
 		}
+
+		JournalUpdate(pItem);
 	}
 }
 
@@ -2711,6 +2815,7 @@ void CQueueView::UpdateItemSize(CFileItem* pItem, wxLongLong size)
 		m_totalQueueSize += size.GetValue();
 
 	pItem->SetSize(size);
+	JournalUpdate(pItem);
 
 	DisplayQueueSize();
 }
@@ -2762,6 +2867,11 @@ void CQueueView::InsertItem(CServerItem* pServerItem, CQueueItem* pItem)
 {
 	CQueueViewBase::InsertItem(pServerItem, pItem);
 
+	if (pItem->GetType() == QueueItemType::File || pItem->GetType() == QueueItemType::Folder) {
+		m_queue_storage.AddItem(*pServerItem, *static_cast<CFileItem*>(pItem));
+		ScheduleJournalFlush();
+	}
+
 	if (pItem->GetType() == QueueItemType::File) {
 		CFileItem* pFileItem = (CFileItem*)pItem;
 
@@ -2797,6 +2907,25 @@ void CQueueView::OnTimer(wxTimerEvent& event)
 		return;
 	}
 
+	if (id == m_journal_timer.GetId()) {
+		m_queue_storage.Flush();
+		return;
+	}
+
+	if (id == m_load_timer.GetId()) {
+		if (!LoadStoredFiles())
+			m_loadError = true;
+
+		if (m_queue_storage.HasUnloadedFiles())
+			m_load_timer.Start(10, true);
+		else
+			FinishLoading();
+
+		if (m_activeMode)
+			AdvanceQueue();
+		return;
+	}
+
 	if (id == m_folderscan_item_refresh_timer.GetId()) {
 		if (m_queuedFolders[1].empty())
 			return;
@@ -2879,6 +3008,7 @@ void CQueueView::OnSetPriority(wxCommandEvent& event)
 			pSkip = 0;
 
 		pItem->SetPriority(priority);
+		JournalUpdate(pItem);
 	}
 
 	RefreshListOnly();
@@ -3289,6 +3419,7 @@ void CQueueView::RenameFileInTransfer(CFileZillaEngine *pEngine, const wxString&
 	}
 	else
 		pFile->SetTargetFile(newName);
+	JournalUpdate(pFile);
 
 	RefreshItem(pFile);
 }
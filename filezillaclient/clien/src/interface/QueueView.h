@@ -311,6 +311,20 @@ protected:
 
 	CQueueStorage m_queue_storage;
 
+	// Pass changes to queue items on to the journal of the queue storage.
+	// Server items include all their children.
+	void JournalUpdate(CQueueItem* pItem);
+	void JournalRemove(CQueueItem* pItem);
+	void ScheduleJournalFlush();
+	wxTimer m_journal_timer;
+
+	// Stored files are loaded in pages, see LoadQueue
+	bool LoadStoredFiles();
+	void FinishLoading();
+	std::map<int64_t, CServer> m_storedServers;
+	wxTimer m_load_timer;
+	bool m_loadError{};
+
 	// Get the current transfer speed.
 	// Unit is byte/s.
 	wxFileOffset GetCurrentSpeed(bool countDownload, bool countUpload);
@@ -1729,6 +1729,9 @@ void CRemoteListView::OnMenuChmod(wxCommandEvent&)
 	CRecursiveOperation* pRecursiveOperation = m_pState->GetRecursiveOperationHandler();
 	wxASSERT(pRecursiveOperation);
 
+	// Files of the current directory are changed in a single command
+	std::vector<std::pair<wxString, wxString>> filesToChmod;
+
 	item = -1;
 	for (;;)
 	{
@@ -1763,13 +1766,16 @@ void CRemoteListView::OnMenuChmod(wxCommandEvent&)
 			bool res = pChmodDlg->ConvertPermissions(*entry.permissions, permissions);
 			wxString newPerms = pChmodDlg->GetPermissions(res ? permissions : 0, entry.is_dir());
 
-			m_pState->m_pCommandQueue->ProcessCommand(new CChmodCommand(m_pDirectoryListing->path, entry.name, newPerms));
+			filesToChmod.emplace_back(entry.name, newPerms);
 		}
 
 		if (pChmodDlg->Recursive() && entry.is_dir())
 			pRecursiveOperation->AddDirectoryToVisit(m_pDirectoryListing->path, entry.name);
 	}
 
+	if (!filesToChmod.empty())
+		m_pState->m_pCommandQueue->ProcessCommand(new CChmodCommand(m_pDirectoryListing->path, filesToChmod));
+
 	if (pChmodDlg->Recursive())
 	{
 		if (IsComparing())
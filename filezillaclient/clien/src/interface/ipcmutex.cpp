@@ -85,8 +85,9 @@ int CInterProcessMutex::TryLock()
 #ifdef __WXMSW__
 	if (!hMutex)
 	{
+		// Can't do any locking in this case
 		m_locked = false;
-		return 0;
+		return -1;
 	}
 
 	int res = ::WaitForSingleObject(hMutex, 1);
@@ -95,6 +96,8 @@ int CInterProcessMutex::TryLock()
 		m_locked = true;
 		return 1;
 	}
+
+	return 0;
 #else
 	if (m_fd >= 0)
 	{
@@ -120,9 +123,10 @@ int CInterProcessMutex::TryLock()
 		m_locked = true;
 		return 1;
 	}
-#endif
 
-	return 0;
+	// Can't do any locking in this case
+	return -1;
+#endif
 }
 
 void CInterProcessMutex::Unlock()
@@ -7,6 +7,50 @@
 #include "timeformatting.h"
 #include "themeprovider.h"
 
+#include <algorithm>
+#include <unordered_map>
+
+void CFenwickTree::push_back(int weight)
+{
+	// The new node covers the positions after its index with the lowest
+	// set bit cleared, add up the nodes covering the ones in front of it.
+	size_t const i = m_tree.size() + 1;
+	size_t const first = i & (i - 1);
+	for (size_t j = i - 1; j > first; j &= j - 1)
+		weight += m_tree[j - 1];
+	m_tree.push_back(weight);
+}
+
+void CFenwickTree::add(size_t pos, int delta)
+{
+	for (size_t i = pos + 1; i <= m_tree.size(); i += i & (~i + 1))
+		m_tree[i - 1] += delta;
+}
+
+int CFenwickTree::prefix(size_t pos) const
+{
+	int sum = 0;
+	for (size_t i = pos; i > 0; i &= i - 1)
+		sum += m_tree[i - 1];
+	return sum;
+}
+
+size_t CFenwickTree::find(int sum) const
+{
+	size_t step = 1;
+	while (step * 2 <= m_tree.size())
+		step *= 2;
+
+	size_t pos = 0;
+	for (; step; step /= 2) {
+		if (pos + step <= m_tree.size() && m_tree[pos + step - 1] <= sum) {
+			pos += step;
+			sum -= m_tree[pos - 1];
+		}
+	}
+	return pos;
+}
+
 CQueueItem::CQueueItem(CQueueItem* parent)
 	: m_parent(parent)
 {
@@ -14,209 +58,155 @@ CQueueItem::CQueueItem(CQueueItem* parent)
 
 CQueueItem::~CQueueItem()
 {
-	for (auto iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
+	for (auto iter = m_children.begin(); iter != m_children.end(); ++iter)
 		delete *iter;
 }
 
 void CQueueItem::SetPriority(QueuePriority priority)
 {
-	for (auto iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
-		(*iter)->SetPriority(priority);
+	for (auto iter = m_children.begin(); iter != m_children.end(); ++iter) {
+		if (*iter)
+			(*iter)->SetPriority(priority);
+	}
 }
 
-void CQueueItem::AddChild(CQueueItem* item)
+void CQueueItem::AddVisibleOffspring(int delta)
 {
-	if (m_removed_at_front) {
-		m_children.erase(m_children.begin(), m_children.begin() + m_removed_at_front);
-		m_removed_at_front = 0;
+	m_visibleOffspring += delta;
+	for (CQueueItem* item = this; item->m_parent; item = item->m_parent) {
+		item->m_parent->m_childRows.add(item->m_indexInParent, delta);
+		item->m_parent->m_visibleOffspring += delta;
 	}
+}
+
+void CQueueItem::AddChild(CQueueItem* item)
+{
+	item->m_parent = this;
+	item->m_indexInParent = m_children.size();
 	m_children.push_back(item);
+	m_childRows.push_back(1 + item->m_visibleOffspring);
+	m_childPresent.push_back(1);
 
-	m_visibleOffspring += 1 + item->m_visibleOffspring;
-	m_maxCachedIndex = -1;
-	CQueueItem* parent = GetParent();
-	while (parent)
-	{
-		parent->m_visibleOffspring += 1 + item->m_visibleOffspring;
-		parent->m_maxCachedIndex = -1;
-		parent = parent->GetParent();
-	}
+	AddVisibleOffspring(1 + item->m_visibleOffspring);
 }
 
 CQueueItem* CQueueItem::GetChild(unsigned int item, bool recursive /*=true*/)
 {
-	std::vector<CQueueItem*>::iterator iter;
-	if (!recursive)
-	{
-		if (item + m_removed_at_front >= m_children.size())
+	if (!recursive) {
+		if (item >= m_children.size() - m_removedChildren)
 			return 0;
-		iter = m_children.begin();
-		iter += item + m_removed_at_front;
-		return *iter;
-	}
-
-	if ((int)item <= m_maxCachedIndex)
-	{
-		// Index is cached
-		iter = m_children.begin() + m_removed_at_front;
-		iter += m_lookupCache[item].child;
-		item -= m_lookupCache[item].index;
-		if (!item)
-			return *iter;
-		else
-			return (*iter)->GetChild(item - 1);
+		return m_children[m_childPresent.find(item)];
 	}
 
-	int index;
-	int child;
-	iter = m_children.begin() + m_removed_at_front;
-	if (m_maxCachedIndex == -1)
-	{
-		child = 0;
-		index = 0;
-	}
-	else
-	{
-		// Start with loop with the last cached item index
-		iter += m_lookupCache[m_maxCachedIndex].child + 1;
-		item -= m_maxCachedIndex + 1;
-		index = m_maxCachedIndex + 1;
-		child = m_lookupCache[m_maxCachedIndex].child + 1;
-	}
+	if ((int)item >= m_visibleOffspring)
+		return 0;
 
-	for (; iter != m_children.end(); ++iter, ++child)
-	{
-		if (!item)
-			return *iter;
+	size_t const pos = m_childRows.find(item);
+	item -= m_childRows.prefix(pos);
+	if (!item)
+		return m_children[pos];
 
-		unsigned int count = (*iter)->GetChildrenCount(true);
-		if (item > count)
-		{
-			if (m_maxCachedIndex == -1 && m_lookupCache.size() < (unsigned int)m_visibleOffspring)
-				m_lookupCache.resize(m_visibleOffspring);
-			for (unsigned int k = index; k <= index + count; k++)
-			{
-				m_lookupCache[k].child = child;
-				m_lookupCache[k].index = index;
-			}
-			m_maxCachedIndex = index + count;
-			item -= count + 1;
-			index += count + 1;
-			continue;
-		}
-
-		return (*iter)->GetChild(item - 1);
-	}
-	return 0;
+	return m_children[pos]->GetChild(item - 1);
 }
 
 unsigned int CQueueItem::GetChildrenCount(bool recursive)
 {
 	if (!recursive)
-		return m_children.size() - m_removed_at_front;
+		return m_children.size() - m_removedChildren;
 
 	return m_visibleOffspring;
 }
 
-bool CQueueItem::RemoveChild(CQueueItem* pItem, bool destroy /*=true*/)
+void CQueueItem::RemoveChildAt(size_t pos)
 {
-	int oldVisibleOffspring = m_visibleOffspring;
-	bool deleted = false;
-	for (auto iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
-	{
-		if (*iter == pItem)
-		{
-			m_visibleOffspring -= 1;
-			m_visibleOffspring -= pItem->m_visibleOffspring;
-			if (destroy)
-				delete pItem;
+	CQueueItem* const child = m_children[pos];
+	int const rows = 1 + child->m_visibleOffspring;
 
-			if (iter - m_children.begin() - m_removed_at_front <= 10)
-			{
-				m_removed_at_front++;
-				unsigned int end = iter - m_children.begin();
-				int c = 0;
-				for (int i = end; i >= m_removed_at_front; i--, c++)
-					m_children[i] = m_children[i - 1];
-			}
-			else
-				m_children.erase(iter);
+	m_children[pos] = 0;
+	++m_removedChildren;
+	m_childRows.add(pos, -rows);
+	m_childPresent.add(pos, -1);
+	AddVisibleOffspring(-rows);
 
-			deleted = true;
-			break;
+	// Compact once at least half the entries are gone, so that removals
+	// stay cheap on average.
+	if (m_removedChildren * 2 >= m_children.size()) {
+		std::vector<CQueueItem*> children;
+		children.reserve(m_children.size() - m_removedChildren);
+		for (auto iter = m_children.begin(); iter != m_children.end(); ++iter) {
+			if (*iter)
+				children.push_back(*iter);
 		}
+		SetChildren(children);
+	}
+}
 
-		int visibleOffspring = (*iter)->m_visibleOffspring;
-		if ((*iter)->RemoveChild(pItem, destroy))
-		{
-			m_visibleOffspring -= visibleOffspring - (*iter)->m_visibleOffspring;
-			if (!((*iter)->m_children.size() - (*iter)->m_removed_at_front))
-			{
-				m_visibleOffspring -= 1;
-				delete *iter;
-
-				if (iter - m_children.begin() - m_removed_at_front <= 10)
-				{
-					m_removed_at_front++;
-					unsigned int end = iter - m_children.begin();
-					for (int i = end; i >= m_removed_at_front; i--)
-						m_children[i] = m_children[i - 1];
-				}
-				else
-					m_children.erase(iter);
-			}
+bool CQueueItem::RemoveChild(CQueueItem* pItem, bool destroy /*=true*/)
+{
+	if (!pItem || pItem == this)
+		return false;
 
-			deleted = true;
-			break;
-		}
+	// Find the child of this item the removed item belongs to
+	CQueueItem* child = pItem;
+	while (child->m_parent != this) {
+		child = child->m_parent;
+		if (!child)
+			return false;
 	}
-
-	if (!deleted)
+	if (child->m_indexInParent >= m_children.size() || m_children[child->m_indexInParent] != child)
 		return false;
 
-	m_maxCachedIndex = -1;
+	if (child != pItem) {
+		if (!child->RemoveChild(pItem, destroy))
+			return false;
 
-	// Propagate new children count to parent
-	CQueueItem* parent = GetParent();
-	while (parent)
-	{
-		parent->m_maxCachedIndex = -1;
-		parent->m_visibleOffspring -= oldVisibleOffspring - m_visibleOffspring;
-		parent = parent->GetParent();
+		// Don't keep items around which lost all their children
+		if (child->GetChildrenCount(false))
+			return true;
+		destroy = true;
 	}
 
+	RemoveChildAt(child->m_indexInParent);
+	if (destroy)
+		delete child;
+
 	return true;
 }
 
+void CQueueItem::SetChildren(std::vector<CQueueItem*> const& children)
+{
+	m_children = children;
+	m_removedChildren = 0;
+	m_childRows.clear();
+	m_childPresent.clear();
+
+	int visibleOffspring = 0;
+	for (size_t i = 0; i < m_children.size(); ++i) {
+		CQueueItem* pItem = m_children[i];
+		pItem->m_parent = this;
+		pItem->m_indexInParent = i;
+		m_childRows.push_back(1 + pItem->m_visibleOffspring);
+		m_childPresent.push_back(1);
+		visibleOffspring += 1 + pItem->m_visibleOffspring;
+	}
+
+	AddVisibleOffspring(visibleOffspring - m_visibleOffspring);
+}
+
 bool CQueueItem::TryRemoveAll()
 {
-	const int oldVisibleOffspring = m_visibleOffspring;
-	std::vector<CQueueItem*>::iterator iter;
 	std::vector<CQueueItem*> keepChildren;
-	m_visibleOffspring = 0;
-	for (iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
+	for (auto iter = m_children.begin(); iter != m_children.end(); ++iter)
 	{
 		CQueueItem* pItem = *iter;
+		if (!pItem)
+			continue;
 		if (pItem->TryRemoveAll())
 			delete pItem;
 		else
-		{
 			keepChildren.push_back(pItem);
-			m_visibleOffspring++;
-			m_visibleOffspring += pItem->GetChildrenCount(true);
-		}
-	}
-	m_children = keepChildren;
-	m_maxCachedIndex = -1;
-	m_removed_at_front = 0;
-
-	CQueueItem* parent = GetParent();
-	while (parent)
-	{
-		parent->m_maxCachedIndex = -1;
-		parent->m_visibleOffspring -= oldVisibleOffspring - m_visibleOffspring;
-		parent = parent->GetParent();
 	}
+	SetChildren(keepChildren);
 
 	return m_children.empty();
 }
@@ -259,26 +249,140 @@ int CQueueItem::GetItemIndex() const
 	if (!pParent)
 		return 0;
 
-	int index = 1;
-	for (std::vector<CQueueItem*>::const_iterator iter = pParent->m_children.begin() + pParent->m_removed_at_front; iter != pParent->m_children.end(); ++iter)
+	return 1 + pParent->m_childRows.prefix(m_indexInParent) + pParent->GetItemIndex();
+}
+
+namespace {
+struct queue_paths_hash
+{
+	// The keys contain a null character, wxStringHash would stop there
+	size_t operator()(wxString const& key) const
 	{
-		if (*iter == this)
-			break;
+		return std::hash<std::wstring>()(key.ToStdWstring());
+	}
+};
 
-		index += (*iter)->GetChildrenCount(true) + 1;
+typedef std::unordered_map<wxString, CQueuePaths*, queue_paths_hash> queue_paths_map;
+
+// Interned paths, keyed by local path and safe remote path. Never destroyed,
+// so that items deleted late during shutdown can still release theirs.
+queue_paths_map& GetQueuePathsMap()
+{
+	static auto* map = new queue_paths_map;
+	return *map;
+}
+
+CQueuePaths* lastQueuePaths{};
+}
+
+CQueuePaths::CQueuePaths(const CLocalPath& localPath, const CServerPath& remotePath, const wxString& key)
+	: m_localPath(localPath)
+	, m_remotePath(remotePath)
+	, m_key(key)
+{
+}
+
+CQueuePaths* CQueuePaths::Get(const CLocalPath& localPath, const CServerPath& remotePath)
+{
+	// Files usually get queued directory by directory
+	if (lastQueuePaths && lastQueuePaths->m_localPath == localPath && lastQueuePaths->m_remotePath == remotePath) {
+		++lastQueuePaths->m_refcount;
+		return lastQueuePaths;
 	}
 
-	return index + pParent->GetItemIndex();
+	wxString key = localPath.GetPath();
+	key += _T('\0');
+	key += remotePath.GetSafePath();
+
+	auto& map = GetQueuePathsMap();
+	auto it = map.find(key);
+	if (it != map.end()) {
+		++it->second->m_refcount;
+	}
+	else {
+		it = map.emplace(key, new CQueuePaths(localPath, remotePath, key)).first;
+	}
+
+	lastQueuePaths = it->second;
+	return it->second;
+}
+
+void CQueuePaths::release::operator()(CQueuePaths* paths) const
+{
+	if (--paths->m_refcount) {
+		return;
+	}
+
+	if (lastQueuePaths == paths) {
+		lastQueuePaths = 0;
+	}
+	GetQueuePathsMap().erase(paths->m_key);
+	delete paths;
+}
+
+namespace {
+/* File names are kept in a single allocation per item: a tag character,
+ * then the null-terminated source name, then the null-terminated target
+ * name which is empty if there is none.
+ *
+ * The names are stored as UTF-8, taking a fraction of the memory of a
+ * wxString. Names which do not survive the conversion, e.g. Windows names
+ * with unpaired surrogates, are stored as wide characters instead. These
+ * start at an offset of sizeof(wchar_t) to keep them aligned.
+ */
+char const names_utf8 = 0;
+char const names_wide = 1;
+
+std::unique_ptr<char[]> EncodeNames(wxString const& source, wxString const& target)
+{
+	wxScopedCharBuffer const source_utf8 = source.utf8_str();
+	wxScopedCharBuffer const target_utf8 = target.utf8_str();
+	if (wxString::FromUTF8(source_utf8.data(), source_utf8.length()) == source &&
+		wxString::FromUTF8(target_utf8.data(), target_utf8.length()) == target)
+	{
+		std::unique_ptr<char[]> names(new char[1 + source_utf8.length() + 1 + target_utf8.length() + 1]);
+		char* p = names.get();
+		*p++ = names_utf8;
+		memcpy(p, source_utf8.data(), source_utf8.length() + 1);
+		p += source_utf8.length() + 1;
+		memcpy(p, target_utf8.data(), target_utf8.length() + 1);
+		return names;
+	}
+
+	size_t const source_len = source.size() + 1;
+	size_t const target_len = target.size() + 1;
+	std::unique_ptr<char[]> names(new char[sizeof(wchar_t) * (1 + source_len + target_len)]);
+	names[0] = names_wide;
+	wchar_t* p = reinterpret_cast<wchar_t*>(names.get()) + 1;
+	memcpy(p, source.wc_str(), sizeof(wchar_t) * source_len);
+	memcpy(p + source_len, target.wc_str(), sizeof(wchar_t) * target_len);
+	return names;
+}
+
+wxString DecodeName(char const* names, bool target)
+{
+	if (names[0] == names_utf8) {
+		char const* p = names + 1;
+		if (target) {
+			p += strlen(p) + 1;
+		}
+		return wxString::FromUTF8(p);
+	}
+
+	wchar_t const* p = reinterpret_cast<wchar_t const*>(names) + 1;
+	if (target) {
+		p += wcslen(p) + 1;
+	}
+	return wxString(p);
+}
 }
 
 CFileItem::CFileItem(CServerItem* parent, bool queued, bool download,
 					 const wxString& sourceFile, const wxString& targetFile,
 					 const CLocalPath& localPath, const CServerPath& remotePath, wxLongLong size)
 	: CQueueItem(parent)
-	, m_sourceFile(sourceFile)
-	, m_targetFile(targetFile.empty() ? CSparseOptional<wxString>() : CSparseOptional<wxString>(targetFile))
-	, m_localPath(localPath)
-	, m_remotePath(remotePath)
+	, m_names(EncodeNames(sourceFile, targetFile))
+	, m_paths(CQueuePaths::Get(localPath, remotePath))
 	, m_size(size)
 {
 	if (download)
@@ -316,6 +420,9 @@ QueuePriority CFileItem::GetPriority() const
 
 void CFileItem::SetActive(const bool active)
 {
+	if (active != IsActive() && m_parent)
+		static_cast<CServerItem*>(m_parent)->SetChildActive(this, active);
+
 	if (active && !IsActive())
 	{
 		AddChild(new CStatusItem);
@@ -336,9 +443,9 @@ void CFileItem::SaveItem(TiXmlElement* pElement) const
 
 	TiXmlElement *file = pElement->LinkEndChild(new TiXmlElement("File"))->ToElement();
 
-	AddTextElement(file, "LocalFile", m_localPath.GetPath() + GetLocalFile());
+	AddTextElement(file, "LocalFile", GetLocalPath().GetPath() + GetLocalFile());
 	AddTextElement(file, "RemoteFile", GetRemoteFile());
-	AddTextElement(file, "RemotePath", m_remotePath.GetSafePath());
+	AddTextElement(file, "RemotePath", GetRemotePath().GetSafePath());
 	AddTextElementRaw(file, "Download", Download() ? "1" : "0");
 	if (m_size != -1)
 		AddTextElement(file, "Size", m_size.ToString());
@@ -360,12 +467,34 @@ bool CFileItem::TryRemoveAll()
 	return false;
 }
 
+wxString CFileItem::GetSourceFile() const
+{
+	return DecodeName(m_names.get(), false);
+}
+
+CSparseOptional<wxString> CFileItem::GetTargetFile() const
+{
+	wxString target = DecodeName(m_names.get(), true);
+	if (target.empty())
+		return CSparseOptional<wxString>();
+	return CSparseOptional<wxString>(target);
+}
+
+wxString CFileItem::GetTargetOrSourceFile() const
+{
+	wxString target = DecodeName(m_names.get(), true);
+	if (target.empty())
+		return DecodeName(m_names.get(), false);
+	return target;
+}
+
 void CFileItem::SetTargetFile(wxString const& file)
 {
-	if (!file.empty() && file != m_sourceFile)
-		m_targetFile = CSparseOptional<wxString>(file);
+	wxString const source = GetSourceFile();
+	if (!file.empty() && file != source)
+		m_names = EncodeNames(source, file);
 	else
-		m_targetFile.clear();
+		m_names = EncodeNames(source, wxString());
 }
 
 void CFileItem::SetStatusMessage(CFileItem::Status status)
@@ -414,7 +543,7 @@ void CFolderItem::SaveItem(TiXmlElement* pElement) const
 	else
 	{
 		AddTextElement(file, "RemoteFile", GetRemoteFile());
-		AddTextElement(file, "RemotePath", m_remotePath.GetSafePath());
+		AddTextElement(file, "RemotePath", GetRemotePath().GetSafePath());
 	}
 	AddTextElementRaw(file, "Download", Download() ? "1" : "0");
 
@@ -423,12 +552,74 @@ void CFolderItem::SaveItem(TiXmlElement* pElement) const
 
 void CFolderItem::SetActive(const bool active)
 {
+	if (active != IsActive() && m_parent)
+		static_cast<CServerItem*>(m_parent)->SetChildActive(this, active);
+
 	if (active)
 		flags |= flag_active;
 	else
 		flags &= ~flag_active;
 }
 
+void CFileItemList::push_back(CFileItem* pItem)
+{
+	pItem->m_prevListed = m_tail;
+	pItem->m_nextListed = 0;
+	pItem->m_list = this;
+	if (m_tail)
+		m_tail->m_nextListed = pItem;
+	else
+		m_head = pItem;
+	m_tail = pItem;
+}
+
+void CFileItemList::push_front(CFileItem* pItem)
+{
+	pItem->m_prevListed = 0;
+	pItem->m_nextListed = m_head;
+	pItem->m_list = this;
+	if (m_head)
+		m_head->m_prevListed = pItem;
+	else
+		m_tail = pItem;
+	m_head = pItem;
+}
+
+void CFileItemList::remove(CFileItem* pItem)
+{
+	if (pItem->m_prevListed)
+		pItem->m_prevListed->m_nextListed = pItem->m_nextListed;
+	else
+		m_head = pItem->m_nextListed;
+	if (pItem->m_nextListed)
+		pItem->m_nextListed->m_prevListed = pItem->m_prevListed;
+	else
+		m_tail = pItem->m_prevListed;
+
+	pItem->m_prevListed = 0;
+	pItem->m_nextListed = 0;
+	pItem->m_list = 0;
+}
+
+void CFileItemList::clear()
+{
+	CFileItem* pItem = m_head;
+	while (pItem) {
+		CFileItem* pNext = pItem->m_nextListed;
+		pItem->m_prevListed = 0;
+		pItem->m_nextListed = 0;
+		pItem->m_list = 0;
+		pItem = pNext;
+	}
+	m_head = 0;
+	m_tail = 0;
+}
+
+bool CFileItemList::contains(CFileItem const* pItem) const
+{
+	return pItem->m_list == this;
+}
+
 CServerItem::CServerItem(const CServer& server)
 	: m_activeCount(0)
 	, m_server(server)
@@ -457,30 +648,62 @@ void CServerItem::AddChild(CQueueItem* pItem)
 		AddFileItemToList((CFileItem*)pItem);
 }
 
+CFileItemList& CServerItem::GetIdleList(bool queued, QueuePriority priority, bool download)
+{
+	return m_idleList[queued ? 0 : 1][static_cast<int>(priority)][download ? 1 : 0];
+}
+
+void CServerItem::PushIdleBack(CFileItem* pItem)
+{
+	pItem->m_listOrder = ++m_backOrder;
+	GetIdleList(pItem->queued(), pItem->GetPriority(), pItem->Download()).push_back(pItem);
+}
+
+void CServerItem::PushIdleFront(CFileItem* pItem)
+{
+	pItem->m_listOrder = --m_frontOrder;
+	GetIdleList(pItem->queued(), pItem->GetPriority(), pItem->Download()).push_front(pItem);
+}
+
 void CServerItem::AddFileItemToList(CFileItem* pItem)
 {
 	if (!pItem)
 		return;
 
-	m_fileList[pItem->queued() ? 0 : 1][static_cast<int>(pItem->GetPriority())].push_back(pItem);
+	if (pItem->IsActive())
+		m_activeList.push_back(pItem);
+	else
+		PushIdleBack(pItem);
 }
 
 void CServerItem::RemoveFileItemFromList(CFileItem* pItem)
 {
-	std::list<CFileItem*>& fileList = m_fileList[pItem->queued() ? 0 : 1][static_cast<int>(pItem->GetPriority())];
-	for (auto iter = fileList.begin(); iter != fileList.end(); ++iter) {
-		if (*iter == pItem) {
-			fileList.erase(iter);
-			return;
-		}
+	CFileItemList& fileList = pItem->IsActive() ? m_activeList : GetIdleList(pItem->queued(), pItem->GetPriority(), pItem->Download());
+	if (!fileList.contains(pItem)) {
+		wxFAIL_MSG(_T("File item not deleted from scheduler lists"));
+		return;
+	}
+	fileList.remove(pItem);
+}
+
+void CServerItem::SetChildActive(CFileItem* pItem, bool active)
+{
+	RemoveFileItemFromList(pItem);
+	if (active)
+		m_activeList.push_back(pItem);
+	else {
+		// Items ahead of it in its old position have been started already,
+		// so the front is the closest to where it was.
+		PushIdleFront(pItem);
 	}
-	wxFAIL_MSG(_T("File item not deleted from m_fileList"));
 }
 
 void CServerItem::SetDefaultFileExistsAction(CFileExistsNotification::OverwriteAction action, const TransferDirection direction)
 {
-	for (auto iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter) {
+	for (auto iter = m_children.begin(); iter != m_children.end(); ++iter) {
 		CQueueItem *pItem = *iter;
+		if (!pItem)
+			continue;
 		if (pItem->GetType() == QueueItemType::File) {
 			CFileItem* pFileItem = ((CFileItem *)pItem);
 			if (direction == TransferDirection::upload && pFileItem->Download())
@@ -497,36 +720,27 @@ void CServerItem::SetDefaultFileExistsAction(CFileExistsNotification::OverwriteA
 	}
 }
 
-namespace {
-CFileItem* DoGetIdleChild(std::list<CFileItem*> const* fileList, TransferDirection direction)
+CFileItem* CServerItem::DoGetIdleChild(CFileItemList const (*fileList)[2], TransferDirection direction)
 {
-	int i = 0;
-	for (i = static_cast<int>(QueuePriority::count) - 1; i >= 0; --i) {
-		for (auto const& item : fileList[i]) {
-			if (item->IsActive())
-				continue;
+	for (int i = static_cast<int>(QueuePriority::count) - 1; i >= 0; --i) {
+		CFileItem* upload = direction != TransferDirection::download ? fileList[i][0].front() : 0;
+		CFileItem* download = direction != TransferDirection::upload ? fileList[i][1].front() : 0;
 
-			if (direction == TransferDirection::both)
-				return item;
-
-			if (direction == TransferDirection::download)
-			{
-				if (item->Download())
-					return item;
-			}
-			else if (!item->Download())
-				return item;
-		}
+		if (upload && download)
+			return upload->m_listOrder < download->m_listOrder ? upload : download;
+		if (upload)
+			return upload;
+		if (download)
+			return download;
 	}
 	return 0;
 }
-}
 
 CFileItem* CServerItem::GetIdleChild(bool immediateOnly, TransferDirection direction)
 {
-	CFileItem* item = DoGetIdleChild(m_fileList[1], direction);
+	CFileItem* item = DoGetIdleChild(m_idleList[1], direction);
 	if( !item && !immediateOnly ) {
-		item = DoGetIdleChild(m_fileList[0], direction);
+		item = DoGetIdleChild(m_idleList[0], direction);
 	}
 	return item;
 }
@@ -547,21 +761,25 @@ bool CServerItem::RemoveChild(CQueueItem* pItem, bool destroy /*=true*/)
 
 void CServerItem::QueueImmediateFiles()
 {
+	// Active immediate files stay immediate, they are not in the idle lists.
+	// Move the idle ones in front of the queued files, keeping their order.
+	std::vector<CFileItem*> items;
 	for (int i = 0; i < static_cast<int>(QueuePriority::count); ++i) {
-		std::list<CFileItem*> activeList;
-		std::list<CFileItem*>& fileList = m_fileList[1][i];
-		for (std::list<CFileItem*>::reverse_iterator iter = fileList.rbegin(); iter != fileList.rend(); ++iter) {
-			CFileItem* item = *iter;
-			wxASSERT(!item->queued());
-			if (item->IsActive())
-				activeList.push_front(item);
-			else
-			{
-				item->set_queued(true);
-				m_fileList[0][i].push_front(item);
+		for (int j = 0; j < 2; ++j) {
+			CFileItemList& fileList = m_idleList[1][i][j];
+			while (!fileList.empty()) {
+				CFileItem* item = fileList.front();
+				wxASSERT(!item->queued());
+				fileList.remove(item);
+				items.push_back(item);
 			}
 		}
-		fileList = activeList;
+	}
+
+	std::sort(items.begin(), items.end(), [](CFileItem const* lhs, CFileItem const* rhs) { return lhs->m_listOrder < rhs->m_listOrder; });
+	for (auto iter = items.rbegin(); iter != items.rend(); ++iter) {
+		(*iter)->set_queued(true);
+		PushIdleFront(*iter);
 	}
 }
 
@@ -570,18 +788,14 @@ void CServerItem::QueueImmediateFile(CFileItem* pItem)
 	if (pItem->queued())
 		return;
 
-	std::list<CFileItem*>& fileList = m_fileList[1][static_cast<int>(pItem->GetPriority())];
-	for (auto iter = fileList.begin(); iter != fileList.end(); ++iter)
-	{
-		if (*iter != pItem)
-			continue;
-
+	if (pItem->IsActive()) {
 		pItem->set_queued(true);
-		fileList.erase(iter);
-		m_fileList[0][static_cast<int>(pItem->GetPriority())].push_front(pItem);
 		return;
 	}
-	wxASSERT(false);
+
+	RemoveFileItemFromList(pItem);
+	pItem->set_queued(true);
+	PushIdleFront(pItem);
 }
 
 void CServerItem::SaveItem(TiXmlElement* pElement) const
@@ -589,8 +803,10 @@ void CServerItem::SaveItem(TiXmlElement* pElement) const
 	TiXmlElement *server = new TiXmlElement("Server");
 	SetServer(server, m_server);
 
-	for (std::vector<CQueueItem*>::const_iterator iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
-		(*iter)->SaveItem(server);
+	for (std::vector<CQueueItem*>::const_iterator iter = m_children.begin(); iter != m_children.end(); ++iter) {
+		if (*iter)
+			(*iter)->SaveItem(server);
+	}
 
 	pElement->LinkEndChild(server);
 }
@@ -598,28 +814,22 @@ void CServerItem::SaveItem(TiXmlElement* pElement) const
 wxLongLong CServerItem::GetTotalSize(int& filesWithUnknownSize, int& queuedFiles, int& folderScanCount) const
 {
 	wxLongLong totalSize = 0;
-	for (int i = 0; i < static_cast<int>(QueuePriority::count); ++i)
+	for (std::vector<CQueueItem*>::const_iterator iter = m_children.begin(); iter != m_children.end(); ++iter)
 	{
-		for (int j = 0; j < 2; j++)
-		{
-			const std::list<CFileItem*>& fileList = m_fileList[j][i];
-			for (std::list<CFileItem*>::const_iterator iter = fileList.begin(); iter != fileList.end(); ++iter)
-			{
-				const CFileItem* item = *iter;
-				wxLongLong size = item->GetSize();
-				if (size >= 0)
-					totalSize += size;
-				else
-					filesWithUnknownSize++;
-			}
-		}
-	}
+		if (!*iter)
+			continue;
 
-	for (std::vector<CQueueItem*>::const_iterator iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
-	{
 		if ((*iter)->GetType() == QueueItemType::File ||
 			(*iter)->GetType() == QueueItemType::Folder)
+		{
 			queuedFiles++;
+
+			wxLongLong size = static_cast<CFileItem const*>(*iter)->GetSize();
+			if (size >= 0)
+				totalSize += size;
+			else
+				filesWithUnknownSize++;
+		}
 		else if ((*iter)->GetType() == QueueItemType::FolderScan)
 			folderScanCount++;
 	}
@@ -629,12 +839,11 @@ wxLongLong CServerItem::GetTotalSize(int& filesWithUnknownSize, int& queuedFiles
 
 bool CServerItem::TryRemoveAll()
 {
-	const int oldVisibleOffspring = m_visibleOffspring;
-	std::vector<CQueueItem*>::iterator iter;
 	std::vector<CQueueItem*> keepChildren;
-	m_visibleOffspring = 0;
-	for (iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter) {
+	for (auto iter = m_children.begin(); iter != m_children.end(); ++iter) {
 		CQueueItem* pItem = *iter;
+		if (!pItem)
+			continue;
 		if (pItem->TryRemoveAll()) {
 			if (pItem->GetType() == QueueItemType::File || pItem->GetType() == QueueItemType::Folder) {
 				CFileItem* pFileItem = static_cast<CFileItem*>(pItem);
@@ -642,20 +851,10 @@ bool CServerItem::TryRemoveAll()
 			}
 			delete pItem;
 		}
-		else {
+		else
 			keepChildren.push_back(pItem);
-			m_visibleOffspring++;
-			m_visibleOffspring += pItem->GetChildrenCount(true);
-		}
-	}
-	m_children = keepChildren;
-	m_removed_at_front = 0;
-
-	CQueueItem* parent = GetParent();
-	while (parent) {
-		parent->m_visibleOffspring -= oldVisibleOffspring - m_visibleOffspring;
-		parent = parent->GetParent();
 	}
+	SetChildren(keepChildren);
 
 	return m_children.empty();
 }
@@ -664,49 +863,62 @@ void CServerItem::DetachChildren()
 {
 	wxASSERT(!m_activeCount);
 
-	m_children.clear();
-	m_visibleOffspring = 0;
-	m_maxCachedIndex = -1;
-	m_removed_at_front = 0;
+	SetChildren(std::vector<CQueueItem*>());
 
 	for (int i = 0; i < 2; i++)
 		for (int j = 0; j < static_cast<int>(QueuePriority::count); j++)
-			m_fileList[i][j].clear();
+			for (int k = 0; k < 2; k++)
+				m_idleList[i][j][k].clear();
+	m_activeList.clear();
 }
 
 void CServerItem::SetPriority(QueuePriority priority)
 {
 	std::vector<CQueueItem*>::iterator iter;
-	for (iter = m_children.begin() + m_removed_at_front; iter != m_children.end(); ++iter)
+	for (iter = m_children.begin(); iter != m_children.end(); ++iter)
 	{
+		if (!*iter)
+			continue;
+
 		if ((*iter)->GetType() == QueueItemType::File)
 			((CFileItem*)(*iter))->SetPriorityRaw(priority);
 		else
 			(*iter)->SetPriority(priority);
 	}
 
+	// The file items already carry the new priority, append the items of
+	// the other lists to the one of that priority.
 	for (int i = 0; i < 2; ++i)
 		for (int j = 0; j < static_cast<int>(QueuePriority::count); ++j) {
-			if (j != static_cast<int>(priority))
-				m_fileList[i][static_cast<int>(priority)].splice(m_fileList[i][static_cast<int>(priority)].end(), m_fileList[i][j]);
+			if (j == static_cast<int>(priority))
+				continue;
+
+			// Merge uploads and downloads to keep their relative order
+			CFileItemList* fileLists = m_idleList[i][j];
+			while (!fileLists[0].empty() || !fileLists[1].empty()) {
+				CFileItem* upload = fileLists[0].front();
+				CFileItem* download = fileLists[1].front();
+				CFileItem* item = (upload && (!download || upload->m_listOrder < download->m_listOrder)) ? upload : download;
+				fileLists[item == upload ? 0 : 1].remove(item);
+				PushIdleBack(item);
+			}
 		}
 }
 
 void CServerItem::SetChildPriority(CFileItem* pItem, QueuePriority oldPriority, QueuePriority newPriority)
 {
-	int i = pItem->queued() ? 0 : 1;
-
-	for (auto iter = m_fileList[i][static_cast<int>(oldPriority)].begin(); iter != m_fileList[i][static_cast<int>(oldPriority)].end(); ++iter)
-	{
-		if (*iter != pItem)
-			continue;
+	if (pItem->IsActive())
+		return;
 
-		m_fileList[i][static_cast<int>(oldPriority)].erase(iter);
-		m_fileList[i][static_cast<int>(newPriority)].push_back(pItem);
+	CFileItemList& oldList = GetIdleList(pItem->queued(), oldPriority, pItem->Download());
+	if (!oldList.contains(pItem)) {
+		wxFAIL;
 		return;
 	}
 
-	wxFAIL;
+	oldList.remove(pItem);
+	pItem->m_listOrder = ++m_backOrder;
+	GetIdleList(pItem->queued(), newPriority, pItem->Download()).push_back(pItem);
 }
 
 CFolderScanItem::CFolderScanItem(CServerItem* parent, bool queued, bool download, const CLocalPath& localPath, const CServerPath& remotePath)
@@ -32,6 +32,30 @@ enum class TransferDirection
 };
 
 class TiXmlElement;
+
+// Fenwick tree over a sequence of non-negative weights. Prefix sums, weight
+// changes and looking up the position containing a given sum all take
+// logarithmic time.
+class CFenwickTree final
+{
+public:
+	size_t size() const { return m_tree.size(); }
+	void clear() { m_tree.clear(); }
+
+	void push_back(int weight);
+	void add(size_t pos, int delta);
+
+	// Sum of the weights in front of pos
+	int prefix(size_t pos) const;
+
+	// Returns the position pos with prefix(pos) <= sum < prefix(pos + 1),
+	// size() if sum is not less than the total weight.
+	size_t find(int sum) const;
+
+private:
+	std::vector<int> m_tree;
+};
+
 class CQueueItem
 {
 public:
@@ -58,38 +82,66 @@ public:
 	wxDateTime GetTime() const { return m_time; }
 	void UpdateTime() { m_time = wxDateTime::UNow(); }
 
+	// Removed children leave null entries behind until the list gets compacted
 	const std::vector<CQueueItem*>& GetChildren() const { return m_children; }
-	int GetRemovedAtFront() const { return m_removed_at_front; }
 
 protected:
 	CQueueItem(CQueueItem* parent = 0);
 
+	// Replaces the list of children, keeping the visible offspring counts
+	// of this item and its parents up to date.
+	void SetChildren(std::vector<CQueueItem*> const& children);
+
 	CQueueItem* m_parent;
 
 	int m_visibleOffspring{}; // Visible offspring over all sublevels
-	int m_maxCachedIndex{-1};
-
-	struct t_cacheItem
-	{
-		int index;
-		int child;
-	};
-	std::vector<t_cacheItem> m_lookupCache;
 
 	friend class CServerItem;
 
 	wxDateTime m_time;
 
 private:
+	void RemoveChildAt(size_t pos);
+	void AddVisibleOffspring(int delta);
+
 	std::vector<CQueueItem*> m_children;
 
-	// Number of items removed at front of list
-	// Increased instead of calling slow m_children.erase(0),
-	// resetted on insert.
-	int m_removed_at_front{};
+	// Position of this item in the children of its parent
+	size_t m_indexInParent{};
+
+	// Number of null entries in m_children
+	size_t m_removedChildren{};
+
+	// Visible rows of each child, itself included, and whether the
+	// child is still present. Used to map between visible row indexes
+	// and children.
+	CFenwickTree m_childRows;
+	CFenwickTree m_childPresent;
 };
 
 class CFileItem;
+
+// Intrusive doubly linked list of file items, the links are stored in the
+// items themselves. An item can be in at most one such list at a time.
+class CFileItemList final
+{
+public:
+	CFileItem* front() const { return m_head; }
+	bool empty() const { return !m_head; }
+
+	void push_back(CFileItem* pItem);
+	void push_front(CFileItem* pItem);
+	void remove(CFileItem* pItem);
+
+	void clear();
+
+	bool contains(CFileItem const* pItem) const;
+
+private:
+	CFileItem* m_head{};
+	CFileItem* m_tail{};
+};
+
 class CServerItem : public CQueueItem
 {
 public:
@@ -121,18 +173,71 @@ public:
 
 	void SetChildPriority(CFileItem* pItem, QueuePriority oldPriority, QueuePriority newPriority);
 
+	// Moves the item between the idle and active lists, called before the
+	// item changes its state.
+	void SetChildActive(CFileItem* pItem, bool active);
+
 	int m_activeCount;
 
+	// Row id in the queue database, 0 if not stored
+	int64_t m_storageId{};
+
+	// Rows of duplicate servers merged into this item while loading
+	std::vector<int64_t> m_mergedStorageIds;
+
 protected:
 	void AddFileItemToList(CFileItem* pItem);
 	void RemoveFileItemFromList(CFileItem* pItem);
 
+	CFileItem* DoGetIdleChild(CFileItemList const (*fileList)[2], TransferDirection direction);
+
+	CFileItemList& GetIdleList(bool queued, QueuePriority priority, bool download);
+	void PushIdleBack(CFileItem* pItem);
+	void PushIdleFront(CFileItem* pItem);
+
 	CServer m_server;
 
-	// array of item lists, sorted by priority. Used by scheduler to find
-	// next file to transfer
-	// First index specifies whether the item is queued (0) or immediate (1)
-	std::list<CFileItem*> m_fileList[2][static_cast<int>(QueuePriority::count)];
+	// Lists of idle items, used by the scheduler to find the next file to
+	// transfer in constant time. Indexed by whether the item is queued (0)
+	// or immediate (1), by priority and by whether it is a download (1) or
+	// an upload (0).
+	CFileItemList m_idleList[2][static_cast<int>(QueuePriority::count)][2];
+
+	// Items currently being transferred
+	CFileItemList m_activeList;
+
+	// Position keys of idle items. The head of the download and upload list
+	// with the smaller key was added first.
+	int m_frontOrder{};
+	int m_backOrder{};
+};
+
+// Local and remote directory of queued files. All files in the same pair of
+// directories share one instance, so the paths take up memory once per
+// directory instead of once per file. Main thread only.
+class CQueuePaths final
+{
+public:
+	// Returns the shared instance for the given paths, with its reference
+	// count incremented.
+	static CQueuePaths* Get(const CLocalPath& localPath, const CServerPath& remotePath);
+
+	const CLocalPath& GetLocalPath() const { return m_localPath; }
+	const CServerPath& GetRemotePath() const { return m_remotePath; }
+
+	// Deleter for std::unique_ptr, drops a reference
+	struct release
+	{
+		void operator()(CQueuePaths* paths) const;
+	};
+
+private:
+	CQueuePaths(const CLocalPath& localPath, const CServerPath& remotePath, const wxString& key);
+
+	CLocalPath const m_localPath;
+	CServerPath const m_remotePath;
+	wxString const m_key;
+	unsigned int m_refcount{1};
 };
 
 struct t_EngineData;
@@ -150,12 +255,12 @@ public:
 	void SetPriorityRaw(QueuePriority priority);
 	QueuePriority GetPriority() const;
 
-	const wxString& GetLocalFile() const { return !Download() ? GetSourceFile() : (m_targetFile ? *m_targetFile : m_sourceFile); }
-	const wxString& GetRemoteFile() const { return Download() ? GetSourceFile() : (m_targetFile ? *m_targetFile : m_sourceFile); }
-	const wxString& GetSourceFile() const { return m_sourceFile; }
-	CSparseOptional<wxString> const& GetTargetFile() const { return m_targetFile; }
-	const CLocalPath& GetLocalPath() const { return m_localPath; }
-	const CServerPath& GetRemotePath() const { return m_remotePath; }
+	wxString GetLocalFile() const { return Download() ? GetTargetOrSourceFile() : GetSourceFile(); }
+	wxString GetRemoteFile() const { return Download() ? GetSourceFile() : GetTargetOrSourceFile(); }
+	wxString GetSourceFile() const;
+	CSparseOptional<wxString> GetTargetFile() const;
+	const CLocalPath& GetLocalPath() const { return m_paths->GetLocalPath(); }
+	const CServerPath& GetRemotePath() const { return m_paths->GetRemotePath(); }
 	const wxLongLong& GetSize() const { return m_size; }
 	void SetSize(wxLongLong size) { m_size = size; }
 	inline bool Download() const { return flags & flag_download; }
@@ -232,6 +337,9 @@ protected:
 public:
 	t_EngineData* m_pEngineData{};
 
+	// Row id in the queue database, 0 if not stored
+	int64_t m_storageId{};
+
 
 	inline bool made_progress() const { return (flags & flag_made_progress) != 0; }
 	inline void set_made_progress(bool made_progress)
@@ -255,10 +363,20 @@ public:
 	}
 
 protected:
-	wxString const m_sourceFile;
-	CSparseOptional<wxString> m_targetFile;
-	CLocalPath const m_localPath;
-	CServerPath const m_remotePath;
+	friend class CFileItemList;
+	friend class CServerItem;
+
+	// Links and position key for the scheduler lists of the server item
+	CFileItem* m_prevListed{};
+	CFileItem* m_nextListed{};
+	CFileItemList* m_list{};
+	int m_listOrder{};
+
+	wxString GetTargetOrSourceFile() const;
+
+	// Source and target name in a single allocation, see queue.cpp
+	std::unique_ptr<char[]> m_names;
+	std::unique_ptr<CQueuePaths, CQueuePaths::release> m_paths;
 	wxLongLong m_size;
 };
 
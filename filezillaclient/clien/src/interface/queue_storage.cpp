@@ -1,15 +1,24 @@
 #include <filezilla.h>
 #include "queue_storage.h"
+#include "ipcmutex.h"
 #include "Options.h"
 #include "queue.h"
 
 #include <sqlite3.h>
 #include <wx/wx.h>
 
+#include <algorithm>
+#include <memory>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
 
 #define INVALID_DATA -1
 
+// Number of journaled changes after which the transaction gets committed
+// even if Flush hasn't been called.
+#define MAX_PENDING_CHANGES 1000
+
 enum class Column_type
 {
 	text,
@@ -105,6 +114,20 @@ _column file_table_columns[] = {
 	{ _T("default_exists_action"), Column_type::integer, 0 }
 };
 
+// Parameters of updateFileQuery_
+namespace file_update_parameters
+{
+	enum type
+	{
+		target_file = 1,
+		size,
+		error_count,
+		priority,
+		default_exists_action,
+		id
+	};
+}
+
 namespace path_table_column_names
 {
 	enum type
@@ -140,6 +163,11 @@ public:
 		, selectFilesQuery_()
 		, selectLocalPathQuery_()
 		, selectRemotePathQuery_()
+		, updateFileQuery_()
+		, deleteFileQuery_()
+		, deleteServerQuery_()
+		, deleteUnloadedFilesQuery_()
+		, deleteUnloadedServerFilesQuery_()
 	{
 	}
 
@@ -153,8 +181,12 @@ public:
 	sqlite3_stmt* PrepareInsertStatement(const wxString& name, const _column*, unsigned int count);
 
 	bool SaveServer(const CServerItem& item);
-	bool SaveFile(wxLongLong server, const CFileItem& item);
-	bool SaveDirectory(wxLongLong server, const CFolderItem& item);
+	int64_t SaveServerRow(const CServer& server);
+	bool SaveFile(int64_t server, const CFileItem& item);
+	bool SaveDirectory(int64_t server, const CFolderItem& item);
+	bool UpdateFile(const CFileItem& item);
+	bool StoreItem(CServerItem& server, CFileItem& item);
+	bool DeleteRow(sqlite3_stmt* statement, int64_t id);
 
 	int64_t SaveLocalPath(const CLocalPath& path);
 	int64_t SaveRemotePath(const CServerPath& path);
@@ -180,6 +212,18 @@ public:
 
 	bool MigrateSchema();
 
+	bool Execute(sqlite3_stmt* statement);
+
+	// Journal transaction handling
+	bool Begin();
+	bool Commit();
+	void Changed();
+
+	bool PurgeRows();
+
+	void BeginLoading();
+	void FinishLoading();
+
 	sqlite3* db_;
 
 	sqlite3_stmt* insertServerQuery_;
@@ -192,6 +236,39 @@ public:
 	sqlite3_stmt* selectLocalPathQuery_;
 	sqlite3_stmt* selectRemotePathQuery_;
 
+	sqlite3_stmt* updateFileQuery_;
+	sqlite3_stmt* deleteFileQuery_;
+	sqlite3_stmt* deleteServerQuery_;
+	sqlite3_stmt* deleteUnloadedFilesQuery_;
+	sqlite3_stmt* deleteUnloadedServerFilesQuery_;
+
+	// Held while this instance owns the stored queue
+	std::unique_ptr<CInterProcessMutex> journalMutex_;
+	bool owner_{};
+	bool journal_{};
+
+	bool transaction_{};
+	int pendingChanges_{};
+
+	// Items that got their rows in the current transaction. If it gets rolled
+	// back, their ids are reset so that they get stored again.
+	std::unordered_set<CFileItem*> newFiles_;
+	std::set<int64_t> newServers_;
+
+	// Rows that could not be parsed while loading
+	std::vector<int64_t> invalidServers_;
+	std::vector<int64_t> invalidFiles_;
+
+	// Files are loaded in pages of rows with ids in (loadedFile_, lastFile_].
+	// Rows added after loading started have larger ids.
+	bool loading_{};
+	bool pageActive_{};
+	int64_t loadedFile_{};
+	int64_t lastFile_{};
+	int pageRows_{};
+	int pageSize_{};
+	std::set<int64_t> loadedServers_;
+
 #ifndef __WXMSW__
 	wxMBConvUTF16 utf16_;
 #endif
@@ -221,8 +298,10 @@ void CQueueStorage::Impl::ReadLocalPaths()
 			int64_t id = GetColumnInt64(selectLocalPathQuery_, path_table_column_names::id);
 			wxString localPathRaw = GetColumnText(selectLocalPathQuery_, path_table_column_names::path);
 			CLocalPath localPath;
-			if (id > 0 && !localPathRaw.empty() && localPath.SetPath(localPathRaw))
+			if (id > 0 && !localPathRaw.empty() && localPath.SetPath(localPathRaw)) {
 				reverseLocalPaths_[id] = localPath;
+				localPaths_[localPath.GetPath()] = id;
+			}
 		}
 	}
 	while (res == SQLITE_BUSY || res == SQLITE_ROW);
@@ -245,8 +324,10 @@ void CQueueStorage::Impl::ReadRemotePaths()
 			int64_t id = GetColumnInt64(selectRemotePathQuery_, path_table_column_names::id);
 			wxString remotePathRaw = GetColumnText(selectRemotePathQuery_, path_table_column_names::path);
 			CServerPath remotePath;
-			if (id > 0 && !remotePathRaw.empty() && remotePath.SetSafePath(remotePathRaw))
+			if (id > 0 && !remotePathRaw.empty() && remotePath.SetSafePath(remotePathRaw)) {
 				reverseRemotePaths_[id] = remotePath;
+				remotePaths_[remotePath.GetSafePath()] = id;
+			}
 		}
 	}
 	while (res == SQLITE_BUSY || res == SQLITE_ROW);
@@ -311,6 +392,147 @@ void CQueueStorage::Impl::ClearCaches()
 }
 
 
+bool CQueueStorage::Impl::Execute(sqlite3_stmt* statement)
+{
+	int res;
+	do {
+		res = sqlite3_step(statement);
+	} while (res == SQLITE_BUSY);
+
+	sqlite3_reset(statement);
+
+	return res == SQLITE_DONE;
+}
+
+
+bool CQueueStorage::Impl::Begin()
+{
+	if (!transaction_)
+		transaction_ = sqlite3_exec(db_, "BEGIN TRANSACTION", 0, 0, 0) == SQLITE_OK;
+
+	return transaction_;
+}
+
+
+bool CQueueStorage::Impl::Commit()
+{
+	if (!transaction_)
+		return true;
+
+	transaction_ = false;
+	pendingChanges_ = 0;
+
+	if (sqlite3_exec(db_, "END TRANSACTION", 0, 0, 0) == SQLITE_OK) {
+		newFiles_.clear();
+		newServers_.clear();
+		return true;
+	}
+
+	sqlite3_exec(db_, "ROLLBACK", 0, 0, 0);
+
+	// Ids of rows inserted in the failed transaction are no longer valid
+	// and would get reused by the next inserts.
+	localPaths_.clear();
+	remotePaths_.clear();
+
+	// Keep the order in which the items had been stored
+	std::vector<CFileItem*> items(newFiles_.begin(), newFiles_.end());
+	std::sort(items.begin(), items.end(), [](CFileItem* lhs, CFileItem* rhs) { return lhs->m_storageId < rhs->m_storageId; });
+
+	for (auto it = items.begin(); it != items.end(); ++it) {
+		CFileItem* item = *it;
+		item->m_storageId = 0;
+
+		CQueueItem* top = item->GetTopLevelItem();
+		if (top->GetType() == QueueItemType::Server) {
+			CServerItem* server = static_cast<CServerItem*>(top);
+			if (newServers_.find(server->m_storageId) != newServers_.end())
+				server->m_storageId = 0;
+		}
+	}
+	newFiles_.clear();
+	newServers_.clear();
+
+	// Store the items again, they get committed along with the next change
+	if (Begin()) {
+		for (auto it = items.begin(); it != items.end(); ++it) {
+			CQueueItem* top = (*it)->GetTopLevelItem();
+			if (top->GetType() == QueueItemType::Server)
+				StoreItem(*static_cast<CServerItem*>(top), **it);
+		}
+	}
+
+	return false;
+}
+
+
+void CQueueStorage::Impl::Changed()
+{
+	if (++pendingChanges_ >= MAX_PENDING_CHANGES)
+		Commit();
+}
+
+
+void CQueueStorage::Impl::BeginLoading()
+{
+	loadedServers_.clear();
+	loadedFile_ = 0;
+	lastFile_ = 0;
+	pageActive_ = false;
+
+	sqlite3_stmt* statement = PrepareStatement(_T("SELECT MAX(id) FROM files"));
+	if (statement) {
+		if (sqlite3_step(statement) == SQLITE_ROW)
+			lastFile_ = GetColumnInt64(statement, 0);
+		sqlite3_finalize(statement);
+	}
+
+	loading_ = lastFile_ > 0;
+}
+
+
+void CQueueStorage::Impl::FinishLoading()
+{
+	if (pageActive_) {
+		sqlite3_reset(selectFilesQuery_);
+		pageActive_ = false;
+	}
+	loading_ = false;
+	loadedServers_.clear();
+
+	// Only needed to parse the loaded rows
+	reverseLocalPaths_.clear();
+	reverseRemotePaths_.clear();
+}
+
+
+bool CQueueStorage::Impl::PurgeRows()
+{
+	bool ret = true;
+
+	for (auto const& id : invalidFiles_)
+		ret &= DeleteRow(deleteFileQuery_, id);
+	invalidFiles_.clear();
+
+	for (auto const& id : invalidServers_)
+		ret &= DeleteRow(deleteServerQuery_, id);
+	invalidServers_.clear();
+
+	// Servers without files are deleted before loading, files of unknown
+	// servers have been reported as invalid while loading.
+	char const* const queries[] = {
+		"DELETE FROM local_paths WHERE id NOT IN (SELECT local_path FROM files WHERE local_path IS NOT NULL)",
+		"DELETE FROM remote_paths WHERE id NOT IN (SELECT remote_path FROM files WHERE remote_path IS NOT NULL)"
+	};
+	for (auto const& query : queries) {
+		if (sqlite3_exec(db_, query, 0, 0, 0) != SQLITE_OK)
+			ret = false;
+	}
+
+	return ret;
+}
+
+
 int64_t CQueueStorage::Impl::SaveLocalPath(const CLocalPath& path)
 {
 	std::unordered_map<wxString, int64_t, wxStringHash, fast_equal>::const_iterator it = localPaths_.find(path.GetPath());
@@ -510,7 +732,7 @@ bool CQueueStorage::Impl::PrepareStatements()
 			query += file_table_columns[i].name;
 		}
 
-		query += _T(" FROM files WHERE server=:server ORDER BY id ASC");
+		query += _T(" FROM files WHERE id>:after AND id<=:last ORDER BY id ASC LIMIT :count");
 
 		if (!(selectFilesQuery_ = PrepareStatement(query)))
 			return false;
@@ -527,6 +749,36 @@ bool CQueueStorage::Impl::PrepareStatements()
 		if (!(selectRemotePathQuery_ = PrepareStatement(query)))
 			return false;
 	}
+
+	{
+		wxString query = _T("UPDATE files SET target_file=?1, size=?2, error_count=?3, priority=?4, default_exists_action=?5 WHERE id=?6");
+		if (!(updateFileQuery_ = PrepareStatement(query)))
+			return false;
+	}
+
+	{
+		wxString query = _T("DELETE FROM files WHERE id=:id");
+		if (!(deleteFileQuery_ = PrepareStatement(query)))
+			return false;
+	}
+
+	{
+		wxString query = _T("DELETE FROM servers WHERE id=:id");
+		if (!(deleteServerQuery_ = PrepareStatement(query)))
+			return false;
+	}
+
+	{
+		wxString query = _T("DELETE FROM files WHERE id>:after AND id<=:last");
+		if (!(deleteUnloadedFilesQuery_ = PrepareStatement(query)))
+			return false;
+	}
+
+	{
+		wxString query = _T("DELETE FROM files WHERE server=:server AND id>:after AND id<=:last");
+		if (!(deleteUnloadedServerFilesQuery_ = PrepareStatement(query)))
+			return false;
+	}
 	return true;
 }
 
@@ -581,9 +833,31 @@ bool CQueueStorage::Impl::BindNull(sqlite3_stmt* statement, int index)
 
 bool CQueueStorage::Impl::SaveServer(const CServerItem& item)
 {
-	bool kiosk_mode = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 0;
+	int64_t const serverId = SaveServerRow(item.GetServer());
+	if (serverId <= 0)
+		return false;
+
+	bool ret = true;
+
+	const std::vector<CQueueItem*>& children = item.GetChildren();
+	for (std::vector<CQueueItem*>::const_iterator it = children.begin(); it != children.end(); ++it)
+	{
+		CQueueItem* item = *it;
+		if (!item)
+			continue;
+		if (item->GetType() == QueueItemType::File)
+			ret &= SaveFile(serverId, *static_cast<CFileItem*>(item));
+		else if (item->GetType() == QueueItemType::Folder)
+			ret &= SaveDirectory(serverId, *static_cast<CFolderItem*>(item));
+	}
+
+	return ret;
+}
 
-	const CServer& server = item.GetServer();
+
+int64_t CQueueStorage::Impl::SaveServerRow(const CServer& server)
+{
+	bool kiosk_mode = COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 0;
 
 	Bind(insertServerQuery_, server_table_column_names::host, server.GetHost());
 	Bind(insertServerQuery_, server_table_column_names::port, static_cast<int>(server.GetPort()));
@@ -680,38 +954,19 @@ bool CQueueStorage::Impl::SaveServer(const CServerItem& item)
 	else
 		BindNull(insertServerQuery_, server_table_column_names::name);
 
-	int res;
-	do {
-		res = sqlite3_step(insertServerQuery_);
-	} while (res == SQLITE_BUSY);
-
-	sqlite3_reset(insertServerQuery_);
-
-	bool ret = res == SQLITE_DONE;
-	if (ret)
-	{
-		sqlite3_int64 serverId = sqlite3_last_insert_rowid(db_);
-		Bind(insertFileQuery_, file_table_column_names::server, static_cast<int64_t>(serverId));
+	if (!Execute(insertServerQuery_))
+		return -1;
 
-		const std::vector<CQueueItem*>& children = item.GetChildren();
-		for (std::vector<CQueueItem*>::const_iterator it = children.begin() + item.GetRemovedAtFront(); it != children.end(); ++it)
-		{
-			CQueueItem* item = *it;
-			if (item->GetType() == QueueItemType::File)
-				ret &= SaveFile(serverId, *static_cast<CFileItem*>(item));
-			else if (item->GetType() == QueueItemType::Folder)
-				ret &= SaveDirectory(serverId, *static_cast<CFolderItem*>(item));
-		}
-	}
-	return ret;
+	return sqlite3_last_insert_rowid(db_);
 }
 
 
-bool CQueueStorage::Impl::SaveFile(wxLongLong server, const CFileItem& file)
+bool CQueueStorage::Impl::SaveFile(int64_t server, const CFileItem& file)
 {
 	if (file.m_edit != CEditHandler::none)
 		return true;
 
+	Bind(insertFileQuery_, file_table_column_names::server, server);
 	Bind(insertFileQuery_, file_table_column_names::source_file, file.GetSourceFile());
 	auto const& targetFile = file.GetTargetFile();
 	if (targetFile)
@@ -755,8 +1010,9 @@ bool CQueueStorage::Impl::SaveFile(wxLongLong server, const CFileItem& file)
 }
 
 
-bool CQueueStorage::Impl::SaveDirectory(wxLongLong server, const CFolderItem& directory)
+bool CQueueStorage::Impl::SaveDirectory(int64_t server, const CFolderItem& directory)
 {
+	Bind(insertFileQuery_, file_table_column_names::server, server);
 	if (directory.Download())
 		BindNull(insertFileQuery_, file_table_column_names::source_file);
 	else
@@ -793,6 +1049,67 @@ bool CQueueStorage::Impl::SaveDirectory(wxLongLong server, const CFolderItem& di
 }
 
 
+bool CQueueStorage::Impl::UpdateFile(const CFileItem& file)
+{
+	auto const& targetFile = file.GetTargetFile();
+	if (file.GetType() == QueueItemType::File && targetFile)
+		Bind(updateFileQuery_, file_update_parameters::target_file, *targetFile);
+	else
+		BindNull(updateFileQuery_, file_update_parameters::target_file);
+
+	if (file.GetType() == QueueItemType::File && file.GetSize() != -1)
+		Bind(updateFileQuery_, file_update_parameters::size, static_cast<int64_t>(file.GetSize().GetValue()));
+	else
+		BindNull(updateFileQuery_, file_update_parameters::size);
+	if (file.m_errorCount)
+		Bind(updateFileQuery_, file_update_parameters::error_count, file.m_errorCount);
+	else
+		BindNull(updateFileQuery_, file_update_parameters::error_count);
+	Bind(updateFileQuery_, file_update_parameters::priority, static_cast<int>(file.GetPriority()));
+
+	if (file.GetType() == QueueItemType::File && file.m_defaultFileExistsAction != CFileExistsNotification::unknown)
+		Bind(updateFileQuery_, file_update_parameters::default_exists_action, file.m_defaultFileExistsAction);
+	else
+		BindNull(updateFileQuery_, file_update_parameters::default_exists_action);
+
+	Bind(updateFileQuery_, file_update_parameters::id, file.m_storageId);
+
+	return Execute(updateFileQuery_);
+}
+
+
+bool CQueueStorage::Impl::StoreItem(CServerItem& server, CFileItem& item)
+{
+	if (!server.m_storageId) {
+		int64_t const serverId = SaveServerRow(server.GetServer());
+		if (serverId <= 0)
+			return false;
+		server.m_storageId = serverId;
+		newServers_.insert(serverId);
+	}
+
+	bool saved;
+	if (item.GetType() == QueueItemType::Folder)
+		saved = SaveDirectory(server.m_storageId, static_cast<CFolderItem&>(item));
+	else
+		saved = SaveFile(server.m_storageId, item);
+	if (!saved)
+		return false;
+
+	item.m_storageId = sqlite3_last_insert_rowid(db_);
+	newFiles_.insert(&item);
+
+	return true;
+}
+
+
+bool CQueueStorage::Impl::DeleteRow(sqlite3_stmt* statement, int64_t id)
+{
+	Bind(statement, 1, id);
+	return Execute(statement);
+}
+
+
 wxString CQueueStorage::Impl::GetColumnText(sqlite3_stmt* statement, int index, bool shrink)
 {
 	wxString ret;
@@ -1015,14 +1332,29 @@ CQueueStorage::CQueueStorage()
 
 	if (sqlite3_exec(d_->db_, "PRAGMA encoding=\"UTF-16le\"", 0, 0, 0) == SQLITE_OK)
 	{
+		// With a write-ahead log, committing the journal doesn't need to sync the database
+		sqlite3_exec(d_->db_, "PRAGMA journal_mode=WAL", 0, 0, 0);
+		sqlite3_exec(d_->db_, "PRAGMA synchronous=NORMAL", 0, 0, 0);
+
 		d_->MigrateSchema();
 		d_->CreateTables();
-		d_->PrepareStatements();
+		if (d_->PrepareStatements()) {
+			// The first instance owns the stored queue. If locking isn't possible at all, assume we're alone.
+			d_->journalMutex_.reset(new CInterProcessMutex(MUTEX_QUEUE_JOURNAL, false));
+			d_->owner_ = d_->journalMutex_->TryLock() != 0;
+
+			// Kiosk mode 2 doesn't save queue
+			d_->journal_ = d_->owner_ && COptions::Get()->GetOptionVal(OPTION_DEFAULT_KIOSKMODE) != 2;
+		}
 	}
 }
 
 CQueueStorage::~CQueueStorage()
 {
+	// The queue items are gone by now
+	d_->newFiles_.clear();
+	d_->Commit();
+
 	sqlite3_finalize(d_->insertServerQuery_);
 	sqlite3_finalize(d_->insertFileQuery_);
 	sqlite3_finalize(d_->insertLocalPathQuery_);
@@ -1031,12 +1363,24 @@ CQueueStorage::~CQueueStorage()
 	sqlite3_finalize(d_->selectFilesQuery_);
 	sqlite3_finalize(d_->selectLocalPathQuery_);
 	sqlite3_finalize(d_->selectRemotePathQuery_);
+	sqlite3_finalize(d_->updateFileQuery_);
+	sqlite3_finalize(d_->deleteFileQuery_);
+	sqlite3_finalize(d_->deleteServerQuery_);
+	sqlite3_finalize(d_->deleteUnloadedFilesQuery_);
+	sqlite3_finalize(d_->deleteUnloadedServerFilesQuery_);
 	sqlite3_close(d_->db_);
 	delete d_;
 }
 
 bool CQueueStorage::SaveQueue(std::vector<CServerItem*> const& queue)
 {
+	if (d_->journal_) {
+		// Everything has been journaled already
+		bool ret = d_->Commit();
+		ret &= sqlite3_exec(d_->db_, "PRAGMA wal_checkpoint(TRUNCATE)", 0, 0, 0) == SQLITE_OK;
+		return ret;
+	}
+
 	d_->ClearCaches();
 
 	bool ret = true;
@@ -1059,12 +1403,18 @@ int64_t CQueueStorage::GetServer(CServer& server, bool fromBeginning)
 {
 	int64_t ret = -1;
 
-	if (d_->selectServersQuery_)
+	if (!d_->owner_) {
+		ret = 0;
+	}
+	else if (d_->selectServersQuery_)
 	{
 		if (fromBeginning)
 		{
+			if (d_->journal_)
+				sqlite3_exec(d_->db_, "DELETE FROM servers WHERE id NOT IN (SELECT server FROM files)", 0, 0, 0);
 			d_->ReadLocalPaths();
 			d_->ReadRemotePaths();
+			d_->BeginLoading();
 			sqlite3_reset(d_->selectServersQuery_);
 		}
 
@@ -1080,8 +1430,12 @@ int64_t CQueueStorage::GetServer(CServer& server, bool fromBeginning)
 			if (res == SQLITE_ROW)
 			{
 				ret = d_->ParseServerFromRow(server);
-				if (ret > 0)
+				if (ret > 0) {
+					d_->loadedServers_.insert(ret);
 					break;
+				}
+
+				d_->invalidServers_.push_back(d_->GetColumnInt64(d_->selectServersQuery_, server_table_column_names::id));
 			}
 			else if (res == SQLITE_DONE)
 			{
@@ -1105,18 +1459,29 @@ int64_t CQueueStorage::GetServer(CServer& server, bool fromBeginning)
 }
 
 
-int64_t CQueueStorage::GetFile(CFileItem** pItem, int64_t server)
+int64_t CQueueStorage::GetFile(CFileItem** pItem, int64_t& server, int count)
 {
 	int64_t ret = -1;
 	*pItem = 0;
+	server = 0;
+
+	if (!d_->loading_)
+		return 0;
 
 	if (d_->selectFilesQuery_)
 	{
-		if (server > 0)
+		if (count > 0)
 		{
 			sqlite3_reset(d_->selectFilesQuery_);
-			sqlite3_bind_int64(d_->selectFilesQuery_, 1, server);
+			sqlite3_bind_int64(d_->selectFilesQuery_, 1, d_->loadedFile_);
+			sqlite3_bind_int64(d_->selectFilesQuery_, 2, d_->lastFile_);
+			sqlite3_bind_int(d_->selectFilesQuery_, 3, count);
+			d_->pageActive_ = true;
+			d_->pageRows_ = 0;
+			d_->pageSize_ = count;
 		}
+		else if (!d_->pageActive_)
+			return 0;
 
 		for (;;)
 		{
@@ -1129,31 +1494,66 @@ int64_t CQueueStorage::GetFile(CFileItem** pItem, int64_t server)
 
 			if (res == SQLITE_ROW)
 			{
-				ret = d_->ParseFileFromRow(pItem);
-				if (ret > 0)
-					break;
+				++d_->pageRows_;
+				d_->loadedFile_ = d_->GetColumnInt64(d_->selectFilesQuery_, file_table_column_names::id);
+
+				server = d_->GetColumnInt64(d_->selectFilesQuery_, file_table_column_names::server);
+				if (d_->loadedServers_.find(server) != d_->loadedServers_.end()) {
+					ret = d_->ParseFileFromRow(pItem);
+					if (ret > 0)
+						break;
+				}
+
+				d_->invalidFiles_.push_back(d_->loadedFile_);
+				server = 0;
 			}
 			else if (res == SQLITE_DONE)
 			{
 				ret = 0;
 				sqlite3_reset(d_->selectFilesQuery_);
+				d_->pageActive_ = false;
+
+				// A short page is the last one
+				if (d_->pageRows_ < d_->pageSize_)
+					d_->FinishLoading();
 				break;
 			}
 			else
 			{
 				ret = -1;
-				sqlite3_reset(d_->selectFilesQuery_);
+				d_->FinishLoading();
 				break;
 			}
 		}
 	}
 	else {
 		ret = -1;
+		d_->FinishLoading();
 	}
 
 	return ret;
 }
 
+bool CQueueStorage::HasUnloadedFiles() const
+{
+	return d_->loading_;
+}
+
+void CQueueStorage::RemoveUnloadedFiles()
+{
+	if (!d_->loading_)
+		return;
+
+	if (d_->journal_ && d_->Begin()) {
+		sqlite3_bind_int64(d_->deleteUnloadedFilesQuery_, 1, d_->loadedFile_);
+		sqlite3_bind_int64(d_->deleteUnloadedFilesQuery_, 2, d_->lastFile_);
+		d_->Execute(d_->deleteUnloadedFilesQuery_);
+		d_->Changed();
+	}
+
+	d_->FinishLoading();
+}
+
 bool CQueueStorage::Clear()
 {
 	if (!d_->db_)
@@ -1176,6 +1576,27 @@ bool CQueueStorage::Clear()
 	return true;
 }
 
+bool CQueueStorage::Purge()
+{
+	if (!d_->journal_) {
+		d_->invalidServers_.clear();
+		d_->invalidFiles_.clear();
+		d_->ClearCaches();
+		return true;
+	}
+
+	bool ret = d_->PurgeRows();
+
+	// Only keep the caches needed for journaling, with the purged paths gone
+	d_->ClearCaches();
+	d_->ReadLocalPaths();
+	d_->ReadRemotePaths();
+	d_->reverseLocalPaths_.clear();
+	d_->reverseRemotePaths_.clear();
+
+	return ret;
+}
+
 wxString CQueueStorage::GetDatabaseFilename()
 {
 	wxFileName file(COptions::Get()->GetOption(OPTION_DEFAULT_SETTINGSDIR), _T("queue.sqlite3"));
@@ -1185,15 +1606,108 @@ wxString CQueueStorage::GetDatabaseFilename()
 
 bool CQueueStorage::BeginTransaction()
 {
-	return sqlite3_exec(d_->db_, "BEGIN TRANSACTION", 0, 0, 0) == SQLITE_OK;
+	return d_->Begin();
 }
 
 bool CQueueStorage::EndTransaction()
 {
-	return sqlite3_exec(d_->db_, "END TRANSACTION", 0, 0, 0) == SQLITE_OK;
+	return d_->Commit();
 }
 
 bool CQueueStorage::Vacuum()
 {
+	// Can't vacuum inside a transaction
+	d_->Commit();
+
 	return sqlite3_exec(d_->db_, "VACUUM", 0, 0, 0) == SQLITE_OK;
 }
+
+bool CQueueStorage::Journaling() const
+{
+	return d_->journal_;
+}
+
+void CQueueStorage::AddItem(CServerItem& server, CFileItem& item)
+{
+	if (!d_->journal_ || item.m_storageId || item.m_edit != CEditHandler::none)
+		return;
+
+	if (!d_->Begin())
+		return;
+
+	d_->StoreItem(server, item);
+	d_->Changed();
+}
+
+void CQueueStorage::UpdateItem(CFileItem const& item)
+{
+	if (!d_->journal_ || !item.m_storageId)
+		return;
+
+	if (!d_->Begin())
+		return;
+
+	d_->UpdateFile(item);
+	d_->Changed();
+}
+
+void CQueueStorage::RemoveItem(CFileItem& item)
+{
+	if (!d_->journal_ || !item.m_storageId)
+		return;
+
+	if (!d_->Begin())
+		return;
+
+	d_->DeleteRow(d_->deleteFileQuery_, item.m_storageId);
+	item.m_storageId = 0;
+	d_->newFiles_.erase(&item);
+	d_->Changed();
+}
+
+void CQueueStorage::RemoveServer(CServerItem& server)
+{
+	if (!d_->journal_)
+		return;
+
+	// Files are deleted one by one, after merging duplicate servers on load
+	// not all of them need to belong to the server's row.
+	const std::vector<CQueueItem*>& children = server.GetChildren();
+	for (auto it = children.begin(); it != children.end(); ++it) {
+		if (!*it)
+			continue;
+		if ((*it)->GetType() == QueueItemType::File || (*it)->GetType() == QueueItemType::Folder)
+			RemoveItem(*static_cast<CFileItem*>(*it));
+	}
+
+	// Files not loaded yet may belong to any of the rows merged into the item
+	std::vector<int64_t> ids = server.m_mergedStorageIds;
+	if (server.m_storageId)
+		ids.push_back(server.m_storageId);
+
+	if (ids.empty() || !d_->Begin())
+		return;
+
+	for (auto it = ids.begin(); it != ids.end(); ++it) {
+		if (d_->loading_) {
+			sqlite3_bind_int64(d_->deleteUnloadedServerFilesQuery_, 1, *it);
+			sqlite3_bind_int64(d_->deleteUnloadedServerFilesQuery_, 2, d_->loadedFile_);
+			sqlite3_bind_int64(d_->deleteUnloadedServerFilesQuery_, 3, d_->lastFile_);
+			d_->Execute(d_->deleteUnloadedServerFilesQuery_);
+		}
+		d_->DeleteRow(d_->deleteServerQuery_, *it);
+	}
+	server.m_storageId = 0;
+	server.m_mergedStorageIds.clear();
+	d_->Changed();
+}
+
+bool CQueueStorage::HasPendingChanges() const
+{
+	return d_->transaction_ && d_->pendingChanges_;
+}
+
+bool CQueueStorage::Flush()
+{
+	return d_->Commit();
+}
@@ -26,17 +26,49 @@ public:
 
 	bool Clear(); // Also clears caches
 
+	// Call once all files have been loaded. Deletes rows that could not be
+	// loaded as well as paths no longer referenced by any file.
+	bool Purge();
+
 	bool Vacuum();
 
+	// If journaling, commits pending changes and checkpoints the database.
+	// Otherwise the whole queue gets written.
 	bool SaveQueue(std::vector<CServerItem*> const& queue);
 
+	// Journal of changes to the queue. Only one instance at a time journals,
+	// the others save their queue on exit using SaveQueue.
+	// Changes are collected in a transaction, call Flush to commit them.
+	bool Journaling() const;
+	void AddItem(CServerItem& server, CFileItem& item);
+	void UpdateItem(CFileItem const& item);
+	void RemoveItem(CFileItem& item);
+	void RemoveServer(CServerItem& server); // Including all its children and files not loaded yet
+	bool HasPendingChanges() const;
+	bool Flush();
+
 	// > 0 = server id
 	//   0 = No server
 	// < 0 = failure.
+	// If another instance is journaling, it owns the stored queue and no
+	// servers are returned.
 	int64_t GetServer(CServer& server, bool fromBeginning);
 	CServer GetNextServer();
 
-	int64_t GetFile(CFileItem** pItem, int64_t server);
+	// Files are read in pages of at most count files, in the order they have
+	// been stored. Call with count > 0 to start the next page, then with 0 to
+	// get the remaining files of the page. Only files stored before the first
+	// call to GetServer are returned.
+	// > 0 = file id, server is set to the id of the file's server
+	//   0 = End of page
+	// < 0 = failure.
+	int64_t GetFile(CFileItem** pItem, int64_t& server, int count = 0);
+
+	// Whether there are files left that haven't been read yet
+	bool HasUnloadedFiles() const;
+
+	// Stops loading and deletes the files not read yet
+	void RemoveUnloadedFiles();
 
 	static wxString GetDatabaseFilename();
 
@@ -237,6 +237,7 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 	bool restrict = !dir.restrict.empty();
 
 	std::list<wxString> filesToDelete;
+	std::vector<std::pair<wxString, wxString>> filesToChmod;
 
 	const wxString path = pDirectoryListing->path.GetPath();
 
@@ -320,7 +321,7 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 				char permissions[9];
 				bool res = m_pChmodDlg->ConvertPermissions(*entry.permissions, permissions);
 				wxString newPerms = m_pChmodDlg->GetPermissions(res ? permissions : 0, entry.is_dir());
-				m_pState->m_pCommandQueue->ProcessCommand(new CChmodCommand(pDirectoryListing->path, entry.name, newPerms));
+				filesToChmod.emplace_back(entry.name, newPerms);
 			}
 		}
 	}
@@ -329,6 +330,8 @@ void CRecursiveOperation::ProcessDirectoryListing(const CDirectoryListing* pDire
 
 	if (m_operationMode == recursive_delete && !filesToDelete.empty())
 		m_pState->m_pCommandQueue->ProcessCommand(new CDeleteCommand(pDirectoryListing->path, filesToDelete));
+	if (!filesToChmod.empty())
+		m_pState->m_pCommandQueue->ProcessCommand(new CChmodCommand(pDirectoryListing->path, filesToChmod));
 
 	NextOperation();
 }
@@ -1,4 +1,5 @@
-#define FZSFTP_PROTOCOL_VERSION 2
+/* Bump together with the copy in engine/sftpcontrolsocket.cpp */
+#define FZSFTP_PROTOCOL_VERSION 4
 
 typedef enum
 {
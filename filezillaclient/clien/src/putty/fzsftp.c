@@ -13,11 +13,170 @@ char* input_pushback = 0;
 
 #ifndef _WINDOWS
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
 
 char *input_buf = 0;
 int input_buflen = 0, input_bufsize = 0;
 #endif
 
+/*
+ * Block of memory shared with the engine. Quota grants and transfer
+ * progress go through it instead of the text protocol, so fzsftp does not
+ * have to stop reading the network until the engine answered a quota
+ * request line. The layout must match the one in engine/sftp_shm.cpp.
+ */
+#define FZ_SHM_VERSION 1
+
+struct fz_shm
+{
+    long long version;
+    long long granted[2];	/* engine: total bytes granted so far */
+    long long unlimited[2];	/* engine: nonzero if no quota is needed */
+    long long limit[2];		/* engine: current speed limit */
+    long long requested[2];	/* set by us, cleared by the engine on grant */
+    long long transferred;	/* progress not yet picked up by the engine */
+    long long progress_pending;	/* set while a progress line is in flight */
+};
+
+#ifdef _WINDOWS
+#define shm_load(p) InterlockedCompareExchange64((p), 0, 0)
+#define shm_add(p, v) InterlockedExchangeAdd64((p), (v))
+#define shm_xchg(p, v) InterlockedExchange64((p), (v))
+#else
+#define shm_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define shm_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define shm_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+static volatile struct fz_shm *shm = NULL;
+static long long shm_used[2] = { 0, 0 };
+static int shm_unlimited_calls[2] = { 0, 0 };
+
+int fz_shm_attach(const char* name)
+{
+    volatile struct fz_shm *p;
+#ifdef _WINDOWS
+    HANDLE mapping;
+#else
+    void *addr;
+    int fd;
+#endif
+
+    if (shm)
+	return 0;
+
+#ifdef _WINDOWS
+    mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (!mapping)
+	return 0;
+    p = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct fz_shm));
+    /* The view keeps the mapping alive */
+    CloseHandle(mapping);
+    if (!p)
+	return 0;
+
+    if (shm_load(&p->version) != FZ_SHM_VERSION) {
+	UnmapViewOfFile((void*)p);
+	return 0;
+    }
+#else
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+	return 0;
+    addr = mmap(NULL, sizeof(struct fz_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+	return 0;
+    p = addr;
+
+    if (shm_load(&p->version) != FZ_SHM_VERSION) {
+	munmap(addr, sizeof(struct fz_shm));
+	return 0;
+    }
+#endif
+
+    shm = p;
+    return 1;
+}
+
+/*
+ * Waits a little for the engine to grant more quota. Exits if the engine
+ * has closed our input, otherwise we would wait forever after it died.
+ */
+static void shm_sleep(void)
+{
+#ifdef _WINDOWS
+    DWORD avail;
+    if (!PeekNamedPipe(GetStdHandle(STD_INPUT_HANDLE), NULL, 0, NULL, &avail, NULL) &&
+	GetLastError() == ERROR_BROKEN_PIPE)
+	cleanup_exit(1);
+    Sleep(5);
+#else
+    /* Only asking for errors, pending commands must not end the wait */
+    struct pollfd fd;
+    fd.fd = 0;
+    fd.events = 0;
+    fd.revents = 0;
+    if (poll(&fd, 1, 5) > 0 && (fd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+	cleanup_exit(1);
+#endif
+}
+
+static int RequestShmQuota(int i, int bytes)
+{
+    long long available;
+
+    if (shm_load(&shm->unlimited[i])) {
+	/* Every now and then ask again in case a limit got enabled */
+	if (++shm_unlimited_calls[i] >= 100) {
+	    shm_unlimited_calls[i] = 0;
+	    if (!shm_xchg(&shm->requested[i], 1))
+		fznotify(sftpUsedQuotaRecv + i);
+	}
+	return bytes;
+    }
+
+    /*
+     * Ask for more as soon as the remaining quota no longer covers a full
+     * read or write, so that the grant usually arrives before we run dry.
+     * At most one request is outstanding at any time.
+     */
+    available = shm_load(&shm->granted[i]) - shm_used[i];
+    if (available < bytes && !shm_xchg(&shm->requested[i], 1))
+	fznotify(sftpUsedQuotaRecv + i);
+
+    while (available <= 0) {
+	shm_sleep();
+	if (shm_load(&shm->unlimited[i]))
+	    return bytes;
+	available = shm_load(&shm->granted[i]) - shm_used[i];
+    }
+
+    if (available > bytes)
+	return bytes;
+
+    return (int)available;
+}
+
+void fz_progress(int bytes)
+{
+    if (!shm) {
+	fzprintf(sftpTransfer, "%d", bytes);
+	return;
+    }
+
+    /*
+     * The line merely wakes up the engine which then takes everything
+     * accumulated so far, so there is no need to send another one until
+     * it has done so.
+     */
+    shm_add(&shm->transferred, bytes);
+    if (!shm_xchg(&shm->progress_pending, 1))
+	fzprintf(sftpTransfer, "0");
+}
+
 static int ReadQuotas(int i)
 {
 #ifdef _WINDOWS
@@ -83,6 +242,9 @@ static int ReadQuotas(int i)
 
 int RequestQuota(int i, int bytes)
 {
+    if (shm)
+	return RequestShmQuota(i, bytes);
+
     if (bytesAvailable[i] < -100)
 	bytesAvailable[i] = 0;
     else if (bytesAvailable[i] < 0)
@@ -108,6 +270,12 @@ int RequestQuota(int i, int bytes)
 
 void UpdateQuota(int i, int bytes)
 {
+    if (shm) {
+	if (!shm_load(&shm->unlimited[i]))
+	    shm_used[i] += bytes;
+	return;
+    }
+
     if (bytesAvailable[i] < 0)
 	return;
 
@@ -246,6 +414,11 @@ const static unsigned int notificationDelay = 10000000 / 10;
 #endif
 
 
+unsigned long fz_ticks(void)
+{
+    return GETTICKCOUNT();
+}
+
 int fz_timer_check(_fztimer *timer)
 {
 #ifdef _WINDOWS
@@ -323,5 +496,8 @@ int fz_timer_check(_fztimer *timer)
 
 int CurrentSpeedLimit(int direction)
 {
+    if (shm)
+	return (int)shm_load(&shm->limit[direction]);
+
     return limit[direction];
 }
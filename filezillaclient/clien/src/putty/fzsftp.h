@@ -12,6 +12,12 @@ char* read_input_line(int force, int* error);
 
 int CurrentSpeedLimit(int direction);
 
+/* Attaches to the engine's shared memory block, returns 0 on failure */
+int fz_shm_attach(const char* name);
+
+/* Reports transferred bytes to the engine */
+void fz_progress(int bytes);
+
 #ifdef _WINDOWS
 #include <windows.h>
 typedef FILETIME _fztimer;
@@ -26,4 +32,7 @@ typedef struct
 void fz_timer_init(_fztimer *timer);
 int fz_timer_check(_fztimer *timer);
 
+/* Milliseconds since an arbitrary point in time, for measuring durations */
+unsigned long fz_ticks(void);
+
 #endif
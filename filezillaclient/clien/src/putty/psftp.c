@@ -556,7 +556,7 @@ int sftp_get_file(char *fname, char *outfname, int recurse, int restart)
 	}
 
 	if (fz_timer_check(&timer)) {
-	    fzprintf(sftpTransfer, "%d", winterval);
+	    fz_progress(winterval);
 	    winterval = 0;
 	}
 
@@ -586,6 +586,7 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
     int ret, err, eof;
     struct fxp_attrs attrs;
     long permissions;
+    char *buffer;
 
     /*
      * In recursive mode, see if we're dealing with a directory.
@@ -767,13 +768,13 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
      */
     ret = 1;
     xfer = xfer_upload_init(fh, offset);
+    buffer = snewn(XFER_REQ_MAXSIZE, char);
     err = eof = 0;
     while ((!err && !eof) || !xfer_done(xfer)) {
-        char buffer[4096*4];
 	int len, ret;
 
 	while (xfer_upload_ready(xfer) && !err && !eof) {
-	    len = read_from_file(file, buffer, sizeof(buffer));
+	    len = read_from_file(file, buffer, xfer_upload_chunk(xfer));
 	    if (len == -1) {
 		fzprintf(sftpError, "error while reading local file");
 		err = 1;
@@ -802,6 +803,7 @@ int sftp_put_file(char *fname, char *outfname, int recurse, int restart)
     }
 
     xfer_cleanup(xfer);
+    sfree(buffer);
 
 cleanup:
     req = fxp_close_send(fh);
@@ -1066,6 +1068,43 @@ int sftp_cmd_keyfile(struct sftp_command *cmd)
     return 1;
 }
 
+/*
+ * FZ: Attaches to the shared memory block set up by the engine. From then on
+ * quota and transfer progress are exchanged through it.
+ */
+int sftp_cmd_shm(struct sftp_command *cmd)
+{
+    if (cmd->nwords != 2) {
+	fzprintf(sftpError, "shm: expects the name of a shared memory block");
+	return 0;
+    }
+
+    if (!fz_shm_attach(cmd->words[1])) {
+	fzprintf(sftpError, "shm: could not attach to %s", cmd->words[1]);
+	return 0;
+    }
+
+    fznotify1(sftpDone, 1);
+    return 1;
+}
+
+/*
+ * FZ: Sets the upper limit of the adaptive transfer window, in bytes.
+ */
+int sftp_cmd_xferwindow(struct sftp_command *cmd)
+{
+    if (cmd->nwords != 2 || !*cmd->words[1] ||
+	cmd->words[1][strspn(cmd->words[1], "0123456789")]) {
+	fzprintf(sftpError, "xferwindow: expects a size in bytes");
+	return 0;
+    }
+
+    xfer_set_max_window(atoi(cmd->words[1]));
+
+    fznotify1(sftpDone, 1);
+    return 1;
+}
+
 int sftp_cmd_proxy(struct sftp_command *cmd)
 {
     int proxy_type;
@@ -1702,6 +1741,204 @@ int sftp_cmd_rm(struct sftp_command *cmd)
     return ret;
 }
 
+/* ----------------------------------------------------------------------
+ * FZ: Pipelined metadata operations on many files at once.
+ *
+ * Each item runs through one or more request/reply steps. Up to
+ * PIPELINE_WINDOW requests are kept in flight, results are reported
+ * in item order once all preceding items are done.
+ */
+#define PIPELINE_WINDOW 16
+
+struct pipeline_item {
+    char *fname;
+    int step;
+    int result;			       /* -1 while still pending */
+    char *error;
+    struct sftp_request *req;
+    void *data;
+    struct fxp_attrs attrs;
+};
+
+struct pipeline_ops {
+    /* Sends the request for the current step of the item */
+    struct sftp_request *(*send)(struct pipeline_item *item);
+    /*
+     * Consumes the reply, returns -1 if the item needs another step,
+     * otherwise its result. On failure item->error has to be set.
+     */
+    int (*recv)(struct pipeline_item *item, struct sftp_packet *pktin,
+		struct sftp_request *req);
+    const char *name;
+};
+
+/*
+ * Builds the items for files given relative to dir. Returns NULL if
+ * the directory cannot be canonified.
+ */
+static struct pipeline_item *pipeline_init(char *dir, char **files,
+					   int nitems)
+{
+    struct pipeline_item *items;
+    char *cdir, *slash;
+    int i;
+
+    cdir = canonify(dir, 0);
+    if (!cdir) {
+	fzprintf(sftpError, "%s: canonify: %s", dir, fxp_error());
+	return NULL;
+    }
+    slash = (*cdir && cdir[strlen(cdir) - 1] == '/') ? "" : "/";
+
+    items = snewn(nitems, struct pipeline_item);
+    memset(items, 0, nitems * sizeof(struct pipeline_item));
+    for (i = 0; i < nitems; i++) {
+	items[i].fname = dupcat(cdir, slash, files[i], NULL);
+	items[i].result = -1;
+    }
+    sfree(cdir);
+
+    return items;
+}
+
+static void pipeline_free(struct pipeline_item *items, int nitems)
+{
+    int i;
+
+    for (i = 0; i < nitems; i++) {
+	sfree(items[i].fname);
+	sfree(items[i].error);
+    }
+    sfree(items);
+}
+
+/*
+ * Fails every item without sending anything, used if the batch cannot
+ * be started at all.
+ */
+static void pipeline_fail_all(int nitems)
+{
+    int i;
+
+    for (i = 0; i < nitems; i++)
+	fznotify1(sftpDone, 0);
+}
+
+static void pipeline_send(struct pipeline_item *item,
+			  const struct pipeline_ops *ops)
+{
+    item->req = ops->send(item);
+    sftp_register(item->req);
+}
+
+/*
+ * Runs all items. Each one gets reported separately: sftpDone 1 on
+ * success, an error followed by sftpDone 0 on failure.
+ */
+static void pipeline_run(struct pipeline_item *items, int nitems,
+			 const struct pipeline_ops *ops)
+{
+    struct sftp_packet *pktin;
+    struct sftp_request *rreq;
+    int started, inflight, reported, i;
+
+    started = inflight = reported = 0;
+    while (reported < nitems) {
+	while (started < nitems && inflight < PIPELINE_WINDOW) {
+	    pipeline_send(&items[started++], ops);
+	    inflight++;
+	}
+
+	pktin = sftp_recv();
+	if (pktin == NULL)
+	    connection_fatal(NULL, "did not receive SFTP response packet "
+			     "from server");
+	rreq = sftp_find_request(pktin);
+	for (i = reported; i < started; i++)
+	    if (items[i].result < 0 && items[i].req == rreq)
+		break;
+	if (!rreq || i == started)
+	    connection_fatal(NULL, "unable to understand SFTP response packet "
+			     "from server: %s", fxp_error());
+
+	items[i].req = NULL;
+	items[i].result = ops->recv(&items[i], pktin, rreq);
+	if (items[i].result < 0) {
+	    /* Next step of the same item, it stays in flight */
+	    items[i].step++;
+	    pipeline_send(&items[i], ops);
+	}
+	else
+	    inflight--;
+
+	/* Replies may arrive out of order, report them in item order */
+	while (reported < started && items[reported].result >= 0) {
+	    if (items[reported].result)
+		fznotify1(sftpDone, 1);
+	    else {
+		fzprintf(sftpError, "%s %s: %s", ops->name,
+			 items[reported].fname,
+			 items[reported].error ? items[reported].error : "failed");
+		fznotify1(sftpDone, 0);
+	    }
+	    reported++;
+	}
+    }
+}
+
+static struct sftp_request *pipeline_rm_send(struct pipeline_item *item)
+{
+    return fxp_remove_send(item->fname);
+}
+
+static int pipeline_rm_recv(struct pipeline_item *item,
+			    struct sftp_packet *pktin,
+			    struct sftp_request *req)
+{
+    if (!fxp_remove_recv(pktin, req)) {
+	item->error = dupstr(fxp_error());
+	return 0;
+    }
+    return 1;
+}
+
+static const struct pipeline_ops pipeline_rm = {
+    pipeline_rm_send, pipeline_rm_recv, "rm"
+};
+
+/*
+ * FZ: Removes several files from the same directory, keeping multiple
+ * requests in flight.
+ */
+int sftp_cmd_mrm(struct sftp_command *cmd)
+{
+    struct pipeline_item *items;
+    int nitems;
+
+    if (cmd->nwords < 3) {
+	fzprintf(sftpError, "mrm: expects a directory and filenames");
+	return 0;
+    }
+    nitems = cmd->nwords - 2;
+
+    if (back == NULL) {
+	not_connected();
+	pipeline_fail_all(nitems);
+	return 1;
+    }
+
+    items = pipeline_init(cmd->words[1], cmd->words + 2, nitems);
+    if (!items) {
+	pipeline_fail_all(nitems);
+	return 1;
+    }
+
+    pipeline_run(items, nitems, &pipeline_rm);
+    pipeline_free(items, nitems);
+
+    return 1;
+}
+
 static int check_is_dir(char *dstfname)
 {
     struct sftp_packet *pktin;
@@ -1867,24 +2104,16 @@ static int sftp_action_chmod(void *vctx, char *fname)
     return 1;
 }
 
-int sftp_cmd_chmod(struct sftp_command *cmd)
+/*
+ * FZ: Parses a mode specifier as understood by chmod into the bits to
+ * clear and to flip. Returns 0 after reporting an error if the
+ * specifier is invalid.
+ */
+static int parse_chmod_mode(const char *cmdname, char *mode,
+			    struct sftp_context_chmod *ctx)
 {
-    char *mode;
-    int i, ret;
-    struct sftp_context_chmod actx, *ctx = &actx;
-
-    if (back == NULL) {
-	not_connected();
-	return 0;
-    }
-
-    if (cmd->nwords < 3) {
-	fzprintf(sftpError, "chmod: expects a mode specifier and a filename");
-	return 0;
-    }
-
     /*
-     * Attempt to parse the mode specifier in cmd->words[1]. We
+     * Attempt to parse the mode specifier. We
      * don't support the full horror of Unix chmod; instead we
      * support a much simpler syntax in which the user can either
      * specify an octal number, or a comma-separated sequence of
@@ -1895,11 +2124,10 @@ int sftp_cmd_chmod(struct sftp_command *cmd)
      * [ugoa] specifications other than exactly u or exactly g.
      */
     ctx->attrs_clr = ctx->attrs_xor = 0;
-    mode = cmd->words[1];
     if (mode[0] >= '0' && mode[0] <= '9') {
 	if (mode[strspn(mode, "01234567")]) {
-	    fzprintf(sftpError, "chmod: numeric file modes should"
-		   " contain digits 0-7 only");
+	    fzprintf(sftpError, "%s: numeric file modes should"
+		   " contain digits 0-7 only", cmdname);
 	    return 0;
 	}
 	ctx->attrs_clr = 07777;
@@ -1920,21 +2148,21 @@ int sftp_cmd_chmod(struct sftp_command *cmd)
 		  case 'o': subset |= 00007; break; /* just other perms */
 		  case 'a': subset |= 06777; break; /* all of the above */
 		  default:
-		    fzprintf(sftpError, "chmod: file mode '%.*s' contains unrecognised"
-			   " user/group/other specifier '%c'",
+		    fzprintf(sftpError, "%s: file mode '%.*s' contains unrecognised"
+			   " user/group/other specifier '%c'", cmdname,
 			   (int)strcspn(modebegin, ","), modebegin, *mode);
 		    return 0;
 		}
 		mode++;
 	    }
 	    if (!*mode || *mode == ',') {
-		fzprintf(sftpError, "chmod: file mode '%.*s' is incomplete",
+		fzprintf(sftpError, "%s: file mode '%.*s' is incomplete", cmdname,
 		       (int)strcspn(modebegin, ","), modebegin);
 		return 0;
 	    }
 	    action = *mode++;
 	    if (!*mode || *mode == ',') {
-		fzprintf(sftpError, "chmod: file mode '%.*s' is incomplete",
+		fzprintf(sftpError, "%s: file mode '%.*s' is incomplete", cmdname,
 		       (int)strcspn(modebegin, ","), modebegin);
 		return 0;
 	    }
@@ -1948,24 +2176,24 @@ int sftp_cmd_chmod(struct sftp_command *cmd)
 		  case 's':
 		    if ((subset & 06777) != 04700 &&
 			(subset & 06777) != 02070) {
-			fzprintf(sftpError, "chmod: file mode '%.*s': set[ug]id bit should"
-			       " be used with exactly one of u or g only",
+			fzprintf(sftpError, "%s: file mode '%.*s': set[ug]id bit should"
+			       " be used with exactly one of u or g only", cmdname,
 			       (int)strcspn(modebegin, ","), modebegin);
 			return 0;
 		    }
 		    perms |= 06000;
 		    break;
 		  default:
-		    fzprintf(sftpError, "chmod: file mode '%.*s' contains unrecognised"
-			   " permission specifier '%c'",
+		    fzprintf(sftpError, "%s: file mode '%.*s' contains unrecognised"
+			   " permission specifier '%c'", cmdname,
 			   (int)strcspn(modebegin, ","), modebegin, *mode);
 		    return 0;
 		}
 		mode++;
 	    }
 	    if (!(subset & 06777) && (perms &~ subset)) {
-		fzprintf(sftpError, "chmod: file mode '%.*s' contains no user/group/other"
-		       " specifier and permissions other than 't'",
+		fzprintf(sftpError, "%s: file mode '%.*s' contains no user/group/other"
+		       " specifier and permissions other than 't'", cmdname,
 		       (int)strcspn(modebegin, ","), modebegin);
 		return 0;
 	    }
@@ -1988,6 +2216,27 @@ int sftp_cmd_chmod(struct sftp_command *cmd)
 	}
     }
 
+    return 1;
+}
+
+int sftp_cmd_chmod(struct sftp_command *cmd)
+{
+    int i, ret;
+    struct sftp_context_chmod actx, *ctx = &actx;
+
+    if (back == NULL) {
+	not_connected();
+	return 0;
+    }
+
+    if (cmd->nwords < 3) {
+	fzprintf(sftpError, "chmod: expects a mode specifier and a filename");
+	return 0;
+    }
+
+    if (!parse_chmod_mode("chmod", cmd->words[1], ctx))
+	return 0;
+
     ret = 1;
     for (i = 2; i < cmd->nwords; i++)
 	ret &= wildcard_iterate(cmd->words[i], sftp_action_chmod, ctx, 0);
@@ -1998,6 +2247,111 @@ int sftp_cmd_chmod(struct sftp_command *cmd)
     return ret;
 }
 
+/*
+ * Numeric modes replace all bits, so the current permissions are not
+ * needed and the item goes straight to SETSTAT. Otherwise the first
+ * step reads the current permissions.
+ */
+static struct sftp_request *pipeline_chmod_send(struct pipeline_item *item)
+{
+    struct sftp_context_chmod *ctx = (struct sftp_context_chmod *)item->data;
+
+    if (!item->step && ctx->attrs_clr != 07777)
+	return fxp_stat_send(item->fname);
+
+    item->attrs.flags = SSH_FILEXFER_ATTR_PERMISSIONS;   /* perms _only_ */
+    item->attrs.permissions &= ~ctx->attrs_clr;
+    item->attrs.permissions ^= ctx->attrs_xor;
+    return fxp_setstat_send(item->fname, item->attrs);
+}
+
+static int pipeline_chmod_recv(struct pipeline_item *item,
+			       struct sftp_packet *pktin,
+			       struct sftp_request *req)
+{
+    struct sftp_context_chmod *ctx = (struct sftp_context_chmod *)item->data;
+    unsigned oldperms;
+
+    if (item->step || ctx->attrs_clr == 07777) {
+	if (!fxp_setstat_recv(pktin, req)) {
+	    item->error = dupstr(fxp_error());
+	    return 0;
+	}
+	return 1;
+    }
+
+    if (!fxp_stat_recv(pktin, req, &item->attrs)) {
+	item->error = dupstr(fxp_error());
+	return 0;
+    }
+    if (!(item->attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+	item->error = dupstr("file permissions not provided");
+	return 0;
+    }
+
+    oldperms = item->attrs.permissions & 07777;
+    if (oldperms == (((oldperms & ~ctx->attrs_clr) ^ ctx->attrs_xor) & 07777))
+	return 1;		       /* no need to do anything! */
+
+    return -1;
+}
+
+static const struct pipeline_ops pipeline_chmod = {
+    pipeline_chmod_send, pipeline_chmod_recv, "chmod"
+};
+
+/*
+ * FZ: Changes the permissions of several files in the same directory,
+ * each with its own mode, keeping multiple requests in flight.
+ */
+int sftp_cmd_mchmod(struct sftp_command *cmd)
+{
+    struct pipeline_item *items;
+    struct sftp_context_chmod *ctxs;
+    char **files;
+    int nitems, i;
+
+    if (cmd->nwords < 4 || (cmd->nwords % 2)) {
+	fzprintf(sftpError, "mchmod: expects a directory and pairs of mode specifier and filename");
+	return 0;
+    }
+    nitems = (cmd->nwords - 2) / 2;
+
+    if (back == NULL) {
+	not_connected();
+	pipeline_fail_all(nitems);
+	return 1;
+    }
+
+    ctxs = snewn(nitems, struct sftp_context_chmod);
+    files = snewn(nitems, char *);
+    for (i = 0; i < nitems; i++) {
+	files[i] = cmd->words[3 + 2 * i];
+	if (!parse_chmod_mode("mchmod", cmd->words[2 + 2 * i], &ctxs[i])) {
+	    sfree(files);
+	    sfree(ctxs);
+	    pipeline_fail_all(nitems);
+	    return 1;
+	}
+    }
+
+    items = pipeline_init(cmd->words[1], files, nitems);
+    sfree(files);
+    if (!items) {
+	sfree(ctxs);
+	pipeline_fail_all(nitems);
+	return 1;
+    }
+    for (i = 0; i < nitems; i++)
+	items[i].data = &ctxs[i];
+
+    pipeline_run(items, nitems, &pipeline_chmod);
+    pipeline_free(items, nitems);
+    sfree(ctxs);
+
+    return 1;
+}
+
 static int sftp_action_chmtime(void *vmtime, char *fname)
 {
     struct fxp_attrs attrs = {0};
@@ -2378,6 +2732,15 @@ END FZ UNUSED */
 	"ls", TRUE, "dir", NULL,
 	    sftp_cmd_ls
     },
+    {
+	"mchmod", TRUE, "change the permissions of multiple files at once",
+	    " <directory> <modes> <filename> [ <modes> <filename>... ]\n"
+	    "  Changes the permissions of the given files in <directory>,\n"
+	    "  each to its own mode. The modes are specified as for chmod.\n"
+	    "  The requests are sent without waiting for the replies to\n"
+	    "  the previous ones. Wildcards are not supported.\n",
+	    sftp_cmd_mchmod
+    },
     {
 	"mget", TRUE, "download multiple files at once",
 	    " [ -r ] [ -- ] <filename-or-wildcard> [ <filename-or-wildcard>... ]\n"
@@ -2402,6 +2765,14 @@ END FZ UNUSED */
 	    "  If -r specified, recursively store files and directories.\n",
 	    sftp_cmd_mput
     },
+    {
+	"mrm", TRUE, "remove multiple files from a directory at once",
+	    " <directory> <filename> [ <filename>... ]\n"
+	    "  Removes the given files from <directory> on the server.\n"
+	    "  The requests are sent without waiting for the replies to\n"
+	    "  the previous ones. Wildcards are not supported.\n",
+	    sftp_cmd_mrm
+    },
     {
 	"mtime", TRUE, "get file modification time",
 	    " <filename>\n"
@@ -2489,6 +2860,20 @@ END FZ UNUSED */
 	    "  The directory will not be removed unless it is empty.\n"
 	    "  Wildcards may be used to specify multiple directories.\n",
 	    sftp_cmd_rmdir
+    },
+    {
+	"shm", TRUE, "use shared memory for quota and progress",
+	    " <name>\n"
+	    "  Attaches to the named shared memory block of the engine and uses\n"
+	    "  it to obtain speed limit quota and to report transfer progress.\n",
+	    sftp_cmd_shm
+    },
+    {
+	"xferwindow", TRUE, "limit the transfer window",
+	    " <bytes>\n"
+	    "  Sets the maximum amount of data in flight during transfers.\n"
+	    "  The window adapts to the connection up to this size.\n",
+	    sftp_cmd_xferwindow
     }
 };
 
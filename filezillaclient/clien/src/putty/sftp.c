@@ -465,10 +465,17 @@ int fxp_error_type(void)
 /*
  * Perform exchange of init/version packets. Return 0 on failure.
  */
+/* FZ: Request sizes the server accepts for reads and writes */
+static int fxp_read_size = XFER_REQ_SIZE, fxp_write_size = XFER_REQ_SIZE;
+
+static int fxp_query_limits(void);
+
 int fxp_init(void)
 {
     struct sftp_packet *pktout, *pktin;
     unsigned long remotever;
+    char *name, *data;
+    int namelen, datalen, limits = 0;
 
     pktout = sftp_pkt_init(SSH_FXP_INIT);
     sftp_pkt_adduint32(pktout, SFTP_PROTO_VERSION);
@@ -496,11 +503,87 @@ int fxp_init(void)
 	return 0;
     }
     /*
-     * In principle, this packet might also contain extension-
-     * string pairs. We should work through them and look for any
-     * we recognise. In practice we don't currently do so because
-     * we know we don't recognise _any_.
+     * FZ: The packet might also contain extension-string pairs. The
+     * only one we recognise tells us about the request sizes the
+     * server accepts.
      */
+    while (sftp_pkt_getstring(pktin, &name, &namelen) &&
+	   sftp_pkt_getstring(pktin, &data, &datalen)) {
+	if (namelen == 18 && !memcmp(name, "limits@openssh.com", 18))
+	    limits = 1;
+    }
+    sftp_pkt_free(pktin);
+
+    fxp_read_size = fxp_write_size = XFER_REQ_SIZE;
+    if (limits)
+	return fxp_query_limits();
+
+    return 1;
+}
+
+/*
+ * FZ: Largest power of two request size between XFER_REQ_SIZE and
+ * XFER_REQ_MAXSIZE the given limit allows. Leaves room for the packet
+ * overhead if only the packet length is limited. Zero means the server
+ * did not state a limit.
+ */
+static int xfer_request_size(unsigned long limit, unsigned long packet_limit)
+{
+    int size = XFER_REQ_SIZE;
+
+    if (packet_limit && (!limit || limit > packet_limit - 1024))
+	limit = packet_limit > 1024 ? packet_limit - 1024 : 1;
+
+    while (size < XFER_REQ_MAXSIZE && (!limit || (unsigned long)size * 2 <= limit))
+	size *= 2;
+
+    return size;
+}
+
+/*
+ * FZ: Asks the server for its limits using the limits@openssh.com
+ * extension. The reply holds the maximum packet, read and write
+ * lengths as well as the number of open handles, all as uint64.
+ */
+static int fxp_query_limits(void)
+{
+    struct sftp_packet *pktout, *pktin;
+    struct sftp_request *req, *rreq;
+    unsigned long hi, lo, values[4];
+    int i;
+
+    req = sftp_alloc_request();
+    pktout = sftp_pkt_init(SSH_FXP_EXTENDED);
+    sftp_pkt_adduint32(pktout, req->id);
+    sftp_pkt_addstring(pktout, "limits@openssh.com");
+    sftp_send(pktout);
+    sftp_register(req);
+
+    pktin = sftp_recv();
+    if (!pktin) {
+	fxp_internal_error("could not connect");
+	return 0;
+    }
+    rreq = sftp_find_request(pktin);
+    if (rreq != req) {
+	fxp_internal_error("request ID mismatch");
+	sftp_pkt_free(pktin);
+	return 0;
+    }
+    sfree(req);
+
+    if (pktin->type == SSH_FXP_EXTENDED_REPLY) {
+	for (i = 0; i < 4; i++) {
+	    if (!sftp_pkt_getuint32(pktin, &hi) ||
+		!sftp_pkt_getuint32(pktin, &lo))
+		break;
+	    values[i] = hi ? ULONG_MAX : lo;
+	}
+	if (i == 4) {
+	    fxp_read_size = xfer_request_size(values[1], values[0]);
+	    fxp_write_size = xfer_request_size(values[2], values[0]);
+	}
+    }
     sftp_pkt_free(pktin);
 
     return 1;
@@ -1122,6 +1205,7 @@ struct req {
     char *buffer;
     int len, retlen, complete;
     uint64 offset;
+    unsigned long sent;		       /* fz_ticks() when sent */
     struct req *next, *prev;
 };
 
@@ -1132,8 +1216,63 @@ struct fxp_xfer {
     struct req *head, *tail;
     _fztimer send_timer;
     int sent_interval;
+
+    /*
+     * FZ: The window of outstanding requests adapts to the bandwidth-
+     * delay product. Every time a full window has been acknowledged
+     * the throughput of that period gets multiplied with the lowest
+     * round-trip time seen.
+     */
+    unsigned long sample_start;
+    int sample_bytes;
+    long rtt_min;		       /* milliseconds, -1 if unknown */
 };
 
+static int xfer_max_window = XFER_WINDOW_MAX;
+
+void xfer_set_max_window(int size)
+{
+    xfer_max_window = size < XFER_WINDOW_MIN ? XFER_WINDOW_MIN : size;
+}
+
+static void xfer_update_window(struct fxp_xfer *xfer, struct req *rr)
+{
+    unsigned long now = fz_ticks();
+    long rtt = (long)(now - rr->sent);
+    unsigned long elapsed;
+    double target;
+
+    if (xfer->rtt_min < 0 || rtt < xfer->rtt_min)
+	xfer->rtt_min = rtt;
+
+    xfer->sample_bytes += rr->len;
+    if (xfer->sample_bytes < xfer->req_maxsize)
+	return;
+
+    /*
+     * If limited by the window, the product is about the current
+     * window and the window doubles. Once the link is the limit, the
+     * window settles at twice the actual bandwidth-delay product.
+     */
+    elapsed = now - xfer->sample_start;
+    if (elapsed)
+	target = 2.0 * xfer->sample_bytes / elapsed *
+	    (xfer->rtt_min > 0 ? xfer->rtt_min : 1);
+    else
+	target = 2.0 * xfer->req_maxsize;
+
+    if (target > 2.0 * xfer->req_maxsize)
+	target = 2.0 * xfer->req_maxsize;
+    if (target > xfer_max_window)
+	target = xfer_max_window;
+    if (target < XFER_WINDOW_MIN)
+	target = XFER_WINDOW_MIN;
+    xfer->req_maxsize = (int)target;
+
+    xfer->sample_start = now;
+    xfer->sample_bytes = 0;
+}
+
 static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset)
 {
     struct fxp_xfer *xfer = snew(struct fxp_xfer);
@@ -1142,7 +1281,10 @@ static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset)
     xfer->offset = offset;
     xfer->head = xfer->tail = NULL;
     xfer->req_totalsize = 0;
-    xfer->req_maxsize = 1048576*4;
+    xfer->req_maxsize = XFER_WINDOW_MIN;
+    xfer->sample_start = fz_ticks();
+    xfer->sample_bytes = 0;
+    xfer->rtt_min = -1;
     xfer->err = 0;
     xfer->filesize = uint64_make(ULONG_MAX, ULONG_MAX);
     xfer->furthestdata = uint64_make(0, 0);
@@ -1184,8 +1326,9 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	xfer->tail = rr;
 	rr->next = NULL;
 
-	rr->len = 32768;
+	rr->len = fxp_read_size;
 	rr->buffer = snewn(rr->len, char);
+	rr->sent = fz_ticks();
 	sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
 	fxp_set_userdata(req, rr);
 
@@ -1226,6 +1369,7 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 	return INT_MIN;		       /* this packet isn't ours */
     }
     rr->retlen = fxp_read_recv(pktin, rreq, rr->buffer, rr->len);
+    xfer_update_window(xfer, rr);
 #ifdef DEBUG_DOWNLOAD
     printf("read request %p has returned [%d]\n", rr, rr->retlen);
 #endif
@@ -1364,6 +1508,16 @@ int xfer_upload_ready(struct fxp_xfer *xfer)
 	return 0;
 }
 
+/*
+ * FZ: Number of bytes to read from the local file for the next write
+ * request. Chunks end on multiples of the request size, so after
+ * resuming at an odd offset the reads line up again.
+ */
+int xfer_upload_chunk(struct fxp_xfer *xfer)
+{
+    return fxp_write_size - (int)(xfer->offset.lo & (fxp_write_size - 1));
+}
+
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 {
     struct req *rr;
@@ -1384,6 +1538,7 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 
     rr->len = len;
     rr->buffer = NULL;
+    rr->sent = fz_ticks();
     sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
     fxp_set_userdata(req, rr);
 
@@ -1432,10 +1587,11 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     else
 	xfer->tail = prev;
     xfer->req_totalsize -= rr->len;
+    xfer_update_window(xfer, rr);
     xfer->sent_interval += rr->len;
     if (fz_timer_check(&xfer->send_timer)) {
 	/* The data we sent is the data we earlier read from file */
-	fzprintf(sftpTransfer, "%d", xfer->sent_interval);
+	fz_progress(xfer->sent_interval);
 	xfer->sent_interval = 0;
     }
     sfree(rr);
@@ -1449,7 +1605,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 void xfer_cleanup(struct fxp_xfer *xfer)
 {
     if (xfer->sent_interval > 0) {
-	fzprintf(sftpTransfer, "%d", xfer->sent_interval);
+	fz_progress(xfer->sent_interval);
     }
     struct req *rr;
     while (xfer->head) {
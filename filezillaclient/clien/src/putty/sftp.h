@@ -248,6 +248,20 @@ struct sftp_packet *sftp_recv(void);
 
 struct fxp_xfer;
 
+/*
+ * FZ: Size of individual read and write requests. Larger requests are
+ * only used if the server states that it accepts them. The window of
+ * outstanding requests starts at XFER_WINDOW_MIN and grows with the
+ * measured bandwidth-delay product up to the maximum, which defaults
+ * to XFER_WINDOW_MAX.
+ */
+#define XFER_REQ_SIZE 32768
+#define XFER_REQ_MAXSIZE 262144
+#define XFER_WINDOW_MIN (1048576*4)
+#define XFER_WINDOW_MAX (1048576*32)
+
+void xfer_set_max_window(int size);
+
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64 offset);
 void xfer_download_queue(struct fxp_xfer *xfer);
 int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
@@ -255,6 +269,7 @@ int xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len);
 
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64 offset);
 int xfer_upload_ready(struct fxp_xfer *xfer);
+int xfer_upload_chunk(struct fxp_xfer *xfer);
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len);
 int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 